@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "error.h"
+
+#ifdef __unix__
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "buffer.h"
+
+#define SITH_ROUNDUP(size, unit) ((((size) + (unit) - 1) / (unit)) * (unit))
+
+
+//------------------------------------------------------------------------------
+// ALLOCATION STRATEGIES
+
+#ifdef __unix__
+
+void* allocate_hugetlb(size_t size) {
+#ifdef MAP_HUGETLB
+    void* this = mmap(NULL, SITH_ROUNDUP(size, SITH_HUGEPAGE_SIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return (this == MAP_FAILED) ? NULL : this;
+#else
+    (void) size;
+    return NULL;
+#endif
+}
+
+void* allocate_thp(size_t size) {
+#ifdef MADV_HUGEPAGE
+    size_t length = SITH_ROUNDUP(size, SITH_HUGEPAGE_SIZE);
+
+    // Over-allocate by one huge page, then trim both ends to get an aligned region
+    char* raw = mmap(NULL, length + SITH_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    char* aligned = (char*) SITH_ROUNDUP((uintptr_t) raw, SITH_HUGEPAGE_SIZE);
+    size_t head = aligned - raw;
+    size_t tail = SITH_HUGEPAGE_SIZE - head;
+    if (head != 0) munmap(raw, head);
+    if (tail != 0) munmap(aligned + length, tail);
+
+    // Fails without THP support in the kernel, drop the region so the caller
+    //falls back to plain pages instead of reporting SITH_BUFMODE_THP
+    if (madvise(aligned, length, MADV_HUGEPAGE)) {
+        munmap(aligned, length);
+        return NULL;
+    }
+    return aligned;
+#else
+    (void) size;
+    return NULL;
+#endif
+}
+
+void* allocate_plain(size_t size) {
+    void* this = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (this == MAP_FAILED) ? NULL : this;
+}
+
+#elif defined _WIN32
+
+void* allocate_hugetlb(size_t size) {
+    SIZE_T largePage = GetLargePageMinimum();
+    if (largePage == 0) return NULL;
+
+    // Fails with ERROR_PRIVILEGE_NOT_HELD unless the token has SeLockMemoryPrivilege
+    return VirtualAlloc(NULL, SITH_ROUNDUP(size, largePage), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+}
+
+void* allocate_plain(size_t size) {
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+#endif
+
+
+//------------------------------------------------------------------------------
+// API FUNCTIONS
+
+void* AllocateLargeBuffer(size_t size, BufferMode* mode) {
+    if (size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void* this = NULL;
+
+    if (size >= SITH_HUGEPAGE_SIZE) {
+        this = allocate_hugetlb(size);
+        if (this != NULL) {
+            if (mode != NULL) *mode = SITH_BUFMODE_HUGETLB;
+            return this;
+        }
+
+#ifdef __unix__
+        this = allocate_thp(size);
+        if (this != NULL) {
+            if (mode != NULL) *mode = SITH_BUFMODE_THP;
+            return this;
+        }
+#endif
+
+        // Huge pages unavailable, not an error from the caller's perspective
+        ClearErrors();
+    }
+
+    this = allocate_plain(size);
+    if (this == NULL) return NULL;
+
+    if (mode != NULL) *mode = SITH_BUFMODE_PLAIN;
+    return this;
+}
+
+int FreeLargeBuffer(void* buffer, size_t size, BufferMode mode) {
+    if (buffer == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+#ifdef _WIN32
+    (void) size;
+    (void) mode;
+    return VirtualFree(buffer, 0, MEM_RELEASE) ? SITH_RET_OK : SITH_RET_ERR;
+#elif defined __unix__
+    if (mode != SITH_BUFMODE_PLAIN) size = SITH_ROUNDUP(size, SITH_HUGEPAGE_SIZE);
+    return munmap(buffer, size) ? SITH_RET_ERR : SITH_RET_OK;
+#endif
+}
+
+const char* GetBufferModeName(BufferMode mode) {
+    switch (mode) {
+        case SITH_BUFMODE_HUGETLB:
+            return "huge pages";
+        case SITH_BUFMODE_THP:
+            return "transparent huge pages";
+        case SITH_BUFMODE_PLAIN:
+            return "regular pages";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,98 @@
+/*
+ * File:   buffer.h
+ * Brief:  Anonymous memory for large working buffers, backed by huge pages
+ *          where the OS allows it
+ *
+ *
+ * Implementation notes:
+ *
+ * - Allocation attempts are made in the following order, the first one that
+ *   succeeds determines the buffer mode:
+ *
+ *      SITH_BUFMODE_HUGETLB:   [UNIX] Explicit huge pages (MAP_HUGETLB), needs
+ *                              a reserved huge page pool on the host
+ *                              [WINAPI] Large pages (MEM_LARGE_PAGES), needs
+ *                              the SeLockMemoryPrivilege on the process token
+ *      SITH_BUFMODE_THP:       [UNIX] Huge-page aligned region advised with
+ *                              MADV_HUGEPAGE, the kernel may back it with
+ *                              transparent huge pages
+ *      SITH_BUFMODE_PLAIN:     Regular anonymous pages
+ *
+ * - Huge pages are only attempted if the requested size covers at least one
+ *   huge page, smaller buffers always get SITH_BUFMODE_PLAIN
+ *
+ * - Buffers are zero-filled on allocation
+ *
+ * - [UNIX] The huge page size is assumed to be the x86/ARM default of 2MiB
+ */
+
+#ifndef SITH_BUFFER_H
+#define SITH_BUFFER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//------------------------------------------------------------------------------
+// INCLUDES
+
+#include "plat.h"
+#include <stddef.h>
+
+
+//------------------------------------------------------------------------------
+// DEFINITIONS
+
+typedef int BufferMode;
+
+#define SITH_BUFMODE_PLAIN 0
+#define SITH_BUFMODE_THP 1
+#define SITH_BUFMODE_HUGETLB 2
+
+#define SITH_HUGEPAGE_SIZE 2097152 // 2MiB
+
+
+//------------------------------------------------------------------------------
+// FUNCTIONS
+
+/**
+ * Allocates an anonymous, zero-filled buffer of at least the given size,
+ * preferring huge pages and silently falling back to regular pages
+ *
+ * @param size The buffer's size in bytes
+ * @param mode Receives the kind of memory backing the buffer, may be NULL
+ * @return A pointer to the buffer, or NULL if an error occurred
+ */
+void* AllocateLargeBuffer(
+        _In_ size_t size,
+        _Out_opt_ BufferMode* mode);
+
+/**
+ * Releases a buffer obtained from AllocateLargeBuffer
+ *
+ * @param buffer The buffer's base address
+ * @param size The size passed to AllocateLargeBuffer
+ * @param mode The mode reported by AllocateLargeBuffer
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int FreeLargeBuffer(
+        _In_ void* buffer,
+        _In_ size_t size,
+        _In_ BufferMode mode);
+
+/**
+ * Returns a printable name for the given buffer mode
+ *
+ * @param mode
+ * @return A static string
+ */
+const char* GetBufferModeName(
+        _In_ BufferMode mode);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SITH_BUFFER_H */
@@ -34,7 +34,7 @@
 #define SITH_CLI_TITLE "Crypto-Sithis, client application"
 #define SITH_CLI_OPTIONS (Option[]) {\
     {'h', "",               0, SITH_OPT_FALSE,         "Show this help"},\
-    {'a', "server_addr",    1, SITH_DEFAULT_ADDRESS,   "The server's IP address. Default is localhost"},\
+    {'a', "server_addr",    1, SITH_DEFAULT_ADDRESS,   "The server's IP address, or the path of its local socket. Default is localhost"},\
     {'p', "server_port",    1, SITH_DEFAULT_PORT,      "The server's port. Default is 8888"},\
     {'L', "",               0, SITH_OPT_FALSE,         "Override the configuration file to localhost" }, \
     {'l', "",               0, SITH_OPT_FALSE,         "Single Command Execution LSTF"},\
@@ -50,6 +50,9 @@
 // UTILITY MACROS
 
 #define SITH_MAXCH_CLIENTREQ 511
+// Commands sent ahead of their replies with length framing, the server holds
+//back those it cannot start yet
+#define SITH_CLI_WINDOW 16
 
 
 //------------------------------------------------------------------------------
@@ -61,6 +64,9 @@ LinkedList* messageQueue;
 CondVar* signaller;
 LockObject* sigLock;
 
+// Tags requests when length framing is in use
+unsigned int requestId = 0;
+
 void printCommand(const void* command) {
     printf("%s\n", (const char*) command);
 }
@@ -69,52 +75,116 @@ void printCommand(const void* command) {
 //------------------------------------------------------------------------------
 // COMMUNICATION BODY
 
+// Sent commands still waiting for their reply, oldest first; legacy framing
+//allows a single one, length framing up to SITH_CLI_WINDOW
+
+char* inFlight[SITH_CLI_WINDOW];
+unsigned int inFlightIds[SITH_CLI_WINDOW];
+unsigned int inFlightCount = 0;
+
+int send_command(char* command) {
+    int error = (GetPeerFraming(server) == framing_length)
+            ? SendFrame(server, frame_text, ++requestId, command, strlen(command))
+            : SendToPeer(server, command);
+    if (error == -1) return SITH_RET_ERR;
+
+    if (CLIENT_REQUEST(command, SITH_PROTO_ENCRYPT) || CLIENT_REQUEST(command, SITH_PROTO_DECRYPT)) {
+
+        // Log the encryption-decryption command
+        HeapString* s = CreateHeapString(command);
+        HeapStringPrepend(s, " ");
+        time_t now = time(NULL);
+        HeapStringPrepend(s, ctime(&now));
+        if (WriteLog(SITH_CLI_LOGPATH, s))
+            HandleErrorStatus("Could not write log file");
+        DisposeHeapString(s);
+    }
+
+    inFlight[inFlightCount] = command;
+    inFlightIds[inFlightCount] = requestId;
+    inFlightCount++;
+    return SITH_RET_OK;
+}
+
+// Forgets the command answered by the given reply, replies to framed requests
+//may come in any order
+
+char* settle_command(unsigned int id) {
+    unsigned int slot = 0;
+    if (GetPeerFraming(server) == framing_length) {
+        while (slot < inFlightCount && inFlightIds[slot] != id) slot++;
+        if (slot == inFlightCount) return NULL;
+    }
+
+    char* command = inFlight[slot];
+    inFlightCount--;
+    memmove(inFlight + slot, inFlight + slot + 1, (inFlightCount - slot) * sizeof (char*));
+    memmove(inFlightIds + slot, inFlightIds + slot + 1, (inFlightCount - slot) * sizeof (unsigned int));
+    return command;
+}
+
+// The other commands are just macro aliases
+
+void dispose_command(char* command) {
+    if (CLIENT_REQUEST(command, SITH_PROTO_ENCRYPT) || CLIENT_REQUEST(command, SITH_PROTO_DECRYPT)) {
+        free(command);
+    }
+}
+
+int receive_response(const char** response, size_t* responseLength, unsigned int* id) {
+    *id = 0;
+    if (GetPeerFraming(server) == framing_length) {
+        return ReceiveFrame(server, NULL, id, response, responseLength);
+    }
+    return ReceiveViewFromPeer(server, response, responseLength);
+}
+
 ThreadValue SITH_THREAD_CALLCONV communicationBody(void* arg) {
 
     (void) arg;
     int longmessage = 0;
-    char* command, *response;
+    int exiting = 0;
+    char* command;
+    // Lent by the connection, valid until the next receive
+    const char* response;
+    size_t responseLength;
+    unsigned int id;
 
     while (1) {
 
-        // Wait for a command to be enqueued to the list
+        // Send queued commands while the window allows, and only wait for one
+        //to be enqueued when no reply is expected
+        unsigned int window = (GetPeerFraming(server) == framing_length) ? SITH_CLI_WINDOW : 1;
         DoLockObject(sigLock);
-        while (GetLinkedListSize(messageQueue) == 0) {
-            WaitConditionVariable(signaller, sigLock);
-        }
-
-        // Extract command and release lock on command list
-        command = (char*) PopHeadFromList(messageQueue);
-        DoUnlockObject(sigLock);
+        while (!exiting && inFlightCount < window) {
+            if (GetLinkedListSize(messageQueue) == 0) {
+                if (inFlightCount > 0) break;
+                WaitConditionVariable(signaller, sigLock);
+                continue;
+            }
 
+            // Extract command and release lock on command list
+            command = (char*) PopHeadFromList(messageQueue);
+            if (command == NULL) {
+                exiting = 1;
+                break;
+            }
+            DoUnlockObject(sigLock);
 
-        // Check if user wants to exit
-        if (command == NULL) {
-            CloseConnection(server);
-            return SITH_RV_ZERO;
+            // Send the command to the server
+            if (send_command(command) == SITH_RET_ERR) {
+                HandleErrorStatus("Failed to send command to server");
+                CloseConnection(server);
+                return SITH_RV_ONE;
+            }
+            DoLockObject(sigLock);
         }
+        DoUnlockObject(sigLock);
 
-        // Send the command to the server
-        if (SendToPeer(server, command) == -1) {
-            HandleErrorStatus("Failed to send command to server");
+        // User wants to exit, and every sent command has been answered
+        if (inFlightCount == 0) {
             CloseConnection(server);
-            return SITH_RV_ONE;
-        }
-
-        //Command is sent, we shall deallocate the string if it was an encr/decr
-        // The other commands are just macro aliases
-        if (CLIENT_REQUEST(command, SITH_PROTO_ENCRYPT) || CLIENT_REQUEST(command, SITH_PROTO_DECRYPT)) {
-
-            // Log the encryption-decryption command
-            HeapString* s = CreateHeapString(command);
-            HeapStringPrepend(s, " ");
-            time_t now = time(NULL);
-            HeapStringPrepend(s, ctime(&now));
-            if (WriteLog(SITH_CLI_LOGPATH, s))
-                HandleErrorStatus("Could not write log file");
-            DisposeHeapString(s);
-
-            free(command);
+            return SITH_RV_ZERO;
         }
 
         // Handle server response
@@ -122,13 +192,12 @@ ThreadValue SITH_THREAD_CALLCONV communicationBody(void* arg) {
         //However we have no access on the raw input before entering a newline or a carrige-return in ICANON mode
         //that is  the default. We will need RAW mode for this.
 resp:
-        switch (ReceiveFromPeer(server, &response)) {
+        switch (receive_response(&response, &responseLength, &id)) {
             case -1:
                 // CLI: Clear line
                 printf("\r");
                 HandleErrorStatus("Failed to receive response from server");
                 CloseConnection(server);
-                free(response);
                 // Server is not responding, close client
                 exit(EXIT_FAILURE);
             case 0:
@@ -136,7 +205,6 @@ resp:
                 printf("\r");
                 printf("Connection closed by server\n");
                 CloseConnection(server);
-                free(response);
                 // Server is not responding, close client
                 exit(EXIT_FAILURE);
             default:
@@ -144,23 +212,44 @@ resp:
                 // CLI: Clear line
                 printf("\r");
 
-                // See if we are still in long-message mode
+                // See if we are still in long-message mode; the parts of a long
+                //reply are never interleaved with other replies
                 if (longmessage == 1) {
-                    if (SERVER_RESPONSE(response, SITH_PROTO_MOREEND)) {
+                    if (responseLength == SITH_MAXCH_PROTORESP && SERVER_RESPONSE(response, SITH_PROTO_MOREEND)) {
                         longmessage = 0;
-                        free(response);
                         break;
                     }
                     else {
                         printf("%s", response);
-                        free(response);
                         // CLI: Prompt
                         printf("> ");
                         goto resp;
                     }
                 }
 
-                if (SERVER_RESPONSE(response, SITH_PROTO_SUCCESS)) {
+                // Not a reply: the server gave up waiting on this client
+                if (responseLength >= SITH_MAXCH_PROTORESP && SERVER_RESPONSE(response, SITH_PROTO_TIMEDOUT)) {
+                    printf("Connection closed by server: %s\n", response + SITH_MAXCH_PROTORESP);
+                    CloseConnection(server);
+                    exit(EXIT_FAILURE);
+                }
+
+                // Name the command when several could be answered
+                int several = inFlightCount > 1;
+                command = settle_command(id);
+                if (command == NULL) {
+                    printf("Reply to an unknown request %u: %s\n", id, response);
+                    fflush(stdout);
+                    goto resp;
+                }
+                if (several) printf("[%.*s] ", (int) strcspn(command, "\n"), command);
+                dispose_command(command);
+
+                if (responseLength < SITH_MAXCH_PROTORESP) {
+                    printf("Could not interpret server response: %s\n", response);
+                    fflush(stdout);
+                }
+                else if (SERVER_RESPONSE(response, SITH_PROTO_SUCCESS)) {
                     printf("Operation successful: %s\n", response + SITH_MAXCH_PROTORESP);
                     fflush(stdout);
                 }
@@ -182,15 +271,12 @@ resp:
                 }
                 else if (SERVER_RESPONSE(response, SITH_PROTO_MOREOUT)) {
                     longmessage = 1;
-                    free(response);
                     goto resp;
                 }
                 else {
                     printf("Could not interpret server response: %s\n", response);
                     fflush(stdout);
                 }
-
-                free(response);
         }
 
         // CLI: Prompt
@@ -281,7 +367,7 @@ int main(int argc, char** argv) {
     }
 
     // Address
-    char address[SITH_MAXCH_IPV4 + 1] = {0};
+    char address[SITH_MAX_VALUE_LEN] = {0};
     unsigned short force_local = 0;
     GetOptionBool('L', 0, &force_local);
     if (force_local == 0) {
@@ -305,7 +391,8 @@ int main(int argc, char** argv) {
 
     // Report configuration
     printf("\n--Crypto Sithis Client--\n");
-    printf("Connecting to %s:%hu... ", address, port);
+    if (IsLocalAddress(address)) printf("Connecting to %s... ", address);
+    else printf("Connecting to %s:%hu... ", address, port);
     fflush(stdout);
 
     // Connect to server
@@ -317,27 +404,38 @@ int main(int argc, char** argv) {
     }
 
     // Receive server response
-    char* response;
-    if (ReceiveFromPeer(server, &response) <= 0) {
+    const char* response;
+    size_t responseLength;
+    if (ReceiveViewFromPeer(server, &response, &responseLength) <= 0 || responseLength < SITH_MAXCH_PROTORESP) {
         printf("failed.\n");
         HandleErrorStatus("Could not get confirmation message from server");
         return EXIT_FAILURE;
     }
     if (SERVER_RESPONSE(response, SITH_PROTO_SERVBUSY)) {
-        free(response);
         CloseConnection(server);
         printf("failed\n");
         HandleErrorStatus("Connection closed by server: busy");
         return EXIT_FAILURE;
     }
     else if (!(SERVER_RESPONSE(response, SITH_PROTO_ACCEPTED))) {
-        free(response);
         CloseConnection(server);
         printf("failed\n");
         HandleErrorStatus("Could not interpret server response, exiting...");
         return EXIT_FAILURE;
     }
-    free(response);
+
+    // Ask for length framing, older servers reject it and we keep using EOTs
+    if (SendToPeer(server, SITH_PROTO_FRAMING) == SITH_RET_ERR || ReceiveViewFromPeer(server, &response, &responseLength) <= 0) {
+        printf("failed.\n");
+        HandleErrorStatus("Could not negotiate framing with server");
+        return EXIT_FAILURE;
+    }
+    if (responseLength >= SITH_MAXCH_PROTORESP && SERVER_RESPONSE(response, SITH_PROTO_SUCCESS) && SetPeerFraming(server, framing_length) == SITH_RET_ERR) {
+        CloseConnection(server);
+        printf("failed.\n");
+        HandleErrorStatus("Could not switch framing");
+        return EXIT_FAILURE;
+    }
     printf("OK.\n");
 
     // Build list locks
@@ -451,6 +549,7 @@ int main(int argc, char** argv) {
                     "clear:    Empties the list of commands to be sent\n"
                     "list:     Queries the server for the files in its current folder\n"
                     "listrec:  Same as \"list\", but recursively lists subfolders\n"
+                    "status:   Queries the server for its encryption job counters\n"
                     "encrypt <filename> <seed>: Instructs the server to encrypt the file specified by <filename> using <seed> for the encryption\n"
                     "decrypt <filename> <seed>: Same as \"encrypt\", filename must end with _enc\n\n");
         }
@@ -479,6 +578,12 @@ int main(int argc, char** argv) {
             DoUnlockObject(sigLock);
             NotifyConditionVariable(signaller);
         }
+        else if (CLIENT_COMMAND(command, SITH_CMD_STATUS)) {
+            DoLockObject(sigLock);
+            AppendToList(messageQueue, SITH_PROTO_STATUS);
+            DoUnlockObject(sigLock);
+            NotifyConditionVariable(signaller);
+        }
         else if (CLIENT_COMMAND(command, SITH_CMD_LISTREC)) {
             DoLockObject(sigLock);
             AppendToList(messageQueue, SITH_PROTO_LISTREC);
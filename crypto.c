@@ -17,6 +17,16 @@
  *   execution, though it should be redundant because of the handle
  *   share-mode set to 0.
  *
+ * - Invoked as "crypto -s <source> <target> <seed>", the engine runs in
+ *   streaming mode: source and target may be pipes, FIFOs, sockets or
+ *   regular files, "-" stands for the standard input/output and "&N" for an
+ *   inherited descriptor N. Nothing is locked nor deleted, and reports go to
+ *   the error stream since the output may be the data itself.
+ *
+ * - [UNIX] In mapped mode, SIGTERM and SIGINT stop the engine cleanly: no
+ *   further page is started, pages in flight finish, then the partial target
+ *   is deleted and the source left as it was.
+ *
  * Created on 06 Sep 2017, 18:10
  */
 
@@ -24,10 +34,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifdef __unix__
+#include <signal.h>
+#endif
+
 #include "error.h"
 #include "file.h"
+#include "buffer.h"
 
 #include "pool.h"
+#include "sync.h"
+#include "multi.h"
+#include "timing.h"
 #include "crypto.h"
 
 
@@ -39,6 +57,93 @@
 #define SITH_ENDEC_RANDMASK_UNITS SITH_ENDEC_DEFAULT_PAGE_SIZE / sizeof(int)
 #define SITH_CRYPTO_POOLNAME "crypto"
 #define SITH_CRYPTO_POOLSIZE 8
+// One mask per kernel, at the default page size this fills exactly one huge page
+#define SITH_CRYPTO_MASKSLOTS SITH_CRYPTO_POOLSIZE
+#define SITH_CRYPTO_STREAMFLAG "-s"
+#define SITH_CRYPTO_STREAMSLOTS 4
+// If set, the page pool's statistics are written to the error stream
+#define SITH_CRYPTO_STATSENV "SITH_POOL_STATS"
+
+
+//------------------------------------------------------------------------------
+// MASK ARENA
+//
+// - Masks are carved out of a single large buffer instead of being malloc'd
+//   per page, a slot is taken by the dispatcher before generating a mask and
+//   given back by the task once the page is done
+
+typedef struct {
+    char* base;
+    BufferMode mode;
+    size_t size;
+
+    // Counts free slots, the dispatcher parks here when all masks are in use
+    SemObject* available;
+    LockObject* lock;
+    unsigned int* freeSlots;
+    unsigned int freeCount;
+} MaskArena;
+
+MaskArena* create_mask_arena() {
+    MaskArena* this = calloc(1, sizeof (MaskArena));
+    if (this == NULL) return NULL;
+
+    this->size = SITH_CRYPTO_MASKSLOTS * (size_t) SITH_ENDEC_DEFAULT_PAGE_SIZE;
+    this->base = AllocateLargeBuffer(this->size, &(this->mode));
+    if (this->base == NULL) {
+        free(this);
+        return NULL;
+    }
+
+    this->freeSlots = malloc(SITH_CRYPTO_MASKSLOTS * sizeof (unsigned int));
+    this->available = CreateSemObject(SITH_CRYPTO_MASKSLOTS, SITH_CRYPTO_MASKSLOTS);
+    this->lock = CreateLockObject();
+    if (this->freeSlots == NULL || this->available == NULL || this->lock == NULL) {
+        if (this->available != NULL) DestroySemObject(this->available);
+        if (this->lock != NULL) DestroyLockObject(this->lock);
+        free(this->freeSlots);
+        FreeLargeBuffer(this->base, this->size, this->mode);
+        free(this);
+        return NULL;
+    }
+
+    for (unsigned int slot = 0; slot < SITH_CRYPTO_MASKSLOTS; slot++) {
+        this->freeSlots[slot] = slot;
+    }
+    this->freeCount = SITH_CRYPTO_MASKSLOTS;
+
+    return this;
+}
+
+// Blocks until a slot is free, unless told otherwise
+
+int* acquire_mask(MaskArena* this, int blocking) {
+    if (WaitSemObject(this->available, blocking)) return NULL;
+
+    DoLockObject(this->lock);
+    unsigned int slot = this->freeSlots[--(this->freeCount)];
+    DoUnlockObject(this->lock);
+
+    return (int*) (this->base + slot * (size_t) SITH_ENDEC_DEFAULT_PAGE_SIZE);
+}
+
+void release_mask(MaskArena* this, int* mask) {
+    unsigned int slot = (unsigned int) (((char*) mask - this->base) / SITH_ENDEC_DEFAULT_PAGE_SIZE);
+
+    DoLockObject(this->lock);
+    this->freeSlots[(this->freeCount)++] = slot;
+    DoUnlockObject(this->lock);
+
+    SignalSemObject(this->available);
+}
+
+void destroy_mask_arena(MaskArena* this) {
+    DestroySemObject(this->available);
+    DestroyLockObject(this->lock);
+    free(this->freeSlots);
+    FreeLargeBuffer(this->base, this->size, this->mode);
+    free(this);
+}
 
 
 //------------------------------------------------------------------------------
@@ -51,6 +156,8 @@ typedef SITH_TASKARG struct {
     size_t pageSize;
     SIZE_T actualSize;
     int* mask;
+    MaskArena* arena;
+    CancelToken* cancel;
 
     ErrorCode* error;
 } PageInfo;
@@ -59,17 +166,27 @@ SITH_TASKBODY int XORendec(void* a) {
 
     PageInfo* taskParam = (PageInfo*) a;
 
+    // The job is being stopped, the target is going away anyway
+    if (IsCancelled(taskParam->cancel)) {
+        release_mask(taskParam->arena, taskParam->mask);
+        free(taskParam);
+        return SITH_RET_OK;
+    }
+
     // Create views
     void* sourceBaseAddress = AllocateMapping(taskParam->sourceFile, taskParam->baseOffset, taskParam->pageSize, taskParam->actualSize, SITH_MAPMODE_READ);
     if (sourceBaseAddress == NULL) {
         *(taskParam->error) = GetErrorCode();
         SetErrorCode(SITH_E_NONE);
+        release_mask(taskParam->arena, taskParam->mask);
         return SITH_RET_ERR;
     }
     void* targetBaseAddress = AllocateMapping(taskParam->targetFile, taskParam->baseOffset, taskParam->pageSize, taskParam->actualSize, SITH_MAPMODE_WRITE);
     if (targetBaseAddress == NULL) {
         *(taskParam->error) = GetErrorCode();
         SetErrorCode(SITH_E_NONE);
+        FreeMapping(sourceBaseAddress, SITH_ENDEC_DEFAULT_PAGE_SIZE);
+        release_mask(taskParam->arena, taskParam->mask);
         return SITH_RET_ERR;
     }
 
@@ -78,27 +195,317 @@ SITH_TASKBODY int XORendec(void* a) {
     char* targetCaret = (char*) targetBaseAddress;
     char* maskCaret = (char*) taskParam->mask;
 
-    // Encrypt
+    // Encrypt, the first touch of the source view faults its pages in here
+    SITH_TIMER_START(xorTimer);
     for (unsigned int i = 0; i < taskParam->actualSize; i++) {
         targetCaret[i] = sourceCaret[i]^maskCaret[i];
     }
+    SITH_TIMER_STOP(xorTimer, phase_xor);
 
     // Sync and free mappings
     FreeMapping(sourceBaseAddress, SITH_ENDEC_DEFAULT_PAGE_SIZE);
     SyncMapping(targetBaseAddress, SITH_ENDEC_DEFAULT_PAGE_SIZE, taskParam->actualSize);
     FreeMapping(targetBaseAddress, SITH_ENDEC_DEFAULT_PAGE_SIZE);
-    free(taskParam->mask);
+    release_mask(taskParam->arena, taskParam->mask);
     free(taskParam);
 
     return SITH_RET_OK;
 }
 
+
+//------------------------------------------------------------------------------
+// STOP REQUESTS
+
+CancelToken* stopToken = NULL;
+
+#ifdef __unix__
+
+void stop_handler(int sig) {
+    (void) sig;
+    RequestCancel(stopToken);
+}
+#endif
+
+// The server spawns engines with all signals blocked
+
+int install_stop_handler() {
+    stopToken = CreateCancelToken(NULL);
+    if (stopToken == NULL) return SITH_RET_ERR;
+
+#ifdef __unix__
+    struct sigaction stopAction;
+    stopAction.sa_handler = stop_handler;
+    sigfillset(&stopAction.sa_mask);
+    stopAction.sa_flags = 0;
+    if (sigaction(SIGTERM, &stopAction, NULL) || sigaction(SIGINT, &stopAction, NULL)) return SITH_RET_ERR;
+
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    if (sigprocmask(SIG_UNBLOCK, &stopSignals, NULL)) return SITH_RET_ERR;
+#endif
+    return SITH_RET_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// STREAM ENDEC
+//
+// - Pages flow through a ring of slots, each holding a staging buffer and the
+//   page's mask: the generator thread fills masks ahead of the reader, the
+//   writer XORs and drains pages in order
+// - The keystream is laid out exactly as in mapped mode, a file encrypted from
+//   a pipe can be decrypted from disk and vice versa
+
+typedef struct {
+    char* data;
+    int* mask;
+    size_t length;
+
+    // Each semaphore hands the slot over to the next stage
+    SemObject* maskFree;
+    SemObject* maskReady;
+    SemObject* dataFree;
+    SemObject* dataReady;
+} StreamSlot;
+
+typedef struct {
+    StreamSlot slots[SITH_CRYPTO_STREAMSLOTS];
+    File* target;
+
+    // Set by the writer after the last page, read by the generator
+    int finished;
+    ErrorCode writeError;
+} StreamPipeline;
+
+ThreadValue SITH_THREAD_CALLCONV generatorBody(void* a) {
+
+    StreamPipeline* pipeline = (StreamPipeline*) a;
+
+    for (unsigned long pageNumber = 0;; pageNumber++) {
+        StreamSlot* slot = pipeline->slots + (pageNumber % SITH_CRYPTO_STREAMSLOTS);
+
+        WaitSemObject(slot->maskFree, 1);
+        if (pipeline->finished) break;
+
+        SITH_TIMER_START(maskTimer);
+        int* endOfMask = slot->mask + SITH_ENDEC_RANDMASK_UNITS;
+        for (int* caret = slot->mask; caret < endOfMask; caret++) {
+            *caret = rand();
+        }
+        SITH_TIMER_STOP(maskTimer, phase_mask);
+
+        SignalSemObject(slot->maskReady);
+    }
+
+    return SITH_RV_ZERO;
+}
+
+ThreadValue SITH_THREAD_CALLCONV writerBody(void* a) {
+
+    StreamPipeline* pipeline = (StreamPipeline*) a;
+    size_t length;
+
+    for (unsigned long pageNumber = 0;; pageNumber++) {
+        StreamSlot* slot = pipeline->slots + (pageNumber % SITH_CRYPTO_STREAMSLOTS);
+
+        SITH_TIMER_START(waitTimer);
+        WaitSemObject(slot->dataReady, 1);
+        WaitSemObject(slot->maskReady, 1);
+        SITH_TIMER_STOP(waitTimer, phase_wait);
+
+        SITH_TIMER_START(xorTimer);
+        char* maskCaret = (char*) slot->mask;
+        for (size_t i = 0; i < slot->length; i++) {
+            slot->data[i] ^= maskCaret[i];
+        }
+        SITH_TIMER_STOP(xorTimer, phase_xor);
+
+        // Drain the page, after a failure keep consuming so that the reader never stalls
+        for (size_t written = 0; written < slot->length && !SITH_ISANERROR(pipeline->writeError); written += length) {
+            length = slot->length - written;
+            if (WriteToFileObject(pipeline->target, slot->data + written, &length)) {
+                pipeline->writeError = GetErrorCode();
+                ClearErrors();
+            }
+        }
+
+        length = slot->length;
+        SignalSemObject(slot->dataFree);
+        SignalSemObject(slot->maskFree);
+
+        // A short page is the last one
+        if (length < SITH_ENDEC_DEFAULT_PAGE_SIZE) break;
+    }
+
+    // Release the generator, wherever it is parked
+    pipeline->finished = 1;
+    for (unsigned int i = 0; i < SITH_CRYPTO_STREAMSLOTS; i++) {
+        SignalSemObject(pipeline->slots[i].maskFree);
+    }
+
+    return SITH_RV_ZERO;
+}
+
+File* open_stream(char* spec, int inbound) {
+
+    FileMode mode = inbound ? SITH_FILEMODE_RO : SITH_FILEMODE_WO;
+
+    if (strcmp(spec, "-") == 0) {
+        return GetStreamObject(inbound ? SITH_STDSTREAM_IN : SITH_STDSTREAM_OUT, mode);
+    }
+    if (spec[0] == '&') {
+        int descriptor;
+        if (getInteger(spec + 1, &descriptor)) return NULL;
+        return GetStreamObject(descriptor, mode);
+    }
+    if (inbound) {
+        return CreateFileObject(spec, SITH_FS_ZERO, mode, SITH_OPENMODE_EXIST, SITH_FILEFLAG_STREAM);
+    }
+    return CreateFileObject(spec, SITH_FS_ZERO, mode, SITH_OPENMODE_TRUNCATE, SITH_FILEFLAG_STREAM);
+}
+
+int stream_endec(char* source, char* target, unsigned int seed) {
+
+    File* sourceFile = open_stream(source, 1);
+    if (sourceFile == NULL) {
+        if (SITH_E_COMPARE(SITH_E_NOTFOUND, GetErrorCode())) {
+            ClearErrors();
+            return SITH_FAILCRYPTO_404;
+        }
+        if (errno == EBADF) {
+            fprintf(stderr, "Source is not a stream or regular file\n");
+            return SITH_FAILCRYPTO_NOTREG;
+        }
+        HandleErrorStatus("Could not open source stream");
+        return SITH_FAILCRYPTO_FILE;
+    }
+
+    StreamPipeline* pipeline = calloc(1, sizeof (StreamPipeline));
+    if (pipeline == NULL) {
+        HandleErrorStatus("Failed allocating stream pipeline");
+        return SITH_FAILCRYPTO_NOMEM;
+    }
+    pipeline->writeError = SITH_E_NONE;
+
+    pipeline->target = open_stream(target, 0);
+    if (pipeline->target == NULL) {
+        HandleErrorStatus("Could not open target stream");
+        return SITH_FAILCRYPTO_FILE;
+    }
+
+    // Staging buffers and masks share one allocation
+    BufferMode mode;
+    size_t arenaSize = 2 * SITH_CRYPTO_STREAMSLOTS * (size_t) SITH_ENDEC_DEFAULT_PAGE_SIZE;
+    char* arena = AllocateLargeBuffer(arenaSize, &mode);
+    if (arena == NULL) {
+        HandleErrorStatus("Failed allocating stream buffers");
+        return SITH_FAILCRYPTO_NOMEM;
+    }
+
+    for (unsigned int i = 0; i < SITH_CRYPTO_STREAMSLOTS; i++) {
+        StreamSlot* slot = pipeline->slots + i;
+        slot->data = arena + 2 * i * (size_t) SITH_ENDEC_DEFAULT_PAGE_SIZE;
+        slot->mask = (int*) (slot->data + SITH_ENDEC_DEFAULT_PAGE_SIZE);
+        slot->maskFree = CreateSemObject(1, 1);
+        slot->maskReady = CreateSemObject(0, 1);
+        slot->dataFree = CreateSemObject(1, 1);
+        slot->dataReady = CreateSemObject(0, 1);
+        if (slot->maskFree == NULL || slot->maskReady == NULL || slot->dataFree == NULL || slot->dataReady == NULL) {
+            HandleErrorStatus("Failed allocating stream semaphores");
+            return SITH_FAILCRYPTO_NOMEM;
+        }
+    }
+
+    fprintf(stderr, "Source: %s\nTarget: %s\nStreaming mode\nPage size: %d\nSeed: %u\nBuffer memory: %s\n\n",
+            source, target, SITH_ENDEC_DEFAULT_PAGE_SIZE, seed, GetBufferModeName(mode));
+    fflush(stderr);
+
+    srand(seed);
+    ThreadObject* generator = SpawnThread(generatorBody, pipeline);
+    ThreadObject* writer = SpawnThread(writerBody, pipeline);
+    if (generator == NULL || writer == NULL) {
+        HandleErrorStatus("Could not start stream pipeline");
+        return SITH_FAILCRYPTO_NOMEM;
+    }
+
+    // Reader stage: fill whole pages, so that they line up with the keystream
+    int error = 0;
+    size_t length;
+    unsigned long long total = 0;
+    for (unsigned long pageNumber = 0;; pageNumber++) {
+        StreamSlot* slot = pipeline->slots + (pageNumber % SITH_CRYPTO_STREAMSLOTS);
+
+        SITH_TIMER_START(waitTimer);
+        WaitSemObject(slot->dataFree, 1);
+        SITH_TIMER_STOP(waitTimer, phase_wait);
+
+        slot->length = 0;
+        while (slot->length < SITH_ENDEC_DEFAULT_PAGE_SIZE) {
+            length = SITH_ENDEC_DEFAULT_PAGE_SIZE - slot->length;
+            if (ReadFromFileObject(sourceFile, slot->data + slot->length, &length)) {
+                HandleErrorStatus("Failed reading source stream");
+                error = SITH_FAILCRYPTO_FILE;
+                break;
+            }
+            if (length == 0) break;
+            slot->length += length;
+        }
+        total += slot->length;
+
+        length = slot->length;
+        SignalSemObject(slot->dataReady);
+        if (length < SITH_ENDEC_DEFAULT_PAGE_SIZE) break;
+    }
+
+    WaitForThread(writer, NULL);
+    WaitForThread(generator, NULL);
+
+    if (SITH_ISANERROR(pipeline->writeError)) {
+        DisplayError("Failed writing target stream", pipeline->writeError);
+        error = SITH_FAILCRYPTO_ENDEC;
+    }
+    fprintf(stderr, "Streamed %llu bytes\n", total);
+    fflush(stderr);
+
+    for (unsigned int i = 0; i < SITH_CRYPTO_STREAMSLOTS; i++) {
+        DestroySemObject(pipeline->slots[i].maskFree);
+        DestroySemObject(pipeline->slots[i].maskReady);
+        DestroySemObject(pipeline->slots[i].dataFree);
+        DestroySemObject(pipeline->slots[i].dataReady);
+    }
+    FreeLargeBuffer(arena, arenaSize, mode);
+
+    if (CloseFileObject(sourceFile) || CloseFileObject(pipeline->target)) {
+        HandleErrorStatus("Could not close source or target stream");
+        error = SITH_FAILCRYPTO_RELEASE;
+    }
+    free(pipeline);
+
+    // Stdout may be carrying the data, keep the report out of it
+    SITH_TIMING_REPORT(source, stderr);
+
+    return error;
+}
+
+
 /*
  * Entry point for endec tasks
  *
  */
 int main(int argc, char** argv) {
 
+    // Look for the streaming switch, then proceed as usual on the remaining arguments
+    SITH_TIMING_INIT();
+
+    int streaming = 0;
+    if (argc > 1 && argv[1] != NULL && strcmp(argv[1], SITH_CRYPTO_STREAMFLAG) == 0) {
+        streaming = 1;
+        argv++;
+        argc--;
+    }
+
     // Arg check
     if (argc != 4 || argv[1] == NULL || argv[2] == NULL || argv[3] == NULL) {
         fprintf(stderr, "Arguments not provided correctly, expected 4 got %d\n", argc);
@@ -111,6 +518,9 @@ int main(int argc, char** argv) {
         HandleErrorStatus("Failed reading seed");
         return SITH_FAILCRYPTO_SEED;
     }
+    if (streaming) {
+        return stream_endec(argv[1], argv[2], encrSeed);
+    }
     srand(encrSeed);
 
     // Open source file
@@ -139,36 +549,68 @@ int main(int argc, char** argv) {
         return SITH_FAILCRYPTO_FILE;
     }
 
-    // Create target file with the right size
     FileSize size;
     if (GetFileObjectSize(sourceFile, &size)) {
         HandleErrorStatus("Could not get file size");
         return SITH_FAILCRYPTO_FILE;
     }
-    File* targetFile = CreateFileObject(argv[2], size, SITH_FILEMODE_RW, SITH_OPENMODE_TRUNCATE, SITH_FILEFLAG_MAP);
-    if (targetFile == NULL) {
-        HandleErrorStatus("Could not create target file");
-        return SITH_FAILCRYPTO_FILE;
-    }
 
-    // Lock files
-    if (LockFileObject(sourceFile, SITH_FS_ZERO, size)) {
+    // Lock files - the server already serializes its own requests per path,
+    // these only guard against other processes, so do not wait on them. An
+    // existing target is left as it is until both locks are held
+    if (TryLockFileObject(sourceFile, SITH_FS_ZERO, size)) {
         HandleErrorStatus("Could not lock source file");
         return SITH_FAILCRYPTO_LOCKED;
     }
-    if (LockFileObject(targetFile, SITH_FS_ZERO, size)) {
+    File* targetFile = CreateFileObject(argv[2], size, SITH_FILEMODE_RW, SITH_OPENMODE_NEW, SITH_FILEFLAG_MAP);
+    if (targetFile == NULL) {
+        HandleErrorStatus("Could not create target file");
+        return SITH_FAILCRYPTO_FILE;
+    }
+    if (TryLockFileObject(targetFile, SITH_FS_ZERO, size)) {
         HandleErrorStatus("Could not lock target file");
         return SITH_FAILCRYPTO_FILE;
     }
 
-    // Build encryption pool
-    ThreadPool* encryptPool = CreateThreadPool(SITH_CRYPTO_POOLNAME, SITH_CRYPTO_POOLSIZE);
+    // Give the target the right size
+    if (TruncateFileObject(targetFile, size)) {
+        HandleErrorStatus("Could not size target file");
+        return SITH_FAILCRYPTO_FILE;
+    }
+
+    // From here on, a stop request leaves the source as it is
+    if (install_stop_handler()) {
+        HandleErrorStatus("Could not set up stop requests");
+        return SITH_FAILCRYPTO_NOMEM;
+    }
+
+    // Build encryption pool, placed as the environment says
+    AffinityPolicy policy = affinity_none;
+    unsigned int cpus[SITH_MAX_CPUS];
+    unsigned int cpuCount = SITH_MAX_CPUS;
+    const char* affinity = getenv(SITH_CRYPTO_AFFINITYENV);
+    if (affinity != NULL && ParseAffinity(affinity, &policy, cpus, &cpuCount)) {
+        fprintf(stderr, "Ignoring malformed %s: %s\n", SITH_CRYPTO_AFFINITYENV, affinity);
+        policy = affinity_none;
+    }
+    ThreadPool* encryptPool = CreatePinnedThreadPool(SITH_CRYPTO_POOLNAME, SITH_CRYPTO_POOLSIZE, policy, cpus, cpuCount);
+    if (encryptPool == NULL && policy != affinity_none) {
+        HandleErrorStatus("Could not place task pool, running unpinned");
+        encryptPool = CreateThreadPool(SITH_CRYPTO_POOLNAME, SITH_CRYPTO_POOLSIZE);
+    }
     if (encryptPool == NULL) {
         HandleErrorStatus("Could not create task pool");
         // Bail out, there's nothing we can do
         return SITH_FAILCRYPTO_NOMEM;
     }
 
+    // Reserve memory for the XOR masks
+    MaskArena* masks = create_mask_arena();
+    if (masks == NULL) {
+        HandleErrorStatus("Failed allocating encryption masks");
+        return SITH_FAILCRYPTO_NOMEM;
+    }
+
     // Compute number of pages needed to cover all the file, and round up if needed
     long long fileSize = SITH_FS_LL(size);
     unsigned long pageCount = (fileSize / SITH_ENDEC_DEFAULT_PAGE_SIZE);
@@ -176,27 +618,50 @@ int main(int argc, char** argv) {
     if (remainder != 0) pageCount++;
 
     // All set, print a report and start encrypting
-    printf("Source: %s\nTarget: %s\nFile size: %"SITH_FORMAT_FILESIZE"\nPage size: %d\nSeed: %d\nPages: %lu\nFinal page size: %d\n\n",
-            argv[1], argv[2], SITH_FS_LL(size), SITH_ENDEC_DEFAULT_PAGE_SIZE, encrSeed, pageCount, remainder);
+    printf("Source: %s\nTarget: %s\nFile size: %"SITH_FORMAT_FILESIZE"\nPage size: %d\nSeed: %d\nPages: %lu\nFinal page size: %d\nMask memory: %s\n\n",
+            argv[1], argv[2], SITH_FS_LL(size), SITH_ENDEC_DEFAULT_PAGE_SIZE, encrSeed, pageCount, remainder, GetBufferModeName(masks->mode));
     fflush(stdout);
 
-    // Loop over pages
+    // All pages of this job are waited on as a group
+    TaskGroup* pages = CreateTaskGroup();
+    if (pages == NULL) {
+        HandleErrorStatus("Could not create page group");
+        return SITH_FAILCRYPTO_NOMEM;
+    }
+
+    // Loop over pages, in batches of as many as there are free masks
     PageInfo* info;
     ErrorCode* errors = calloc(pageCount, sizeof (ErrorCode));
+    TaskEntry batch[SITH_CRYPTO_MASKSLOTS];
+    unsigned int batchSize = 0;
     for (unsigned long pageNumber = 0; pageNumber < pageCount; pageNumber++) {
 
-        // Build XOR mask
-        int* mask = malloc(SITH_ENDEC_DEFAULT_PAGE_SIZE);
-        if (mask == NULL) {
-            HandleErrorStatus("Failed allocating encryption mask");
+        // Stop requests are honoured between batches, a blocked mask wait lasts
+        // one page at most
+        if (batchSize == 0 && IsCancelled(stopToken)) break;
+
+        // Build XOR mask, only the first page of a batch waits for a page in
+        // flight to give back its slot
+        SITH_TIMER_START(waitTimer);
+        int* mask = acquire_mask(masks, batchSize == 0);
+        SITH_TIMER_STOP(waitTimer, phase_wait);
+        if (mask == NULL && batchSize == 0) {
+            HandleErrorStatus("Failed acquiring encryption mask");
             return SITH_FAILCRYPTO_NOMEM;
         }
+        if (mask == NULL) {
+            // No mask free right now, dispatch what we have and come back
+            errno = 0;
+            goto dispatch;
+        }
 
         // Using pointer arithmetic for performance
+        SITH_TIMER_START(maskTimer);
         int* endOfMask = mask + SITH_ENDEC_RANDMASK_UNITS;
         for (int* caret = mask; caret < endOfMask; caret++) {
             *caret = rand();
         }
+        SITH_TIMER_STOP(maskTimer, phase_mask);
 
         info = calloc(1, sizeof (PageInfo));
         if (info == NULL) {
@@ -204,30 +669,80 @@ int main(int argc, char** argv) {
             return SITH_FAILCRYPTO_NOMEM;
         }
 
-        info->actualSize = (pageNumber == pageCount - 1) ? remainder : SITH_ENDEC_DEFAULT_PAGE_SIZE;
+        info->actualSize = (pageNumber == pageCount - 1 && remainder != 0) ? remainder : SITH_ENDEC_DEFAULT_PAGE_SIZE;
         info->baseOffset = SITH_FS_INIT(pageNumber * SITH_ENDEC_DEFAULT_PAGE_SIZE);
         info->mask = mask;
+        info->arena = masks;
+        info->cancel = stopToken;
         info->pageSize = SITH_ENDEC_DEFAULT_PAGE_SIZE;
         info->sourceFile = sourceFile;
         info->targetFile = targetFile;
         info->error = errors + pageNumber;
 
-        printf("\rProgress: %.0f%% (%lu/%lu)", (pageNumber + 1) * 100. / pageCount, pageNumber + 1, pageCount);
+        batch[batchSize].task = XORendec;
+        batch[batchSize].argument = info;
+        batchSize++;
+        if (batchSize < SITH_CRYPTO_MASKSLOTS && pageNumber + 1 < pageCount) continue;
+
+dispatch:
+        printf("\rProgress: %.0f%% (%lu/%lu)", (pageNumber + (mask != NULL)) * 100. / pageCount, pageNumber + (mask != NULL), pageCount);
         fflush(stdout);
 
-        // Spin the kernel
-        if (ScheduleTask(encryptPool, XORendec, info, 1)) {
-            HandleErrorStatus("Error scheduling page");
+        // Spin the kernels
+        SITH_TIMER_START(scheduleTimer);
+        unsigned int scheduled = 0;
+        int refused = ScheduleTasks(encryptPool, batch, batchSize, 1, pages, &scheduled);
+        SITH_TIMER_STOP(scheduleTimer, phase_wait);
+        if (refused) {
+            ErrorCode cause = GetErrorCode();
+            HandleErrorStatus("Error scheduling pages");
+            for (unsigned int index = scheduled; index < batchSize; index++) {
+                PageInfo* lost = (PageInfo*) batch[index].argument;
+                *(lost->error) = cause;
+                release_mask(masks, lost->mask);
+                free(lost);
+            }
         }
+        batchSize = 0;
+
+        // The page without a mask goes first in the next batch
+        if (mask == NULL) pageNumber--;
     }
 
-    // This call doubles as resource release and synchronization point
+    // Masks are released by the tasks, the arena must outlive them all
+    unsigned int failures = 0;
+    if (WaitTaskGroup(pages, &failures)) {
+        HandleErrorStatus("Failed waiting for pages");
+        return SITH_FAILCRYPTO_ENDEC;
+    }
+    DestroyTaskGroup(pages);
+    if (getenv(SITH_CRYPTO_STATSENV) != NULL) DumpThreadPoolStats(encryptPool, stderr);
     DestroyThreadPool(encryptPool, 1);
+    destroy_mask_arena(masks);
+
+    // Stopped, pages may be missing: drop the target, keep the source
+    if (IsCancelled(stopToken)) {
+        printf("\nEncryption cancelled\n");
+        fflush(stdout);
+        free(errors);
+        UnlockFileObject(sourceFile, SITH_FS_ZERO, size);
+        UnlockFileObject(targetFile, SITH_FS_ZERO, size);
+        CloseFileObject(sourceFile);
+        CloseFileObject(targetFile);
+        if (DeleteFilePath(argv[2])) {
+            HandleErrorStatus("Could not delete partial target file");
+        }
+        return SITH_FAILCRYPTO_CANCEL;
+    }
+
     printf("\nEncryption finished\n");
     fflush(stdout);
 
-    // Report all errors
+    // Report all errors, including pages that could not be scheduled
     int error = 0;
+    if (failures != 0) {
+        fprintf(stderr, "%u pages failed\n", failures);
+    }
     for (unsigned long index = 0; index < pageCount; index++) {
         if (SITH_ISANERROR(errors[index])) {
             error = SITH_FAILCRYPTO_ENDEC;
@@ -255,5 +770,8 @@ int main(int argc, char** argv) {
         error = SITH_FAILCRYPTO_RELEASE;
     }
 
+    // Kernels have been joined with the pool, all accounts are final
+    SITH_TIMING_REPORT(argv[1], stdout);
+
     return error;
 }
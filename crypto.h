@@ -31,6 +31,16 @@ extern "C" {
 #define SITH_FAILCRYPTO_NOTREG 7
 #define SITH_FAILCRYPTO_LOCKED 8
 #define SITH_FAILCRYPTO_SEED 9
+// Stopped on request, the source is untouched and the partial target removed
+#define SITH_FAILCRYPTO_CANCEL 10
+
+
+//------------------------------------------------------------------------------
+// ENVIRONMENT
+
+// Placement of the page pool, as understood by ParseAffinity(); the server
+// exports it for the engines it spawns
+#define SITH_CRYPTO_AFFINITYENV "SITH_CRYPTO_AFFINITY"
 
 
 #ifdef __cplusplus
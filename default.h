@@ -14,6 +14,16 @@
 #define SITH_DEFAULT_SERVROOT "."
 #define SITH_DEFAULT_SERVMAXCLI "4"
 #define SITH_DEFAULT_SERVMAXTASKS "8"
+#define SITH_DEFAULT_SERVMAXQUEUED "16"
+#define SITH_DEFAULT_SERVMAXPENDING "8"
+#define SITH_DEFAULT_SERVMAXGROW "0"
+#define SITH_DEFAULT_SERVACCEPTORS "1"
+#define SITH_DEFAULT_SERVBACKLOG "128"
+#define SITH_DEFAULT_SERVMAXPIPELINED "8"
+#define SITH_DEFAULT_SERVIDLETIMEOUT "300"
+#define SITH_DEFAULT_SERVMESSAGETIMEOUT "30"
+#define SITH_DEFAULT_SERVLOCALSOCKET "none"
+#define SITH_DEFAULT_AFFINITY "none"
 
 #endif /* DEFAULT_H */
 
@@ -1,12 +1,15 @@
 
 #include "file.h"
 #include "error.h"
+#include "timing.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 
-#ifdef __unix__
+#ifdef _WIN32
+#include <io.h>
+#elif defined __unix__
 #include <sys/stat.h>
 #if _XOPEN_UNIX == -1
 #pragma message "This POSIX stdlib does not implement XSI extensions, GetRealPath function may not work correctly"
@@ -17,6 +20,8 @@ struct file {
 #ifdef _WIN32
     HANDLE handle;
     HANDLE mapping;
+    // Mapped on request, once the file is not empty
+    int mapped;
 #elif defined  __unix__
     int descriptor;
     FileMode mode;
@@ -33,11 +38,11 @@ const FileSize SITH_FS_ZERO = 0;
 #endif
 
 
-File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode, OpenMode openMode, int doMap) {
+File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode, OpenMode openMode, int flags) {
 
 #ifdef _WIN32
     DWORD attr = GetFileAttributes(file_path);
-    if (!(attr & FILE_ATTRIBUTE_NORMAL)
+    if (!(flags & SITH_FILEFLAG_STREAM) && !(attr & FILE_ATTRIBUTE_NORMAL)
             && (attr & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_VIRTUAL))) {
         errno = EBADF;
         return NULL;
@@ -56,9 +61,13 @@ File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode
         }
     }
     else if (!S_ISREG(metadata.st_mode)) {
-        // Path is a valid location for something other than a regular file, bail out
-        errno = EBADF;
-        return NULL;
+        // Streams are tolerated on request, directories and links never are
+        int isStream = S_ISFIFO(metadata.st_mode) || S_ISSOCK(metadata.st_mode) || S_ISCHR(metadata.st_mode);
+        if (!(flags & SITH_FILEFLAG_STREAM) || !isStream) {
+            // Path is a valid location for something other than a regular file, bail out
+            errno = EBADF;
+            return NULL;
+        }
     }
 
 #endif
@@ -70,7 +79,9 @@ File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode
     int open_mode   = openMode & (~SITH_TEMP_APPEND_MODE);
     int append_mode = openMode & SITH_TEMP_APPEND_MODE;
     // Open handle
+    SITH_TIMER_START(openTimer);
     this->handle = CreateFile(file_path, accessMode, 0, NULL, open_mode , FILE_ATTRIBUTE_NORMAL, NULL);
+    SITH_TIMER_STOP(openTimer, phase_open);
     if (this->handle == INVALID_HANDLE_VALUE) {
         free(this);
         return NULL;
@@ -78,7 +89,7 @@ File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode
 
     // Check if it is a regular file
     DWORD type = GetFileType(this->handle);
-    if (type != FILE_TYPE_DISK) {
+    if (type != FILE_TYPE_DISK && !(flags & SITH_FILEFLAG_STREAM)) {
         CloseHandle(this->handle);
         free(this);
         errno = EBADF;
@@ -108,8 +119,11 @@ File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode
             return NULL;
         }
     }
-    // Instantiate the FileMapping object, if requested
-    if (doMap == SITH_FILEFLAG_MAP) {
+    // Instantiate the FileMapping object, if requested; an empty file cannot
+    // be mapped, it is once TruncateFileObject() gives it a size
+    this->mapped = (flags & SITH_FILEFLAG_MAP) != 0;
+    LARGE_INTEGER current;
+    if (this->mapped && GetFileSizeEx(this->handle, &current) && current.QuadPart != 0) {
 
         int permissions = ((accessMode == SITH_FILEMODE_RO) ? PAGE_READONLY : PAGE_READWRITE);
 
@@ -128,14 +142,15 @@ File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode
 
 #elif defined __unix__
     // UNIX does not have an intermediary object for file mappings
-    (void) doMap;
     this->mode = accessMode;
 
     // We need to specify an access mask if O_CREAT is passed to open()
+    SITH_TIMER_START(openTimer);
     if (openMode == SITH_OPENMODE_EXIST)
         this->descriptor = open(file_path, accessMode | openMode);
     else
         this->descriptor = open(file_path, accessMode | openMode, S_IRWXU);
+    SITH_TIMER_STOP(openTimer, phase_open);
     if (this->descriptor == -1) {
         free(this);
         return NULL;
@@ -156,6 +171,44 @@ File* CreateFileObject(const char* file_path, FileSize size, FileMode accessMode
     return this;
 }
 
+File* GetStreamObject(int descriptor, FileMode accessMode) {
+
+    File* this = malloc(sizeof (File));
+    if (this == NULL) return NULL;
+
+#ifdef _WIN32
+    (void) accessMode;
+    switch (descriptor) {
+        case SITH_STDSTREAM_IN:
+            this->handle = GetStdHandle(STD_INPUT_HANDLE);
+            break;
+        case SITH_STDSTREAM_OUT:
+            this->handle = GetStdHandle(STD_OUTPUT_HANDLE);
+            break;
+        default:
+            this->handle = (HANDLE) _get_osfhandle(descriptor);
+    }
+    if (this->handle == INVALID_HANDLE_VALUE || this->handle == NULL) {
+        free(this);
+        errno = EBADF;
+        return NULL;
+    }
+    this->mapping = INVALID_HANDLE_VALUE;
+    this->mapped = 0;
+
+#elif defined __unix__
+    // Validate the descriptor before taking ownership
+    if (fcntl(descriptor, F_GETFD) == -1) {
+        free(this);
+        return NULL;
+    }
+    this->descriptor = descriptor;
+    this->mode = accessMode;
+#endif
+
+    return this;
+}
+
 int GetFileObjectSize(File* this, FileSize* fSize) {
 #ifdef _WIN32
     BOOL success = GetFileSizeEx(this->handle, fSize);
@@ -175,7 +228,9 @@ int GetFileObjectSize(File* this, FileSize* fSize) {
 int ReadFromFileObject(File* this, char* buffer, size_t* size) {
 #ifdef _WIN32
     DWORD out = *size;
+    SITH_TIMER_START(readTimer);
     BOOL success = ReadFile(this->handle, buffer, (DWORD) (*size), &out, NULL);
+    SITH_TIMER_STOP(readTimer, phase_read);
     if (success == TRUE) {
         *size = (size_t) out;
         return SITH_RET_OK;
@@ -183,7 +238,9 @@ int ReadFromFileObject(File* this, char* buffer, size_t* size) {
 
     else return SITH_RET_ERR;
 #elif defined __unix__
+    SITH_TIMER_START(readTimer);
     ssize_t out = read(this->descriptor, buffer, *size);
+    SITH_TIMER_STOP(readTimer, phase_read);
     if (out < 0) return SITH_RET_ERR;
     else {
         *size = (size_t) out;
@@ -195,7 +252,9 @@ int ReadFromFileObject(File* this, char* buffer, size_t* size) {
 int WriteToFileObject(File* this, const char* buffer, size_t* size) {
 #ifdef _WIN32
     DWORD out = *size;
+    SITH_TIMER_START(writeTimer);
     BOOL success = WriteFile(this->handle, buffer, (DWORD) (*size), &out, NULL);
+    SITH_TIMER_STOP(writeTimer, phase_write);
     if (success == TRUE) {
         *size = (size_t) out;
         return SITH_RET_OK;
@@ -203,7 +262,9 @@ int WriteToFileObject(File* this, const char* buffer, size_t* size) {
 
     else return SITH_RET_ERR;
 #elif defined __unix__
+    SITH_TIMER_START(writeTimer);
     ssize_t out = write(this->descriptor, buffer, *size);
+    SITH_TIMER_STOP(writeTimer, phase_write);
     if (out < 0) return SITH_RET_ERR;
     else {
         *size = (size_t) out;
@@ -214,7 +275,9 @@ int WriteToFileObject(File* this, const char* buffer, size_t* size) {
 
 int LockFileObject(File* this, FileSize base, FileSize limit) {
 #ifdef _WIN32
+    SITH_TIMER_START(lockTimer);
     BOOL success = LockFile(this->handle, base.LowPart, base.HighPart, limit.LowPart, limit.HighPart);
+    SITH_TIMER_STOP(lockTimer, phase_lock);
     return (success == TRUE) ? SITH_RET_OK : SITH_RET_ERR;
 #elif defined __unix__
     struct flock l = {
@@ -224,7 +287,28 @@ int LockFileObject(File* this, FileSize base, FileSize limit) {
         .l_len = limit,
         .l_pid = 0
     };
+    SITH_TIMER_START(lockTimer);
     int error = fcntl(this->descriptor, F_SETLKW, &l);
+    SITH_TIMER_STOP(lockTimer, phase_lock);
+
+    return error ? SITH_RET_ERR : SITH_RET_OK;
+#endif
+}
+
+int TryLockFileObject(File* this, FileSize base, FileSize limit) {
+#ifdef _WIN32
+    return LockFileObject(this, base, limit);
+#elif defined __unix__
+    struct flock l = {
+        .l_type = this->mode == O_RDONLY ? F_RDLCK : F_WRLCK,
+        .l_whence = SEEK_SET,
+        .l_start = base,
+        .l_len = limit,
+        .l_pid = 0
+    };
+    SITH_TIMER_START(lockTimer);
+    int error = fcntl(this->descriptor, F_SETLK, &l);
+    SITH_TIMER_STOP(lockTimer, phase_lock);
 
     return error ? SITH_RET_ERR : SITH_RET_OK;
 #endif
@@ -251,12 +335,16 @@ int UnlockFileObject(File* this, FileSize base, FileSize limit) {
 
 int CloseFileObject(File* this) {
 #ifdef _WIN32
-    BOOL success = CloseHandle(this->mapping);
+    SITH_TIMER_START(closeTimer);
+    BOOL success = (this->mapping == INVALID_HANDLE_VALUE) || CloseHandle(this->mapping);
     BOOL success2 = CloseHandle(this->handle);
+    SITH_TIMER_STOP(closeTimer, phase_close);
     free(this);
     return (success == TRUE && success2 == TRUE) ? SITH_RET_OK : SITH_RET_ERR;
 #elif defined __unix__
+    SITH_TIMER_START(closeTimer);
     int error = close(this->descriptor);
+    SITH_TIMER_STOP(closeTimer, phase_close);
     free(this);
 
     return error ? SITH_RET_ERR : SITH_RET_OK;
@@ -265,10 +353,14 @@ int CloseFileObject(File* this) {
 
 int DeleteFilePath(const char* file_path) {
 #ifdef _WIN32
+    SITH_TIMER_START(unlinkTimer);
     BOOL success = DeleteFile(file_path);
+    SITH_TIMER_STOP(unlinkTimer, phase_unlink);
     return (success == TRUE) ? SITH_RET_OK : SITH_RET_ERR;
 #elif defined __unix__
+    SITH_TIMER_START(unlinkTimer);
     int error = unlink(file_path);
+    SITH_TIMER_STOP(unlinkTimer, phase_unlink);
 
     return error ? SITH_RET_ERR : SITH_RET_OK;
 #endif
@@ -286,14 +378,19 @@ void* AllocateMapping(File* file, FileSize baseAddress, size_t pageSize, SIZE_T
         return NULL;
     }
 	
+    SITH_TIMER_START(mapTimer);
     this = MapViewOfFile(file->mapping, mode, baseAddress.HighPart, baseAddress.LowPart, actualSize);
+    SITH_TIMER_STOP(mapTimer, phase_map);
     if (this == NULL) {
         return NULL;
     }
 #elif defined __unix__
     (void) actualSize;
 
+    // MAP_POPULATE prefaults the writable view, so its page faults count in here
+    SITH_TIMER_START(mapTimer);
     this = mmap(NULL, pageSize, mode, (mode == SITH_MAPMODE_READ) ? MAP_PRIVATE : (MAP_SHARED | MAP_POPULATE), file->descriptor, baseAddress);
+    SITH_TIMER_STOP(mapTimer, phase_map);
     if (this == MAP_FAILED) {
 
         return NULL;
@@ -306,10 +403,14 @@ void* AllocateMapping(File* file, FileSize baseAddress, size_t pageSize, SIZE_T
 int FreeMapping(void* this, size_t pageSize) {
 #ifdef _WIN32
     (void) pageSize;
+    SITH_TIMER_START(unmapTimer);
     BOOL success = UnmapViewOfFile(this);
+    SITH_TIMER_STOP(unmapTimer, phase_unmap);
     return (success == TRUE) ? SITH_RET_OK : SITH_RET_ERR;
 #elif defined __unix__
+    SITH_TIMER_START(unmapTimer);
     int error = munmap(this, pageSize);
+    SITH_TIMER_STOP(unmapTimer, phase_unmap);
 
     return error ? SITH_RET_ERR : SITH_RET_OK;
 #endif
@@ -318,21 +419,51 @@ int FreeMapping(void* this, size_t pageSize) {
 int SyncMapping(void* this, size_t pageSize, SIZE_T actualSize) {
 #ifdef _WIN32
     (void) pageSize;
+    SITH_TIMER_START(syncTimer);
     BOOL success = FlushViewOfFile(this, actualSize);
+    SITH_TIMER_STOP(syncTimer, phase_sync);
     return (success == TRUE) ? SITH_RET_OK : SITH_RET_ERR;
 #elif defined __unix__
     (void) actualSize;
+    SITH_TIMER_START(syncTimer);
     int error = msync(this, pageSize, MS_SYNC);
+    SITH_TIMER_STOP(syncTimer, phase_sync);
 
     return error ? SITH_RET_ERR : SITH_RET_OK;
 #endif
 }
 
+int TruncateFileObject(File* file, FileSize size) {
+#ifdef _WIN32
+    // The mapping's size is fixed at creation
+    if (file->mapping != INVALID_HANDLE_VALUE) CloseHandle(file->mapping);
+    file->mapping = INVALID_HANDLE_VALUE;
+    if (!SetFilePointerEx(file->handle, SITH_FS_ZERO, NULL, FILE_BEGIN) || !SetEndOfFile(file->handle)) return SITH_RET_ERR;
+    if (!SetFilePointerEx(file->handle, size, NULL, FILE_BEGIN) || !SetEndOfFile(file->handle)) return SITH_RET_ERR;
+    if (file->mapped && SITH_FS_LL(size) != 0) {
+        file->mapping = CreateFileMapping(file->handle, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (file->mapping == NULL) {
+            file->mapping = INVALID_HANDLE_VALUE;
+            return SITH_RET_ERR;
+        }
+    }
+    return SITH_RET_OK;
+#elif defined __unix__
+    if (ftruncate(file->descriptor, 0) || ftruncate(file->descriptor, size)) return SITH_RET_ERR;
+    return SITH_RET_OK;
+#endif
+}
+
 int SyncFileObject(File* file) {
+    SITH_TIMER_START(syncTimer);
 #ifdef _WIN32
-    return FlushFileBuffers(file->handle) ? SITH_RET_OK : SITH_RET_ERR;
+    BOOL success = FlushFileBuffers(file->handle);
+    SITH_TIMER_STOP(syncTimer, phase_sync);
+    return success ? SITH_RET_OK : SITH_RET_ERR;
 #elif defined __unix__
-    return fsync(file->descriptor) ? SITH_RET_ERR : SITH_RET_OK;
+    int error = fsync(file->descriptor);
+    SITH_TIMER_STOP(syncTimer, phase_sync);
+    return error ? SITH_RET_ERR : SITH_RET_OK;
 #endif
 }
 
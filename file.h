@@ -23,7 +23,8 @@
  *
  * - Locks are advisory on UNIX, and mandaory on Windows
  *
- * - LockObject does (should...) block on invocation
+ * - LockObject does (should...) block on invocation, TryLockFileObject never
+ *   does; note that WINAPI's LockFile is always immediate
  *
  * - The abstract type FileSize is defined in order to accomodate the different
  *      definitions from the OSs, utility macros have been defined to permit
@@ -138,6 +139,11 @@ typedef int OpenMode;
 #endif
 
 #define SITH_FILEFLAG_MAP 1
+#define SITH_FILEFLAG_STREAM 2
+
+// Descriptors of the standard streams, for GetStreamObject
+#define SITH_STDSTREAM_IN 0
+#define SITH_STDSTREAM_OUT 1
 
 
 //------------------------------------------------------------------------------
@@ -160,6 +166,8 @@ typedef int OpenMode;
  * @param flags: An OR combination of the following flags:
  * <ul>
  * <li> SITH_FILEFLAG_MAP: Map the file to memory</li>
+ * <li> SITH_FILEFLAG_STREAM: Also accept FIFOs, sockets and character
+ *      devices; such objects can only be read and written sequentially</li>
  * </ul>
  *
  * @return the FileObject of the specified file, or NULL if an error occurred
@@ -171,6 +179,19 @@ File* CreateFileObject(
         _In_ OpenMode openMode,
         _In_ int flags);
 
+/**
+ * Wraps an already open descriptor of the calling process into a file object,
+ * for sequential access only. Closing the object closes the descriptor.
+ *
+ * @param descriptor One of the SITH_STDSTREAM macros, or [UNIX] any inherited
+ *      file descriptor (pipe, socket...) / [WINAPI] any CRT descriptor
+ * @param accessMode One of the FILEMODE macros
+ * @return the FileObject wrapping the descriptor, or NULL if an error occurred
+ */
+File* GetStreamObject(
+        _In_ int descriptor,
+        _In_ FileMode accessMode);
+
 /**
  * Frees all resources of this file object
  *
@@ -221,6 +242,17 @@ int WriteToFileObject(File* file, const char* buffer, size_t* size);
  */
 int LockFileObject(File* file, FileSize offset, FileSize length);
 
+/**
+ * Same as LockFileObject, but fails immediately with EAGAIN/EACCES
+ * ([WINAPI] ERROR_LOCK_VIOLATION) if the segment is held by another process
+ *
+ * @param file this File object
+ * @param offset
+ * @param length
+ * @return SITH_OK if successful, SITH_ERR otherwise
+ */
+int TryLockFileObject(File* file, FileSize offset, FileSize length);
+
 /**
  * Unlocks exclusively this file's segment specified by offset and length for the calling process
  *
@@ -287,6 +319,19 @@ int SyncMapping(
         _In_ size_t pageSize,
         _In_ SIZE_T actualSize);
 
+/**
+ * Empties the given file, then extends it with zeros to the given size; meant
+ * for writable files whose previous contents must survive until the caller
+ * holds their locks
+ *
+ * @param file The file object to truncate
+ * @param size The file's new size
+ * @return SITH_OK if successful, SITH_ERR otherwise
+ */
+int TruncateFileObject(
+        _In_ File* file,
+        _In_ FileSize size);
+
 /**
  * Flushes all buffers of the given file object
  *
@@ -3,6 +3,7 @@
 
 #include "string.h"
 #include "error.h"
+#include "sync.h"
 #include "filewalker.h"
 
 #ifdef __unix__
@@ -170,31 +171,63 @@ ReturnWalk WalkNext(SithWalker* walker, FileSize* size, HeapString* file) {
 #endif
 }
 
-int WalkInDir(SithWalker* walker, HeapString* files) {
-    if (files == NULL) return SITH_RET_ERR;
+void append_entry(HeapString* lines, FileSize size, HeapString* path) {
+    char sizeformat[22] = {0};
+    snprintf(sizeformat, 22, "%-15"SITH_FORMAT_FILESIZE" ", SITH_FS_LL(size));
+    HeapStringAppend(lines, sizeformat);
+    HeapStringAppendSafe(lines, path);
+    HeapStringAppend(lines, "\r\n");
+}
+
+// Hands the batch over once it is full, or whatever is left when forced; the
+//batch starts over either way
+
+int emit_batch(HeapString* lines, int force, WalkSink sink, void* context) {
+    size_t length = HeapStringLength(lines);
+    if (length == 0 || (!force && length < SITH_WALK_BATCH)) return SITH_RET_OK;
+    int error = sink(context, HeapStringGetRaw(lines), length);
+    HeapStringSet(lines, "");
+    return error;
+}
+
+int append_lines(void* context, const char* lines, size_t length) {
+    (void) length;
+    return HeapStringAppend((HeapString*) context, (char*) lines);
+}
+
+int WalkInDirStreamed(SithWalker* walker, WalkSink sink, void* context) {
+    if (sink == NULL) return SITH_RET_ERR;
     FileSize size = SITH_FS_INIT(0);
     HeapString* string = CreateHeapString("");
-    ReturnWalk st = WalkFirst(walker, &size, string);
-    if (st == return_error) return SITH_RET_ERR;
-    char sizeformatted[22] = {0};
-    snprintf(sizeformatted, 22, "%-15"SITH_FORMAT_FILESIZE" ", SITH_FS_LL(size));
-    HeapStringSet(files, sizeformatted);
-    HeapStringAppendSafe(files, string);
-    HeapStringAppend(files, "\r\n");
-    while (1) {
-        if (WalkNext(walker, &size, string) == return_error) break;
-        char sizeformat[22] = {0};
-        snprintf(sizeformat, 22, "%-15"SITH_FORMAT_FILESIZE" ", SITH_FS_LL(size));
-        HeapStringAppend(files, sizeformat);
-        HeapStringAppendSafe(files, string);
-        HeapStringAppend(files, "\r\n");
+    HeapString* lines = CreateHeapString("");
+    if (string == NULL || lines == NULL) {
+        DisposeHeapString(string);
+        DisposeHeapString(lines);
+        return SITH_RET_ERR;
     }
-    HeapStringAppend(files, ".\r\n");
-    /*
-        printf("%s\n", HeapStringGetRaw(files));
-     */
+
+    ReturnWalk ret = WalkFirst(walker, &size, string);
+    int error = (ret == return_error) ? SITH_RET_ERR : SITH_RET_OK;
+    int stopped = 0;
+    while (ret != return_error) {
+        append_entry(lines, size, string);
+        if ((stopped = emit_batch(lines, 0, sink, context))) break;
+        ret = WalkNext(walker, &size, string);
+    }
+    if (!stopped) {
+        if (walker->main_folder) HeapStringAppend(lines, ".\r\n");
+        stopped = emit_batch(lines, 1, sink, context);
+    }
+
+    DisposeHeapString(lines);
     DisposeHeapString(string);
-    return SITH_RET_OK;
+    return (error || stopped) ? SITH_RET_ERR : SITH_RET_OK;
+}
+
+int WalkInDir(SithWalker* walker, HeapString* files) {
+    if (files == NULL) return SITH_RET_ERR;
+    HeapStringSet(files, "");
+    return WalkInDirStreamed(walker, append_lines, files);
 }
 
 int WalkInDirRecursive(SithWalker* walker, HeapString* files) {
@@ -234,12 +267,302 @@ int WalkInDirRecursive(SithWalker* walker, HeapString* files) {
     return SITH_RET_OK;
 }
 
+// Parallel walk state, shared by all directory tasks. Only the caller hands
+//lines to the sink: tasks queue their batches, and a task finding the queue
+//full is set aside rather than kept waiting on a kernel
+
+typedef SITH_TASKARG struct sith_dir_task {
+    struct sith_parallel_walk* walk;
+    SithWalker* walker;
+    // The batch being filled, kept while the task is set aside
+    HeapString* lines;
+    int started;
+    int over;
+    int caller;
+    struct sith_dir_task* next;
+} DirTask;
+
+typedef struct sith_parallel_walk {
+    ThreadPool* pool;
+    WalkSink sink;
+    void* context;
+    LockObject* lock;
+    // Signalled as batches are queued and tasks are over
+    CondVar* changed;
+    unsigned int outstanding;
+    int error;
+    // Set once the sink refuses lines, no further directories are walked
+    int stopped;
+    HeapString* queued[SITH_WALK_QUEUED];
+    unsigned int queuedFirst;
+    unsigned int queuedCount;
+    // Tasks set aside with a full batch, and ones not started yet
+    DirTask* parked;
+    DirTask* waiting;
+} ParallelWalk;
+
+SITH_TASKBODY int walk_task(void* a);
+
+void schedule_dir(ParallelWalk* walk, const char* path) {
+    DirTask* task = calloc(1, sizeof (DirTask));
+    SithWalker* walker = InitWalker(path);
+    if (task == NULL || walker == NULL) {
+        free(task);
+        DisposeWalker(walker);
+        DoLockObject(walk->lock);
+        walk->error = 1;
+        DoUnlockObject(walk->lock);
+        return;
+    }
+    task->walk = walk;
+    task->walker = walker;
+
+    DoLockObject(walk->lock);
+    (walk->outstanding)++;
+    DoUnlockObject(walk->lock);
+
+    // From a kernel of a stealing pool, this lands on its own deque; from the
+    // caller it is queued as urgent, so that a new listing does not wait for
+    // the kernels to finish the trees of listings already running
+    if (SchedulePriorityTask(walk->pool, walk_task, task, 1, priority_high)) {
+        DoLockObject(walk->lock);
+        (walk->outstanding)--;
+        walk->error = 1;
+        DoUnlockObject(walk->lock);
+        DisposeWalker(walker);
+        free(task);
+    }
+}
+
+void finish_task(ParallelWalk* walk, DirTask* task) {
+    DisposeHeapString(task->lines);
+    DisposeWalker(task->walker);
+    free(task);
+
+    DoLockObject(walk->lock);
+    (walk->outstanding)--;
+    BroadcastConditionVariable(walk->changed);
+    DoUnlockObject(walk->lock);
+}
+
+// Caller only, with the lock held: queues the batch of a task set aside, or
+//picks one not started yet; it is scheduled again by resume_task
+
+DirTask* unpark_task(ParallelWalk* walk) {
+    DirTask* task = walk->parked;
+    if (task != NULL) {
+        walk->parked = task->next;
+        walk->queued[(walk->queuedFirst + walk->queuedCount) % SITH_WALK_QUEUED] = task->lines;
+        walk->queuedCount++;
+        task->lines = NULL;
+        return task;
+    }
+    task = walk->waiting;
+    if (task != NULL) walk->waiting = task->next;
+    return task;
+}
+
+void resume_task(ParallelWalk* walk, DirTask* task) {
+    if (task == NULL) return;
+    if (task->over || SchedulePriorityTask(walk->pool, walk_task, task, 1, priority_high) == SITH_RET_ERR) {
+        if (!task->over) {
+            DoLockObject(walk->lock);
+            walk->error = 1;
+            DoUnlockObject(walk->lock);
+        }
+        finish_task(walk, task);
+    }
+}
+
+// Caller only, with the lock held: hands the oldest batch to the sink, and
+//lets a task set aside take its place; the lock is let go meanwhile
+
+void take_walked(ParallelWalk* walk) {
+    HeapString* lines = walk->queued[walk->queuedFirst];
+    walk->queuedFirst = (walk->queuedFirst + 1) % SITH_WALK_QUEUED;
+    walk->queuedCount--;
+    DirTask* resumed = unpark_task(walk);
+    DoUnlockObject(walk->lock);
+
+    resume_task(walk, resumed);
+    int error = walk->sink(walk->context, HeapStringGetRaw(lines), HeapStringLength(lines));
+    DisposeHeapString(lines);
+
+    DoLockObject(walk->lock);
+    if (error) walk->stopped = 1;
+}
+
+// Caller only, with the lock held: once stopped, queued batches and tasks set
+//aside are dropped
+
+void drop_walked(ParallelWalk* walk) {
+    while (walk->queuedCount != 0) {
+        DisposeHeapString(walk->queued[walk->queuedFirst]);
+        walk->queuedFirst = (walk->queuedFirst + 1) % SITH_WALK_QUEUED;
+        walk->queuedCount--;
+    }
+    while (walk->parked != NULL || walk->waiting != NULL) {
+        DirTask* task = walk->parked != NULL ? walk->parked : walk->waiting;
+        if (task == walk->parked) walk->parked = task->next;
+        else walk->waiting = task->next;
+        DoUnlockObject(walk->lock);
+        finish_task(walk, task);
+        DoLockObject(walk->lock);
+    }
+}
+
+// Queues the task's batch once full, or whatever is left when forced. Returns
+//1 if the task was set aside instead, to be resumed by the caller as it takes
+//batches, SITH_RET_ERR once the walk is stopped; the caller makes room itself
+
+int queue_walked(ParallelWalk* walk, DirTask* task, int force) {
+    size_t length = HeapStringLength(task->lines);
+    if (length == 0 || (!force && length < SITH_WALK_BATCH)) return SITH_RET_OK;
+
+    DoLockObject(walk->lock);
+    while (task->caller && !walk->stopped && walk->queuedCount == SITH_WALK_QUEUED) take_walked(walk);
+    int result = SITH_RET_OK;
+    if (walk->stopped) {
+        result = SITH_RET_ERR;
+    }
+    else if (walk->queuedCount == SITH_WALK_QUEUED) {
+        task->next = walk->parked;
+        walk->parked = task;
+        result = 1;
+    }
+    else {
+        walk->queued[(walk->queuedFirst + walk->queuedCount) % SITH_WALK_QUEUED] = task->lines;
+        walk->queuedCount++;
+        task->lines = NULL;
+        BroadcastConditionVariable(walk->changed);
+    }
+    DoUnlockObject(walk->lock);
+    return result;
+}
+
+// Lists a single directory in a private batch, queued whenever it fills and at
+//the end, so that its entries stay together unless they are many;
+//subdirectories are handed to the pool on the way. Returns 1 if the task was
+//set aside, after which it belongs to the caller; SITH_RET_ERR if the
+//directory could not be read
+
+int walk_entries(ParallelWalk* walk, DirTask* task) {
+    // A task is not started while the queue is full, so that tasks set aside
+    //do not hold a directory open
+    if (!task->started && !task->caller) {
+        DoLockObject(walk->lock);
+        int full = !walk->stopped && walk->queuedCount == SITH_WALK_QUEUED;
+        if (full) {
+            task->next = walk->waiting;
+            walk->waiting = task;
+        }
+        DoUnlockObject(walk->lock);
+        if (full) return 1;
+    }
+
+    FileSize size = SITH_FS_INIT(0);
+    HeapString* string = CreateHeapString("");
+    if (string == NULL) return SITH_RET_ERR;
+
+    ReturnWalk ret = task->started ? WalkNext(task->walker, &size, string) : WalkFirst(task->walker, &size, string);
+    int error = (ret == return_error && !task->started) ? SITH_RET_ERR : SITH_RET_OK;
+    int queued = SITH_RET_OK;
+    task->started = 1;
+    while (ret != return_error) {
+        if (ret == return_dir) schedule_dir(walk, HeapStringGetRaw(string));
+        if (task->lines == NULL && (task->lines = CreateHeapString("")) == NULL) {
+            error = SITH_RET_ERR;
+            break;
+        }
+        append_entry(task->lines, size, string);
+        if ((queued = queue_walked(walk, task, 0))) break;
+        ret = WalkNext(task->walker, &size, string);
+    }
+    DisposeHeapString(string);
+    if (queued) return queued;
+
+    // The task may be resumed by the caller as soon as it is set aside
+    task->over = 1;
+    if (task->lines != NULL) queued = queue_walked(walk, task, 1);
+    return (queued == 1) ? 1 : error;
+}
+
+SITH_TASKBODY int walk_task(void* a) {
+    DirTask* task = (DirTask*) a;
+    ParallelWalk* walk = task->walk;
+
+    // Empty or unreadable subdirectories are skipped, as in the sequential walk
+    DoLockObject(walk->lock);
+    int stopped = walk->stopped;
+    DoUnlockObject(walk->lock);
+    if (stopped || walk_entries(walk, task) != 1) finish_task(walk, task);
+    return SITH_RET_OK;
+}
+
+int WalkInDirParallelStreamed(SithWalker* walker, WalkSink sink, void* context, ThreadPool* pool) {
+    if (sink == NULL || pool == NULL) return SITH_RET_ERR;
+
+    ParallelWalk walk = {0};
+    walk.pool = pool;
+    walk.sink = sink;
+    walk.context = context;
+    walk.lock = CreateLockObject();
+    walk.changed = CreateConditionVar();
+    if (walk.lock == NULL || walk.changed == NULL) {
+        if (walk.lock != NULL) DestroyLockObject(walk.lock);
+        if (walk.changed != NULL) DestroyConditionVar(walk.changed);
+        return SITH_RET_ERR;
+    }
+
+    // The root is listed by the caller, then the tree is taken as it comes
+    DirTask root = {0};
+    root.walk = &walk;
+    root.walker = walker;
+    root.caller = 1;
+    int error = walk_entries(&walk, &root);
+    DisposeHeapString(root.lines);
+
+    DoLockObject(walk.lock);
+    while (1) {
+        if (walk.stopped) drop_walked(&walk);
+        if (walk.queuedCount != 0) {
+            take_walked(&walk);
+        }
+        else if (walk.parked != NULL || walk.waiting != NULL) {
+            // Only tasks not started yet are left, as full ones queue right away
+            DirTask* resumed = unpark_task(&walk);
+            DoUnlockObject(walk.lock);
+            resume_task(&walk, resumed);
+            DoLockObject(walk.lock);
+        }
+        else if (walk.outstanding != 0) {
+            WaitConditionVariable(walk.changed, walk.lock);
+        }
+        else {
+            break;
+        }
+    }
+    DoUnlockObject(walk.lock);
+
+    if (walker->main_folder && !walk.stopped) {
+        if (sink(context, ".\r\n", 3)) walk.stopped = 1;
+    }
+    DestroyConditionVar(walk.changed);
+    DestroyLockObject(walk.lock);
+    return (error || walk.error || walk.stopped) ? SITH_RET_ERR : SITH_RET_OK;
+}
+
+int WalkInDirParallel(SithWalker* walker, HeapString* files, ThreadPool* pool) {
+    if (files == NULL) return SITH_RET_ERR;
+    return WalkInDirParallelStreamed(walker, append_lines, files, pool);
+}
+
 void DisposeWalker(SithWalker* walker) {
     if (walker == NULL) return;
     DisposeHeapString(walker->root);
     walker->root = NULL;
 #ifdef __unix__
-    closedir(walker->currentDir);
+    if (walker->currentDir != NULL) closedir(walker->currentDir);
     walker->currentDir = NULL;
 #endif
     free(walker);
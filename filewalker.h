@@ -9,6 +9,7 @@ extern "C" {
 #include "plat.h"
 #include "file.h"
 #include "string_heap.h"
+#include "pool.h"
 
 #include <limits.h>
 #ifdef _WIN32
@@ -41,6 +42,17 @@ typedef enum retMean{
 
 typedef struct filewalker SithWalker;
 
+/*
+ * Receives listing lines as they are walked, NUL terminated and only valid during the call.
+ * Returning SITH_RET_ERR stops the walk.
+ */
+typedef int (*WalkSink)(void* context, const char* lines, size_t length);
+
+// Lines are handed to a sink in batches of about this many bytes
+#define SITH_WALK_BATCH 16384
+// Batches a parallel walk holds for its caller, before setting tasks aside
+#define SITH_WALK_QUEUED 8
+
 
 /*
  * This function  intialize a SithWalker.
@@ -68,6 +80,41 @@ int WalkInDir(SithWalker* walker, HeapString* files);
  */
 int WalkInDirRecursive(SithWalker* walker, HeapString* files);
 
+/*
+ * Same as WalkInDirRecursive, but subdirectories are listed as tasks on the given pool, best in stealing mode.
+ * Entries of a directory stay together unless they exceed SITH_WALK_BATCH, directories come in no particular order.
+ *
+ * @param walker: The walker
+ * @param files : the heapstring with the content of the files
+ * @param pool : the pool running the subdirectory tasks, the caller should not be one of its kernels
+ * Remarks: Blocks until all subdirectories have been listed.
+ */
+int WalkInDirParallel(SithWalker* walker, HeapString* files, ThreadPool* pool);
+
+/*
+ * Same as WalkInDir, but lines go to the sink in batches as they are walked, so that memory does not grow with the directory.
+ *
+ * @param walker: The walker
+ * @param sink : the function receiving the lines
+ * @param context : passed to the sink
+ * @return SITH_RET_ERR if the directory could not be read or the sink stopped the walk
+ */
+int WalkInDirStreamed(SithWalker* walker, WalkSink sink, void* context);
+
+/*
+ * Same as WalkInDirParallel, but lines go to the sink in batches as they are walked.
+ * The sink is only called by the caller, kernels queue batches for it and never wait on it: past SITH_WALK_QUEUED
+ * batches, their tasks are set aside until the sink takes one, so a slow sink does not hold back other walks.
+ * Entries of a directory stay together unless they exceed a batch.
+ *
+ * @param walker: The walker
+ * @param sink : the function receiving the lines
+ * @param context : passed to the sink
+ * @param pool : the pool running the subdirectory tasks, the caller should not be one of its kernels
+ * Remarks: Blocks until all subdirectories have been listed, or the sink stopped the walk.
+ */
+int WalkInDirParallelStreamed(SithWalker* walker, WalkSink sink, void* context, ThreadPool* pool);
+
 
 /*
  * Start the directory walking.
@@ -0,0 +1,477 @@
+/*
+ * File:   loadgen.c
+ * Brief:  Load generator, drives a server over many connections and reports
+ *          throughput, failure rates and latency percentiles per command
+ *
+ * - Each connection has a thread of its own and one request in flight; without
+ *      a target rate they send back to back (closed loop), otherwise requests
+ *      are spread evenly over the connections at the given total rate, and
+ *      latencies count from the intended send time, so that a server falling
+ *      behind shows up in them
+ * - Connection i encrypts and decrypts its own file, named after the file
+ *      prefix and i; since ENCR replaces a file by its encrypted copy and DECR
+ *      reverses it, a connection alternates the two whichever the mix picks, so
+ *      that their weights add up. Files are decrypted back after the run
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "error.h"
+#include "net.h"
+#include "multi.h"
+
+#include "string.h"
+#include "arguments.h"
+#include "proto.h"
+#include "default.h"
+#include "timing.h"
+
+//------------------------------------------------------------------------------
+// ARGUMENTS
+
+#define SITH_GEN_OPTNUM 11
+#define SITH_GEN_TITLE "Crypto-Sithis, load generator"
+#define SITH_GEN_OPTIONS (Option[]) {\
+    {'h', "",               0, SITH_OPT_FALSE,          "Show this help"},\
+    {'a', "server_addr",    1, SITH_DEFAULT_ADDRESS,    "The server's IP address, or the path of its local socket. Default is localhost"},\
+    {'p', "server_port",    1, SITH_DEFAULT_PORT,       "The server's port. Default is 8888"},\
+    {'n', "connections",    1, "8",                     "Number of concurrent connections"},\
+    {'d', "duration",       1, "10",                    "Run length in seconds"},\
+    {'r', "rate",           1, "0",                     "Total requests per second across all connections, 0 sends back to back"},\
+    {'m', "mix",            1, "LSTF:40,LSTR:10,ENCR:25,DECR:25", "Relative weights of the commands sent, as COMMAND:weight pairs"},\
+    {'f', "file_prefix",    1, "bench",                 "Files encrypted by connection i are named after this prefix and i, relative to the server's root"},\
+    {'R', "server_root",    1, "none",                  "The server's root directory, if local: the files are then created there and removed after the run"},\
+    {'z', "file_size",      1, "64",                    "Size in KiB of the files created in server_root"},\
+    {'s', "seed",           1, "42",                    "Seed used for encryption"},\
+}
+
+#define SITH_GEN_CFGPATH "./loadgen.conf"
+
+//------------------------------------------------------------------------------
+// UTILITY MACROS
+
+// Command, file name and seed
+#define SITH_MAXCH_GENREQ (2 * SITH_MAX_VALUE_LEN + 32)
+// Latency samples kept per command before the first growth
+#define SITH_GEN_SAMPLES 1024
+
+
+//------------------------------------------------------------------------------
+// DATA STRUCTURES
+
+typedef enum {
+    command_lstf, command_lstr, command_encr, command_decr, command_count
+} Command;
+
+const char* commandNames[command_count] = {"LSTF", "LSTR", "ENCR", "DECR"};
+
+// Outcomes of one command on one connection, latencies in nanoseconds
+
+typedef struct {
+    unsigned long long sent;
+    unsigned long long succeeded;
+    unsigned long long busy;
+    unsigned long long failed;
+    unsigned long long* latencies;
+    size_t latencyCount;
+    size_t latencyCapacity;
+} CommandStats;
+
+typedef struct {
+    unsigned int index;
+    ThreadObject* thread;
+    ConnectionSocket* server;
+    unsigned int random;
+    // Whether the connection's file is currently encrypted
+    int encrypted;
+    // Connection refused or lost, the thread then stops early
+    int refused;
+    int lost;
+    CommandStats stats[command_count];
+} Worker;
+
+
+//------------------------------------------------------------------------------
+// GENERATOR FIELDS
+
+char address[SITH_MAX_VALUE_LEN] = {0};
+unsigned short port = 0;
+unsigned int connections = 0;
+unsigned int rate = 0;
+unsigned int weights[command_count] = {0};
+unsigned int weightTotal = 0;
+char filePrefix[SITH_MAX_VALUE_LEN] = {0};
+char seed[SITH_MAX_VALUE_LEN] = {0};
+
+// Run window, workers start together
+unsigned long long startTime = 0;
+unsigned long long endTime = 0;
+
+
+//------------------------------------------------------------------------------
+// FUNCTIONS
+
+int parse_mix(const char* mix) {
+    char copy[SITH_MAX_VALUE_LEN];
+    strncpy(copy, mix, SITH_MAX_VALUE_LEN - 1);
+    copy[SITH_MAX_VALUE_LEN - 1] = '\0';
+
+    for (char* pair = strtok(copy, ","); pair != NULL; pair = strtok(NULL, ",")) {
+        char* colon = strchr(pair, ':');
+        if (colon == NULL) return SITH_RET_ERR;
+        *colon = '\0';
+
+        int command = 0;
+        while (command < command_count && strcmp(pair, commandNames[command]) != 0) command++;
+        char* end;
+        unsigned long weight = strtoul(colon + 1, &end, 10);
+        if (command == command_count || *end != '\0' || end == colon + 1 || weight > 1000000) return SITH_RET_ERR;
+
+        weights[command] = (unsigned int) weight;
+    }
+
+    for (int command = 0; command < command_count; command++) weightTotal += weights[command];
+    return weightTotal > 0 ? SITH_RET_OK : SITH_RET_ERR;
+}
+
+// Xorshift, one state per worker
+
+unsigned int next_random(Worker* worker) {
+    unsigned int x = worker->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return worker->random = x;
+}
+
+Command pick_command(Worker* worker) {
+    unsigned int roll = next_random(worker) % weightTotal;
+    int command = 0;
+    while (roll >= weights[command]) roll -= weights[command++];
+
+    // The file only allows one of the two
+    if (command == command_encr && worker->encrypted) return command_decr;
+    if (command == command_decr && !worker->encrypted) return command_encr;
+    return (Command) command;
+}
+
+void pause_until(unsigned long long deadline) {
+    unsigned long long now = ReadTimer();
+    if (now >= deadline) return;
+    unsigned long long left = deadline - now;
+#ifdef _WIN32
+    Sleep((DWORD) (left / 1000000));
+#elif defined __unix__
+    struct timespec wait = {(time_t) (left / 1000000000ULL), (long) (left % 1000000000ULL)};
+    nanosleep(&wait, NULL);
+#endif
+}
+
+int record_latency(CommandStats* stats, unsigned long long latency) {
+    if (stats->latencyCount == stats->latencyCapacity) {
+        size_t capacity = (stats->latencyCapacity > 0) ? stats->latencyCapacity * 2 : SITH_GEN_SAMPLES;
+        unsigned long long* grown = realloc(stats->latencies, capacity * sizeof (unsigned long long));
+        if (grown == NULL) return SITH_RET_ERR;
+        stats->latencies = grown;
+        stats->latencyCapacity = capacity;
+    }
+    stats->latencies[stats->latencyCount++] = latency;
+    return SITH_RET_OK;
+}
+
+void build_request(Worker* worker, Command command, char* request) {
+    switch (command) {
+        case command_lstf:
+            strcpy(request, SITH_PROTO_LIST);
+            break;
+        case command_lstr:
+            strcpy(request, SITH_PROTO_LISTREC);
+            break;
+        case command_encr:
+            snprintf(request, SITH_MAXCH_GENREQ + 1, SITH_PROTO_ENCRYPT"%s%u %s", filePrefix, worker->index, seed);
+            break;
+        default:
+            snprintf(request, SITH_MAXCH_GENREQ + 1, SITH_PROTO_DECRYPT"%s%u_enc %s", filePrefix, worker->index, seed);
+    }
+}
+
+// Sends the request and reads the whole reply, long ones included; status
+//receives the reply's code
+
+int exchange(Worker* worker, const char* request, char* status) {
+    if (SendToPeer(worker->server, request) == SITH_RET_ERR) return SITH_RET_ERR;
+
+    const char* response;
+    size_t responseLength;
+    if (ReceiveViewFromPeer(worker->server, &response, &responseLength) <= 0) return SITH_RET_ERR;
+    if (responseLength < SITH_MAXCH_PROTORESP) {
+        strcpy(status, "???");
+        return SITH_RET_OK;
+    }
+    memcpy(status, response, SITH_MAXCH_PROTORESP);
+    status[SITH_MAXCH_PROTORESP] = '\0';
+
+    if (SERVER_RESPONSE(response, SITH_PROTO_MOREOUT)) {
+        do {
+            if (ReceiveViewFromPeer(worker->server, &response, &responseLength) <= 0) return SITH_RET_ERR;
+        } while (responseLength != SITH_MAXCH_PROTORESP || !SERVER_RESPONSE(response, SITH_PROTO_MOREEND));
+    }
+    return SITH_RET_OK;
+}
+
+ThreadValue SITH_THREAD_CALLCONV workerBody(void* arg) {
+    Worker* worker = (Worker*) arg;
+
+    worker->server = ConnectToServer(address, port);
+    if (worker->server == NULL) {
+        worker->refused = 1;
+        return SITH_RV_ONE;
+    }
+    const char* response;
+    size_t responseLength;
+    if (ReceiveViewFromPeer(worker->server, &response, &responseLength) <= 0 ||
+            responseLength < SITH_MAXCH_PROTORESP || !SERVER_RESPONSE(response, SITH_PROTO_ACCEPTED)) {
+        CloseConnection(worker->server);
+        worker->refused = 1;
+        return SITH_RV_ONE;
+    }
+
+    // Requests are spread evenly, each connection offset by its share
+    unsigned long long interval = rate ? 1000000000ULL * connections / rate : 0;
+    unsigned long long scheduled = startTime + (rate ? 1000000000ULL * worker->index / rate : 0);
+    pause_until(startTime);
+
+    char request[SITH_MAXCH_GENREQ + 1];
+    char status[SITH_MAXCH_PROTORESP + 1];
+    while (1) {
+        if (rate) pause_until(scheduled);
+        else scheduled = ReadTimer();
+        if (scheduled >= endTime) break;
+
+        Command command = pick_command(worker);
+        CommandStats* stats = worker->stats + command;
+        build_request(worker, command, request);
+        stats->sent++;
+
+        if (exchange(worker, request, status)) {
+            stats->failed++;
+            worker->lost = 1;
+            break;
+        }
+        record_latency(stats, ReadTimer() - scheduled);
+
+        if (status[0] == '2' || status[0] == '3') {
+            stats->succeeded++;
+            if (command == command_encr || command == command_decr) worker->encrypted = !worker->encrypted;
+        }
+        else if (SERVER_RESPONSE(status, SITH_PROTO_SERVBUSY)) stats->busy++;
+        else stats->failed++;
+
+        scheduled += interval;
+    }
+
+    // Leave the file as found, outside of the measurements
+    if (!worker->lost && worker->encrypted) {
+        build_request(worker, command_decr, request);
+        if (exchange(worker, request, status) == SITH_RET_OK && SERVER_RESPONSE(status, SITH_PROTO_SUCCESS)) worker->encrypted = 0;
+    }
+    CloseConnection(worker->server);
+    return SITH_RV_ZERO;
+}
+
+int compare_latencies(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*) a;
+    unsigned long long y = *(const unsigned long long*) b;
+    return (x > y) - (x < y);
+}
+
+double percentile_ms(unsigned long long* sorted, size_t count, double fraction) {
+    if (count == 0) return 0.0;
+    size_t rank = (size_t) (fraction * count);
+    if (rank >= count) rank = count - 1;
+    return sorted[rank] / 1e6;
+}
+
+void print_report(Worker* workers, unsigned long long elapsed) {
+    double seconds = elapsed / 1e9;
+    unsigned long long total = 0, busy = 0, failed = 0;
+    unsigned int refused = 0, lost = 0;
+    for (unsigned int i = 0; i < connections; i++) {
+        refused += workers[i].refused;
+        lost += workers[i].lost;
+    }
+
+    printf("\n%u connections (%u refused, %u lost), %s, %.1f s\n", connections, refused, lost, rate ? "open loop" : "closed loop", seconds);
+    printf("%-6s %10s %10s %8s %8s %10s %10s %10s\n", "", "requests", "req/s", "busy %", "error %", "p50 ms", "p99 ms", "p99.9 ms");
+
+    for (int command = 0; command < command_count; command++) {
+        CommandStats merged = {0};
+        for (unsigned int i = 0; i < connections; i++) {
+            CommandStats* stats = workers[i].stats + command;
+            merged.sent += stats->sent;
+            merged.busy += stats->busy;
+            merged.failed += stats->failed;
+            merged.latencyCount += stats->latencyCount;
+        }
+        if (merged.sent == 0) continue;
+
+        merged.latencies = malloc((merged.latencyCount + 1) * sizeof (unsigned long long));
+        if (merged.latencies == NULL) {
+            HandleErrorStatus("Could not merge latencies");
+            return;
+        }
+        size_t at = 0;
+        for (unsigned int i = 0; i < connections; i++) {
+            CommandStats* stats = workers[i].stats + command;
+            memcpy(merged.latencies + at, stats->latencies, stats->latencyCount * sizeof (unsigned long long));
+            at += stats->latencyCount;
+        }
+        qsort(merged.latencies, merged.latencyCount, sizeof (unsigned long long), compare_latencies);
+
+        printf("%-6s %10llu %10.1f %8.2f %8.2f %10.3f %10.3f %10.3f\n", commandNames[command], merged.sent, merged.sent / seconds,
+                100.0 * merged.busy / merged.sent, 100.0 * merged.failed / merged.sent,
+                percentile_ms(merged.latencies, merged.latencyCount, 0.5),
+                percentile_ms(merged.latencies, merged.latencyCount, 0.99),
+                percentile_ms(merged.latencies, merged.latencyCount, 0.999));
+        free(merged.latencies);
+
+        total += merged.sent;
+        busy += merged.busy;
+        failed += merged.failed;
+    }
+
+    printf("%-6s %10llu %10.1f %8.2f %8.2f\n", "total", total, total / seconds,
+            total ? 100.0 * busy / total : 0.0, total ? 100.0 * failed / total : 0.0);
+}
+
+// Creates, or removes with their encrypted copies, the files of all
+//connections in the server's root
+
+int prepare_files(const char* root, unsigned int kib, int create) {
+    char path[SITH_MAX_VALUE_LEN * 2 + 32];
+    for (unsigned int i = 0; i < connections; i++) {
+        snprintf(path, sizeof (path), "%s/%s%u", root, filePrefix, i);
+        if (!create) {
+            remove(path);
+            strcat(path, "_enc");
+            remove(path);
+            continue;
+        }
+
+        FILE* file = fopen(path, "wb");
+        if (file == NULL) return SITH_RET_ERR;
+        unsigned char block[1024];
+        for (unsigned int k = 0; k < kib; k++) {
+            for (size_t b = 0; b < sizeof (block); b++) block[b] = (unsigned char) rand();
+            if (fwrite(block, 1, sizeof (block), file) != sizeof (block)) {
+                fclose(file);
+                return SITH_RET_ERR;
+            }
+        }
+        if (fclose(file)) return SITH_RET_ERR;
+    }
+    return SITH_RET_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// GENERATOR MAIN
+
+void terminateWSA(void) {
+    SocketAPIDestroy();
+}
+
+int main(int argc, char** argv) {
+
+    InitArguments(SITH_GEN_OPTIONS, SITH_GEN_OPTNUM, SITH_GEN_TITLE, SITH_GEN_CFGPATH, NULL);
+    if (argc > 1) {
+        if (ParseArguments(argc, argv) == SITH_RET_ERR) {
+            HandleErrorStatus("Failed reading arguments");
+            return EXIT_FAILURE;
+        }
+    }
+
+    unsigned short show_help = 0;
+    GetOptionBool('h', 0, &show_help);
+    if (show_help == 1) {
+        PrintHelp();
+        return EXIT_SUCCESS;
+    }
+
+    GetOptionString('a', 1, address);
+    if (GetOptionUShort('p', 1, &port) < 0) {
+        HandleErrorStatus("Bad port specified");
+        return EXIT_FAILURE;
+    }
+    if (GetOptionUInt('n', 1, &connections) || connections == 0) {
+        HandleErrorStatus("Bad connection count specified");
+        return EXIT_FAILURE;
+    }
+    unsigned int duration = 0;
+    if (GetOptionUInt('d', 1, &duration) || duration == 0) {
+        HandleErrorStatus("Bad duration specified");
+        return EXIT_FAILURE;
+    }
+    if (GetOptionUInt('r', 1, &rate)) {
+        HandleErrorStatus("Bad rate specified");
+        return EXIT_FAILURE;
+    }
+    char mix[SITH_MAX_VALUE_LEN] = {0};
+    GetOptionString('m', 1, mix);
+    if (parse_mix(mix)) {
+        printf("Malformed mix: %s\n", mix);
+        return EXIT_FAILURE;
+    }
+    GetOptionString('f', 1, filePrefix);
+    GetOptionString('s', 1, seed);
+    char root[SITH_MAX_VALUE_LEN] = {0};
+    GetOptionString('R', 1, root);
+    int ownFiles = strcmp(root, "none") != 0;
+    unsigned int kib = 0;
+    if (GetOptionUInt('z', 1, &kib)) {
+        HandleErrorStatus("Bad file size specified");
+        return EXIT_FAILURE;
+    }
+
+    SocketAPIInit();
+    atexit(terminateWSA);
+
+    Worker* workers = calloc(connections, sizeof (Worker));
+    if (workers == NULL) {
+        HandleErrorStatus("Could not allocate connections");
+        return EXIT_FAILURE;
+    }
+    if (ownFiles && prepare_files(root, kib, 1)) {
+        HandleErrorStatus("Could not create files in the server's root");
+        prepare_files(root, kib, 0);
+        return EXIT_FAILURE;
+    }
+
+    printf("Driving %s with %u connections for %u s, mix %s\n", address, connections, duration, mix);
+    fflush(stdout);
+
+    // Leave connections some time to be set up before the run starts
+    startTime = ReadTimer() + 200000000ULL;
+    endTime = startTime + duration * 1000000000ULL;
+    for (unsigned int i = 0; i < connections; i++) {
+        workers[i].index = i;
+        workers[i].random = 2463534242U + i * 2654435761U;
+        workers[i].thread = SpawnThread(workerBody, workers + i);
+        if (workers[i].thread == NULL) {
+            HandleErrorStatus("Could not start connection thread");
+            return EXIT_FAILURE;
+        }
+    }
+    for (unsigned int i = 0; i < connections; i++) WaitForThread(workers[i].thread, NULL);
+
+    print_report(workers, endTime - startTime);
+
+    if (ownFiles) prepare_files(root, kib, 0);
+    for (unsigned int i = 0; i < connections; i++) {
+        for (int command = 0; command < command_count; command++) free(workers[i].stats[command].latencies);
+    }
+    free(workers);
+    return EXIT_SUCCESS;
+}
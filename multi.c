@@ -6,7 +6,12 @@
 
 #ifdef __unix__
 #include <pthread.h>
+#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #endif
 
 #include "multi.h"
@@ -177,6 +182,78 @@ int WaitForProcObject(ProcessObject* this, ProcessValue* value) {
 #endif
 }
 
+int TimedWaitForProcObject(ProcessObject* this, ProcessValue* value, unsigned long milliseconds) {
+    if (this == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+#ifdef _WIN32
+    DWORD result = WaitForSingleObject(this->procInfo.hProcess, milliseconds);
+    if (result == WAIT_FAILED) {
+        return SITH_RET_ERR;
+    }
+    if (result == WAIT_TIMEOUT) {
+        errno = ETIMEDOUT;
+        return SITH_RET_ERR;
+    }
+
+#elif defined __unix__
+    // Peek at the child without reaping it, WaitForProcObject does that
+    siginfo_t status;
+    status.si_pid = 0;
+    if (waitid(P_PID, this->descriptor, &status, WEXITED | WNOHANG | WNOWAIT) == -1) return SITH_RET_ERR;
+
+    if (status.si_pid == 0) {
+        int pidfd = -1;
+#ifdef SYS_pidfd_open
+        pidfd = (int) syscall(SYS_pidfd_open, this->descriptor, 0);
+#endif
+        if (pidfd != -1) {
+            // The process descriptor turns readable on exit
+            struct pollfd poller = {.fd = pidfd, .events = POLLIN};
+            int ready = poll(&poller, 1, (int) milliseconds);
+            close(pidfd);
+            if (ready == -1 && errno != EINTR) return SITH_RET_ERR;
+        }
+        else {
+            // Older kernels, check back every millisecond
+            errno = 0;
+            struct timespec slice = {0, 1000000L};
+            for (unsigned long slept = 0; slept < milliseconds; slept++) {
+                nanosleep(&slice, NULL);
+                if (waitid(P_PID, this->descriptor, &status, WEXITED | WNOHANG | WNOWAIT) == -1) return SITH_RET_ERR;
+                if (status.si_pid != 0) break;
+            }
+        }
+
+        status.si_pid = 0;
+        if (waitid(P_PID, this->descriptor, &status, WEXITED | WNOHANG | WNOWAIT) == -1) return SITH_RET_ERR;
+        if (status.si_pid == 0) {
+            errno = ETIMEDOUT;
+            return SITH_RET_ERR;
+        }
+    }
+#endif
+
+    return WaitForProcObject(this, value);
+}
+
+int StopProcObject(ProcessObject* this) {
+    if (this == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+#ifdef _WIN32
+    // Console processes cannot be asked politely, terminate it as Ctrl-C would
+    if (!TerminateProcess(this->procInfo.hProcess, STATUS_CONTROL_C_EXIT)) return SITH_RET_ERR;
+#elif defined __unix__
+    if (kill(this->descriptor, SIGTERM)) return SITH_RET_ERR;
+#endif
+    return SITH_RET_OK;
+}
+
 ProcessID GetPID(ProcessObject* this) {
     if (this == NULL) {
         errno = EINVAL;
@@ -281,3 +358,90 @@ int ReturnThread(ThreadValue code) {
     pthread_exit(code);
 #endif
 }
+
+
+//------------------------------------------------------------------------------
+// PROCESSORS
+
+// - [UNIX] Affinity and NUMA lookups are Linux only, other systems report
+//   ENOSYS and leave threads where the scheduler puts them
+
+#ifdef __linux__
+// Raw affinity masks, the glibc wrappers would require _GNU_SOURCE
+#define SITH_CPUMASK_BITS (8 * sizeof (unsigned long))
+typedef unsigned long CPUMask[SITH_MAX_CPUS / SITH_CPUMASK_BITS];
+#endif
+
+unsigned int GetAllowedCPUs(unsigned int* cpus, unsigned int max) {
+    unsigned int count = 0;
+#ifdef _WIN32
+    DWORD_PTR processMask, systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) return 0;
+    for (unsigned int cpu = 0; cpu < 8 * sizeof (DWORD_PTR); cpu++) {
+        if (!(processMask & ((DWORD_PTR) 1 << cpu))) continue;
+        if (cpus != NULL && count < max) cpus[count] = cpu;
+        count++;
+    }
+#elif defined __linux__
+    CPUMask mask = {0};
+    if (syscall(SYS_sched_getaffinity, 0, sizeof (CPUMask), mask) == -1) return 0;
+    for (unsigned int cpu = 0; cpu < SITH_MAX_CPUS; cpu++) {
+        if (!(mask[cpu / SITH_CPUMASK_BITS] & (1UL << (cpu % SITH_CPUMASK_BITS)))) continue;
+        if (cpus != NULL && count < max) cpus[count] = cpu;
+        count++;
+    }
+#else
+    (void) cpus;
+    (void) max;
+    errno = ENOSYS;
+#endif
+    return count;
+}
+
+unsigned int GetCPUNode(unsigned int cpu) {
+#ifdef _WIN32
+    UCHAR node = 0;
+    if (cpu > 0xFF || !GetNumaProcessorNode((UCHAR) cpu, &node) || node == 0xFF) return 0;
+    return node;
+#elif defined __linux__
+    // The CPU's sysfs directory links to its node, if the kernel knows NUMA
+    char path[64];
+    snprintf(path, 64, "/sys/devices/system/cpu/cpu%u", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) return 0;
+
+    unsigned int node = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%u", &node) == 1) break;
+        node = 0;
+    }
+    closedir(dir);
+    return node;
+#else
+    (void) cpu;
+    return 0;
+#endif
+}
+
+int PinThread(unsigned int cpu) {
+#ifdef _WIN32
+    if (cpu >= 8 * sizeof (DWORD_PTR)) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu) ? SITH_RET_OK : SITH_RET_ERR;
+#elif defined __linux__
+    if (cpu >= SITH_MAX_CPUS) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    CPUMask mask = {0};
+    mask[cpu / SITH_CPUMASK_BITS] = 1UL << (cpu % SITH_CPUMASK_BITS);
+    return syscall(SYS_sched_setaffinity, 0, sizeof (CPUMask), mask) == -1 ? SITH_RET_ERR : SITH_RET_OK;
+#else
+    (void) cpu;
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
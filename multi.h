@@ -8,6 +8,9 @@
  *  - [UNIX]: We do not use posix_spawn for process creation, because of
  *      missing specifications with waitpid() related macros
  * 
+ *  - [WINAPI]: Affinity functions only see the first processor group, that
+ *      is up to 64 CPUs
+ * 
  * Created on 17 October 2017, 15:16
  */
 
@@ -31,6 +34,9 @@ extern "C" {
 typedef struct sith_thread ThreadObject;
 typedef struct sith_process ProcessObject;
 
+// Highest CPU number understood by the affinity functions, plus one
+#define SITH_MAX_CPUS 1024
+
 
 #ifdef _WIN32
 
@@ -128,6 +134,27 @@ ProcessObject* CreateProcObject(int argc, char* const* argv);
  */
 int WaitForProcObject(ProcessObject* process, ProcessValue* value);
 
+/**
+ * Same as WaitForProcObject, fails with ETIMEDOUT if the process is still
+ * running after the given time; the object stays valid in that case
+ * 
+ * @param process
+ * @param value
+ * @param milliseconds
+ * @return 0 if successful, -1 otherwise
+ */
+int TimedWaitForProcObject(ProcessObject* process, ProcessValue* value, unsigned long milliseconds);
+
+/**
+ * Asks the given process to stop: SIGTERM on UNIX, which it may handle to
+ * clean up; on Windows it is terminated outright, with STATUS_CONTROL_C_EXIT.
+ * The process must still be waited for
+ * 
+ * @param process
+ * @return 0 if successful, -1 otherwise
+ */
+int StopProcObject(ProcessObject* process);
+
 /**
  * Send a signal to the specified thread.</br>
  * Remarks: Has no effect on Windows
@@ -148,6 +175,34 @@ void SignalThread(ThreadObject* thread, int signal);
  */
 int ReturnThread(ThreadValue code);
 
+/**
+ * Lists the CPUs the calling process may run on, in ascending order
+ * 
+ * @param cpus Receives the first max CPU numbers, may be NULL
+ * @param max
+ * @return The number of allowed CPUs, 0 if an error occurred; [UNIX] other
+ *      than Linux, always 0 with ENOSYS
+ */
+unsigned int GetAllowedCPUs(_Out_opt_ unsigned int* cpus, _In_ unsigned int max);
+
+/**
+ * Gets the NUMA node the given CPU belongs to
+ * 
+ * @param cpu
+ * @return The node number, 0 if the system has no NUMA information
+ *      ([UNIX] other than Linux)
+ */
+unsigned int GetCPUNode(_In_ unsigned int cpu);
+
+/**
+ * Restricts the calling thread to the given CPU
+ * 
+ * @param cpu
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise; [UNIX] other
+ *      than Linux, always SITH_RET_ERR with ENOSYS
+ */
+int PinThread(_In_ unsigned int cpu);
+
 #ifdef __cplusplus
 }
 #endif
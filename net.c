@@ -7,24 +7,49 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include "plat.h"
 #include "error.h"
-#include "string_heap.h"
 
 #ifdef __unix__
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif // __unix__
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
 #include "net.h"
 #include "sync.h"
+#include "timing.h"
 
 #define SITH_EOTS "\04" // End-Of-Transmission string
 #define SITH_EOTC '\04' // End-Of-Transmission char
 
-#define SITH_MESSAGE_BUFFER_LENGTH 255
+
+// Receive buffer sizing: initial size, least room offered to recv, and the size
+//an idle connection falls back to after a large message
+#define SITH_RECEIVE_LENGTH 4096
+#define SITH_RECEIVE_MINROOM 1024
+#define SITH_RECEIVE_KEEPLENGTH 65536
+
+// Most buffers handed to a single vectored send; POSIX guarantees at least 16
+#define SITH_SEND_MAXVECTORS 64
+
+// Most events reported by a single poller wait
+#define SITH_POLL_MAXEVENTS 256
 
 
 //------------------------------------------------------------------------------
@@ -123,6 +148,7 @@ const char* inet_ntop(int addrFamily, const void* restrict sockAddr, char* restr
 #define SD_BOTH 2
 #define INVALID_SOCKET -1
 typedef int SOCKET;
+typedef struct iovec WSABUF;
 #endif // _WIN32 - __unix__
 
 
@@ -155,17 +181,456 @@ int SocketAPIDestroy() {
 //------------------------------------------------------------------------------
 // DATA STRUCTURES
 
+// A queued message, sent along with its frame header or trailing EOT
+
+typedef struct sith_outgoing {
+    const char* payload;
+    size_t length;
+    unsigned char header[SITH_FRAME_HEADERLENGTH];
+    int framed;
+} Outgoing;
+
 struct sith_conn {
     SOCKET descriptor;
-    struct sockaddr_in peerAddress;
-    char receiveBuffer[SITH_MESSAGE_BUFFER_LENGTH + 1];
+    struct sockaddr_storage peerAddress;
+    // Unix-domain connection, none of the TCP tuning applies
+    int local;
+    // Receiving and sending are locked apart, so that a reader waiting on the
+    //socket does not hold up replies from other threads
     LockObject* lock;
+    LockObject* outputLock;
+
+    // Receive buffer, holding bytes [start, end) from the stream; the first
+    //'lent' of them belong to the message handed out by the last receive
+    char* input;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    size_t scanned;
+    size_t lent;
+    // Byte overwritten to terminate the lent frame, restored on release
+    char held;
+    int holding;
+
+    // Messages waiting for the next flush, referenced and not copied; a flush
+    //interrupted on a non-blocking socket resumes from part 'flushed', minus
+    //'flushedOffset' bytes
+    Outgoing* output;
+    size_t queued;
+    size_t outputCapacity;
+    size_t flushed;
+    size_t flushedOffset;
+
+    Framing framing;
+    // ID of the last frame received, used to tag replies
+    unsigned int lastId;
+
+    // Receive deadlines in milliseconds, 0 waiting forever: the next message
+    //must start within 'idleTimeout' of 'idleSince', and end within
+    //'messageTimeout' of 'messageSince', when its first bytes arrived
+    unsigned long idleTimeout;
+    unsigned long messageTimeout;
+    unsigned long long idleSince;
+    unsigned long long messageSince;
+    unsigned long long lastFill;
+    // Send deadline in milliseconds, 0 waiting forever: blocking sockets leave
+    //it to SO_SNDTIMEO, non-blocking ones track since when output is stuck
+    unsigned long sendTimeout;
+    unsigned long long stalledSince;
+    int nonBlocking;
 };
 
 
+//------------------------------------------------------------------------------
+// FRAMING
+//
+// - Header layout: version (1 byte), type (1), reserved (2), request ID (4),
+//      payload length (4), multibyte fields in network byte order
+// - Receiving callers hold the connection's lock, sending ones its output lock
+
+void put_u32(unsigned char* bytes, unsigned int value) {
+    bytes[0] = (unsigned char) (value >> 24);
+    bytes[1] = (unsigned char) (value >> 16);
+    bytes[2] = (unsigned char) (value >> 8);
+    bytes[3] = (unsigned char) value;
+}
+
+unsigned int get_u32(const unsigned char* bytes) {
+    return ((unsigned int) bytes[0] << 24) | ((unsigned int) bytes[1] << 16) | ((unsigned int) bytes[2] << 8) | bytes[3];
+}
+
+// Drops the message lent by the previous receive, its view becomes invalid
+
+void release_input(ConnectionSocket* sock) {
+    if (sock->holding) {
+        sock->input[sock->start + sock->lent] = sock->held;
+        sock->holding = 0;
+    }
+    if (sock->lent > 0) {
+        // Either the connection turns idle, or the next message is already
+        //partially here since the last fill
+        if (sock->start + sock->lent == sock->end) sock->idleSince = ReadTimer();
+        else sock->messageSince = sock->lastFill;
+    }
+    sock->start += sock->lent;
+    sock->lent = 0;
+
+    if (sock->start == sock->end) {
+        sock->start = sock->end = sock->scanned = 0;
+
+        // Do not keep a large buffer around for an idle connection
+        if (sock->capacity > SITH_RECEIVE_KEEPLENGTH) {
+            free(sock->input);
+            sock->input = NULL;
+            sock->capacity = 0;
+        }
+    }
+}
+
+// Waits for the socket to become readable within the deadline that applies,
+//failing with ETIMEDOUT once it passes. Non-blocking sockets are left to their
+//poller, see PeerTimedOut
+
+int wait_input(ConnectionSocket* sock) {
+    int partial = (sock->end > sock->start + sock->lent);
+    unsigned long timeout = partial ? sock->messageTimeout : sock->idleTimeout;
+    if (timeout == 0 || sock->nonBlocking) return SITH_RET_OK;
+
+    unsigned long long deadline = (partial ? sock->messageSince : sock->idleSince) + timeout * 1000000ULL;
+    while (1) {
+        unsigned long long now = ReadTimer();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return SITH_RET_ERR;
+        }
+        // Round up, so that the deadline has passed on wakeup
+        unsigned long long left = (deadline - now + 999999) / 1000000;
+
+#ifdef _WIN32
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(sock->descriptor, &readable);
+        struct timeval wait = {(long) (left / 1000), (long) (left % 1000) * 1000};
+        int ready = select(0, &readable, NULL, NULL, &wait);
+#elif defined __unix__
+        struct pollfd poller = {.fd = sock->descriptor, .events = POLLIN};
+        int ready = poll(&poller, 1, (int) left);
+        if (ready < 0 && errno == EINTR) continue;
+#endif
+        if (ready < 0) return SITH_RET_ERR;
+        if (ready > 0) return SITH_RET_OK;
+    }
+}
+
+// Receives as many bytes as fit in the buffer, making room for at least
+//'wanted' bytes from the start of the pending message; one byte is always kept
+//spare for terminating the lent message. Same return values as recv
+
+int fill_input(ConnectionSocket* sock, size_t wanted) {
+    size_t pending = sock->end - sock->start;
+    if (wanted < pending + SITH_RECEIVE_MINROOM) wanted = pending + SITH_RECEIVE_MINROOM;
+
+    if (sock->capacity - sock->end < wanted - pending + 1) {
+        // Move the partial message to the front, then grow if still short
+        if (sock->start > 0) {
+            memmove(sock->input, sock->input + sock->start, pending);
+            sock->scanned -= sock->start;
+            sock->end = pending;
+            sock->start = 0;
+        }
+        if (sock->capacity < wanted + 1) {
+            size_t capacity = (sock->capacity > 0) ? sock->capacity * 2 : SITH_RECEIVE_LENGTH;
+            if (capacity < wanted + 1) capacity = wanted + 1;
+            char* grown = realloc(sock->input, capacity);
+            if (grown == NULL) return SITH_RET_ERR;
+            sock->input = grown;
+            sock->capacity = capacity;
+        }
+    }
+
+    if (wait_input(sock)) return SITH_RET_ERR;
+
+    int bytes = recv(sock->descriptor, sock->input + sock->end, (int) (sock->capacity - 1 - sock->end), 0);
+    if (bytes > 0) {
+        sock->lastFill = ReadTimer();
+        if (pending == 0) sock->messageSince = sock->lastFill;
+        sock->end += bytes;
+    }
+    return bytes;
+}
+
+int queue_message(ConnectionSocket* sock, FrameType type, unsigned int id, const char* payload, size_t length) {
+    if (sock->framing == framing_length) {
+        if (length > SITH_FRAME_MAXLENGTH) {
+            errno = EMSGSIZE;
+            return SITH_RET_ERR;
+        }
+    }
+        // An EOT inside the message would split it in two
+    else if (memchr(payload, SITH_EOTC, length) != NULL) {
+        errno = EBADMSG;
+        return SITH_RET_ERR;
+    }
+
+    if (sock->queued == sock->outputCapacity) {
+        size_t capacity = (sock->outputCapacity > 0) ? sock->outputCapacity * 2 : 4;
+        Outgoing* grown = realloc(sock->output, capacity * sizeof (Outgoing));
+        if (grown == NULL) return SITH_RET_ERR;
+        sock->output = grown;
+        sock->outputCapacity = capacity;
+    }
+
+    Outgoing* message = sock->output + sock->queued++;
+    message->payload = payload;
+    message->length = length;
+    message->framed = (sock->framing == framing_length);
+    if (message->framed) {
+        message->header[0] = SITH_FRAME_VERSION;
+        message->header[1] = (unsigned char) type;
+        message->header[2] = message->header[3] = 0;
+        put_u32(message->header + 4, id);
+        put_u32(message->header + 8, (unsigned int) length);
+    }
+    return SITH_RET_OK;
+}
+
+// Each queued message is sent as two parts: header and payload, or payload and EOT
+
+void get_part(ConnectionSocket* sock, size_t part, const char** base, size_t* length) {
+    Outgoing* message = sock->output + part / 2;
+    int first = (part % 2 == 0);
+
+    if (message->framed == first) {
+        *base = message->framed ? (const char*) message->header : SITH_EOTS;
+        *length = message->framed ? SITH_FRAME_HEADERLENGTH : 1;
+    }
+    else {
+        *base = message->payload;
+        *length = message->length;
+    }
+}
+
+void set_cork(ConnectionSocket* sock, int cork) {
+#ifdef TCP_CORK
+    if (sock->local) return;
+    setsockopt(sock->descriptor, IPPROTO_TCP, TCP_CORK, &cork, sizeof (int));
+#else
+    (void) sock;
+    (void) cork;
+#endif
+}
+
+int would_block() {
+#ifdef _WIN32
+    if (WSAGetLastError() != WSAEWOULDBLOCK) return 0;
+    errno = EAGAIN;
+    return 1;
+#elif defined __unix__
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// A blocking send past its deadline, see SetPeerSendTimeout
+
+int send_timed_out() {
+#ifdef _WIN32
+    if (WSAGetLastError() != WSAETIMEDOUT) return 0;
+#elif defined __unix__
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return 0;
+#endif
+    errno = ETIMEDOUT;
+    return 1;
+}
+
+// Sends everything queued with as few calls as possible. The queue is emptied
+//even on failure since the stream's state is then unknown, except when a
+//non-blocking socket is full: the rest is then kept for the next flush
+
+int flush_output(ConnectionSocket* sock) {
+    size_t parts = sock->queued * 2;
+    size_t part = sock->flushed;
+    size_t offset = sock->flushedOffset;
+    int error = SITH_RET_OK;
+    int full = 0;
+
+    // Batches needing several calls are held back until complete, so that no
+    //partial segment leaves in between
+    int corked = (parts > SITH_SEND_MAXVECTORS);
+    if (corked) set_cork(sock, 1);
+
+    while (part < parts) {
+        WSABUF vectors[SITH_SEND_MAXVECTORS];
+        int count = 0;
+        for (size_t next = part; next < parts && count < SITH_SEND_MAXVECTORS; next++) {
+            const char* base;
+            size_t length;
+            get_part(sock, next, &base, &length);
+            if (next == part) {
+                base += offset;
+                length -= offset;
+            }
+            if (length == 0) continue;
+#ifdef _WIN32
+            vectors[count].buf = (char*) base;
+            vectors[count].len = (ULONG) length;
+#elif defined __unix__
+            vectors[count].iov_base = (void*) base;
+            vectors[count].iov_len = length;
+#endif
+            count++;
+        }
+        if (count == 0) break;
+
+#ifdef _WIN32
+        DWORD sent;
+        if (WSASend(sock->descriptor, vectors, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            error = SITH_RET_ERR;
+            full = would_block();
+            break;
+        }
+#elif defined __unix__
+        struct msghdr header = {.msg_iov = vectors, .msg_iovlen = count};
+        ssize_t sent = sendmsg(sock->descriptor, &header, 0);
+        if (sent < 0) {
+            error = SITH_RET_ERR;
+            full = would_block();
+            break;
+        }
+#endif
+
+        // Skip what went out, the last part may have been sent partially
+        size_t left = sent;
+        while (left > 0) {
+            const char* base;
+            size_t length;
+            get_part(sock, part, &base, &length);
+            if (left < length - offset) {
+                offset += left;
+                break;
+            }
+            left -= length - offset;
+            offset = 0;
+            part++;
+        }
+    }
+
+    if (corked) {
+        ErrorCode c = GetErrorCode();
+        set_cork(sock, 0);
+        SetErrorCode(c);
+    }
+    // A blocking socket gave up on a client taking nothing, the message it was
+    //sending is cut short for good
+    if (error && !sock->nonBlocking && send_timed_out()) {
+        full = 0;
+        shutdown(sock->descriptor, SD_BOTH);
+        errno = ETIMEDOUT;
+    }
+    if (full) {
+        // The stall clock restarts whenever bytes go out
+        if (sock->stalledSince == 0 || part != sock->flushed || offset != sock->flushedOffset) sock->stalledSince = ReadTimer();
+        sock->flushed = part;
+        sock->flushedOffset = offset;
+        return error;
+    }
+
+    sock->queued = 0;
+    sock->flushed = sock->flushedOffset = 0;
+    sock->stalledSince = 0;
+    return error;
+}
+
+// Latency matters more than segment count here: messages are already batched
+//by the queue, so Nagle would only delay them. Failure is not fatal
+
+void tune_connection(ConnectionSocket* sock) {
+    if (sock->local) return;
+    int enable = 1;
+    setsockopt(sock->descriptor, IPPROTO_TCP, TCP_NODELAY, (const char*) &enable, sizeof (int));
+}
+
+int receive_frame(ConnectionSocket* sock, FrameType* type, unsigned int* id, const char** payload, size_t* length) {
+    while (sock->end - sock->start < SITH_FRAME_HEADERLENGTH) {
+        int bytes = fill_input(sock, SITH_FRAME_HEADERLENGTH);
+        if (bytes <= 0) return bytes;
+    }
+
+    unsigned char* header = (unsigned char*) sock->input + sock->start;
+    if (header[0] != SITH_FRAME_VERSION) {
+        errno = EBADMSG;
+        return SITH_RET_ERR;
+    }
+    size_t size = get_u32(header + 8);
+    if (size > SITH_FRAME_MAXLENGTH) {
+        errno = EMSGSIZE;
+        return SITH_RET_ERR;
+    }
+
+    // Size is known up front, the buffer is made large enough at once
+    while (sock->end - sock->start < SITH_FRAME_HEADERLENGTH + size) {
+        int bytes = fill_input(sock, SITH_FRAME_HEADERLENGTH + size);
+        if (bytes <= 0) return bytes;
+    }
+
+    // Filling may have moved the bytes
+    char* frame = sock->input + sock->start;
+    header = (unsigned char*) frame;
+    sock->lent = SITH_FRAME_HEADERLENGTH + size;
+
+    // Terminate in place, the byte past the payload may belong to the next frame
+    sock->held = frame[sock->lent];
+    sock->holding = 1;
+    frame[sock->lent] = '\0';
+
+    sock->lastId = get_u32(header + 4);
+    if (type != NULL) *type = (FrameType) header[1];
+    if (id != NULL) *id = sock->lastId;
+    *payload = frame + SITH_FRAME_HEADERLENGTH;
+    *length = size;
+    return 1;
+}
+
+int receive_eot(ConnectionSocket* sock, const char** message, size_t* length) {
+    if (sock->scanned < sock->start) sock->scanned = sock->start;
+
+    while (1) {
+        // Only bytes not seen by earlier calls are searched
+        char* eot = memchr(sock->input + sock->scanned, SITH_EOTC, sock->end - sock->scanned);
+        if (eot != NULL) {
+            *eot = '\0';
+            *message = sock->input + sock->start;
+            *length = eot - *message;
+            sock->lent = *length + 1;
+            sock->scanned = sock->start + sock->lent;
+            return 1;
+        }
+        sock->scanned = sock->end;
+
+        if (sock->end - sock->start >= SITH_FRAME_MAXLENGTH) {
+            errno = EMSGSIZE;
+            return SITH_RET_ERR;
+        }
+        int bytes = fill_input(sock, 0);
+        if (bytes <= 0) return bytes;
+    }
+}
+
+int receive_view(ConnectionSocket* sock, FrameType* type, unsigned int* id, const char** message, size_t* length) {
+    release_input(sock);
+    if (sock->framing == framing_length) return receive_frame(sock, type, id, message, length);
+
+    if (type != NULL) *type = frame_text;
+    if (id != NULL) *id = 0;
+    return receive_eot(sock, message, length);
+}
+
 //------------------------------------------------------------------------------
 // FUNCTIONS
 
+int IsLocalAddress(const char* address) {
+    return address != NULL && (address[0] == '/' || address[0] == '.' || address[0] == '@');
+}
+
 int buildAddressToMemory(const char* ipAddress, unsigned short port, struct sockaddr_in* mem) {
 
     switch (inet_pton(AF_INET, ipAddress, &(mem->sin_addr.s_addr))) {
@@ -182,34 +647,150 @@ int buildAddressToMemory(const char* ipAddress, unsigned short port, struct sock
     return SITH_RET_OK;
 }
 
-ListenerSocket* CreateServerSocket(const char* address, unsigned short port, int backlog) {
+// Fills in an IPV4 or a Unix-domain address, along with its size
+
+int build_address(const char* address, unsigned short port, struct sockaddr_storage* mem, socklen_t* size) {
+    memset(mem, 0, sizeof (struct sockaddr_storage));
+    if (!IsLocalAddress(address)) {
+        *size = sizeof (struct sockaddr_in);
+        return buildAddressToMemory(address, port, (struct sockaddr_in*) mem);
+    }
+
+#ifdef __unix__
+    struct sockaddr_un* local = (struct sockaddr_un*) mem;
+    size_t length = strlen(address);
+    if (length >= sizeof (local->sun_path)) {
+        errno = ENAMETOOLONG;
+        return SITH_RET_ERR;
+    }
+    local->sun_family = AF_UNIX;
+    memcpy(local->sun_path, address, length);
+    *size = offsetof(struct sockaddr_un, sun_path) + length + 1;
+
+    if (address[0] == '@') {
+#ifdef __linux__
+        // Abstract names start with a NUL instead, and are not terminated
+        local->sun_path[0] = '\0';
+        *size = offsetof(struct sockaddr_un, sun_path) + length;
+#else
+        errno = ENOSYS;
+        return SITH_RET_ERR;
+#endif
+    }
+    return SITH_RET_OK;
+#else
+    (void) port;
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
+
+#ifdef __unix__
+
+// A socket file nobody accepts from anymore was left over by a listener that
+//is gone, and would fail the bind; a live one is never taken over
+
+int remove_stale_socket(const struct sockaddr_storage* addr, socklen_t size, const char* path) {
+    SOCKET probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == INVALID_SOCKET) return SITH_RET_ERR;
+    int error = connect(probe, (const struct sockaddr*) addr, size);
+    int reason = errno;
+    closesocket(probe);
+
+    if (error == 0) {
+        errno = EADDRINUSE;
+        return SITH_RET_ERR;
+    }
+    // Anything else is for bind to report
+    struct stat info;
+    if (reason == ECONNREFUSED && lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path);
+    errno = 0;
+    return SITH_RET_OK;
+}
+#endif
+
+void remove_socket_file(ListenerSocket* sock) {
+    if (sock->path == NULL) return;
+#ifdef __unix__
+    unlink(sock->path);
+#endif
+    free(sock->path);
+    sock->path = NULL;
+}
+
+// Shared listeners bind alongside each other on the same address, the kernel
+//spreading incoming connections across them
+
+ListenerSocket* open_listener(const char* address, unsigned short port, int backlog, int shared) {
+#if !defined __linux__ || !defined SO_REUSEPORT
+    if (shared) {
+        errno = ENOSYS;
+        return NULL;
+    }
+#endif
+    // Socket files cannot be shared
+    if (shared && IsLocalAddress(address)) {
+        errno = ENOSYS;
+        return NULL;
+    }
+
     ListenerSocket* sock = calloc(1, sizeof (ListenerSocket));
     if (sock == NULL) return NULL;
+    sock->shared = shared;
 
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
+    socklen_t addrSize;
 
     // FIll address fields
-    int error = buildAddressToMemory(address, port, &addr);
+    int error = build_address(address, port, &addr, &addrSize);
     if (error) {
         free(sock);
         return NULL;
     }
 
     // Open socket
-    sock->descriptor = socket(AF_INET, SOCK_STREAM, 0);
+    sock->descriptor = socket(addr.ss_family, SOCK_STREAM, 0);
     if (sock->descriptor == INVALID_SOCKET) {
         free(sock);
         return NULL;
     }
 
+#ifdef __unix__
+    if (addr.ss_family == AF_INET) {
+        // Restarts and rebinds must not wait for old connections to time out
+        int enable = 1;
+        error = setsockopt(sock->descriptor, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (int));
+#if defined __linux__ && defined SO_REUSEPORT
+        if (error == 0 && shared) error = setsockopt(sock->descriptor, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof (int));
+#endif
+    }
+    else if (address[0] != '@') {
+        error = remove_stale_socket(&addr, addrSize, address);
+        if (error == 0) {
+            sock->path = malloc(strlen(address) + 1);
+            if (sock->path == NULL) error = SITH_RET_ERR;
+            else strcpy(sock->path, address);
+        }
+    }
+    if (error) {
+        ErrorCode c = GetErrorCode();
+        closesocket(sock->descriptor);
+        free(sock->path);
+        free(sock);
+        SetErrorCode(c);
+        return NULL;
+    }
+#endif
+
     // Bind socket
-    error = bind(sock->descriptor, (struct sockaddr*) &addr, sizeof (struct sockaddr_in));
+    error = bind(sock->descriptor, (struct sockaddr*) &addr, addrSize);
     if (error) {
         // closesocket clears error state (at least in Windows), saving it
         ErrorCode c = GetErrorCode();
 
         // Ignoring errors on these
         closesocket(sock->descriptor);
+        free(sock->path);
         free(sock);
 
         // Restoring failure code
@@ -225,6 +806,7 @@ ListenerSocket* CreateServerSocket(const char* address, unsigned short port, int
 
         // Ignoring errors on these
         closesocket(sock->descriptor);
+        remove_socket_file(sock);
         free(sock);
 
         // Restoring failure code
@@ -235,23 +817,36 @@ ListenerSocket* CreateServerSocket(const char* address, unsigned short port, int
     return sock;
 }
 
+ListenerSocket* CreateServerSocket(const char* address, unsigned short port, int backlog) {
+    return open_listener(address, port, backlog, 0);
+}
+
+ListenerSocket* CreateServerShard(const char* address, unsigned short port, int backlog) {
+    return open_listener(address, port, backlog, 1);
+}
+
 ConnectionSocket* AcceptFromClient(ListenerSocket* listener) {
 
     ConnectionSocket* sock = calloc(1, sizeof (ConnectionSocket));
     if (sock == NULL) return NULL;
 
-    socklen_t size = sizeof (struct sockaddr_in);
+    socklen_t size = sizeof (struct sockaddr_storage);
     sock->descriptor = accept(listener->descriptor, (struct sockaddr*) &(sock->peerAddress), &(size));
 
-    sock->lock = CreateLockObject();
-
     if (sock->descriptor == INVALID_SOCKET) {
+        // Keep accept's failure code, non-blocking listeners rely on it
+        ErrorCode c = GetErrorCode();
         free(sock);
+        SetErrorCode(c);
         return NULL;
     }
 
-    memset(sock->receiveBuffer, 0, SITH_MESSAGE_BUFFER_LENGTH + 1);
+    sock->lock = CreateLockObject();
+    sock->outputLock = CreateLockObject();
+    sock->idleSince = ReadTimer();
+    sock->local = (sock->peerAddress.ss_family != AF_INET);
 
+    tune_connection(sock);
     return sock;
 }
 
@@ -261,21 +856,23 @@ ConnectionSocket* ConnectToServer(char* address, unsigned short port) {
     if (sock == NULL) return NULL;
 
     // Fill address fields
-    int error = buildAddressToMemory(address, port, &(sock->peerAddress));
+    socklen_t addrSize;
+    int error = build_address(address, port, &(sock->peerAddress), &addrSize);
     if (error) {
         free(sock);
         return NULL;
     }
+    sock->local = (sock->peerAddress.ss_family != AF_INET);
 
     // Open socket
-    sock->descriptor = socket(AF_INET, SOCK_STREAM, 0);
+    sock->descriptor = socket(sock->peerAddress.ss_family, SOCK_STREAM, 0);
     if (sock->descriptor == INVALID_SOCKET) {
         free(sock);
         return NULL;
     }
 
     // Connect to given address
-    error = connect(sock->descriptor, (struct sockaddr*) &(sock->peerAddress), sizeof (struct sockaddr_in));
+    error = connect(sock->descriptor, (struct sockaddr*) &(sock->peerAddress), addrSize);
     if (error) {
         // closesocket clears error state (at least in Windows), saving it
         ErrorCode c = GetErrorCode();
@@ -290,7 +887,8 @@ ConnectionSocket* ConnectToServer(char* address, unsigned short port) {
     }
 
     sock->lock = CreateLockObject();
-    memset(sock->receiveBuffer, 0, SITH_MESSAGE_BUFFER_LENGTH + 1);
+    sock->outputLock = CreateLockObject();
+    tune_connection(sock);
 
     return sock;
 }
@@ -301,45 +899,47 @@ int SendToPeer(ConnectionSocket* sock, const char* message) {
         return SITH_RET_ERR;
     }
 
-    // Check if message contains EOT chars
-    for (const char* c = message; *c != '\0'; c++) {
-        if (*c == SITH_EOTC) {
-            errno = EBADMSG;
-            return SITH_RET_ERR;
-        }
+    DoLockObject(sock->outputLock);
+    int error = queue_message(sock, frame_text, sock->lastId, message, strlen(message));
+    if (error == SITH_RET_OK) error = flush_output(sock);
+    DoUnlockObject(sock->outputLock);
+    return error;
+}
+
+int QueueToPeer(ConnectionSocket* sock, const char* message, size_t length) {
+    if (sock == NULL || message == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
     }
 
-    DoLockObject(sock->lock);
-    const char* caret = message;
-    size_t remainderSize = strlen(message);
-    while (remainderSize > 0) {
-
-        //printf("Sending %s\n", caret);
-        int bytes = send(sock->descriptor, caret, (remainderSize < SITH_MESSAGE_BUFFER_LENGTH) ? remainderSize : SITH_MESSAGE_BUFFER_LENGTH, 0);
-        if (bytes < 0) {
-            DoUnlockObject(sock->lock);
-            return SITH_RET_ERR;
-        }
-        //printf("Sent %d bytes\n", bytes);
-        caret += bytes;
-        remainderSize -= bytes;
+    DoLockObject(sock->outputLock);
+    int error = queue_message(sock, frame_text, sock->lastId, message, length);
+    DoUnlockObject(sock->outputLock);
+    return error;
+}
+
+int QueueTaggedToPeer(ConnectionSocket* sock, unsigned int id, const char* message, size_t length) {
+    if (sock == NULL || message == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
     }
 
-    // Send EOT
-    while (1) {
-        switch (send(sock->descriptor, SITH_EOTS, 1, 0)) {
-            case 1:
-                DoUnlockObject(sock->lock);
-                return SITH_RET_OK;
-            case 0:
-                continue;
-            case -1:
-            default:
-                DoUnlockObject(sock->lock);
-                return SITH_RET_ERR;
-        }
+    DoLockObject(sock->outputLock);
+    int error = queue_message(sock, frame_text, id, message, length);
+    DoUnlockObject(sock->outputLock);
+    return error;
+}
+
+int FlushPeer(ConnectionSocket* sock) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
     }
 
+    DoLockObject(sock->outputLock);
+    int error = flush_output(sock);
+    DoUnlockObject(sock->outputLock);
+    return error;
 }
 
 int ReceiveFromPeer(ConnectionSocket* sock, char** message) {
@@ -348,87 +948,187 @@ int ReceiveFromPeer(ConnectionSocket* sock, char** message) {
         return SITH_RET_ERR;
     }
 
+    // Copy out of the lent view
+    const char* view;
+    size_t length;
     DoLockObject(sock->lock);
+    int status = receive_view(sock, NULL, NULL, &view, &length);
+    if (status > 0) {
+        *message = malloc(length + 1);
+        if (*message == NULL) status = SITH_RET_ERR;
+        else memcpy(*message, view, length + 1);
+    }
+    DoUnlockObject(sock->lock);
+    return (status <= 0) ? status : (int) length;
+}
 
-    HeapString* buffer = CreateHeapString(sock->receiveBuffer);
+int ReceiveViewFromPeer(ConnectionSocket* sock, const char** message, size_t* length) {
+    if (sock == NULL || message == NULL || length == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
 
-    // Before looping, get any previously received bytes
-    HeapString* prev = HeapStringSplitAtCharFirst(buffer, SITH_EOTC);
-    // If we enconter an EOT here, we actually have a full message, return it
-    if (prev != NULL) {
-        //printf("Message in internal buffer: %s, %s\n", HeapStringGetRaw(prev), HeapStringGetRaw(buffer));
-        // Copy to a new array
-        const char* trueout = HeapStringGetRaw(prev);
-        int len = HeapStringLength(prev);
-        *message = calloc(len + 1, sizeof (char));
-        memcpy(*message, trueout, len);
+    DoLockObject(sock->lock);
+    int status = receive_view(sock, NULL, NULL, message, length);
+    DoUnlockObject(sock->lock);
+    return status;
+}
 
-        // Update the socket's internal buffer
-        memset(sock->receiveBuffer, 0, SITH_MESSAGE_BUFFER_LENGTH + 1);
-        memcpy(sock->receiveBuffer, HeapStringGetRaw(buffer), HeapStringLength(buffer));
+int SendFrame(ConnectionSocket* sock, FrameType type, unsigned int id, const void* payload, size_t length) {
+    if (sock == NULL || (payload == NULL && length > 0)) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    if (sock->framing != framing_length) {
+        errno = EPROTO;
+        return SITH_RET_ERR;
+    }
 
-        //printf("extracted message: %s\ninternal buffer: %s\n", *message, sock->receiveBuffer);
+    DoLockObject(sock->outputLock);
+    int error = queue_message(sock, type, id, (const char*) payload, length);
+    if (error == SITH_RET_OK) error = flush_output(sock);
+    DoUnlockObject(sock->outputLock);
+    return error;
+}
 
-        // return
-        DisposeHeapString(prev);
-        DisposeHeapString(buffer);
-        DoUnlockObject(sock->lock);
-        return len;
+int ReceiveFrame(ConnectionSocket* sock, FrameType* type, unsigned int* id, const char** payload, size_t* length) {
+    if (sock == NULL || payload == NULL || length == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    if (sock->framing != framing_length) {
+        errno = EPROTO;
+        return SITH_RET_ERR;
     }
 
-    // Else, copy any byte from the socket's buffer and start receiving
-    // NOTE: By send design, we can assume there are no \0s before an EOTC
+    DoLockObject(sock->lock);
+    int status = receive_view(sock, type, id, payload, length);
+    DoUnlockObject(sock->lock);
+    return status;
+}
+
+int SetPeerFraming(ConnectionSocket* sock, Framing framing) {
+    if (sock == NULL || (framing != framing_eot && framing != framing_length)) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
 
-    // AP180418: Use 'buffer' directly, it's already a copy
-    //printf("Start receiving\n");
+    DoLockObject(sock->lock);
+    // Bytes past the lent message would be read with the wrong framing
+    if (sock->end - sock->start > sock->lent) {
+        DoUnlockObject(sock->lock);
+        errno = EBUSY;
+        return SITH_RET_ERR;
+    }
+    DoLockObject(sock->outputLock);
+    sock->framing = framing;
+    DoUnlockObject(sock->outputLock);
+    DoUnlockObject(sock->lock);
+    return SITH_RET_OK;
+}
 
-    // Start the recv loop
-    int bytes;
-    while (1) {
-        // Wait for more bytes
-        memset(sock->receiveBuffer, 0, SITH_MESSAGE_BUFFER_LENGTH + 1);
-        bytes = recv(sock->descriptor, sock->receiveBuffer, SITH_MESSAGE_BUFFER_LENGTH, 0);
-
-        if (bytes <= 0) {
-            // Bad recv call
-            DisposeHeapString(buffer);
-            DoUnlockObject(sock->lock);
-            return bytes;
-        }
+Framing GetPeerFraming(ConnectionSocket* sock) {
+    return sock->framing;
+}
 
-        // We got some bytes, look for EOTC
-        HeapString* next = CreateHeapString(sock->receiveBuffer);
-        HeapString* segm = HeapStringSplitAtCharFirst(next, SITH_EOTC);
-        if (segm != NULL) {
-            // EOT reached, append the last message's part to the buffer and save the rest inside this socket's own buffer
-            HeapStringAppendSafe(buffer, segm);
-            DisposeHeapString(segm);
+int PeerHasClosed(ConnectionSocket* sock) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return 1;
+    }
 
-            memset(sock->receiveBuffer, 0, SITH_MESSAGE_BUFFER_LENGTH + 1);
-            memcpy(sock->receiveBuffer, HeapStringGetRaw(next), HeapStringLength(next));
+    // Look without waiting
+#ifdef _WIN32
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(sock->descriptor, &readable);
+    struct timeval now = {0, 0};
+    int ready = select(0, &readable, NULL, NULL, &now);
+#elif defined __unix__
+    struct pollfd poller = {.fd = sock->descriptor, .events = POLLIN};
+    int ready = poll(&poller, 1, 0);
+#endif
+    if (ready < 0) return 1;
+    if (ready == 0) return 0;
 
-            break;
-        }
+    // Readable means either bytes to be received later, or the end of stream
+    char probe;
+    return recv(sock->descriptor, &probe, 1, MSG_PEEK) <= 0;
+}
 
-        // EOT not reached, copy all bytes received from recv and keep looping
-        HeapStringAppendSafe(buffer, next);
-        DisposeHeapString(next);
+int SetPeerTimeouts(ConnectionSocket* sock, unsigned long idleMillis, unsigned long messageMillis) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
     }
 
-    // Access the output
-    const char* trueout = HeapStringGetRaw(buffer);
-    //printf("Receive loop over, message is %s\n", trueout);
+    DoLockObject(sock->lock);
+    sock->idleTimeout = idleMillis;
+    sock->messageTimeout = messageMillis;
+    sock->idleSince = ReadTimer();
+    DoUnlockObject(sock->lock);
+    return SITH_RET_OK;
+}
+
+int PeerIsIdle(ConnectionSocket* sock) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
 
-    // Copy it
-    *message = calloc(strlen(trueout) + 1, sizeof (char));
-    memcpy(*message, trueout, strlen(trueout));
+    // Bytes past the lent message belong to one not received yet
+    DoLockObject(sock->lock);
+    int idle = (sock->end <= sock->start + sock->lent);
+    DoUnlockObject(sock->lock);
+    return idle;
+}
 
-    //printf("socket buffer: %s\n", sock->receiveBuffer);
+int PeerTimedOut(ConnectionSocket* sock) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
 
-    // We're done
-    DisposeHeapString(buffer);
+    DoLockObject(sock->lock);
+    int partial = (sock->end > sock->start + sock->lent);
+    unsigned long timeout = partial ? sock->messageTimeout : sock->idleTimeout;
+    unsigned long long since = partial ? sock->messageSince : sock->idleSince;
     DoUnlockObject(sock->lock);
-    return strlen(*message);
+
+    return timeout > 0 && ReadTimer() - since >= timeout * 1000000ULL;
+}
+
+int SetPeerSendTimeout(ConnectionSocket* sock, unsigned long millis) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+#ifdef _WIN32
+    DWORD timeout = millis;
+    if (setsockopt(sock->descriptor, SOL_SOCKET, SO_SNDTIMEO, (const char*) &timeout, sizeof (DWORD)) == SOCKET_ERROR) return SITH_RET_ERR;
+#elif defined __unix__
+    struct timeval timeout = {(time_t) (millis / 1000), (suseconds_t) (millis % 1000) * 1000};
+    if (setsockopt(sock->descriptor, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (struct timeval)) == -1) return SITH_RET_ERR;
+#endif
+    DoLockObject(sock->outputLock);
+    sock->sendTimeout = millis;
+    DoUnlockObject(sock->outputLock);
+    return SITH_RET_OK;
+}
+
+int PeerSendStalled(ConnectionSocket* sock) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    DoLockObject(sock->outputLock);
+    unsigned long timeout = sock->sendTimeout;
+    unsigned long long since = sock->stalledSince;
+    DoUnlockObject(sock->outputLock);
+
+    return timeout > 0 && since != 0 && ReadTimer() - since >= timeout * 1000000ULL;
 }
 
 int CloseConnection(ConnectionSocket* sock) {
@@ -441,16 +1141,51 @@ int CloseConnection(ConnectionSocket* sock) {
     // Overwrite possible lock errors, we're more interested in socket failures
     ErrorCode e = GetErrorCode();
     DestroyLockObject(sock->lock);
+    DestroyLockObject(sock->outputLock);
     SetErrorCode(e);
 
+    free(sock->input);
+    free(sock->output);
     free(sock);
 
     if (error) return SITH_RET_ERR;
     return SITH_RET_OK;
 }
 
+int set_blocking(SOCKET descriptor, int blocking) {
+#ifdef _WIN32
+    u_long nonBlocking = !blocking;
+    if (ioctlsocket(descriptor, FIONBIO, &nonBlocking) == SOCKET_ERROR) return SITH_RET_ERR;
+#elif defined __unix__
+    int flags = fcntl(descriptor, F_GETFL);
+    if (flags == -1) return SITH_RET_ERR;
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    if (fcntl(descriptor, F_SETFL, flags) == -1) return SITH_RET_ERR;
+#endif
+    return SITH_RET_OK;
+}
+
+int SetPeerBlocking(ConnectionSocket* sock, int blocking) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    int error = set_blocking(sock->descriptor, blocking);
+    if (!error) sock->nonBlocking = !blocking;
+    return error;
+}
+
+int SetListenerBlocking(ListenerSocket* sock, int blocking) {
+    if (sock == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    return set_blocking(sock->descriptor, blocking);
+}
+
 int CloseListener(ListenerSocket* sock) {
     int error = closesocket(sock->descriptor);
+    remove_socket_file(sock);
     free(sock);
     if (error) return SITH_RET_ERR;
     return SITH_RET_OK;
@@ -461,18 +1196,203 @@ int GetPeerFullAddress(ConnectionSocket* sock, char** buffer) {
     *buffer = calloc(1, SITH_MAXCH_IPV4FULL + 1);
     if (*buffer == NULL) return SITH_RET_ERR;
 
-    char ip[SITH_MAXCH_IPV4 + 1];
+    int error;
+    if (sock->local) {
+        error = snprintf(*buffer, SITH_MAXCH_IPV4FULL + 1, "local:%d", (int) sock->descriptor);
+    }
+    else {
+        struct sockaddr_in* address = (struct sockaddr_in*) &(sock->peerAddress);
+        char ip[SITH_MAXCH_IPV4 + 1];
 
-    if (inet_ntop(AF_INET, &(sock->peerAddress.sin_addr.s_addr), ip, SITH_MAXCH_IPV4 + 1) == NULL) {
-        free(buffer);
+        if (inet_ntop(AF_INET, &(address->sin_addr.s_addr), ip, SITH_MAXCH_IPV4 + 1) == NULL) {
+            free(*buffer);
+            *buffer = NULL;
+            return SITH_RET_ERR;
+        }
+        error = snprintf(*buffer, SITH_MAXCH_IPV4FULL + 1, "%s:%hu", ip, ntohs(address->sin_port));
+    }
+    if (error <= 0) {
+        free(*buffer);
+        *buffer = NULL;
         return SITH_RET_ERR;
     }
 
-    int error = snprintf(*buffer, SITH_MAXCH_IPV4FULL + 1, "%s:%hu", ip, ntohs(sock->peerAddress.sin_port));
-    if (error <= 0) {
-        free(buffer);
+    return SITH_RET_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// READINESS POLLING
+//
+// - Built on epoll, level-triggered: a socket keeps being reported for as long
+//      as it stays ready, so callers may stop reading at any point
+// - Wakeups go through an eventfd registered with a NULL tag
+// - Other platforms report ENOSYS
+
+struct sith_poller {
+#ifdef __linux__
+    int descriptor;
+    int wakeup;
+#endif
+    int unused;
+};
+
+Poller* CreatePoller() {
+#ifdef __linux__
+    Poller* poller = calloc(1, sizeof (Poller));
+    if (poller == NULL) return NULL;
+
+    poller->descriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->descriptor == -1) {
+        free(poller);
+        return NULL;
+    }
+    poller->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (poller->wakeup == -1 || epoll_ctl(poller->descriptor, EPOLL_CTL_ADD, poller->wakeup, &event)) {
+        ErrorCode c = GetErrorCode();
+        if (poller->wakeup != -1) close(poller->wakeup);
+        close(poller->descriptor);
+        free(poller);
+        SetErrorCode(c);
+        return NULL;
+    }
+    return poller;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+#ifdef __linux__
+
+int watch_descriptor(Poller* poller, SOCKET descriptor, unsigned int interest, void* tag) {
+    struct epoll_event event = {.events = 0, .data.ptr = tag};
+    if (interest & ready_read) event.events |= EPOLLIN;
+    if (interest & ready_write) event.events |= EPOLLOUT;
+
+    // Modify first, most calls change the interest of a watched socket
+    if (epoll_ctl(poller->descriptor, EPOLL_CTL_MOD, descriptor, &event) == 0) return SITH_RET_OK;
+    if (errno != ENOENT) return SITH_RET_ERR;
+    errno = 0;
+    return epoll_ctl(poller->descriptor, EPOLL_CTL_ADD, descriptor, &event) ? SITH_RET_ERR : SITH_RET_OK;
+}
+#endif
+
+int WatchPeer(Poller* poller, ConnectionSocket* sock, unsigned int interest, void* tag) {
+    if (poller == NULL || sock == NULL || tag == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+#ifdef __linux__
+    return watch_descriptor(poller, sock->descriptor, interest, tag);
+#else
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
+
+int UnwatchPeer(Poller* poller, ConnectionSocket* sock) {
+    if (poller == NULL || sock == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+#ifdef __linux__
+    if (epoll_ctl(poller->descriptor, EPOLL_CTL_DEL, sock->descriptor, NULL) == 0) return SITH_RET_OK;
+    if (errno != ENOENT) return SITH_RET_ERR;
+    errno = 0;
+    return SITH_RET_OK;
+#else
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
+
+int WatchListener(Poller* poller, ListenerSocket* sock, void* tag) {
+    if (poller == NULL || sock == NULL || tag == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+#ifdef __linux__
+    return watch_descriptor(poller, sock->descriptor, ready_read, tag);
+#else
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
+
+int UnwatchListener(Poller* poller, ListenerSocket* sock) {
+    if (poller == NULL || sock == NULL) {
+        errno = EINVAL;
         return SITH_RET_ERR;
     }
+#ifdef __linux__
+    if (epoll_ctl(poller->descriptor, EPOLL_CTL_DEL, sock->descriptor, NULL) == 0) return SITH_RET_OK;
+    if (errno != ENOENT) return SITH_RET_ERR;
+    errno = 0;
+    return SITH_RET_OK;
+#else
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
 
+int WaitPoller(Poller* poller, PollEvent* events, int capacity, int milliseconds) {
+    if (poller == NULL || events == NULL || capacity <= 0) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+#ifdef __linux__
+    struct epoll_event ready[SITH_POLL_MAXEVENTS];
+    if (capacity > SITH_POLL_MAXEVENTS) capacity = SITH_POLL_MAXEVENTS;
+    int count = epoll_wait(poller->descriptor, ready, capacity, milliseconds);
+    if (count < 0) return SITH_RET_ERR;
+
+    for (int i = 0; i < count; i++) {
+        events[i].tag = ready[i].data.ptr;
+        events[i].ready = 0;
+        if (ready[i].events & EPOLLIN) events[i].ready |= ready_read;
+        if (ready[i].events & EPOLLOUT) events[i].ready |= ready_write;
+        if (ready[i].events & (EPOLLHUP | EPOLLERR)) events[i].ready |= ready_hangup;
+
+        // Consume the wakeup, several of them collapse into one event
+        if (events[i].tag == NULL) {
+            eventfd_t value;
+            eventfd_read(poller->wakeup, &value);
+        }
+    }
+    return count;
+#else
+    (void) milliseconds;
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
+
+int WakePoller(Poller* poller) {
+    if (poller == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+#ifdef __linux__
+    return eventfd_write(poller->wakeup, 1) ? SITH_RET_ERR : SITH_RET_OK;
+#else
+    errno = ENOSYS;
+    return SITH_RET_ERR;
+#endif
+}
+
+int DestroyPoller(Poller* poller) {
+    if (poller == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+#ifdef __linux__
+    int error = close(poller->wakeup) | close(poller->descriptor);
+    free(poller);
+    return error ? SITH_RET_ERR : SITH_RET_OK;
+#else
+    free(poller);
     return SITH_RET_OK;
+#endif
 }
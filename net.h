@@ -7,7 +7,10 @@
  *
  * Implementation notes:
  *
- * - Uses only IPV4 addresses
+ * - Uses IPV4 addresses, or Unix-domain socket paths where the system has
+ *      them: an address starting with '/' or '.' names a socket file, one
+ *      starting with '@' an abstract socket (Linux). Such connections skip
+ *      the TCP-only tuning, and ports are ignored
  *
  * - [WSA] Most WinSock functions (namely bind, connect) that return 0/-1 in UNIX do
  *      return 0/SOCKET_ERROR in Windows; now SOCKET_ERROR is currently defined
@@ -23,6 +26,29 @@
  * - About receiving messages from connected sockets:
  * https://stackoverflow.com/questions/2862071/how-large-should-my-recv-buffer-be-when-calling-recv-in-the-socket-library
  *
+ * - Connections start in the legacy framing, where each message is a NUL-free
+ *      string terminated by an EOT byte. Once both ends agree (see
+ *      SITH_PROTO_FRAMING), they switch to length-prefixed frames: a fixed
+ *      12-byte header in network byte order carrying version, type, request ID
+ *      and payload length, followed by exactly that many payload bytes.
+ *      Receivers read the header first and then the payload straight into a
+ *      buffer of the announced size, and payloads may hold any byte
+ *
+ * - Each connection owns a growable receive buffer filled by large recv calls;
+ *      message boundaries are found in place and receivers may borrow a view
+ *      of the message instead of a copy. Partial messages are moved to the
+ *      front only when the buffer runs short, so views are always contiguous
+ *
+ * - Sends are vectored: a message goes out with its header or EOT in one
+ *      writev-like call, without copies, and callers may queue several
+ *      messages to be flushed together. Connections run with TCP_NODELAY, and
+ *      flushes needing more than one call are corked where TCP_CORK exists
+ *
+ * - Connections may be switched to non-blocking mode for event loops: receives
+ *      then fail with EAGAIN until a whole message is buffered, and flushes
+ *      fail with EAGAIN keeping the unsent rest queued. A Poller reports which
+ *      sockets are ready; it is only implemented with epoll (Linux)
+ *
  * - Using constructors and destructors for WSA, apparently a common GCC extension (AP171215: Removed, now using shutdown hooks):
  * https://stackoverflow.com/questions/1526882/how-do-i-get-the-gcc-attribute-constructor-to-work-under-osx
  *
@@ -43,6 +69,7 @@ extern "C" {
 
 typedef struct sith_listen ListenerSocket;
 typedef struct sith_conn ConnectionSocket;
+typedef struct sith_poller Poller;
 
 #ifdef __unix__
 typedef int SOCKET;
@@ -50,10 +77,44 @@ typedef int SOCKET;
 struct sith_listen {
     SOCKET descriptor;
     int backlog;
+    // Bound alongside other shards on the same address
+    int shared;
+    // Socket file removed on close, NULL for other listeners
+    char* path;
 };
 
+// How messages are delimited on a connection
+typedef enum sith_framing {
+    framing_eot,
+    framing_length
+} Framing;
+
+// Payload kinds carried in a frame header
+typedef enum sith_frame_type {
+    frame_text = 1,
+    frame_binary
+} FrameType;
+
+// Readiness flags, see WaitPoller()
+typedef enum sith_readiness {
+    ready_read = 1,
+    ready_write = 2,
+    ready_hangup = 4
+} Readiness;
+
+typedef struct sith_poll_event {
+    // As given when watching, NULL for a wakeup
+    void* tag;
+    unsigned int ready;
+} PollEvent;
+
+#define SITH_FRAME_VERSION 2
+#define SITH_FRAME_HEADERLENGTH 12
+#define SITH_FRAME_MAXLENGTH (16U << 20)           // Larger frames are refused
+
 #define SITH_MAXCH_IPV4 15                          // xxx.xxx.xxx.xxx
 #define SITH_MAXCH_IPV4FULL (SITH_MAXCH_IPV4 + 6)   // xxx.xxx.xxx.xxx:ppppp
+#define SITH_MAXCH_LOCALPATH 107                    // sun_path, terminator excluded
 
 
 //------------------------------------------------------------------------------
@@ -63,9 +124,19 @@ struct sith_listen {
 int SocketAPIInit();
 int SocketAPIDestroy();
 
+/**
+ * @param address An address as taken by CreateServerSocket() and ConnectToServer()
+ * @return 1 if the address names a Unix-domain socket, 0 otherwise
+ */
+int IsLocalAddress(
+        _In_ const char* address);
+
 /**
  * Opens a new socket on this process at the given address and port, and starts
  * listening for incoming connections.
+ * A socket file left over by a listener that is gone is replaced, while one
+ * still accepted from fails the call with EADDRINUSE. Unix-domain sockets are
+ * not available on Windows, the call then fails with ENOSYS.
  *
  * @param address The socket's address
  * @param port The socket's port
@@ -77,6 +148,25 @@ ListenerSocket* CreateServerSocket(
         _In_ unsigned short port,
         _In_ int backlog);
 
+/**
+ * Opens a listening socket like CreateServerSocket(), but as one shard of a
+ * group: every shard binds the same address and port, and the system spreads
+ * incoming connections across them, so that each can be accepted from on its
+ * own thread.
+ *
+ * Only available on Linux and for IPV4 addresses, otherwise it fails with errno
+ * set to ENOSYS.
+ *
+ * @param address The socket's address
+ * @param port The socket's port
+ * @param backlog The max amount of pending requests this shard shall hold
+ * @return The corresponding ListenerSocket object, or NULL on failure
+ */
+ListenerSocket* CreateServerShard(
+        _In_ const char* address,
+        _In_ unsigned short port,
+        _In_ int backlog);
+
 /**
  * Creates a connection with a connection request from the given listening
  * socket. This call blocks until a connection request is received or an error
@@ -104,6 +194,11 @@ ConnectionSocket* ConnectToServer(
  * This call blocks until the whole message is sent, or an error occurs;
  * see send() for details.
  *
+ * With length framing the message goes out as a text frame tagged with the ID
+ * of the last frame received on this connection, so that replies carry the ID
+ * of the request they answer. Messages queued by QueueToPeer() go out first,
+ * in the same call.
+ *
  * @param sock The host to send the message to
  * @param message A string containing the message to send
  * @return A value greater than 0 if successful, or -1 on error
@@ -112,6 +207,55 @@ int SendToPeer(
         _In_ ConnectionSocket* sock,
         _In_ const char* message);
 
+/**
+ * Queues a message for the host connected to the given ConnectionSocket, to
+ * be sent by the next FlushPeer() or SendToPeer() call together with any
+ * other queued message. The message is referenced, not copied, and must stay
+ * valid until then; it is tagged as in SendToPeer().
+ *
+ * @param sock The host to send the message to
+ * @param message The message's bytes, without EOT chars in legacy framing
+ * @param length The message's length
+ * @return 0 if successful, -1 on error
+ */
+int QueueToPeer(
+        _In_ ConnectionSocket* sock,
+        _In_ const char* message,
+        _In_ size_t length);
+
+/**
+ * Same as QueueToPeer(), but tags the message with the given request ID when
+ * length framing is in use, for replies sent while other requests are being
+ * received; the ID is ignored in legacy framing.
+ *
+ * Sending and receiving are locked apart, so a thread may queue and flush
+ * while another one waits for the next message on the same connection.
+ *
+ * @param sock The host to send the message to
+ * @param id The ID of the request being answered
+ * @param message The message's bytes, without EOT chars in legacy framing
+ * @param length The message's length
+ * @return 0 if successful, -1 on error
+ */
+int QueueTaggedToPeer(
+        _In_ ConnectionSocket* sock,
+        _In_ unsigned int id,
+        _In_ const char* message,
+        _In_ size_t length);
+
+/**
+ * Sends all messages queued on the given ConnectionSocket, in as few send
+ * calls as possible. The queue is emptied even on failure, except when a
+ * non-blocking connection cannot take more bytes: the call then fails with
+ * EAGAIN and the next one resumes where this one stopped. A blocking one fails
+ * with ETIMEDOUT past its send deadline, see SetPeerSendTimeout().
+ *
+ * @param sock The host to send the messages to
+ * @return 0 if successful, -1 on error
+ */
+int FlushPeer(
+        _In_ ConnectionSocket* sock);
+
 /**
  * Receives a message from the host connected to the given ConnectionSocket.
  * This call blocks until a whole message is received, or an error occurs;
@@ -132,6 +276,181 @@ int ReceiveFromPeer(
         _In_ ConnectionSocket* sock,
         _Out_ char** message);
 
+/**
+ * Receives a message from the host connected to the given ConnectionSocket,
+ * like ReceiveFromPeer(), but without copying: the message is lent from the
+ * connection's receive buffer and stays valid until the next receive on the
+ * same connection, which therefore must not happen on another thread while
+ * the view is in use. The view is NUL-terminated and must not be modified.
+ * On a non-blocking connection, fails with EAGAIN until a whole message has
+ * arrived; the bytes received so far are kept. On a blocking one, fails with
+ * ETIMEDOUT when a deadline set by SetPeerTimeouts() passes.
+ *
+ * @param sock The host to receive the message from
+ * @param message Receives the address of the message
+ * @param length Receives the message's length, terminator excluded
+ * @return 1 if successful, 0 if the connection has been closed, -1 on error
+ */
+int ReceiveViewFromPeer(
+        _In_ ConnectionSocket* sock,
+        _Out_ const char** message,
+        _Out_ size_t* length);
+
+/**
+ * Sends a single frame to the host connected to the given ConnectionSocket,
+ * flushing any queued message before it. Header and payload leave in the same
+ * send, the payload is not inspected.
+ * Requires length framing, fails with EPROTO otherwise.
+ *
+ * @param sock The host to send the frame to
+ * @param type The payload kind
+ * @param id The request ID to tag the frame with
+ * @param payload The payload bytes, may be NULL if length is 0
+ * @param length The payload size, at most SITH_FRAME_MAXLENGTH
+ * @return 0 if successful, -1 on error
+ */
+int SendFrame(
+        _In_ ConnectionSocket* sock,
+        _In_ FrameType type,
+        _In_ unsigned int id,
+        _In_ const void* payload,
+        _In_ size_t length);
+
+/**
+ * Receives a single frame from the host connected to the given
+ * ConnectionSocket. The payload is lent as in ReceiveViewFromPeer(), followed
+ * by a NUL for the convenience of text frames.
+ * Requires length framing, fails with EPROTO otherwise. Frames with a
+ * different version or longer than SITH_FRAME_MAXLENGTH fail with EBADMSG and
+ * EMSGSIZE respectively, leaving the stream unusable.
+ *
+ * @param sock The host to receive the frame from
+ * @param type Receives the payload kind, may be NULL
+ * @param id Receives the frame's request ID, may be NULL
+ * @param payload Receives the address of the payload
+ * @param length Receives the payload size
+ * @return 1 if successful, 0 if the connection has been closed, -1 on error
+ */
+int ReceiveFrame(
+        _In_ ConnectionSocket* sock,
+        _Out_opt_ FrameType* type,
+        _Out_opt_ unsigned int* id,
+        _Out_ const char** payload,
+        _Out_ size_t* length);
+
+/**
+ * Switches the framing used on the given connection. Both ends must switch at
+ * the same point of the stream, which the protocol guarantees by switching
+ * right after the negotiation reply; fails with EBUSY if bytes past the last
+ * received message are already buffered.
+ *
+ * @param sock The ConnectionSocket to update
+ * @param framing The new framing
+ * @return 0 if successful, -1 otherwise
+ */
+int SetPeerFraming(
+        _In_ ConnectionSocket* sock,
+        _In_ Framing framing);
+
+/**
+ * @param sock The ConnectionSocket to query
+ * @return The framing currently used on the connection
+ */
+Framing GetPeerFraming(
+        _In_ ConnectionSocket* sock);
+
+/**
+ * Checks, without blocking nor consuming data, whether the peer has closed the
+ * given connection or the connection has failed
+ *
+ * @param sock The ConnectionSocket to check
+ * @return 1 if the connection is gone, 0 otherwise
+ */
+int PeerHasClosed(
+        _In_ ConnectionSocket* sock);
+
+/**
+ * Sets the receive deadlines of the given connection: a blocking receive fails
+ * with ETIMEDOUT if no byte of the next message arrives within the idle
+ * timeout, or if the message is not complete within the message timeout of its
+ * first bytes. Non-blocking connections are checked with PeerTimedOut() instead.
+ * Also restarts the idle clock, e.g. after the connection was busy.
+ *
+ * @param sock The ConnectionSocket to update
+ * @param idleMillis The idle timeout in milliseconds, 0 to wait forever
+ * @param messageMillis The message timeout in milliseconds, 0 to wait forever
+ * @return 0 if successful, -1 otherwise
+ */
+int SetPeerTimeouts(
+        _In_ ConnectionSocket* sock,
+        _In_ unsigned long idleMillis,
+        _In_ unsigned long messageMillis);
+
+/**
+ * @param sock The ConnectionSocket to query
+ * @return 1 if no byte of a message not yet received is buffered, 0 otherwise
+ */
+int PeerIsIdle(
+        _In_ ConnectionSocket* sock);
+
+/**
+ * Checks whether the deadline set by SetPeerTimeouts() that applies to the
+ * next message on the given connection has passed.
+ *
+ * @param sock The ConnectionSocket to check
+ * @return 1 if the deadline has passed, 0 otherwise
+ */
+int PeerTimedOut(
+        _In_ ConnectionSocket* sock);
+
+/**
+ * Sets the send deadline of the given connection: on a blocking connection, a
+ * flush taking no byte within it fails with ETIMEDOUT, and the connection is
+ * shut down as the message is left cut short. Non-blocking connections are
+ * checked with PeerSendStalled() instead.
+ *
+ * @param sock The ConnectionSocket to update
+ * @param millis The send timeout in milliseconds, 0 to wait forever
+ * @return 0 if successful, -1 otherwise
+ */
+int SetPeerSendTimeout(
+        _In_ ConnectionSocket* sock,
+        _In_ unsigned long millis);
+
+/**
+ * Checks whether output left behind by a flush on a non-blocking connection
+ * has taken no byte for the send deadline set by SetPeerSendTimeout().
+ *
+ * @param sock The ConnectionSocket to check
+ * @return 1 if the deadline has passed, 0 otherwise
+ */
+int PeerSendStalled(
+        _In_ ConnectionSocket* sock);
+
+/**
+ * Switches the given connection between blocking and non-blocking mode.
+ *
+ * @param sock The ConnectionSocket to update
+ * @param blocking 0 for non-blocking mode, blocking otherwise
+ * @return 0 if successful, -1 otherwise
+ */
+int SetPeerBlocking(
+        _In_ ConnectionSocket* sock,
+        _In_ int blocking);
+
+/**
+ * Switches the given listening socket between blocking and non-blocking mode;
+ * a non-blocking listener fails AcceptFromClient() with EAGAIN when no
+ * connection is pending. Accepted connections are always blocking.
+ *
+ * @param sock The ListenerSocket to update
+ * @param blocking 0 for non-blocking mode, blocking otherwise
+ * @return 0 if successful, -1 otherwise
+ */
+int SetListenerBlocking(
+        _In_ ListenerSocket* sock,
+        _In_ int blocking);
+
 /**
  * Closes the given connection to the corresponding host.
  *
@@ -150,9 +469,105 @@ int CloseConnection(
 int CloseListener(
         _In_ ListenerSocket* sock);
 
+/**
+ * Creates a readiness poller. Fails with ENOSYS where no implementation is
+ * available.
+ *
+ * @return A new Poller, or NULL on failure
+ */
+Poller* CreatePoller();
+
+/**
+ * Starts watching the given connection, or changes what it is watched for.
+ * Hang-ups and errors are always reported.
+ *
+ * @param poller The Poller to update
+ * @param sock The ConnectionSocket to watch
+ * @param interest A combination of ready_read and ready_write
+ * @param tag A non-NULL value reported along with the connection's events
+ * @return 0 if successful, -1 otherwise
+ */
+int WatchPeer(
+        _In_ Poller* poller,
+        _In_ ConnectionSocket* sock,
+        _In_ unsigned int interest,
+        _In_ void* tag);
+
+/**
+ * Stops watching the given connection, closing it does the same.
+ *
+ * @param poller The Poller to update
+ * @param sock The ConnectionSocket to forget
+ * @return 0 if successful or if the connection was not watched, -1 otherwise
+ */
+int UnwatchPeer(
+        _In_ Poller* poller,
+        _In_ ConnectionSocket* sock);
+
+/**
+ * Starts watching the given listening socket for pending connections.
+ *
+ * @param poller The Poller to update
+ * @param sock The ListenerSocket to watch
+ * @param tag A non-NULL value reported along with the listener's events
+ * @return 0 if successful, -1 otherwise
+ */
+int WatchListener(
+        _In_ Poller* poller,
+        _In_ ListenerSocket* sock,
+        _In_ void* tag);
+
+/**
+ * Stops watching the given listening socket, closing it does the same.
+ *
+ * @param poller The Poller to update
+ * @param sock The ListenerSocket to forget
+ * @return 0 if successful or if the listener was not watched, -1 otherwise
+ */
+int UnwatchListener(
+        _In_ Poller* poller,
+        _In_ ListenerSocket* sock);
+
+/**
+ * Waits until some watched socket is ready, WakePoller() is called, or the
+ * timeout expires. Sockets stay reported for as long as they are ready.
+ *
+ * @param poller The Poller to wait on
+ * @param events The array receiving the events
+ * @param capacity The array's length
+ * @param milliseconds The timeout, or -1 to wait indefinitely
+ * @return The number of events, 0 on timeout, -1 on error (EINTR if a signal
+ *          was caught)
+ */
+int WaitPoller(
+        _In_ Poller* poller,
+        _Out_ PollEvent* events,
+        _In_ int capacity,
+        _In_ int milliseconds);
+
+/**
+ * Makes a current or the next WaitPoller() call return with a NULL-tagged
+ * event; may be called from any thread.
+ *
+ * @param poller The Poller to wake
+ * @return 0 if successful, -1 otherwise
+ */
+int WakePoller(
+        _In_ Poller* poller);
+
+/**
+ * Destroys the given Poller, watched sockets are left open.
+ *
+ * @param poller The Poller to destroy
+ * @return 0 if successful, -1 otherwise
+ */
+int DestroyPoller(
+        _In_ Poller* poller);
+
 /**
  * Returns the address of the given ConnectionSocket's peer as a string to the
- * given buffer
+ * given buffer; peers on a Unix-domain socket have no address of their own, and
+ * are named "local:" followed by the connection's descriptor
  *
  * @param sock The peer's ConnectionSocket
  * @param buffer The buffer which will contain the stringified address
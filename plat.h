@@ -54,6 +54,12 @@ extern "C" {
     
 #endif // _WIN32 / __unix__
 
+#if defined _MSC_VER
+#define SITH_THREADLOCAL __declspec(thread)
+#else
+#define SITH_THREADLOCAL _Thread_local
+#endif
+
 #ifndef __ATTR_SAL
 #define _In_
 #define _In_opt_
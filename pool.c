@@ -1,29 +1,137 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "error.h"
 #include "multi.h"
 #include "sync.h"
+#include "timing.h"
 
 #include "pool.h"
 
+#ifdef __unix__
+#include <stdatomic.h>
+#endif
+
+// The kernel table is never reallocated, lock-free readers index into it
+#define SITH_POOL_MAXKERNELS 1024
+
+// Local tasks a kernel can hold in stealing mode, it runs further ones inline
+#define SITH_POOL_DEQUESIZE 256
+
+// Queued tasks older than this go first, whatever their class
+#define SITH_POOL_AGINGMS 100
+
+// Autoscaler checks per growth threshold, and bounds on its period
+#define SITH_POOL_SCALECHECKS 4
+#define SITH_POOL_MINTICKMS 10
+#define SITH_POOL_MAXTICKMS 1000
+
+// Idle stack head: ABA tag in the upper half, kernel slot + 1 in the lower one
+#define idle_slot(head) ((unsigned int) ((head) & 0xFFFFFFFFULL))
+#define idle_tag(head) ((head) >> 32)
+#define idle_head(tag, slot) (((tag) << 32) | (unsigned long long) (slot))
+
+#ifdef _WIN32
+typedef volatile LONG64 AtomicWord;
+typedef volatile LONG AtomicCount;
+#define word_load(p) ((unsigned long long) InterlockedCompareExchange64((p), 0, 0))
+#define word_cas(p, expected, desired) (InterlockedCompareExchange64((p), (LONG64) (desired), (LONG64) (expected)) == (LONG64) (expected))
+#define count_load(p) InterlockedCompareExchange((p), 0, 0)
+#define count_add(p, v) InterlockedExchangeAdd((p), (v))
+#define count_store(p, v) InterlockedExchange((p), (v))
+#define word_add(p, v) InterlockedExchangeAdd64((p), (LONG64) (v))
+#define word_store(p, v) InterlockedExchange64((p), (LONG64) (v))
+// Single writer, no need for a locked instruction
+#define stat_add(p, v) (*(p) += (v))
+#define stat_set(p, v) (*(p) = (v))
+#elif defined __unix__
+typedef _Atomic unsigned long long AtomicWord;
+typedef _Atomic int AtomicCount;
+#define word_load(p) atomic_load(p)
+#define count_load(p) atomic_load(p)
+#define count_add(p, v) atomic_fetch_add((p), (v))
+#define count_store(p, v) atomic_store((p), (v))
+#define word_add(p, v) atomic_fetch_add((p), (v))
+#define word_store(p, v) atomic_store((p), (v))
+// Single writer, no need for a locked instruction
+#define stat_add(p, v) atomic_store_explicit((p), atomic_load_explicit((p), memory_order_relaxed) + (v), memory_order_relaxed)
+#define stat_set(p, v) atomic_store_explicit((p), (v), memory_order_relaxed)
+
+int word_cas(AtomicWord* word, unsigned long long expected, unsigned long long desired) {
+    return atomic_compare_exchange_weak(word, &expected, desired);
+}
+#endif
+
+// Pending task, waiting for a kernel
+typedef struct {
+    PoolTask task;
+    void* argument;
+    unsigned long long submitted;
+    CancelToken* token;
+} PendingTask;
+
+// Cancellation token, the flag may be set from a signal handler
+struct sith_cancel {
+    AtomicCount cancelled;
+    CancelToken* parent;
+};
+
+// Kernel statistics, written by the kernel only
+typedef struct {
+    AtomicWord tasks;
+    AtomicWord busyNanos;
+    AtomicWord idleNanos;
+    AtomicWord waitHistogram[SITH_POOL_HISTBUCKETS];
+    AtomicWord runHistogram[SITH_POOL_HISTBUCKETS];
+
+    // Start of the current task or idle period, for snapshots; the lowest bit
+    // is set while busy
+    AtomicWord since;
+} KernelCounters;
+
+// Memory written mostly by its kernel, allocated by the kernel itself once
+// pinned, so that it lands on the kernel's NUMA node on first touch
+typedef struct {
+    KernelCounters stats;
+    PendingTask deque[SITH_POOL_DEQUESIZE];
+} KernelScratch;
+
 // Kernel definition
 
 typedef struct sith_node {
+    // Slot in the kernel table, never changes
     unsigned int id;
+
+    // NULL while the kernel is retired
     ThreadObject* thread;
 
+    // Set under lock by a kernel retiring on its own, until it is joined
+    int exited;
+
     // Useful for list reinsertion
     ThreadPool* owner;
 
     // Task fields
     PoolTask task;
     void* argument;
+    unsigned long long submitted;
+    CancelToken* token;
+
+    ParkObject* parker;
 
-    SemObject* semaph;
+    // CPU the kernel is pinned to, -1 if none
+    int cpu;
+    KernelScratch* scratch;
 
-    // List implementation
-    struct sith_node* next;
+    // Idle stack link, slot + 1 of the next idle kernel
+    AtomicCount next;
+
+    // Stealing mode: tasks submitted by this kernel, the owner works at the
+    // bottom, thieves take from the top; slots are in the scratch
+    unsigned int dequeTop;
+    AtomicCount dequeCount;
+    LockObject* dequeLock;
 } Kernel;
 
 // Pool definition
@@ -32,91 +140,509 @@ struct sith_pool {
     // Pool name, unused for now
     char* name;
 
-    // Holds pointers to all Kernels of this pool, for easy memmgmt
+    // Holds pointers to all Kernels of this pool, for easy memmgmt; retired
+    // kernels keep their slot, to be reused on extension
     Kernel** kernels;
+    AtomicCount slotCount;
+
+    // Nonzero if kernels keep their own submissions and steal from each other
+    AtomicCount stealing;
 
-    // This list keeps track of the available threads for scheduling
-    Kernel* idleKernels;
+    // CPUs for kernels to run on, slot i takes placement[i % placementCount];
+    // NULL if kernels are not pinned
+    unsigned int* placement;
+    unsigned int placementCount;
 
-    // Using a condition variable to synchronize all threads
+    // New kernels report here once ready, spawns never overlap
+    ParkObject* starter;
+
+    // Lock-free stack of the available threads for scheduling
+    AtomicWord idleHead;
+
+    // Only the slow paths take the lock: queueing, waiting, resizing and
+    // destroying; waiters is written under lock, read by kernels without
     LockObject* lock;
     CondVar* cv;
-    
+    AtomicCount waiters;
+
     // Counters for quick checks and reports
-    unsigned int idleCount;
+    AtomicCount idleCount;
     unsigned int kernCount;
+
+    // Rings of tasks accepted while no kernel was idle, one per priority class
+    // laid out back to back, written under lock; pendingLength bounds them all
+    // together, pendingCount is their sum
+    PendingTask* pending;
+    unsigned int pendingHead[priority_count];
+    AtomicCount classCount[priority_count];
+    AtomicCount pendingCount;
+    unsigned int pendingLength;
+
+    // Choice among classes, written under lock
+    DispatchMode dispatch;
+    unsigned long long agingNanos;
+    unsigned int credits[priority_count];
+
+    // Statistics not tied to a kernel; the peak is written under lock
+    unsigned int pendingPeak;
+    AtomicWord rejected;
+    AtomicWord blocked;
+
+    // Deferred shrinking: kernels yet to retire, under lock, and how many of
+    // them are to be taken by whichever kernels finish their task first
+    unsigned int retiring;
+    AtomicCount retireDebt;
+
+    // Autoscaler, under lock; its thread runs from the first enabling call to
+    // the pool's destruction, and sleeps while maxKernels is 0
+    ThreadObject* scaler;
+    CondVar* scalerCv;
+    int scalerStop;
+    unsigned int minKernels;
+    unsigned int maxKernels;
+    unsigned long long growNanos;
+    unsigned long long shrinkNanos;
 };
 
+// Kernel running on the calling thread, if any
+SITH_THREADLOCAL Kernel* currentKernel = NULL;
+
 
 //------------------------------------------------------------------------------
 // POOL HELPERS
 
-// ASSERT: Requires lock
+void push_idle(ThreadPool* pool, Kernel* k) {
+    unsigned long long head;
+    do {
+        head = word_load(&(pool->idleHead));
+        count_store(&(k->next), idle_slot(head));
+    } while (!word_cas(&(pool->idleHead), head, idle_head(idle_tag(head) + 1, k->id + 1)));
+    count_add(&(pool->idleCount), 1);
+}
+
+Kernel* pop_idle(ThreadPool* pool) {
+    unsigned long long head;
+    Kernel* k;
+    do {
+        head = word_load(&(pool->idleHead));
+        if (idle_slot(head) == 0) return NULL;
+
+        // The link may be stale if k was popped meanwhile, the tag catches it
+        k = pool->kernels[idle_slot(head) - 1];
+    } while (!word_cas(&(pool->idleHead), head, idle_head(idle_tag(head) + 1, (unsigned int) count_load(&(k->next)))));
+    count_add(&(pool->idleCount), -1);
+    return k;
+}
+
+// Registers the task to run next in the kernel
+
+void load_task(Kernel* k, PendingTask next) {
+    k->task = next.task;
+    k->argument = next.argument;
+    k->submitted = next.submitted;
+    k->token = next.token;
+}
+
+// Kernel must have been popped from the idle stack
+
+void dispatch_task(Kernel* k, PendingTask next) {
+    load_task(k, next);
+    UnparkThread(k->parker);
+}
+
+// Turns per round of weighted dispatch, by class
+const unsigned int classWeights[priority_count] = {4, 2, 1};
+
+#define class_ring(pool, c) ((pool)->pending + (c) * (pool)->pendingLength)
+
+// ASSERT: Requires lock, and at least one pending task
+
+unsigned int pick_class(ThreadPool* pool) {
+    unsigned int best = priority_count, filled = 0;
+    for (unsigned int c = 0; c < priority_count; c++) {
+        if (count_load(&(pool->classCount[c])) == 0) continue;
+        if (best == priority_count) best = c;
+        filled++;
+    }
+    if (filled == 1) return best;
+
+    // Starvation guard: the oldest head past the limit goes first
+    if (pool->agingNanos != 0) {
+        unsigned long long now = ReadTimer();
+        unsigned int oldest = priority_count;
+        unsigned long long oldestStamp = 0;
+        for (unsigned int c = 0; c < priority_count; c++) {
+            if (count_load(&(pool->classCount[c])) == 0) continue;
+            unsigned long long stamp = class_ring(pool, c)[pool->pendingHead[c]].submitted;
+            if (now - stamp > pool->agingNanos && (oldest == priority_count || stamp < oldestStamp)) {
+                oldest = c;
+                oldestStamp = stamp;
+            }
+        }
+        if (oldest != priority_count) return oldest;
+    }
+
+    if (pool->dispatch == dispatch_strict) return best;
+
+    // Weighted: the highest class with turns left, a new round once all
+    // queued classes have used theirs
+    for (int round = 0; round < 2; round++) {
+        for (unsigned int c = 0; c < priority_count; c++) {
+            if (count_load(&(pool->classCount[c])) != 0 && pool->credits[c] != 0) return c;
+        }
+        memcpy(pool->credits, classWeights, sizeof (classWeights));
+    }
+    return best;
+}
 
-void spin_kernel() {
+// ASSERT: Requires lock, and at least one pending task
 
+PendingTask dequeue_task(ThreadPool* pool) {
+    unsigned int c = pick_class(pool);
+    PendingTask next = class_ring(pool, c)[pool->pendingHead[c]];
+    pool->pendingHead[c] = (pool->pendingHead[c] + 1) % pool->pendingLength;
+    if (pool->credits[c] != 0) (pool->credits[c])--;
+    count_add(&(pool->classCount[c]), -1);
+    count_add(&(pool->pendingCount), -1);
+    return next;
 }
 
 // ASSERT: Requires lock
+// Hands pending tasks to idle kernels, if both are present; this happens when
+// a kernel parks while a task is being queued
+
+void drain_pending(ThreadPool* pool) {
+    while (count_load(&(pool->pendingCount)) != 0) {
+        Kernel* k = pop_idle(pool);
+        if (k == NULL) return;
+        dispatch_task(k, dequeue_task(pool));
+    }
+}
+
+// Reports a task failure, with the kernel that ran it
+
+void report_outcome(Kernel* k, int outcome) {
+    if (outcome) {
+        fprintf(stderr, "[Kern_%s_%u]: Task failed with code %d\n", k->owner->name, k->id, outcome);
+        fflush(stderr);
+    }
+}
+
 
-Kernel* terminate_kernel(Kernel* k) {
+//------------------------------------------------------------------------------
+// WORK STEALING
+//
+// - Deques are guarded by their own lock, the owner and thieves rarely meet on
+//   it; the pool lock is never involved
+// - An idle kernel is woken with the steal_work task, which does nothing: like
+//   after any task, the kernel then looks for work on its own
+
+SITH_TASKBODY int steal_work(void* unused) {
+    (void) unused;
+    return SITH_RET_OK;
+}
+
+// Returns SITH_RET_ERR if the deque is full
+
+int push_local(Kernel* k, PendingTask entry) {
+    DoLockObject(k->dequeLock);
+    unsigned int count = (unsigned int) count_load(&(k->dequeCount));
+    if (count == SITH_POOL_DEQUESIZE) {
+        DoUnlockObject(k->dequeLock);
+        return SITH_RET_ERR;
+    }
+    k->scratch->deque[(k->dequeTop + count) % SITH_POOL_DEQUESIZE] = entry;
+    count_add(&(k->dequeCount), 1);
+    DoUnlockObject(k->dequeLock);
+    return SITH_RET_OK;
+}
+
+// Takes the newest task if own is set, the oldest otherwise
+
+int take_local(Kernel* k, int own, PendingTask* out) {
+    if (count_load(&(k->dequeCount)) == 0) return 0;
+
+    DoLockObject(k->dequeLock);
+    unsigned int count = (unsigned int) count_load(&(k->dequeCount));
+    if (count == 0) {
+        DoUnlockObject(k->dequeLock);
+        return 0;
+    }
+    if (own) {
+        *out = k->scratch->deque[(k->dequeTop + count - 1) % SITH_POOL_DEQUESIZE];
+    }
+    else {
+        *out = k->scratch->deque[k->dequeTop];
+        k->dequeTop = (k->dequeTop + 1) % SITH_POOL_DEQUESIZE;
+    }
+    count_add(&(k->dequeCount), -1);
+    DoUnlockObject(k->dequeLock);
+    return 1;
+}
+
+// Scans the other kernels once, starting from the next slot
+
+int steal_task(Kernel* self, PendingTask* out) {
+    ThreadPool* pool = self->owner;
+    unsigned int slots = (unsigned int) count_load(&(pool->slotCount));
+    for (unsigned int i = 1; i < slots; i++) {
+        Kernel* victim = pool->kernels[(self->id + i) % slots];
+        if (take_local(victim, 0, out)) return 1;
+    }
+    return 0;
+}
+
+
+// Wakes threads blocked on the pool, skipping the lock if there are none
+
+void wake_waiters(ThreadPool* pool) {
+    if (count_load(&(pool->waiters)) != 0) {
+        DoLockObject(pool->lock);
+        BroadcastConditionVariable(pool->cv);
+        DoUnlockObject(pool->lock);
+    }
+}
+
+void terminate_kernel(Kernel* k) {
 
     // Force NULL values here, kernel will interpret them as a termination command
     k->task = NULL;
     k->argument = NULL;
-    SignalSemObject(k->semaph);
+    UnparkThread(k->parker);
 
     // Wait for kernel return
     WaitForThread(k->thread, NULL);
-    DestroySemObject(k->semaph);
-    Kernel* next = k->next;
-    free(k);
-    return next;
+    k->thread = NULL;
 }
 
-// ASSERT: Requires lock
-// CAUTION: Releases lock
+// CAUTION: All kernels must be parked, and no other thread may use the pool
 
 void deallocate_pool(ThreadPool* pool) {
 
-    LockObject* lock = pool->lock;
-
     // Free all kernels
-    for (Kernel* k = pool->idleKernels; k != NULL; k = terminate_kernel(k)) {
+    unsigned int slots = (unsigned int) count_load(&(pool->slotCount));
+    for (unsigned int slot = 0; slot < slots; slot++) {
+        Kernel* k = pool->kernels[slot];
+        if (k->exited) WaitForThread(k->thread, NULL);
+        else if (k->thread != NULL) terminate_kernel(k);
+        DestroyParkObject(k->parker);
+        DestroyLockObject(k->dequeLock);
+        free(k->scratch);
+        free(k);
     }
     free(pool->kernels);
+    free(pool->pending);
+    free(pool->placement);
+    DestroyParkObject(pool->starter);
+    if (pool->scalerCv != NULL) DestroyConditionVar(pool->scalerCv);
 
-    // Deallocate pool struct before exiting the critsection
     DestroyConditionVar(pool->cv);
+    DestroyLockObject(pool->lock);
     free(pool->name);
     free(pool);
-    DoUnlockObject(lock);
-    DestroyLockObject(lock);
+}
+
+
+//------------------------------------------------------------------------------
+// RESIZING
+//
+// - Growing spawns kernels at once. Shrinking retires idle kernels at once,
+//   and leaves the rest as a debt: busy kernels pay it as their task ends,
+//   kernels going idle as they push themselves
+// - Retired kernels exit without waiting for anyone, they are joined on the
+//   next resize, which frees their slots
+
+// Wake-up call to an idle kernel, which exits instead of running it
+
+SITH_TASKBODY int retire_now(void* unused) {
+    (void) unused;
+    return SITH_RET_OK;
+}
+
+// ASSERT: Requires lock
+// The kernel must return right after
+
+void retire_kernel(Kernel* k) {
+    ThreadPool* pool = k->owner;
+    k->exited = 1;
+    (pool->retiring)--;
+
+    // A destroyer may be waiting for the last ones
+    if (count_load(&(pool->waiters)) != 0) BroadcastConditionVariable(pool->cv);
+}
+
+// ASSERT: Requires lock
+// Retires idle kernels while some debt is left
+
+void pay_debt(ThreadPool* pool) {
+    while (count_load(&(pool->retireDebt)) != 0) {
+        Kernel* k = pop_idle(pool);
+        if (k == NULL) return;
+        count_add(&(pool->retireDebt), -1);
+        dispatch_task(k, (PendingTask) {retire_now, NULL, 0, NULL});
+    }
+}
+
+// ASSERT: Requires lock
+
+void reap_kernels(ThreadPool* pool) {
+    unsigned int slots = (unsigned int) count_load(&(pool->slotCount));
+    for (unsigned int slot = 0; slot < slots; slot++) {
+        Kernel* k = pool->kernels[slot];
+        if (!k->exited) continue;
+
+        // Retired kernels take no lock on their way out
+        WaitForThread(k->thread, NULL);
+        k->thread = NULL;
+        k->exited = 0;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// PLACEMENT
+//
+// - Compact fills one NUMA node before moving to the next, scatter deals
+//   kernels out to the nodes in turn; both only use CPUs the process is
+//   allowed on
+// - Kernels are placed by slot, so a revived kernel returns to its CPU
+
+// Returns the CPU order for the given policy, NULL with errno set on failure
+// or if no placement is needed
+
+unsigned int* plan_placement(AffinityPolicy policy, const unsigned int* cpus, unsigned int cpuCount, unsigned int* planned) {
+    errno = 0;
+    if (policy == affinity_none) return NULL;
+
+    unsigned int* allowed = malloc(SITH_MAX_CPUS * sizeof (unsigned int));
+    unsigned int* nodes = malloc(SITH_MAX_CPUS * sizeof (unsigned int));
+    unsigned int* plan = malloc(SITH_MAX_CPUS * sizeof (unsigned int));
+    if (allowed == NULL || nodes == NULL || plan == NULL) {
+        free(allowed);
+        free(nodes);
+        free(plan);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    unsigned int count = GetAllowedCPUs(allowed, SITH_MAX_CPUS);
+    if (count > SITH_MAX_CPUS) count = SITH_MAX_CPUS;
+
+    if (policy == affinity_list) {
+        // Listed CPUs are taken as they are, as long as we may run there
+        for (unsigned int i = 0; i < cpuCount && errno == 0; i++) {
+            unsigned int found = 0;
+            while (found < count && allowed[found] != cpus[i]) found++;
+            if (found == count) errno = EINVAL;
+            plan[i] = cpus[i];
+        }
+        count = cpuCount;
+    }
+    else {
+        // Sort allowed CPUs by node, keeping the numbering within a node
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int cpu = allowed[i], node = GetCPUNode(cpu), j = i;
+            for (; j > 0 && nodes[j - 1] > node; j--) {
+                allowed[j] = allowed[j - 1];
+                nodes[j] = nodes[j - 1];
+            }
+            allowed[j] = cpu;
+            nodes[j] = node;
+        }
+
+        if (policy == affinity_compact) {
+            memcpy(plan, allowed, count * sizeof (unsigned int));
+        }
+        else {
+            // One CPU per node per round, nodes exhausted early drop out
+            unsigned int taken = 0;
+            while (taken < count) {
+                unsigned int lastNode = (unsigned int) -1;
+                for (unsigned int i = 0; i < count; i++) {
+                    if (allowed[i] == (unsigned int) -1 || nodes[i] == lastNode) continue;
+                    plan[taken++] = allowed[i];
+                    lastNode = nodes[i];
+                    allowed[i] = (unsigned int) -1;
+                }
+            }
+        }
+    }
+    free(allowed);
+    free(nodes);
+
+    if (errno != 0 || count == 0) {
+        if (errno == 0) errno = EINVAL;
+        free(plan);
+        return NULL;
+    }
+    *planned = count;
+    return plan;
 }
 
 
 //------------------------------------------------------------------------------
 // KERNEL BODY
 
+unsigned int histogram_bucket(unsigned long long nanos) {
+    unsigned long long micros = nanos / 1000;
+    unsigned int bucket = 0;
+    while (micros != 0 && bucket < SITH_POOL_HISTBUCKETS - 1) {
+        micros >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Runs the kernel's current task and accounts for it
+
+void run_task(Kernel* k) {
+    // Wake-up calls do nothing, they are not tasks of their own
+    if (k->task == steal_work) return;
+
+    KernelCounters* stats = &(k->scratch->stats);
+    unsigned long long start = ReadTimer() & ~1ULL;
+    stat_add(&(stats->idleNanos), start - word_load(&(stats->since)));
+    stat_set(&(stats->since), start | 1ULL);
+    stat_add(&(stats->waitHistogram[histogram_bucket(start > k->submitted ? start - k->submitted : 0)]), 1);
+
+    int outcome = (*(k->task))(k->argument);
+
+    unsigned long long stop = ReadTimer() & ~1ULL;
+    stat_set(&(stats->since), stop);
+    stat_add(&(stats->busyNanos), stop - start);
+    stat_add(&(stats->runHistogram[histogram_bucket(stop - start)]), 1);
+    stat_add(&(stats->tasks), 1);
+
+    report_outcome(k, outcome);
+}
+
 ThreadValue SITH_THREAD_CALLCONV kernelBody(void* n) {
 
     Kernel* self = (Kernel*) n;
+    ThreadPool* pool = self->owner;
     int error;
 
-    while (1) {
+    currentKernel = self;
 
-        // Name reporting is prone to race conditions if lock is not held
-        /*
-                DoLockObject(self->owner->lock);
-                printf("[%s_kno%u] Parking\n", self->owner->name, self->id);
-                DoUnlockObject(self->owner->lock);
-                fflush(stdout);
-         */
+    // Placement comes first, so that the scratch is allocated where we run
+    if (self->cpu >= 0 && PinThread((unsigned int) self->cpu)) {
+        fprintf(stderr, "[Kern_%s_%u]: Could not pin to CPU %d, running unpinned\n", pool->name, self->id, self->cpu);
+        fflush(stderr);
+    }
+    if (self->scratch == NULL) self->scratch = calloc(1, sizeof (KernelScratch));
+
+    // Report to the spawner, it gives up on us if there is no scratch
+    KernelScratch* scratch = self->scratch;
+    UnparkThread(pool->starter);
+    if (scratch == NULL) return SITH_RV_ONE;
+    stat_set(&(scratch->stats.since), ReadTimer() & ~1ULL);
+
+    while (1) {
 
         // Park thread
-        error = WaitSemObject(self->semaph, 1);
+        error = ParkThread(self->parker);
         if (error) {
-            HandleErrorStatus("Kernel failure on semaphore");
+            HandleErrorStatus("Kernel failure on parking");
             return SITH_RV_ONE;
         }
 
@@ -125,59 +651,175 @@ ThreadValue SITH_THREAD_CALLCONV kernelBody(void* n) {
         // Do return normally
         if (self->argument == NULL && self->task == NULL) break;
 
-        // See above
-        /*
-                DoLockObject(self->owner->lock);
-                printf("[%s_kno%u] Executing\n", self->owner->name, self->id);
-                DoUnlockObject(self->owner->lock);
-                fflush(stdout);
-         */
+        // Picked to retire while idle
+        int retired = self->task == retire_now;
+        if (retired) {
+            DoLockObject(pool->lock);
+            retire_kernel(self);
+            DoUnlockObject(pool->lock);
+            break;
+        }
 
-        // Asserting task and argument fields are set
-        // invoke task
-        int outcome = (*(self->task))(self->argument);
+        // Keep running while there are pending tasks
+        int draining;
+        do {
+            // Asserting task and argument fields are set
+            // invoke task
+            run_task(self);
+
+            // The pool is shrinking, retire once our own tasks are done
+            if (count_load(&(pool->retireDebt)) != 0 && count_load(&(self->dequeCount)) == 0) {
+                DoLockObject(pool->lock);
+                retired = count_load(&(pool->retireDebt)) != 0;
+                if (retired) {
+                    count_add(&(pool->retireDebt), -1);
+                    retire_kernel(self);
+                }
+                DoUnlockObject(pool->lock);
+                if (retired) break;
+            }
 
-        // Update pool - enter critical
-        DoLockObject(self->owner->lock);
-        if (outcome) {
-            // Report task failure
-            fprintf(stderr, "[Kern_%s_%u]: Task failed with code %d\n", self->owner->name, self->id, outcome);
-            fflush(stderr);
-        }
+            // Own submissions first, they are the hottest in cache, unless
+            // something urgent is queued
+            PendingTask next;
+            int urgent = count_load(&(pool->classCount[priority_high])) != 0;
+            draining = !urgent && count_load(&(pool->stealing)) && take_local(self, 1, &next);
+            if (draining) load_task(self, next);
+            else if (count_load(&(pool->pendingCount)) != 0) {
+                // Take over the oldest pending task, this frees a queue slot
+                DoLockObject(pool->lock);
+                if (count_load(&(pool->pendingCount)) != 0) {
+                    load_task(self, dequeue_task(pool));
+                    draining = 1;
+                }
+                DoUnlockObject(pool->lock);
+
+                // Submitters may be waiting for room
+                if (draining) wake_waiters(pool);
+            }
+            if (!draining && urgent && count_load(&(pool->stealing)) && take_local(self, 1, &next)) {
+                load_task(self, next);
+                draining = 1;
+            }
+
+            // Then whatever the others have left behind
+            if (!draining && count_load(&(pool->stealing)) && steal_task(self, &next)) {
+                load_task(self, next);
+                draining = 1;
+            }
 
-        self->next = self->owner->idleKernels;
-        self->owner->idleKernels = self;
-        (self->owner->idleCount)++;
-        DoUnlockObject(self->owner->lock);
-        NotifyConditionVariable(self->owner->cv);
+            if (!draining) {
+                push_idle(pool, self);
 
+                // A task may have been queued after the check above, or a
+                // shrink may have found no idle kernel
+                if (count_load(&(pool->pendingCount)) != 0 || count_load(&(pool->retireDebt)) != 0) {
+                    DoLockObject(pool->lock);
+                    drain_pending(pool);
+                    pay_debt(pool);
+                    DoUnlockObject(pool->lock);
+                }
+
+                // Both submitters and a destroyer may be waiting
+                wake_waiters(pool);
+            }
+        } while (draining);
+        if (retired) break;
     }
 
+    // Close the last idle period, the slot may be revived later
+    stat_add(&(scratch->stats.idleNanos), (ReadTimer() & ~1ULL) - word_load(&(scratch->stats.since)));
     return SITH_RV_ZERO;
 }
 
+// Constructs a kernel in the given slot, or revives the one retired there
+// ASSERT: Requires lock, or exclusive access to the pool
+
+Kernel* spawn_kernel(ThreadPool* pool, unsigned int slot) {
+    Kernel* kern = NULL;
+    unsigned int slots = (unsigned int) count_load(&(pool->slotCount));
+
+    if (slot < slots) {
+        kern = pool->kernels[slot];
+    }
+    else {
+        kern = calloc(1, sizeof (Kernel));
+        if (kern == NULL) return NULL;
+
+        kern->id = slot;
+        kern->owner = pool;
+        kern->parker = CreateParkObject();
+        kern->dequeLock = CreateLockObject();
+        if (kern->parker == NULL || kern->dequeLock == NULL) {
+            if (kern->parker != NULL) DestroyParkObject(kern->parker);
+            if (kern->dequeLock != NULL) DestroyLockObject(kern->dequeLock);
+            free(kern);
+            return NULL;
+        }
+    }
+    kern->cpu = pool->placement != NULL ? (int) pool->placement[slot % pool->placementCount] : -1;
+
+    // Start the kernel, and wait until it has its scratch
+    kern->thread = SpawnThread(kernelBody, kern);
+    if (kern->thread != NULL) {
+        ParkThread(pool->starter);
+        if (kern->scratch == NULL) {
+            WaitForThread(kern->thread, NULL);
+            kern->thread = NULL;
+            errno = ENOMEM;
+        }
+    }
+    if (kern->thread == NULL) {
+        if (slot >= slots) {
+            DestroyParkObject(kern->parker);
+            DestroyLockObject(kern->dequeLock);
+            free(kern);
+        }
+        return NULL;
+    }
+
+    // Register kernel in pool, the table entry must be visible before the count
+    if (slot == slots) {
+        pool->kernels[slot] = kern;
+        count_add(&(pool->slotCount), 1);
+    }
+    return kern;
+}
+
 
 //------------------------------------------------------------------------------
 // API FUNCTIONS
 
 ThreadPool* CreateThreadPool(char* name, unsigned int numThreads) {
+    return CreatePinnedThreadPool(name, numThreads, affinity_none, NULL, 0);
+}
+
+ThreadPool* CreatePinnedThreadPool(char* name, unsigned int numThreads, AffinityPolicy policy, const unsigned int* cpus, unsigned int cpuCount) {
 
     // Arg check
-    if (name == NULL || numThreads == 0) {
+    if (name == NULL || numThreads == 0 || numThreads > SITH_POOL_MAXKERNELS ||
+            policy > affinity_list || (policy == affinity_list && (cpus == NULL || cpuCount == 0 || cpuCount > SITH_MAX_CPUS))) {
         errno = EINVAL;
         return NULL;
     }
 
-    ThreadPool* pool = malloc(sizeof (ThreadPool));
+    ThreadPool* pool = calloc(1, sizeof (ThreadPool));
     if (pool == NULL) {
         return NULL;
     }
 
+    pool->placement = plan_placement(policy, cpus, cpuCount, &(pool->placementCount));
+    if (pool->placement == NULL && errno != 0) {
+        free(pool);
+        return NULL;
+    }
+
     // Give the pool a name, for all its related semaphores
     // Using PID to ensure they are process-private
     size_t namelen = strlen(name) + 1;
     pool->name = malloc(namelen * sizeof (char));
     if (pool->name == NULL) {
+        free(pool->placement);
         free(pool);
         return NULL;
     }
@@ -186,108 +828,195 @@ ThreadPool* CreateThreadPool(char* name, unsigned int numThreads) {
     pool->cv = CreateConditionVar();
     if (pool->cv == NULL) {
         free(pool->name);
+        free(pool->placement);
+        free(pool);
+        return NULL;
+    }
+
+    pool->lock = CreateLockObject();
+    if (pool->lock == NULL) {
+        DestroyConditionVar(pool->cv);
+        free(pool->name);
+        free(pool->placement);
         free(pool);
         return NULL;
     }
 
-    // Allocate space for kernel pointers
-    pool->kernels = malloc(numThreads * sizeof (Kernel*));
-    if (pool->kernels == NULL) {
+    // Allocate space for kernel pointers, once and for all
+    pool->kernels = malloc(SITH_POOL_MAXKERNELS * sizeof (Kernel*));
+    pool->starter = CreateParkObject();
+    if (pool->kernels == NULL || pool->starter == NULL) {
+        if (pool->starter != NULL) DestroyParkObject(pool->starter);
+        free(pool->kernels);
+        DestroyLockObject(pool->lock);
         DestroyConditionVar(pool->cv);
         free(pool->name);
+        free(pool->placement);
         free(pool);
         return NULL;
     }
 
-    // Init pool state
-    pool->idleCount = 0;
+    // Init pool state, the idle stack starts empty from calloc
+    count_store(&(pool->slotCount), 0);
+    count_store(&(pool->stealing), 0);
     pool->kernCount = numThreads;
-    pool->lock = CreateLockObject();
+    count_store(&(pool->idleCount), 0);
+    count_store(&(pool->waiters), 0);
+    pool->pending = NULL;
+    for (unsigned int c = 0; c < priority_count; c++) {
+        pool->pendingHead[c] = 0;
+        count_store(&(pool->classCount[c]), 0);
+    }
+    count_store(&(pool->pendingCount), 0);
+    pool->pendingLength = 0;
+    pool->dispatch = dispatch_strict;
+    pool->agingNanos = SITH_POOL_AGINGMS * 1000000ULL;
+    memcpy(pool->credits, classWeights, sizeof (classWeights));
+    pool->pendingPeak = 0;
+    word_store(&(pool->rejected), 0);
+    word_store(&(pool->blocked), 0);
 
     // Kernel construction
-    pool->idleKernels = NULL;
-    Kernel* kern;
     for (unsigned int kerIndex = 0; kerIndex < numThreads; kerIndex++) {
 
-        kern = calloc(1, sizeof (Kernel));
+        Kernel* kern = spawn_kernel(pool, kerIndex);
         if (kern == NULL) {
             deallocate_pool(pool);
             return NULL;
         }
 
-        kern->id = kerIndex;
+        // Chain the idle list to this node
+        push_idle(pool, kern);
+    }
+
+    return pool;
+}
 
-        kern->semaph = CreateSemObject(0, 1);
-        if (kern->semaph == NULL) {
-            free(kern);
-            deallocate_pool(pool);
-            return NULL;
+// Returns how many entries were taken, in order; errno tells why the rest
+// were not
+
+unsigned int schedule_batch(ThreadPool* pool, const TaskEntry* batch, unsigned int count, int blocking, TaskPriority priority, CancelToken* token) {
+    unsigned int done = 0;
+    unsigned long long now = ReadTimer();
+
+    // Stealing mode: kernels keep their own submissions, and never block
+    Kernel* self = currentKernel;
+    if (self != NULL && self->owner == pool && count_load(&(pool->stealing))) {
+        unsigned int queued = 0;
+        for (; done < count; done++) {
+            if (push_local(self, (PendingTask) {batch[done].task, batch[done].argument, now, token})) {
+                // Deque is full, no point in queueing deeper
+                CancelToken* own = self->token;
+                self->token = token;
+                report_outcome(self, (*(batch[done].task))(batch[done].argument));
+                self->token = own;
+            }
+            else {
+                queued++;
+            }
         }
 
-        // All went well (finally), link the kernel to its pool
-        kern->owner = pool;
+        // We go back to the task at hand, not to these: one idle kernel for
+        // each, single submissions included
+        for (unsigned int woken = 0; woken < queued && count_load(&(pool->idleCount)) > 0; woken++) {
+            Kernel* thief = pop_idle(pool);
+            if (thief == NULL) break;
+            dispatch_task(thief, (PendingTask) {steal_work, NULL, now, NULL});
+        }
+        return done;
+    }
 
-        // Start the kernel
-        kern->thread = SpawnThread(kernelBody, kern);
-        if (kern->thread == NULL) {
-            DestroySemObject(kern->semaph);
-            free(kern);
-            deallocate_pool(pool);
-            return NULL;
+    DoLockObject(pool->lock);
+
+    // Registering first, any kernel going idle after the checks below will
+    // see us and wake us up
+    count_add(&(pool->waiters), 1);
+
+    int waited = 0;
+    while (1) {
+        drain_pending(pool);
+
+        // Idle kernels first, as long as nothing older is queued
+        while (done < count && count_load(&(pool->pendingCount)) == 0) {
+            Kernel* chosen = pop_idle(pool);
+            if (chosen == NULL) break;
+            dispatch_task(chosen, (PendingTask) {batch[done].task, batch[done].argument, now, token});
+            done++;
         }
 
+        // Then as many as the queue can hold
+        unsigned int queued = (unsigned int) count_load(&(pool->pendingCount));
+        unsigned int tail = pool->pendingHead[priority] + (unsigned int) count_load(&(pool->classCount[priority]));
+        unsigned int added = 0;
+        while (done < count && queued + added < pool->pendingLength) {
+            class_ring(pool, priority)[(tail + added) % pool->pendingLength] = (PendingTask) {batch[done].task, batch[done].argument, now, token};
+            added++;
+            done++;
+        }
+        if (added != 0) {
+            count_add(&(pool->classCount[priority]), (int) added);
+            count_add(&(pool->pendingCount), (int) added);
+            if (queued + added > pool->pendingPeak) pool->pendingPeak = queued + added;
 
-        // Register kernel in pool
-        pool->kernels[kerIndex] = kern;
+            // A kernel may have parked without seeing these
+            drain_pending(pool);
+        }
 
-        // Chain the idle list to this node - we are doing a prepend action over a list
-        kern->next = pool->idleKernels;
-        pool->idleKernels = kern;
+        if (done == count) break;
+        if (!blocking) {
+            word_add(&(pool->rejected), count - done);
+            errno = EAGAIN;
+            break;
+        }
+        if (!waited) {
+            word_add(&(pool->blocked), 1);
+            waited = 1;
+        }
+        if (WaitConditionVariable(pool->cv, pool->lock)) break;
     }
 
-    //No further actions needed, assume all kernels are ready
-    pool->idleCount = numThreads;
+    count_add(&(pool->waiters), -1);
+    DoUnlockObject(pool->lock);
+    return done;
+}
 
-    return pool;
+// Tasks scheduled from a task carry its token, unless given their own
+
+CancelToken* inherited_token() {
+    return currentKernel != NULL ? currentKernel->token : NULL;
 }
 
-int ScheduleTask(ThreadPool* pool, PoolTask task, void* argument, int blocking) {
-    if (pool == NULL || task == NULL) {
+int schedule_one(ThreadPool* pool, PoolTask task, void* argument, int blocking, TaskPriority priority, CancelToken* token) {
+    if (pool == NULL || task == NULL || priority >= priority_count) {
         errno = EINVAL;
         return SITH_RET_ERR;
     }
 
-    int error;
-
-    DoLockObject(pool->lock);
-
-    // Query for available kernels
-    while (pool->idleCount == 0) {
-        if (!blocking) {
-            errno = EAGAIN;
-            DoUnlockObject(pool->lock);
-            return SITH_RET_ERR;
-        }
-        error = WaitConditionVariable(pool->cv, pool->lock);
-        if (error) {
-            return SITH_RET_ERR;
+    // Fast path: an idle kernel, and no older task waiting for it
+    Kernel* self = currentKernel;
+    int local = self != NULL && self->owner == pool && count_load(&(pool->stealing));
+    if (!local && count_load(&(pool->pendingCount)) == 0) {
+        Kernel* chosen = pop_idle(pool);
+        if (chosen != NULL) {
+            dispatch_task(chosen, (PendingTask) {task, argument, ReadTimer(), token});
+            return SITH_RET_OK;
         }
     }
 
-    // If we're here, then we have idle kernels, detach one from the idle list
-    Kernel* chosen = pool->idleKernels;
-    pool->idleKernels = pool->idleKernels->next;
+    TaskEntry entry = {task, argument};
+    return schedule_batch(pool, &entry, 1, blocking, priority, token) == 1 ? SITH_RET_OK : SITH_RET_ERR;
+}
 
-    // register runnable and argument in the kernel
-    chosen->task = task;
-    chosen->argument = argument;
-    (pool->idleCount)--;
-    DoUnlockObject(pool->lock);
+int ScheduleTask(ThreadPool* pool, PoolTask task, void* argument, int blocking) {
+    return schedule_one(pool, task, argument, blocking, priority_normal, inherited_token());
+}
 
-    // Detached kernel can start working
-    SignalSemObject(chosen->semaph);
+int SchedulePriorityTask(ThreadPool* pool, PoolTask task, void* argument, int blocking, TaskPriority priority) {
+    return schedule_one(pool, task, argument, blocking, priority, inherited_token());
+}
 
-    return SITH_RET_OK;
+int ScheduleCancellableTask(ThreadPool* pool, PoolTask task, void* argument, int blocking, CancelToken* token) {
+    return schedule_one(pool, task, argument, blocking, priority_normal, token);
 }
 
 int DestroyThreadPool(ThreadPool* pool, int blocking) {
@@ -297,157 +1026,827 @@ int DestroyThreadPool(ThreadPool* pool, int blocking) {
     }
 
     DoLockObject(pool->lock);
+    count_add(&(pool->waiters), 1);
 
-    // See if there are any active kernels
-    while (pool->idleCount != pool->kernCount) {
+    // See if there are any active kernels, tasks still to run, or kernels still
+    // to retire
+    while ((unsigned int) count_load(&(pool->idleCount)) != pool->kernCount || count_load(&(pool->pendingCount)) != 0 || pool->retiring != 0) {
         // Some threads are still running
         if (!blocking) {
+            count_add(&(pool->waiters), -1);
             DoUnlockObject(pool->lock);
             errno = EAGAIN;
             return SITH_RET_ERR;
         }
         WaitConditionVariable(pool->cv, pool->lock);
     }
+    count_add(&(pool->waiters), -1);
+
+    // The autoscaler must not resize the pool from now on
+    ThreadObject* scaler = pool->scaler;
+    pool->scalerStop = 1;
+    if (scaler != NULL) NotifyConditionVariable(pool->scalerCv);
+
+    // The last kernel to go idle may still need the lock to wake us, release
+    // it before joining
+    DoUnlockObject(pool->lock);
+    if (scaler != NULL) WaitForThread(scaler, NULL);
 
     // If not, then all kernels are parked, start dismantling the pool
     deallocate_pool(pool);
     return SITH_RET_OK;
 }
 
+// ASSERT: Requires lock
+
+int resize_pool(ThreadPool* pool, unsigned int newCount) {
+    reap_kernels(pool);
+
+    if (newCount > pool->kernCount) {
+        // Extend case, kernels not yet retired are simply kept
+        unsigned int missing = newCount - pool->kernCount;
+        unsigned int kept = (unsigned int) count_load(&(pool->retireDebt));
+        if (kept > missing) kept = missing;
+        count_add(&(pool->retireDebt), -(int) kept);
+        pool->retiring -= kept;
+        pool->kernCount += kept;
+        missing -= kept;
+
+        // Then revive retired kernels, then take new slots
+        for (unsigned int slot = 0; slot < SITH_POOL_MAXKERNELS && missing != 0; slot++) {
+            if (slot < (unsigned int) count_load(&(pool->slotCount)) && pool->kernels[slot]->thread != NULL) continue;
+
+            Kernel* kern = spawn_kernel(pool, slot);
+            if (kern == NULL) {
+                // Keep the kernels started so far
+                return SITH_RET_ERR;
+            }
+            push_idle(pool, kern);
+            (pool->kernCount)++;
+            missing--;
+        }
+
+        // Slots still held by kernels on their way out
+        if (missing != 0) {
+            errno = EAGAIN;
+            return SITH_RET_ERR;
+        }
+
+        // Pending tasks can start right away on the new kernels
+        drain_pending(pool);
+    }
+
+    else if (newCount < pool->kernCount) {
+        // Busy kernels retire as their task ends, pay_debt() picks the idle ones
+        // now; the debt goes first, so that a kernel parking meanwhile sees it
+        unsigned int excess = pool->kernCount - newCount;
+        count_add(&(pool->retireDebt), (int) excess);
+        pool->retiring += excess;
+        pool->kernCount = newCount;
+        pay_debt(pool);
+    }
+
+    return SITH_RET_OK;
+}
+
 int ResizeThreadPool(ThreadPool* pool, unsigned int newCount) {
-    if (pool == NULL || newCount == 0) {
+    if (pool == NULL || newCount == 0 || newCount > SITH_POOL_MAXKERNELS) {
         errno = EINVAL;
         return SITH_RET_ERR;
     }
 
-    if (newCount == pool->kernCount) return 0;
+    DoLockObject(pool->lock);
+    int result = resize_pool(pool, newCount);
+    DoUnlockObject(pool->lock);
+
+    // Submitters may have room now
+    wake_waiters(pool);
+    return result;
+}
+
+int SetThreadPoolQueueLength(ThreadPool* pool, unsigned int newLength) {
+    if (pool == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
 
-    // Critical section entry point
     DoLockObject(pool->lock);
 
-    if (newCount > pool->kernCount) {
-        // Extend case, construct new kernels
+    if (newLength == pool->pendingLength) {
+        DoUnlockObject(pool->lock);
+        return SITH_RET_OK;
+    }
+
+    // Pending tasks cannot be dropped
+    unsigned int queued = (unsigned int) count_load(&(pool->pendingCount));
+    if (queued > newLength) {
+        DoUnlockObject(pool->lock);
+        errno = EAGAIN;
+        return SITH_RET_ERR;
+    }
 
-        // Create a buffer that keeps pointers to he new kernels
-        // Guaranteed to be nonzero because of the "if" expression
-        Kernel** kernelBuffer = calloc(newCount - pool->kernCount, sizeof (Kernel*));
-        if (kernelBuffer == NULL) {
+    PendingTask* newRings = NULL;
+    if (newLength != 0) {
+        newRings = malloc(priority_count * newLength * sizeof (PendingTask));
+        if (newRings == NULL) {
             DoUnlockObject(pool->lock);
             return SITH_RET_ERR;
         }
+    }
+
+    // Move pending tasks to the front of the new rings, keeping their order
+    for (unsigned int c = 0; c < priority_count; c++) {
+        unsigned int classQueued = (unsigned int) count_load(&(pool->classCount[c]));
+        for (unsigned int i = 0; i < classQueued; i++) {
+            newRings[c * newLength + i] = class_ring(pool, c)[(pool->pendingHead[c] + i) % pool->pendingLength];
+        }
+        pool->pendingHead[c] = 0;
+    }
+    free(pool->pending);
+    pool->pending = newRings;
+    pool->pendingLength = newLength;
 
-        // Build the new kernels
-        Kernel* kern;
-        for (unsigned int kerIndex = 0; kerIndex < newCount - pool->kernCount; kerIndex++) {
+    // A longer queue may let blocked submitters through
+    BroadcastConditionVariable(pool->cv);
+    DoUnlockObject(pool->lock);
+    return SITH_RET_OK;
+}
 
-            // Allocate space for the object
-            kern = calloc(1, sizeof (Kernel));
-            if (kern == NULL) {
-                goto extendFail;
-            }
+int SetThreadPoolDispatch(ThreadPool* pool, DispatchMode mode, unsigned long agingMillis) {
+    if (pool == NULL || mode > dispatch_weighted) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
 
-            kern->id = kerIndex + pool->kernCount;
+    DoLockObject(pool->lock);
+    pool->dispatch = mode;
+    pool->agingNanos = agingMillis * 1000000ULL;
+    memcpy(pool->credits, classWeights, sizeof (classWeights));
+    DoUnlockObject(pool->lock);
+    return SITH_RET_OK;
+}
 
-            // COnstruct its semaphore
-            kern->semaph = CreateSemObject(0, 1);
-            if (kern->semaph == NULL) {
-                free(kern);
-                goto extendFail;
-            }
+int SetThreadPoolStealing(ThreadPool* pool, int enabled) {
+    if (pool == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
 
+    DoLockObject(pool->lock);
 
-            // Spin up the underlying thread
-            kern->thread = SpawnThread(kernelBody, kern);
-            if (kern->thread == NULL) {
-                DestroySemObject(kern->semaph);
-                free(kern);
-                goto extendFail;
-            }
+    // Switching with tasks around would strand them in deques
+    if ((unsigned int) count_load(&(pool->idleCount)) != pool->kernCount || count_load(&(pool->pendingCount)) != 0) {
+        DoUnlockObject(pool->lock);
+        errno = EAGAIN;
+        return SITH_RET_ERR;
+    }
+
+    count_store(&(pool->stealing), enabled ? 1 : 0);
+    DoUnlockObject(pool->lock);
+    return SITH_RET_OK;
+}
+
+//------------------------------------------------------------------------------
+// TASK HANDLES AND GROUPS
+//
+// - A tracked task runs wrapped in track_task(), which stores the outcome and
+//   wakes the waiters, so its result never reaches the failure report
+// - Handles are shared by the caller and the task, the last one to let go
+//   frees it
+
+struct sith_task {
+    LockObject* lock;
+    CondVar* done;
+    int finished;
+    int result;
+    AtomicCount references;
+};
+
+struct sith_taskgroup {
+    LockObject* lock;
+    CondVar* done;
+    unsigned int running;
+    unsigned int failures;
+};
+
+typedef SITH_TASKARG struct {
+    PoolTask task;
+    void* argument;
+    TaskHandle* handle;
+    TaskGroup* group;
+} TrackedTask;
+
+void release_handle(TaskHandle* this) {
+    if (count_add(&(this->references), -1) != 1) return;
+    DestroyConditionVar(this->done);
+    DestroyLockObject(this->lock);
+    free(this);
+}
 
-            // Link the kernel to its pool
-            kern->owner = pool;
+// Waits on the condition until the deadline, 0 meaning none
+// ASSERT: Requires lock
+
+int wait_until(CondVar* cv, LockObject* lock, unsigned long long deadline) {
+    if (deadline == 0) return WaitConditionVariable(cv, lock);
+
+    unsigned long long now = ReadTimer();
+    if (now >= deadline) {
+        errno = ETIMEDOUT;
+        return SITH_RET_ERR;
+    }
 
-            // Keep track of the kernel in the buffer
-            kernelBuffer[kerIndex] = kern;
+    // Rounding up, so that an early return is never mistaken for a timeout
+    unsigned long long remaining = (deadline - now + 999999ULL) / 1000000ULL;
+    if (TimedWaitConditionVariable(cv, lock, (unsigned long) remaining) && errno != ETIMEDOUT) return SITH_RET_ERR;
+    errno = 0;
+    return SITH_RET_OK;
+}
 
+unsigned long long make_deadline(unsigned long milliseconds) {
+    return ReadTimer() + milliseconds * 1000000ULL;
+}
+
+int wait_handle(TaskHandle* this, unsigned long long deadline, int* result) {
+    if (this == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+    DoLockObject(this->lock);
+    while (!this->finished) {
+        if (wait_until(this->done, this->lock, deadline)) {
+            DoUnlockObject(this->lock);
+            return SITH_RET_ERR;
         }
+    }
+    if (result != NULL) *result = this->result;
+    DoUnlockObject(this->lock);
+    return SITH_RET_OK;
+}
 
-        // Now, attach the new kernels to the pool
+int wait_group(TaskGroup* this, unsigned long long deadline, unsigned int* failures) {
+    if (this == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
 
-        // Reallocate the kernel tracker
-        Kernel** pkAlias = realloc(pool->kernels, newCount * sizeof (Kernel*));
-        if (pkAlias == NULL) {
-            goto extendFail;
+    DoLockObject(this->lock);
+    while (this->running != 0) {
+        if (wait_until(this->done, this->lock, deadline)) {
+            DoUnlockObject(this->lock);
+            return SITH_RET_ERR;
         }
-        pool->kernels = pkAlias;
+    }
+    if (failures != NULL) *failures = this->failures;
+    this->failures = 0;
+    DoUnlockObject(this->lock);
+    return SITH_RET_OK;
+}
 
-        // We're done with allocations, tie up all loose ends
-        for (unsigned int kerIndex = pool->kernCount; kerIndex < newCount; kerIndex++) {
+SITH_TASKBODY int track_task(void* a) {
+    TrackedTask* tracked = (TrackedTask*) a;
+    int outcome = (*(tracked->task))(tracked->argument);
+
+    TaskHandle* handle = tracked->handle;
+    if (handle != NULL) {
+        DoLockObject(handle->lock);
+        handle->result = outcome;
+        handle->finished = 1;
+        BroadcastConditionVariable(handle->done);
+        DoUnlockObject(handle->lock);
+        release_handle(handle);
+    }
 
-            // Register kernel in pool
-            pool->kernels[kerIndex] = kernelBuffer[kerIndex - pool->kernCount];
+    // The group may be destroyed as soon as its lock is released
+    TaskGroup* group = tracked->group;
+    if (group != NULL) {
+        DoLockObject(group->lock);
+        if (outcome) (group->failures)++;
+        if (--(group->running) == 0) BroadcastConditionVariable(group->done);
+        DoUnlockObject(group->lock);
+    }
 
-            // Chain the idle list to this node - we are doing a prepend action over a list
-            kernelBuffer[kerIndex - pool->kernCount]->next = pool->idleKernels;
-            pool->idleKernels = kernelBuffer[kerIndex - pool->kernCount];
+    free(tracked);
+    return SITH_RET_OK;
+}
 
+int ScheduleTrackedTask(ThreadPool* pool, PoolTask task, void* argument, int blocking, TaskGroup* group, TaskHandle** handle) {
+    if (pool == NULL || task == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    if (group == NULL && handle == NULL) return ScheduleTask(pool, task, argument, blocking);
+
+    TrackedTask* tracked = malloc(sizeof (TrackedTask));
+    if (tracked == NULL) return SITH_RET_ERR;
+    tracked->task = task;
+    tracked->argument = argument;
+    tracked->group = group;
+    tracked->handle = NULL;
+
+    if (handle != NULL) {
+        TaskHandle* created = calloc(1, sizeof (TaskHandle));
+        if (created == NULL) {
+            free(tracked);
+            return SITH_RET_ERR;
+        }
+        created->lock = CreateLockObject();
+        created->done = CreateConditionVar();
+        if (created->lock == NULL || created->done == NULL) {
+            if (created->lock != NULL) DestroyLockObject(created->lock);
+            if (created->done != NULL) DestroyConditionVar(created->done);
+            free(created);
+            free(tracked);
+            return SITH_RET_ERR;
         }
-        free(kernelBuffer);
 
-        // Update pool counters
-        pool->idleCount += newCount - pool->kernCount;
-        pool->kernCount = newCount;
-        goto exitPoint;
+        // One for the caller, one for the task
+        count_store(&(created->references), 2);
+        tracked->handle = created;
+    }
 
+    // Accounted before submission, the task may finish before we get back
+    if (group != NULL) {
+        DoLockObject(group->lock);
+        (group->running)++;
+        DoUnlockObject(group->lock);
+    }
 
-extendFail:
-        // We have failed here, shut down the spawned kernels gracefully
-        for (size_t i = 0; i < newCount - pool->kernCount; i++)
-            terminate_kernel(kernelBuffer[i]);
-        DoUnlockObject(pool->lock);
+    if (ScheduleTask(pool, track_task, tracked, blocking)) {
+        ErrorCode error = GetErrorCode();
+        if (group != NULL) {
+            DoLockObject(group->lock);
+            if (--(group->running) == 0) BroadcastConditionVariable(group->done);
+            DoUnlockObject(group->lock);
+        }
+        if (tracked->handle != NULL) {
+            release_handle(tracked->handle);
+            release_handle(tracked->handle);
+        }
+        free(tracked);
+        SetErrorCode(error);
         return SITH_RET_ERR;
     }
 
-    else {
-        //Be careful..
-        if (pool->kernCount - newCount > pool->idleCount) {
-            DoUnlockObject(pool->lock);
-            errno = EAGAIN;
+    if (handle != NULL) *handle = tracked->handle;
+    return SITH_RET_OK;
+}
+
+int ScheduleTasks(ThreadPool* pool, const TaskEntry* entries, unsigned int count, int blocking, TaskGroup* group, unsigned int* scheduled) {
+    if (scheduled != NULL) *scheduled = 0;
+    if (pool == NULL || (entries == NULL && count != 0)) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        if (entries[i].task == NULL) {
+            errno = EINVAL;
             return SITH_RET_ERR;
         }
+    }
+    if (count == 0) return SITH_RET_OK;
+
+    // Grouped entries run wrapped, see ScheduleTrackedTask
+    const TaskEntry* batch = entries;
+    TaskEntry* wrapped = NULL;
+    if (group != NULL) {
+        wrapped = malloc(count * sizeof (TaskEntry));
+        if (wrapped == NULL) return SITH_RET_ERR;
+        for (unsigned int i = 0; i < count; i++) {
+            TrackedTask* tracked = malloc(sizeof (TrackedTask));
+            if (tracked == NULL) {
+                while (i-- > 0) free(wrapped[i].argument);
+                free(wrapped);
+                return SITH_RET_ERR;
+            }
+            tracked->task = entries[i].task;
+            tracked->argument = entries[i].argument;
+            tracked->handle = NULL;
+            tracked->group = group;
+            wrapped[i].task = track_task;
+            wrapped[i].argument = tracked;
+        }
 
-        while (newCount != pool->kernCount) {
+        DoLockObject(group->lock);
+        group->running += count;
+        DoUnlockObject(group->lock);
+        batch = wrapped;
+    }
 
-            // Just terminate an idle kernel
-            Kernel* kern = pool->idleKernels;
-            unsigned int kid = kern->id;
-            pool->idleKernels = pool->idleKernels->next;
+    unsigned int done = schedule_batch(pool, batch, count, blocking, priority_normal, inherited_token());
+
+    if (group != NULL) {
+        // Entries past the first refusal never started
+        if (done != count) {
+            ErrorCode error = GetErrorCode();
+            for (unsigned int i = done; i < count; i++) free(wrapped[i].argument);
+            DoLockObject(group->lock);
+            group->running -= count - done;
+            if (group->running == 0) BroadcastConditionVariable(group->done);
+            DoUnlockObject(group->lock);
+            SetErrorCode(error);
+        }
+        free(wrapped);
+    }
 
-            // Update IDs if necessary
-            if (kid != pool->kernCount - 1) {
-                pool->kernels[pool->kernCount - 1]->id = kid;
-                pool->kernels[kid] = pool->kernels[pool->kernCount - 1];
-            }
-            terminate_kernel(kern);
+    if (scheduled != NULL) *scheduled = done;
+    return done == count ? SITH_RET_OK : SITH_RET_ERR;
+}
 
-            pool->idleCount--;
-            pool->kernCount--;
-        }
+int WaitTask(TaskHandle* handle, int* result) {
+    return wait_handle(handle, 0, result);
+}
+
+int TimedWaitTask(TaskHandle* handle, unsigned long milliseconds, int* result) {
+    return wait_handle(handle, make_deadline(milliseconds), result);
+}
 
-        // Now we can directly reallocate the kernel map
-        //  - Should be guaranteed to succeed because of shrink-only case and
-        //    memory function synchronization
-        pool->kernels = realloc(pool->kernels, newCount * sizeof (Kernel*));
+int PollTask(TaskHandle* handle, int* result) {
+    if (handle == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
     }
 
-exitPoint:
+    DoLockObject(handle->lock);
+    int finished = handle->finished;
+    if (finished && result != NULL) *result = handle->result;
+    DoUnlockObject(handle->lock);
+
+    if (!finished) {
+        errno = EAGAIN;
+        return SITH_RET_ERR;
+    }
+    return SITH_RET_OK;
+}
+
+void ReleaseTaskHandle(TaskHandle* handle) {
+    if (handle != NULL) release_handle(handle);
+}
+
+TaskGroup* CreateTaskGroup() {
+    TaskGroup* this = calloc(1, sizeof (TaskGroup));
+    if (this == NULL) return NULL;
+
+    this->lock = CreateLockObject();
+    this->done = CreateConditionVar();
+    if (this->lock == NULL || this->done == NULL) {
+        if (this->lock != NULL) DestroyLockObject(this->lock);
+        if (this->done != NULL) DestroyConditionVar(this->done);
+        free(this);
+        return NULL;
+    }
+    return this;
+}
+
+int WaitTaskGroup(TaskGroup* group, unsigned int* failures) {
+    return wait_group(group, 0, failures);
+}
+
+int TimedWaitTaskGroup(TaskGroup* group, unsigned long milliseconds, unsigned int* failures) {
+    return wait_group(group, make_deadline(milliseconds), failures);
+}
+
+int DestroyTaskGroup(TaskGroup* group) {
+    if (group == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+    DoLockObject(group->lock);
+    unsigned int running = group->running;
+    DoUnlockObject(group->lock);
+    if (running != 0) {
+        errno = EBUSY;
+        return SITH_RET_ERR;
+    }
+
+    DestroyConditionVar(group->done);
+    DestroyLockObject(group->lock);
+    free(group);
+    return SITH_RET_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// CANCELLATION
+//
+// - Cancelling only raises a flag, tasks poll it at points of their choosing;
+//   queued tasks still run, and find their token already cancelled
+
+CancelToken* CreateCancelToken(CancelToken* parent) {
+    CancelToken* token = calloc(1, sizeof (CancelToken));
+    if (token == NULL) return NULL;
+    token->parent = parent;
+    return token;
+}
+
+void RequestCancel(CancelToken* token) {
+    if (token != NULL) count_store(&(token->cancelled), 1);
+}
+
+int IsCancelled(CancelToken* token) {
+    for (; token != NULL; token = token->parent) {
+        if (count_load(&(token->cancelled))) return 1;
+    }
+    return 0;
+}
+
+void DestroyCancelToken(CancelToken* token) {
+    free(token);
+}
+
+CancelToken* GetTaskCancelToken() {
+    return inherited_token();
+}
+
+int TaskCancelled() {
+    return IsCancelled(inherited_token());
+}
+
+//------------------------------------------------------------------------------
+// STATISTICS
+//
+// - Kernels update their counters with plain stores, snapshots read them
+//   atomically but not all at once: figures taken while tasks run may be off by
+//   the task in progress
+
+// Adds the kernel's counters to the given stats, including the current period
+
+void snapshot_kernel(Kernel* k, unsigned long long now, KernelStats* out) {
+    KernelCounters* stats = &(k->scratch->stats);
+    out->cpu = k->cpu;
+    out->active += k->thread != NULL && !k->exited;
+    out->tasks += word_load(&(stats->tasks));
+    out->busyNanos += word_load(&(stats->busyNanos));
+    out->idleNanos += word_load(&(stats->idleNanos));
+    for (unsigned int bucket = 0; bucket < SITH_POOL_HISTBUCKETS; bucket++) {
+        out->waitHistogram[bucket] += word_load(&(stats->waitHistogram[bucket]));
+        out->runHistogram[bucket] += word_load(&(stats->runHistogram[bucket]));
+    }
+
+    // Retired kernels are neither busy nor idle
+    unsigned long long since = word_load(&(stats->since));
+    if (k->thread == NULL || k->exited || now < (since & ~1ULL)) return;
+    if (since & 1ULL) out->busyNanos += now - (since & ~1ULL);
+    else out->idleNanos += now - since;
+}
+
+void print_histogram(FILE* stream, const char* label, unsigned long long* histogram) {
+    fprintf(stream, "  %s:", label);
+    for (unsigned int bucket = 0; bucket < SITH_POOL_HISTBUCKETS; bucket++) {
+        if (histogram[bucket] == 0) continue;
+        if (bucket == SITH_POOL_HISTBUCKETS - 1) fprintf(stream, " >=%lluus:%llu", GetHistogramBound(bucket - 1), histogram[bucket]);
+        else fprintf(stream, " <%lluus:%llu", GetHistogramBound(bucket), histogram[bucket]);
+    }
+    fprintf(stream, "\n");
+}
+
+unsigned int busy_percent(KernelStats* stats) {
+    unsigned long long total = stats->busyNanos + stats->idleNanos;
+    return total ? (unsigned int) (stats->busyNanos * 100 / total) : 0;
+}
+
+int GetThreadPoolStats(ThreadPool* pool, PoolStats* stats, KernelStats* kernels, unsigned int maxKernels) {
+    if (pool == NULL || stats == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    memset(stats, 0, sizeof (PoolStats));
+
+    // Resizing rewrites the kernel threads, and the queue fields live under lock
+    DoLockObject(pool->lock);
+    stats->size = pool->kernCount;
+    stats->idle = (unsigned int) count_load(&(pool->idleCount));
+    stats->queued = (unsigned int) count_load(&(pool->pendingCount));
+    stats->queueLength = pool->pendingLength;
+    stats->queuePeak = pool->pendingPeak;
+    stats->rejected = word_load(&(pool->rejected));
+    stats->blocked = word_load(&(pool->blocked));
+    stats->kernels = (unsigned int) count_load(&(pool->slotCount));
+
+    stats->total.cpu = -1;
+    unsigned long long now = ReadTimer();
+    for (unsigned int slot = 0; slot < stats->kernels; slot++) {
+        Kernel* k = pool->kernels[slot];
+        snapshot_kernel(k, now, &(stats->total));
+        if (kernels != NULL && slot < maxKernels) {
+            memset(kernels + slot, 0, sizeof (KernelStats));
+            snapshot_kernel(k, now, kernels + slot);
+        }
+    }
     DoUnlockObject(pool->lock);
+
+    return SITH_RET_OK;
+}
+
+int DumpThreadPoolStats(ThreadPool* pool, FILE* stream) {
+    if (pool == NULL || stream == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+    KernelStats* kernels = malloc(SITH_POOL_MAXKERNELS * sizeof (KernelStats));
+    if (kernels == NULL) return SITH_RET_ERR;
+
+    PoolStats stats;
+    GetThreadPoolStats(pool, &stats, kernels, SITH_POOL_MAXKERNELS);
+
+    fprintf(stream, "Pool %s: %u kernels, %u idle, queue %u/%u (peak %u), %llu rejected, %llu blocked\n",
+            pool->name, stats.size, stats.idle, stats.queued, stats.queueLength, stats.queuePeak, stats.rejected, stats.blocked);
+    fprintf(stream, "  %llu tasks, %u%% busy\n", stats.total.tasks, busy_percent(&(stats.total)));
+    for (unsigned int slot = 0; slot < stats.kernels; slot++) {
+        if (!kernels[slot].active) continue;
+        fprintf(stream, "  Kernel %u: %llu tasks, %u%% busy (%llums busy, %llums idle)", slot, kernels[slot].tasks,
+                busy_percent(kernels + slot), kernels[slot].busyNanos / 1000000, kernels[slot].idleNanos / 1000000);
+        if (kernels[slot].cpu >= 0) fprintf(stream, " on CPU %d", kernels[slot].cpu);
+        fprintf(stream, "\n");
+    }
+    print_histogram(stream, "Wait", stats.total.waitHistogram);
+    print_histogram(stream, "Run", stats.total.runHistogram);
+    fflush(stream);
+
+    free(kernels);
+    return SITH_RET_OK;
+}
+
+int ParseAffinity(const char* spec, AffinityPolicy* policy, unsigned int* cpus, unsigned int* cpuCount) {
+    if (spec == NULL || policy == NULL || cpus == NULL || cpuCount == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+    if (strcmp(spec, SITH_AFFINITY_NONE) == 0) *policy = affinity_none;
+    else if (strcmp(spec, SITH_AFFINITY_COMPACT) == 0) *policy = affinity_compact;
+    else if (strcmp(spec, SITH_AFFINITY_SCATTER) == 0) *policy = affinity_scatter;
+    else {
+        // Comma-separated CPUs or inclusive ranges, as in "0,2,4-7"
+        unsigned int count = 0;
+        const char* caret = spec;
+        while (1) {
+            unsigned int first, last;
+            int read = 0;
+            if (sscanf(caret, "%u%n", &first, &read) != 1) break;
+            caret += read;
+            last = first;
+            if (*caret == '-') {
+                if (sscanf(caret + 1, "%u%n", &last, &read) != 1) break;
+                caret += read + 1;
+            }
+            if (last < first || last >= SITH_MAX_CPUS || count + (last - first) >= *cpuCount) break;
+            for (unsigned int cpu = first; cpu <= last; cpu++) cpus[count++] = cpu;
+
+            if (*caret == '\0') {
+                *policy = affinity_list;
+                *cpuCount = count;
+                return SITH_RET_OK;
+            }
+            if (*caret != ',') break;
+            caret++;
+        }
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+    *cpuCount = 0;
     return SITH_RET_OK;
 }
 
+unsigned long long GetHistogramBound(unsigned int bucket) {
+    if (bucket >= SITH_POOL_HISTBUCKETS - 1) return 0;
+    return 1ULL << bucket;
+}
+
 unsigned int GetThreadPoolSize(ThreadPool* this) {
     if (this == NULL) {
         return SITH_RET_ERR;
     }
     return this->kernCount;
 }
+
+unsigned int GetThreadPoolQueueLength(ThreadPool* this) {
+    if (this == NULL) {
+        return 0;
+    }
+    return this->pendingLength;
+}
+
+
+//------------------------------------------------------------------------------
+// AUTOSCALING
+//
+// - Growth follows queue wait: whenever the oldest queued task has waited past
+//   the threshold, the pool grows by the queue length, up to the maximum
+// - Shrinking follows idleness over a whole window: the pool keeps the kernels
+//   that were busy on average, plus a spare, and sheds at most as many as were
+//   idle at every check; busy kernels retire as their task ends
+
+// ASSERT: Requires lock, and at least one pending task
+
+unsigned long long oldest_pending(ThreadPool* pool) {
+    unsigned long long oldest = ~0ULL;
+    for (unsigned int c = 0; c < priority_count; c++) {
+        if (count_load(&(pool->classCount[c])) == 0) continue;
+        unsigned long long stamp = class_ring(pool, c)[pool->pendingHead[c]].submitted;
+        if (stamp < oldest) oldest = stamp;
+    }
+    return oldest;
+}
+
+// ASSERT: Requires lock
+// Time spent on tasks by all kernels so far, retired ones included
+
+unsigned long long busy_nanos(ThreadPool* pool, unsigned long long now) {
+    KernelStats total;
+    memset(&total, 0, sizeof (KernelStats));
+    unsigned int slots = (unsigned int) count_load(&(pool->slotCount));
+    for (unsigned int slot = 0; slot < slots; slot++) snapshot_kernel(pool->kernels[slot], now, &total);
+    return total.busyNanos;
+}
+
+ThreadValue SITH_THREAD_CALLCONV scalerBody(void* p) {
+    ThreadPool* pool = (ThreadPool*) p;
+
+    // Current shrink window: start, busy time so far, fewest idle kernels seen
+    int watching = 0;
+    unsigned long long windowStart = 0, windowBusy = 0;
+    unsigned int idleFloor = 0;
+
+    DoLockObject(pool->lock);
+    while (!pool->scalerStop) {
+        if (pool->maxKernels == 0) {
+            watching = 0;
+            WaitConditionVariable(pool->scalerCv, pool->lock);
+            continue;
+        }
+
+        unsigned long long now = ReadTimer();
+        unsigned int target = pool->kernCount;
+        if (target < pool->minKernels) target = pool->minKernels;
+        if (target > pool->maxKernels) target = pool->maxKernels;
+
+        unsigned int queued = (unsigned int) count_load(&(pool->pendingCount));
+        if (queued != 0 && target < pool->maxKernels && now - oldest_pending(pool) > pool->growNanos) {
+            target += queued < pool->maxKernels - target ? queued : pool->maxKernels - target;
+            watching = 0;
+        }
+        else if (!watching) {
+            watching = 1;
+            windowStart = now;
+            windowBusy = busy_nanos(pool, now);
+            idleFloor = (unsigned int) count_load(&(pool->idleCount));
+        }
+        else {
+            unsigned int idle = (unsigned int) count_load(&(pool->idleCount));
+            if (idle < idleFloor) idleFloor = idle;
+
+            if (now - windowStart >= pool->shrinkNanos) {
+                unsigned long long span = now - windowStart;
+                unsigned int keep = (unsigned int) ((busy_nanos(pool, now) - windowBusy + span - 1) / span) + 1;
+                if (keep < pool->minKernels) keep = pool->minKernels;
+                if (keep < target) target -= target - keep < idleFloor ? target - keep : idleFloor;
+                watching = 0;
+            }
+        }
+
+        // Failures are retried on the next check
+        if (target != pool->kernCount) {
+            resize_pool(pool, target);
+            if (count_load(&(pool->waiters)) != 0) BroadcastConditionVariable(pool->cv);
+        }
+
+        unsigned long tick = (unsigned long) (pool->growNanos / 1000000 / SITH_POOL_SCALECHECKS);
+        if (tick < SITH_POOL_MINTICKMS) tick = SITH_POOL_MINTICKMS;
+        if (tick > SITH_POOL_MAXTICKMS) tick = SITH_POOL_MAXTICKMS;
+        TimedWaitConditionVariable(pool->scalerCv, pool->lock, tick);
+    }
+    DoUnlockObject(pool->lock);
+
+    return SITH_RV_ZERO;
+}
+
+int SetThreadPoolAutoscale(ThreadPool* pool, unsigned int minKernels, unsigned int maxKernels, unsigned long growMillis, unsigned long shrinkMillis) {
+    if (pool == NULL || (maxKernels != 0 && (minKernels == 0 || minKernels > maxKernels || maxKernels > SITH_POOL_MAXKERNELS))) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+    DoLockObject(pool->lock);
+    pool->minKernels = minKernels;
+    pool->maxKernels = maxKernels;
+    pool->growNanos = growMillis * 1000000ULL;
+    pool->shrinkNanos = shrinkMillis * 1000000ULL;
+
+    // The scaler starts on first use, and picks up changes right away
+    if (pool->scaler == NULL && maxKernels != 0) {
+        if (pool->scalerCv == NULL) pool->scalerCv = CreateConditionVar();
+        if (pool->scalerCv != NULL) pool->scaler = SpawnThread(scalerBody, pool);
+        if (pool->scaler == NULL) {
+            pool->maxKernels = 0;
+            DoUnlockObject(pool->lock);
+            return SITH_RET_ERR;
+        }
+    }
+    else if (pool->scaler != NULL) NotifyConditionVariable(pool->scalerCv);
+    DoUnlockObject(pool->lock);
+
+    return SITH_RET_OK;
+}
@@ -8,6 +8,46 @@
  * 
  *  - Pools created by the same process shall NOT have the same name
  *
+ *  - Idle kernels sit on a lock-free stack and park on their own ParkObject;
+ *    scheduling on an idle kernel, and a kernel going idle, take no lock.
+ *    Pools are limited to 1024 threads, the kernel table never moves
+ *
+ *  - In stealing mode, tasks scheduled from one of the pool's own kernels go
+ *    to that kernel's deque instead, and never block: the kernel runs its
+ *    newest local task next, idle kernels take the oldest ones. This suits
+ *    tasks that spawn subtasks, such as recursive walks
+ *
+ *  - A pool may hold a bounded queue of pending tasks, empty by default; a
+ *    task is queued only when no kernel is idle, and kernels drain the queue
+ *    before parking again. ScheduleTask() blocks or fails only once the queue
+ *    is full
+ *
+ *  - Queued tasks come in three priority classes, sharing the queue length.
+ *    Strict dispatch always takes the highest class, weighted dispatch lets
+ *    classes take turns 4:2:1; either way a task queued for longer than the
+ *    aging limit goes first, so that lower classes cannot starve. In stealing
+ *    mode, queued high priority tasks also go before a kernel's own ones.
+ *    Tasks handed straight to an idle kernel are not affected
+ *
+ *  - Tasks scheduled with ScheduleTrackedTask() report their result through a
+ *    handle and/or a group instead of stderr. A group counts its running tasks
+ *    and can be waited on as a unit, then reused for the next job; do not
+ *    wait on a group from one of the kernels running its tasks
+ *
+ *  - Every kernel keeps its own statistics, without locking: tasks run, time
+ *    spent busy and idle, and histograms of the time tasks waited to start and
+ *    of their run time. Bucket 0 counts durations below 1us, bucket i those
+ *    below 2^i us, the last one everything longer
+ *
+ *  - A task may carry a cancellation token, which long-running work checks with
+ *    TaskCancelled() between steps; tasks scheduled from a task inherit its
+ *    token. Cancelling a token cancels its children too, and is safe from a
+ *    signal handler. Tokens must outlive the tasks carrying them
+ *
+ *  - Shrinking never fails: idle kernels retire at once, busy ones as their
+ *    current task ends. An autoscaler may resize the pool on its own, between
+ *    given bounds, following queue wait and idleness
+ *
  * Created on 22 July 2017, 14:42
  */
 
@@ -17,6 +57,8 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+#include <stdio.h>
     
 
 //------------------------------------------------------------------------------
@@ -30,6 +72,81 @@ typedef struct sith_pool ThreadPool;
 // Pool task signature
 typedef int (*PoolTask)(void*);
 
+// One task of a batch
+typedef struct {
+    PoolTask task;
+    void* argument;
+} TaskEntry;
+
+typedef struct sith_task TaskHandle;
+typedef struct sith_taskgroup TaskGroup;
+typedef struct sith_cancel CancelToken;
+
+// Priority classes, ScheduleTask() uses priority_normal
+typedef enum sith_priority {
+    priority_high,
+    priority_normal,
+    priority_low,
+    priority_count
+} TaskPriority;
+
+// Choice among queued classes, see SetThreadPoolDispatch()
+typedef enum sith_dispatch {
+    dispatch_strict,
+    dispatch_weighted
+} DispatchMode;
+
+// Where kernels run, see CreatePinnedThreadPool()
+typedef enum sith_affinity {
+    affinity_none,
+    affinity_compact,
+    affinity_scatter,
+    affinity_list
+} AffinityPolicy;
+
+// Policy names understood by ParseAffinity()
+#define SITH_AFFINITY_NONE "none"
+#define SITH_AFFINITY_COMPACT "compact"
+#define SITH_AFFINITY_SCATTER "scatter"
+
+// Histogram size, the last bucket holds durations of 2^22us (~4s) and above
+#define SITH_POOL_HISTBUCKETS 24
+
+// Statistics of one kernel, or of all of them
+typedef struct {
+    // Zero if the kernel has been retired by a resize
+    unsigned int active;
+    // CPU the kernel is pinned to, -1 if none
+    int cpu;
+
+    unsigned long long tasks;
+    unsigned long long busyNanos;
+    unsigned long long idleNanos;
+
+    // From submission to start, and from start to return
+    unsigned long long waitHistogram[SITH_POOL_HISTBUCKETS];
+    unsigned long long runHistogram[SITH_POOL_HISTBUCKETS];
+} KernelStats;
+
+// Statistics of a pool
+typedef struct {
+    unsigned int size;
+    unsigned int idle;
+    unsigned int queued;
+    unsigned int queueLength;
+    unsigned int queuePeak;
+
+    // Submissions turned down for lack of room, and those that had to wait
+    unsigned long long rejected;
+    unsigned long long blocked;
+
+    // Kernel slots in use, including retired ones
+    unsigned int kernels;
+
+    // Sum over all kernels
+    KernelStats total;
+} PoolStats;
+
 
 //------------------------------------------------------------------------------
 // FUNCTIONS
@@ -45,6 +162,36 @@ typedef int (*PoolTask)(void*);
  */
 ThreadPool* CreateThreadPool(char* name, unsigned int numThreads);
 
+/**
+ * Same as CreateThreadPool, with each kernel pinned to one CPU:
+ *  - affinity_compact fills the CPUs of one NUMA node before the next
+ *  - affinity_scatter spreads kernels over the nodes in turn
+ *  - affinity_list uses the given CPUs in order
+ * Kernels allocate their own bookkeeping once pinned, so that it stays local
+ * to their node. With more kernels than CPUs, placement wraps around
+ * 
+ * @param name
+ * @param numThreads
+ * @param policy
+ * @param cpus The CPUs for affinity_list, ignored otherwise
+ * @param cpuCount
+ * @return A pointer to the newly created thread pool, NULL if an error
+ *         occurred; fails with EINVAL if a listed CPU is not available
+ */
+ThreadPool* CreatePinnedThreadPool(char* name, unsigned int numThreads, AffinityPolicy policy, const unsigned int* cpus, unsigned int cpuCount);
+
+/**
+ * Reads an affinity policy from its name, or from a list of CPUs and CPU
+ * ranges such as "0,2,4-7"
+ * 
+ * @param spec
+ * @param policy
+ * @param cpus Receives the listed CPUs
+ * @param cpuCount The capacity of cpus, receives the number of listed CPUs
+ * @return SITH_RET_OK if successful, SITH_RET_ERR with EINVAL otherwise
+ */
+int ParseAffinity(const char* spec, AffinityPolicy* policy, unsigned int* cpus, unsigned int* cpuCount);
+
 /**
  * Submits a task to be executed to this thread pool
  * 
@@ -57,14 +204,208 @@ ThreadPool* CreateThreadPool(char* name, unsigned int numThreads);
 int ScheduleTask(ThreadPool* pool, PoolTask task, void* argument, int blocking);
 
 /**
- * Changes the number of threads in this pool
+ * Same as ScheduleTask, with the given priority class
+ * 
+ * @param pool
+ * @param task
+ * @param argument
+ * @param blocking
+ * @param priority
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int SchedulePriorityTask(ThreadPool* pool, PoolTask task, void* argument, int blocking, TaskPriority priority);
+
+/**
+ * Same as ScheduleTask, the task and its subtasks carry the given token
+ * instead of the caller's
+ * 
+ * @param pool
+ * @param task
+ * @param argument
+ * @param blocking
+ * @param token May be NULL
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int ScheduleCancellableTask(ThreadPool* pool, PoolTask task, void* argument, int blocking, CancelToken* token);
+
+/**
+ * Same as ScheduleTask, but the task's result can be collected
+ * 
+ * @param pool
+ * @param task
+ * @param argument
+ * @param blocking
+ * @param group The group to account the task in, may be NULL
+ * @param handle If not NULL, receives a handle to be released with ReleaseTaskHandle()
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int ScheduleTrackedTask(ThreadPool* pool, PoolTask task, void* argument, int blocking, TaskGroup* group, TaskHandle** handle);
+
+/**
+ * Submits several tasks at once, under a single lock acquisition: as many as
+ * possible go straight to idle kernels, the rest to the queue. Tasks are handed
+ * out in array order
+ * 
+ * @param pool
+ * @param entries
+ * @param count
+ * @param blocking If set, waits for room until all entries are taken
+ * @param group The group to account the tasks in, may be NULL
+ * @param scheduled If not NULL, receives the number of entries taken, always
+ *                  a prefix of the array
+ * @return SITH_RET_OK if all entries were taken, SITH_RET_ERR otherwise
+ */
+int ScheduleTasks(ThreadPool* pool, const TaskEntry* entries, unsigned int count, int blocking, TaskGroup* group, unsigned int* scheduled);
+
+/**
+ * Blocks until the task has returned
+ * 
+ * @param handle
+ * @param result If not NULL, receives the task's return value
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int WaitTask(TaskHandle* handle, int* result);
+
+/**
+ * Same as WaitTask, fails with ETIMEDOUT if the task is still running after
+ * the given time
+ * 
+ * @param handle
+ * @param milliseconds
+ * @param result
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int TimedWaitTask(TaskHandle* handle, unsigned long milliseconds, int* result);
+
+/**
+ * Checks whether the task has returned, fails with EAGAIN if not
+ * 
+ * @param handle
+ * @param result If not NULL and the task has returned, receives its return value
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int PollTask(TaskHandle* handle, int* result);
+
+/**
+ * Gives up the handle, the task is unaffected
+ * 
+ * @param handle
+ */
+void ReleaseTaskHandle(TaskHandle* handle);
+
+/**
+ * Creates an empty task group, usable with any pool
+ * 
+ * @return a new TaskGroup, or NULL if creation failed
+ */
+TaskGroup* CreateTaskGroup();
+
+/**
+ * Blocks until all tasks in the group have returned
+ * 
+ * @param group
+ * @param failures If not NULL, receives the number of tasks that returned
+ *                 nonzero since the last wait
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int WaitTaskGroup(TaskGroup* group, unsigned int* failures);
+
+/**
+ * Same as WaitTaskGroup, fails with ETIMEDOUT if some task is still running
+ * after the given time
+ * 
+ * @param group
+ * @param milliseconds
+ * @param failures
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int TimedWaitTaskGroup(TaskGroup* group, unsigned long milliseconds, unsigned int* failures);
+
+/**
+ * Releases the group, fails with EBUSY if some of its tasks are still running
+ * 
+ * @param group
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int DestroyTaskGroup(TaskGroup* group);
+
+/**
+ * Creates a cancellation token, not cancelled
+ * 
+ * @param parent A token whose cancellation cancels this one too, may be NULL
+ * @return a new CancelToken, or NULL if allocation failed
+ */
+CancelToken* CreateCancelToken(CancelToken* parent);
+
+/**
+ * Cancels the given token, and its children. Async-signal-safe
+ * 
+ * @param token
+ */
+void RequestCancel(CancelToken* token);
+
+/**
+ * @param token May be NULL
+ * @return nonzero if the token or one of its ancestors has been cancelled
+ */
+int IsCancelled(CancelToken* token);
+
+/**
+ * Releases the given token, its children must have been released already
+ * 
+ * @param token
+ */
+void DestroyCancelToken(CancelToken* token);
+
+/**
+ * @return the token of the task running on the calling thread, NULL if none
+ */
+CancelToken* GetTaskCancelToken();
+
+/**
+ * Polled by long-running tasks, between pages or messages
+ * 
+ * @return nonzero if the calling task's token has been cancelled
+ */
+int TaskCancelled();
+
+/**
+ * Changes the number of threads in this pool. Busy kernels in excess retire
+ * when their task ends; growing fails with EAGAIN if all slots are held by
+ * kernels still on their way out
  * 
  * @param pool
  * @param newCount
- * @return 
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
  */
 int ResizeThreadPool(ThreadPool* pool, unsigned int newCount);
 
+/**
+ * Lets the pool resize itself between the given bounds: it grows by the queue
+ * length once the oldest queued task has waited longer than growMillis, and
+ * sheds kernels that stayed idle over a whole shrinkMillis window. Only queued
+ * tasks are seen, a pool without a queue never grows. Explicit resizes still
+ * apply, until the next decision
+ * 
+ * @param pool
+ * @param minKernels
+ * @param maxKernels 0 disables autoscaling
+ * @param growMillis
+ * @param shrinkMillis
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int SetThreadPoolAutoscale(ThreadPool* pool, unsigned int minKernels, unsigned int maxKernels, unsigned long growMillis, unsigned long shrinkMillis);
+
+/**
+ * Changes the number of tasks this pool may hold while all its threads are
+ * busy. Fails with EAGAIN if more tasks than the new length are pending
+ * 
+ * @param pool
+ * @param newLength 0 disables queueing
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int SetThreadPoolQueueLength(ThreadPool* pool, unsigned int newLength);
+
 /**
  * Releases all resources for this thread pool
  * 
@@ -74,6 +415,57 @@ int ResizeThreadPool(ThreadPool* pool, unsigned int newCount);
  */
 int DestroyThreadPool(ThreadPool* pool, int blocking);
 
+/**
+ * Chooses how kernels pick among queued priority classes, see the notes above.
+ * Pools start in strict mode with an aging limit of 100ms
+ * 
+ * @param pool
+ * @param mode
+ * @param agingMillis Queue time after which a task goes first, 0 disables aging
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int SetThreadPoolDispatch(ThreadPool* pool, DispatchMode mode, unsigned long agingMillis);
+
+/**
+ * Turns work stealing on or off for this thread pool, see the notes above.
+ * Fails with EAGAIN unless the pool is idle
+ * 
+ * @param pool
+ * @param enabled
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int SetThreadPoolStealing(ThreadPool* pool, int enabled);
+
+/**
+ * Takes a snapshot of this pool's statistics; time spent in the current task
+ * or idle period is included
+ * 
+ * @param pool
+ * @param stats Receives the pool-wide figures
+ * @param kernels If not NULL, receives the figures of the first maxKernels
+ *                kernel slots
+ * @param maxKernels
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int GetThreadPoolStats(ThreadPool* pool, PoolStats* stats, KernelStats* kernels, unsigned int maxKernels);
+
+/**
+ * Writes a readable summary of this pool's statistics
+ * 
+ * @param pool
+ * @param stream
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int DumpThreadPoolStats(ThreadPool* pool, FILE* stream);
+
+/**
+ * Returns the upper bound of a histogram bucket, 0 for the last one
+ * 
+ * @param bucket
+ * @return The bound in microseconds
+ */
+unsigned long long GetHistogramBound(unsigned int bucket);
+
 /**
  * Returns this thread pool's size
  * 
@@ -82,6 +474,14 @@ int DestroyThreadPool(ThreadPool* pool, int blocking);
  */
 unsigned int GetThreadPoolSize(ThreadPool* this);
 
+/**
+ * Returns the maximum number of pending tasks of this thread pool
+ * 
+ * @param this
+ * @return 
+ */
+unsigned int GetThreadPoolQueueLength(ThreadPool* this);
+
     
 #ifdef __cplusplus
 }
@@ -28,6 +28,8 @@ extern "C" {
 #define SITH_PROTO_MOREEND      "301"
 
 #define SITH_PROTO_INVALID      "400"
+// Sent untagged right before the server closes a connection past its deadline
+#define SITH_PROTO_TIMEDOUT     "408"
 
 #define SITH_PROTO_FAILURE      "500"
 #define SITH_PROTO_SERVBUSY     "503"
@@ -49,6 +51,16 @@ extern "C" {
 // decifra con il metodo dello XOR il file path utilizzando seed (un unsigned int) come seme del generatore random rand().
 #define SITH_PROTO_DECRYPT "DECR "
 
+// Requests the server's load counters, answered as a long message (extension)
+#define SITH_PROTO_STATUS "STAT\n"
+
+// Switches the connection to length-prefixed frames after the 200 reply, see
+//net.h; older servers answer 400 and the connection stays in EOT mode (extension).
+// Framed requests carry a client-chosen ID, echoed by their reply: listings and
+//encryptions may then run concurrently and be answered out of order, though
+//the parts of a long reply are never interleaved with other replies
+#define SITH_PROTO_FRAMING "FRM2\n"
+
 
 //------------------------------------------------------------------------------
 // CLIENT COMMANDS
@@ -80,6 +92,9 @@ extern "C" {
 // DECR
 #define SITH_CMD_DECRYPT "decrypt "
 
+// STAT
+#define SITH_CMD_STATUS "status\n"
+
 
 //------------------------------------------------------------------------------
 // UTILITY MACROS
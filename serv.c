@@ -36,12 +36,13 @@
 #include "list.h"
 #include "sync.h"
 #include "crypto.h"
+#include "timing.h"
 
 
 //------------------------------------------------------------------------------
 // ARGUMENTS
 
-#define SITH_SERV_OPTNUM 7
+#define SITH_SERV_OPTNUM 21
 #define SITH_SERV_TITLE "Crypto-Sithis, server application"
 #define SITH_SERV_OPTIONS (Option[]) {\
     {'h', "",                       0, SITH_OPT_FALSE,               "Show this help"},\
@@ -50,7 +51,21 @@
     {'L', "",                       0, SITH_OPT_FALSE,               "Listen to localhost. Override the configuration file"},\
     {'c', "current_root_dir" ,      1, SITH_DEFAULT_SERVROOT,        "Set the server's root directory"},\
     {'u', "max_client_connect",     1, SITH_DEFAULT_SERVMAXCLI,      "Set maximum number of concurrent clients"},\
-    {'I', "",                       0, SITH_OPT_FALSE,               "Do not daemonize (no effect on Windows)"}\
+    {'I', "",                       0, SITH_OPT_FALSE,               "Do not daemonize (no effect on Windows)"},\
+    {'w', "queue_locked",           0, SITH_OPT_FALSE,               "Queue requests on files already being processed, instead of rejecting them"},\
+    {'n', "max_tasks",              1, SITH_DEFAULT_SERVMAXTASKS,    "Set maximum number of concurrent encryption jobs, across all clients"},\
+    {'q', "max_queued_tasks",       1, SITH_DEFAULT_SERVMAXQUEUED,   "Set maximum number of encryption jobs waiting for a free slot"},\
+    {'b', "max_pending_clients",    1, SITH_DEFAULT_SERVMAXPENDING,  "Set maximum number of accepted clients waiting for a free connection slot"},\
+    {'A', "client_affinity",        1, SITH_DEFAULT_AFFINITY,        "Pin connection threads to CPUs: none, compact, scatter or a list such as 0,2,4-7"},\
+    {'C', "crypto_affinity",        1, SITH_DEFAULT_AFFINITY,        "Pin encryption threads to CPUs, same values as client_affinity"},\
+    {'g', "max_client_grow",        1, SITH_DEFAULT_SERVMAXGROW,     "Let the connection pool grow up to this many threads under load, and shrink back to max_client_connect when idle. 0 disables"},\
+    {'E', "event_loop",             0, SITH_OPT_FALSE,               "Serve all clients from one event loop thread, connection threads then only run listings and encryptions (Linux)"},\
+    {'k', "accept_threads",         1, SITH_DEFAULT_SERVACCEPTORS,   "Accept connections on this many threads, each with its own listening socket on the server's address (Linux)"},\
+    {'l', "listen_backlog",         1, SITH_DEFAULT_SERVBACKLOG,     "Set how many connections the system holds for each listening socket until they are accepted"},\
+    {'r', "max_pipelined",          1, SITH_DEFAULT_SERVMAXPIPELINED, "Set how many listings and encryptions a client using length framing may have running at once, their replies come back as they complete"},\
+    {'t', "idle_timeout",           1, SITH_DEFAULT_SERVIDLETIMEOUT, "Close connections sending no request for this many seconds. 0 disables"},\
+    {'m', "message_timeout",        1, SITH_DEFAULT_SERVMESSAGETIMEOUT, "Close connections taking longer than this many seconds to send a request once started, or taking none of a reply for as long. 0 disables"},\
+    {'x', "local_socket",           1, SITH_DEFAULT_SERVLOCALSOCKET, "Also listen on this Unix socket path, '@' starting an abstract name (Linux). none disables"}\
 }
 
 #define SITH_SERV_CFGPATH "server.conf"
@@ -59,11 +74,25 @@
 
 #define SITH_SERVOPT_HELP 0
 #define SITH_SERVOPT_ADDRESS 1
-#define SITH_SERVOPT_LOCAL 2
-#define SITH_SERVOPT_PORT 3
+#define SITH_SERVOPT_PORT 2
+#define SITH_SERVOPT_LOCAL 3
 #define SITH_SERVOPT_ROOT 4
 #define SITH_SERVOPT_CLIENTS 5
 #define SITH_SERVOPT_INTERACTIVE 6
+#define SITH_SERVOPT_QUEUELOCKED 7
+#define SITH_SERVOPT_TASKS 8
+#define SITH_SERVOPT_QUEUED 9
+#define SITH_SERVOPT_PENDING 10
+#define SITH_SERVOPT_CLIENTAFFINITY 11
+#define SITH_SERVOPT_CRYPTOAFFINITY 12
+#define SITH_SERVOPT_GROW 13
+#define SITH_SERVOPT_EVENTLOOP 14
+#define SITH_SERVOPT_ACCEPTORS 15
+#define SITH_SERVOPT_BACKLOG 16
+#define SITH_SERVOPT_PIPELINED 17
+#define SITH_SERVOPT_IDLETIMEOUT 18
+#define SITH_SERVOPT_MESSAGETIMEOUT 19
+#define SITH_SERVOPT_LOCALSOCKET 20
 
 //------------------------------------------------------------------------------
 // RETURN VALUES
@@ -73,6 +102,9 @@
 #define SITH_ENDECFAIL_STR 0x0101
 #define SITH_ENDECFAIL_NOMEM 0x0102
 #define SITH_ENDECFAIL_SYS 0x0103
+#define SITH_ENDECFAIL_BUSY 0x0104
+#define SITH_ENDECFAIL_FULL 0x0105
+#define SITH_ENDECFAIL_CANCEL 0x0106
 
 
 //------------------------------------------------------------------------------
@@ -80,7 +112,28 @@
 
 #define SITH_ENCRSFX "_enc"
 #define SITH_MAXCH_ENCRSFX 4
-#define SITH_SERV_BACKLOG 32
+// Kernels shared by all recursive listings
+#define SITH_SERV_WALKERS 4
+// Kernels listed one by one in STAT, pools may be larger
+#define SITH_SERV_STATKERNELS 64
+// Connection pool autoscaling: grow once a client has waited this long for a
+// thread, shrink after a whole window with threads to spare
+#define SITH_SERV_GROWWAITMS 50
+#define SITH_SERV_SHRINKIDLEMS 60000
+// How often a running job checks on its client, and how long a shutdown waits
+// for stopped jobs to clean up
+#define SITH_SERV_CANCELPOLLMS 50
+#define SITH_SERV_SHUTDOWNMS 5000
+// Event loop: events handled per wait, and how long accepting pauses when the
+// process is out of descriptors
+#define SITH_SERV_LOOPEVENTS 64
+#define SITH_SERV_ACCEPTPAUSEMS 100
+// How often the event loop looks for connections past their deadline
+#define SITH_SERV_SWEEPMS 1000
+// Event loop: listing batches a kernel may hand over before the socket takes them
+#define SITH_SERV_STREAMPARTS 4
+// Systems clamp the listen backlog lower anyway
+#define SITH_SERV_MAXBACKLOG 65535
 // Asserting that server is executed in its folder, and that crypto is located in the same folder
 #ifdef _WIN32
 #define SITH_FILENAME_CRYPTO "crypto.exe"
@@ -94,15 +147,42 @@
 //------------------------------------------------------------------------------
 // SERVER FIELDS
 
-ThreadObject* listenerThread;
 ThreadPool* clients;
+// Runs pipelined requests when connections have a thread each
+ThreadPool* requests = NULL;
+ThreadPool* walkers;
+// Cancelled on shutdown, parent of every connection's token
+CancelToken* shutdownToken;
 char* configPathName;
 char* cryptoPathName;
-ListenerSocket* listener;
+unsigned short queueLocked = 0;
+unsigned short eventLoop = 0;
+unsigned int maxPipelined = 1;
+// Receive deadlines in seconds, 0 disabling them
+unsigned int idleTimeout = 0;
+unsigned int messageTimeout = 0;
+
+// Each accepting thread owns a listener, and rebinds it itself on an address
+//change
+typedef struct {
+    ListenerSocket* listener;
+    ThreadObject* thread;
+    // Acceptor thread only, STAT reads it unlocked
+    unsigned long long accepted;
+#ifdef __unix__
+    volatile sig_atomic_t changed;
+    volatile sig_atomic_t failed;
+#endif
+} Acceptor;
+
+Acceptor* acceptors;
+unsigned int acceptorCount = 0;
+// Accepts co-located clients on a Unix socket, never rebound; no listener if
+//disabled
+Acceptor localAcceptor;
+SITH_THREADLOCAL Acceptor* ownAcceptor = NULL;
 
 #ifdef __unix__
-volatile sig_atomic_t servChange = 0;
-volatile sig_atomic_t servFailure = 0;
 struct sockaddr_in addressBuffer = {
     .sin_addr =
     {0},
@@ -118,6 +198,15 @@ typedef struct bitfield_mask {
     unsigned int changed_address : 1;
     unsigned int changed_max_clients : 1;
     unsigned int changed_root_dir : 1;
+    unsigned int changed_queue_locked : 1;
+    unsigned int changed_max_tasks : 1;
+    unsigned int changed_max_pending : 1;
+    unsigned int changed_affinity : 1;
+    unsigned int changed_max_grow : 1;
+    unsigned int changed_event_loop : 1;
+    unsigned int changed_listening : 1;
+    unsigned int changed_max_pipelined : 1;
+    unsigned int changed_timeouts : 1;
     //The compiler will probably inject 3 byte padding here . Test in case insert a manual padding to remain consistent
 } BitFieldMask;
 
@@ -132,12 +221,354 @@ void maskerer(void* bitfield_mask, unsigned short* opt, size_t size) {
     if (opt[SITH_SERVOPT_PORT] == 1) mask->changed_port = 1;
     if (opt[SITH_SERVOPT_ROOT] == 1) mask->changed_root_dir = 1;
     if (opt[SITH_SERVOPT_CLIENTS] == 1) mask->changed_max_clients = 1;
+    if (opt[SITH_SERVOPT_QUEUELOCKED] == 1) mask->changed_queue_locked = 1;
+    if (opt[SITH_SERVOPT_TASKS] == 1 || opt[SITH_SERVOPT_QUEUED] == 1) mask->changed_max_tasks = 1;
+    if (opt[SITH_SERVOPT_PENDING] == 1) mask->changed_max_pending = 1;
+    if (opt[SITH_SERVOPT_CLIENTAFFINITY] == 1 || opt[SITH_SERVOPT_CRYPTOAFFINITY] == 1) mask->changed_affinity = 1;
+    if (opt[SITH_SERVOPT_GROW] == 1) mask->changed_max_grow = 1;
+    if (opt[SITH_SERVOPT_EVENTLOOP] == 1) mask->changed_event_loop = 1;
+    if (opt[SITH_SERVOPT_ACCEPTORS] == 1 || opt[SITH_SERVOPT_BACKLOG] == 1 || opt[SITH_SERVOPT_LOCALSOCKET] == 1) mask->changed_listening = 1;
+    if (opt[SITH_SERVOPT_PIPELINED] == 1) mask->changed_max_pipelined = 1;
+    if (opt[SITH_SERVOPT_IDLETIMEOUT] == 1 || opt[SITH_SERVOPT_MESSAGETIMEOUT] == 1) mask->changed_timeouts = 1;
+}
+
+
+//------------------------------------------------------------------------------
+// JOB LIMITER
+//
+// - Caps the crypto processes running at once, whatever the number of
+//   connected clients; jobs beyond the cap wait in a bounded queue, and are
+//   rejected once that is full too
+// - Limits can be changed at any time, lowering them never interrupts running
+//   jobs, the excess drains as they finish
+
+typedef struct {
+    LockObject* lock;
+    CondVar* freed;
+    // Signalled when the last job leaves, for shutdown
+    CondVar* idle;
+
+    unsigned int limit;
+    unsigned int queueLimit;
+    unsigned int running;
+    unsigned int waiting;
+
+    // Counters, reported by STAT
+    unsigned long long admitted;
+    unsigned long long rejected;
+    unsigned int peakWaiting;
+    unsigned long long totalWaitNs;
+    unsigned long long maxWaitNs;
+} JobLimiter;
+
+JobLimiter jobs;
+
+int init_job_limiter(unsigned int limit, unsigned int queueLimit) {
+    memset(&jobs, 0, sizeof (JobLimiter));
+    jobs.lock = CreateLockObject();
+    jobs.freed = CreateConditionVar();
+    jobs.idle = CreateConditionVar();
+    if (jobs.lock == NULL || jobs.freed == NULL || jobs.idle == NULL) return SITH_RET_ERR;
+
+    jobs.limit = limit;
+    jobs.queueLimit = queueLimit;
+    return SITH_RET_OK;
+}
+
+// Returns SITH_RET_ERR with EAGAIN if the queue is full, or with ECANCELED if
+//the request is stopped or its client leaves while queued
+
+int enter_job(ConnectionSocket* peer) {
+    DoLockObject(jobs.lock);
+
+    if (jobs.running >= jobs.limit && jobs.waiting >= jobs.queueLimit) {
+        jobs.rejected++;
+        DoUnlockObject(jobs.lock);
+        errno = EAGAIN;
+        return SITH_RET_ERR;
+    }
+
+    if (jobs.running >= jobs.limit) {
+        unsigned long long start = ReadTimer();
+        jobs.waiting++;
+        if (jobs.waiting > jobs.peakWaiting) jobs.peakWaiting = jobs.waiting;
+        while (jobs.running >= jobs.limit) {
+            if (TaskCancelled() || PeerHasClosed(peer)) {
+                jobs.waiting--;
+                // A slot this waiter was woken for goes to the next one
+                if (jobs.running < jobs.limit) NotifyConditionVariable(jobs.freed);
+                int last = jobs.running == 0 && jobs.waiting == 0;
+                DoUnlockObject(jobs.lock);
+                if (last) BroadcastConditionVariable(jobs.idle);
+                errno = ECANCELED;
+                return SITH_RET_ERR;
+            }
+            TimedWaitConditionVariable(jobs.freed, jobs.lock, SITH_SERV_CANCELPOLLMS);
+            errno = 0;
+        }
+        jobs.waiting--;
+
+        unsigned long long waited = ReadTimer() - start;
+        jobs.totalWaitNs += waited;
+        if (waited > jobs.maxWaitNs) jobs.maxWaitNs = waited;
+    }
+    jobs.running++;
+    jobs.admitted++;
+
+    DoUnlockObject(jobs.lock);
+    return SITH_RET_OK;
+}
+
+void leave_job() {
+    DoLockObject(jobs.lock);
+    jobs.running--;
+    int last = jobs.running == 0 && jobs.waiting == 0;
+    DoUnlockObject(jobs.lock);
+    NotifyConditionVariable(jobs.freed);
+    if (last) BroadcastConditionVariable(jobs.idle);
+}
+
+// Returns SITH_RET_ERR with ETIMEDOUT if jobs are still running by then
+
+int wait_jobs_idle(unsigned long milliseconds) {
+    unsigned long long deadline = ReadTimer() + milliseconds * 1000000ULL;
+
+    DoLockObject(jobs.lock);
+    while (jobs.running != 0 || jobs.waiting != 0) {
+        unsigned long long now = ReadTimer();
+        if (now >= deadline) {
+            DoUnlockObject(jobs.lock);
+            errno = ETIMEDOUT;
+            return SITH_RET_ERR;
+        }
+        TimedWaitConditionVariable(jobs.idle, jobs.lock, (unsigned long) ((deadline - now + 999999) / 1000000));
+        errno = 0;
+    }
+    DoUnlockObject(jobs.lock);
+    return SITH_RET_OK;
+}
+
+void set_job_limits(unsigned int limit, unsigned int queueLimit) {
+    DoLockObject(jobs.lock);
+    jobs.limit = limit;
+    jobs.queueLimit = queueLimit;
+    DoUnlockObject(jobs.lock);
+
+    // A raised limit may admit several waiters at once
+    BroadcastConditionVariable(jobs.freed);
+}
+
+void append_job_stats(HeapString* output) {
+    char line[128];
+
+    DoLockObject(jobs.lock);
+    unsigned long long averageUs = jobs.admitted ? jobs.totalWaitNs / jobs.admitted / 1000 : 0;
+    snprintf(line, 128, "jobs_limit %u\r\njobs_queue_limit %u\r\n", jobs.limit, jobs.queueLimit);
+    HeapStringAppend(output, line);
+    snprintf(line, 128, "jobs_running %u\r\njobs_waiting %u\r\njobs_waiting_peak %u\r\n", jobs.running, jobs.waiting, jobs.peakWaiting);
+    HeapStringAppend(output, line);
+    snprintf(line, 128, "jobs_admitted %llu\r\njobs_rejected %llu\r\n", jobs.admitted, jobs.rejected);
+    HeapStringAppend(output, line);
+    snprintf(line, 128, "jobs_wait_avg_us %llu\r\njobs_wait_max_us %llu\r\n", averageUs, jobs.maxWaitNs / 1000);
+    HeapStringAppend(output, line);
+    DoUnlockObject(jobs.lock);
+}
+
+// Histograms as "<bound>:<count>" pairs, the last bound is open
+
+void append_histogram(HeapString* output, const char* name, const char* kind, unsigned long long* histogram) {
+    char line[128];
+
+    snprintf(line, 128, "pool_%s_%s_hist_us", name, kind);
+    HeapStringAppend(output, line);
+    for (unsigned int bucket = 0; bucket < SITH_POOL_HISTBUCKETS; bucket++) {
+        if (histogram[bucket] == 0) continue;
+        if (bucket == SITH_POOL_HISTBUCKETS - 1) snprintf(line, 128, " inf:%llu", histogram[bucket]);
+        else snprintf(line, 128, " %llu:%llu", GetHistogramBound(bucket), histogram[bucket]);
+        HeapStringAppend(output, line);
+    }
+    HeapStringAppend(output, "\r\n");
+}
+
+void append_pool_stats(HeapString* output, const char* name, ThreadPool* pool) {
+    char line[128];
+    PoolStats stats;
+    KernelStats kernels[SITH_SERV_STATKERNELS];
+
+    if (GetThreadPoolStats(pool, &stats, kernels, SITH_SERV_STATKERNELS)) return;
+
+    snprintf(line, 128, "pool_%s_size %u\r\npool_%s_idle %u\r\n", name, stats.size, name, stats.idle);
+    HeapStringAppend(output, line);
+    snprintf(line, 128, "pool_%s_queued %u\r\npool_%s_queued_peak %u\r\n", name, stats.queued, name, stats.queuePeak);
+    HeapStringAppend(output, line);
+    snprintf(line, 128, "pool_%s_rejected %llu\r\npool_%s_blocked %llu\r\n", name, stats.rejected, name, stats.blocked);
+    HeapStringAppend(output, line);
+    snprintf(line, 128, "pool_%s_tasks %llu\r\npool_%s_busy_ms %llu\r\npool_%s_idle_ms %llu\r\n", name, stats.total.tasks,
+            name, stats.total.busyNanos / 1000000, name, stats.total.idleNanos / 1000000);
+    HeapStringAppend(output, line);
+    append_histogram(output, name, "wait", stats.total.waitHistogram);
+    append_histogram(output, name, "run", stats.total.runHistogram);
+
+    // Utilization per kernel, busy share of its lifetime in percent
+    for (unsigned int slot = 0; slot < stats.kernels && slot < SITH_SERV_STATKERNELS; slot++) {
+        if (!kernels[slot].active) continue;
+        unsigned long long lifetime = kernels[slot].busyNanos + kernels[slot].idleNanos;
+        snprintf(line, 128, "pool_%s_kernel_%u %llu tasks %llu%% busy\r\n", name, slot, kernels[slot].tasks,
+                lifetime ? kernels[slot].busyNanos * 100 / lifetime : 0);
+        HeapStringAppend(output, line);
+    }
+}
+
+void append_acceptor_stats(HeapString* output) {
+    char line[128];
+    snprintf(line, 128, "acceptors %u\r\n", acceptorCount);
+    HeapStringAppend(output, line);
+    for (unsigned int i = 0; i < acceptorCount; i++) {
+        snprintf(line, 128, "acceptor_%u_accepted %llu\r\n", i, acceptors[i].accepted);
+        HeapStringAppend(output, line);
+    }
+    if (localAcceptor.listener != NULL) {
+        snprintf(line, 128, "local_accepted %llu\r\n", localAcceptor.accepted);
+        HeapStringAppend(output, line);
+    }
+}
+
+// The connection pool never shrinks below its configured size, a growth limit
+// under that size disables autoscaling
+
+int set_client_autoscale(unsigned int baseClients, unsigned int growClients) {
+    if (growClients <= baseClients) return SetThreadPoolAutoscale(clients, 0, 0, 0, 0);
+    return SetThreadPoolAutoscale(clients, baseClients, growClients, SITH_SERV_GROWWAITMS, SITH_SERV_SHRINKIDLEMS);
+}
+
+
+//------------------------------------------------------------------------------
+// PATH LOCKS
+//
+// - Every ENCR/DECR holds its plaintext path here for the whole crypto run, so
+//   that an encryption and a decryption of the same file are mutually
+//   exclusive as well; a path is held as long as its entry is in the table
+// - Crypto's own file locks remain as protection against other processes
+
+typedef struct path_lock {
+    char* path;
+    struct path_lock* next;
+} PathLock;
+
+PathLock* pathLocks = NULL;
+LockObject* pathLocksGuard;
+CondVar* pathLocksReleased;
+
+PathLock* find_path(const char* path) {
+    for (PathLock* entry = pathLocks; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Returns SITH_RET_ERR with EBUSY if the path is held and waiting is not allowed,
+//or with ECANCELED if the request is stopped or its client leaves while waiting
+
+int acquire_path(const char* path, int wait, ConnectionSocket* peer) {
+
+    PathLock* entry = calloc(1, sizeof (PathLock));
+    if (entry == NULL) return SITH_RET_ERR;
+    entry->path = calloc(strlen(path) + 1, sizeof (char));
+    if (entry->path == NULL) {
+        free(entry);
+        return SITH_RET_ERR;
+    }
+    memcpy(entry->path, path, strlen(path));
+
+    DoLockObject(pathLocksGuard);
+    while (find_path(path) != NULL) {
+        int cancelled = wait && (TaskCancelled() || PeerHasClosed(peer));
+        if (!wait || cancelled) {
+            DoUnlockObject(pathLocksGuard);
+            free(entry->path);
+            free(entry);
+            errno = cancelled ? ECANCELED : EBUSY;
+            return SITH_RET_ERR;
+        }
+        TimedWaitConditionVariable(pathLocksReleased, pathLocksGuard, SITH_SERV_CANCELPOLLMS);
+        errno = 0;
+    }
+    entry->next = pathLocks;
+    pathLocks = entry;
+    DoUnlockObject(pathLocksGuard);
+
+    return SITH_RET_OK;
+}
+
+void release_path(const char* path) {
+
+    DoLockObject(pathLocksGuard);
+    for (PathLock** link = &pathLocks; *link != NULL; link = &((*link)->next)) {
+        if (strcmp((*link)->path, path) == 0) {
+            PathLock* entry = *link;
+            *link = entry->next;
+            free(entry->path);
+            free(entry);
+            break;
+        }
+    }
+    DoUnlockObject(pathLocksGuard);
+
+    // Waiters may be queued on different paths, wake them all
+    BroadcastConditionVariable(pathLocksReleased);
+}
+
+// Resolves the parent directory, so that all spellings of a path share a key;
+//the file itself may not exist. Without a parent to resolve, the path is only
+//put against the current root, the request then fails on its own
+
+HeapString* build_lock_key(HeapString* path) {
+    const char* raw = HeapStringGetRaw(path);
+    const char* name = strrchr(raw, SITH_NAMESEP);
+#ifdef _WIN32
+    const char* slash = strrchr(raw, '/');
+    if (slash != NULL && (name == NULL || slash > name)) name = slash;
+#endif
+    HeapString* parent = (name == NULL) ? CreateHeapString(".") : CreateHeapStringL((char*) raw, name - raw + 1);
+    if (parent == NULL) return NULL;
+    char* resolved = GetRealPath((char*) HeapStringGetRaw(parent));
+    DisposeHeapString(parent);
+    if (resolved != NULL) {
+        size_t length = strlen(resolved);
+        char separator[2] = {SITH_NAMESEP, '\0'};
+        HeapString* key = CreateHeapString(resolved);
+        int error = (key == NULL);
+        if (!error && length > 0 && resolved[length - 1] != SITH_NAMESEP) error = HeapStringAppend(key, separator);
+        if (!error) error = HeapStringAppend(key, (char*) ((name == NULL) ? raw : name + 1));
+        free(resolved);
+        if (error) {
+            DisposeHeapString(key);
+            return NULL;
+        }
+        return key;
+    }
+
+    HeapString* key = HeapStringClone(path);
+    if (key == NULL) return NULL;
+    if (SITH_ISABSOLUTEPATH(HeapStringGetRaw(key))) return key;
+
+    char cwd[SITH_MAXCH_PATHNAME + 2] = {0};
+    if (GetWorkingDirectory(cwd, SITH_MAXCH_PATHNAME)) {
+        DisposeHeapString(key);
+        return NULL;
+    }
+    cwd[strlen(cwd)] = SITH_NAMESEP;
+    HeapStringPrepend(key, cwd);
+    return key;
 }
 //------------------------------------------------------------------------------
 // ENCODE-DECODE FUNCTION
 
-int EndecFile(char* request, int doEncrypt, ProcessValue* outcome) {
-    if (request == NULL || outcome == NULL) {
+// Crypto is stopped as soon as the client leaves or the server shuts down, it
+// then removes its partial output
+
+int EndecFile(const char* request, int doEncrypt, ConnectionSocket* peer, ProcessValue* outcome) {
+    if (request == NULL || peer == NULL || outcome == NULL) {
         return SITH_ENDECFAIL_INVAL;
     }
 
@@ -187,6 +618,28 @@ int EndecFile(char* request, int doEncrypt, ProcessValue* outcome) {
         HeapStringTruncate(targetPath, SITH_MAXCH_ENCRSFX);
     }
 
+    // Both requests on a file pair are keyed by the plaintext path
+    HeapString* lockKey = build_lock_key(targetPath);
+    if (lockKey == NULL) {
+        HandleErrorStatus("Could not resolve request path");
+        DisposeHeapString(targetPath);
+        DisposeHeapString(sourcePath);
+        DisposeHeapString(seed);
+        return SITH_ENDECFAIL_STR;
+    }
+    if (doEncrypt) HeapStringTruncate(lockKey, SITH_MAXCH_ENCRSFX);
+    if (acquire_path(HeapStringGetRaw(lockKey), queueLocked, peer)) {
+        int busy = (errno == EBUSY);
+        int cancelled = (errno == ECANCELED);
+        if (busy || cancelled) errno = 0;
+        else HandleErrorStatus("Could not register request path");
+        DisposeHeapString(lockKey);
+        DisposeHeapString(targetPath);
+        DisposeHeapString(sourcePath);
+        DisposeHeapString(seed);
+        return busy ? SITH_ENDECFAIL_BUSY : cancelled ? SITH_ENDECFAIL_CANCEL : SITH_ENDECFAIL_NOMEM;
+    }
+
     // Requote
     if (quoted) {
         HeapStringPrepend(targetPath, "\"");
@@ -194,10 +647,40 @@ int EndecFile(char* request, int doEncrypt, ProcessValue* outcome) {
     }
 
 
+    // Wait for a job slot, the path stays held meanwhile
+    if (enter_job(peer)) {
+        int cancelled = (errno == ECANCELED);
+        errno = 0;
+        release_path(HeapStringGetRaw(lockKey));
+        DisposeHeapString(lockKey);
+        DisposeHeapString(targetPath);
+        DisposeHeapString(sourcePath);
+        DisposeHeapString(seed);
+        return cancelled ? SITH_ENDECFAIL_CANCEL : SITH_ENDECFAIL_FULL;
+    }
+
+    // The wait may have been long, see if anyone still wants the result
+    if (TaskCancelled() || PeerHasClosed(peer)) {
+        leave_job();
+        release_path(HeapStringGetRaw(lockKey));
+        DisposeHeapString(lockKey);
+        DisposeHeapString(targetPath);
+        DisposeHeapString(sourcePath);
+        DisposeHeapString(seed);
+        return SITH_ENDECFAIL_CANCEL;
+    }
+
     // Start writing the command line
     char** argv = calloc(5, sizeof (char*));
-    if (argv == NULL)
+    if (argv == NULL) {
+        leave_job();
+        release_path(HeapStringGetRaw(lockKey));
+        DisposeHeapString(lockKey);
+        DisposeHeapString(targetPath);
+        DisposeHeapString(sourcePath);
+        DisposeHeapString(seed);
         return SITH_ENDECFAIL_NOMEM;
+    }
     argv[0] = cryptoPathName;
     argv[1] = HeapStringInner(sourcePath);
     argv[2] = HeapStringInner(targetPath);
@@ -213,15 +696,45 @@ int EndecFile(char* request, int doEncrypt, ProcessValue* outcome) {
     free(argv);
     if (proc == NULL) {
         HandleErrorStatus("Could not launch crypto");
+        leave_job();
+        release_path(HeapStringGetRaw(lockKey));
+        DisposeHeapString(lockKey);
         return SITH_ENDECFAIL_SYS;
     }
 
-    // Wait for crypto to terminate
-    int error = WaitForProcObject(proc, outcome);
+    // Wait for crypto to terminate, checking on the client meanwhile
+    int stopped = 0;
+    int error;
+    while ((error = TimedWaitForProcObject(proc, outcome, SITH_SERV_CANCELPOLLMS)) && errno == ETIMEDOUT) {
+        errno = 0;
+        if (stopped || !(TaskCancelled() || PeerHasClosed(peer))) continue;
+
+        if (StopProcObject(proc)) {
+            HandleErrorStatus("Could not stop crypto");
+        }
+        stopped = 1;
+    }
+
+#ifdef _WIN32
+    // Terminated before it could clean up, the path is still ours
+    if (!error && stopped && *outcome == STATUS_CONTROL_C_EXIT) {
+        if (doEncrypt) HeapStringAppend(lockKey, SITH_ENCRSFX);
+        if (DeleteFilePath(HeapStringGetRaw(lockKey))) HandleErrorStatus("Could not delete partial target file");
+        if (doEncrypt) HeapStringTruncate(lockKey, SITH_MAXCH_ENCRSFX);
+        *outcome = SITH_FAILCRYPTO_CANCEL;
+    }
+#endif
+
+    leave_job();
+    release_path(HeapStringGetRaw(lockKey));
+    DisposeHeapString(lockKey);
     if (error) {
         HandleErrorStatus("Error waiting for crypto");
         return SITH_ENDECFAIL_SYS;
     }
+    if (stopped && *outcome == SITH_FAILCRYPTO_CANCEL) {
+        return SITH_ENDECFAIL_CANCEL;
+    }
     
     return 0;
 }
@@ -230,11 +743,550 @@ int EndecFile(char* request, int doEncrypt, ProcessValue* outcome) {
 //------------------------------------------------------------------------------
 // CLIENT CONNECTION TASK
 
-typedef SITH_TASKARG struct {
+// What a request is answered with: a single message, or a long message body
+//between its markers, owned by the reply until sent
+
+typedef struct {
+    const char* status;
+    HeapString* body;
+    // Length framing starts right after this reply
+    int switchFraming;
+    // A part of a streamed listing, past its opening marker or short of its
+    //closing one; a listing its kernel streamed itself leaves nothing to send
+    int continued;
+    int unfinished;
+    int sent;
+} Reply;
+
+typedef SITH_TASKARG struct sith_conn_task {
     ConnectionSocket* peerSocket;
     char* peerAddress;
+    // Child of the shutdown token, carried by the connection task
+    CancelToken* cancel;
+
+    // Requests running apart from the connection's reader, counted under the
+    //lock in threaded mode, where settled is signalled as requests finish
+    unsigned int running;
+    LockObject* lock;
+    CondVar* settled;
+    // Threaded mode only: held while queueing a reply or a listing batch, and
+    //signalled as a streamed listing gives the output up
+    LockObject* replying;
+    CondVar* streamed;
+
+    // Event loop only: replies referenced by the output queue until flushed,
+    //writing while they are, closing once the client is gone but requests
+    //still run
+    struct sith_pending* sent;
+    int writing;
+    int closing;
+    unsigned int watching;
+    // The streamed listing owning the output, and the replies held back until
+    //it is over, in the order they completed; under replying in threaded mode
+    struct sith_pending* stream;
+    struct sith_pending* deferred;
+    // Event loop only: all connections, swept for deadlines; a dropped one is
+    //moved to the dropped list, and freed once the events at hand are handled
+    struct sith_conn_task* previous;
+    struct sith_conn_task* next;
+    int dropped;
 } ConnTaskArg;
 
+// A request with its reply, and its ID for clients using length framing; the
+//request is copied when it runs apart from the connection's reader
+
+typedef SITH_TASKARG struct sith_pending {
+    ConnTaskArg* conn;
+    unsigned int id;
+    char* request;
+    size_t requestLength;
+    Reply reply;
+    struct sith_pending* next;
+
+    // Event loop only, a listing streamed by its kernel: the parts handed over
+    //and not yet taken, up to SITH_SERV_STREAMPARTS, whether the walk is over,
+    //the request is on the completed list, or its client is gone; guarded by
+    //completedLock
+    struct sith_pending* parts;
+    struct sith_pending* lastPart;
+    unsigned int partCount;
+    int streaming;
+    int finished;
+    int announced;
+    int abandoned;
+    // Held back behind another stream, see the connection's deferred list
+    int held;
+    struct sith_pending* behind;
+} PendingRequest;
+
+void release_connection(ConnTaskArg* connInfo) {
+    CloseConnection(connInfo->peerSocket);
+    free(connInfo->peerAddress);
+    DestroyCancelToken(connInfo->cancel);
+    if (connInfo->lock != NULL) DestroyLockObject(connInfo->lock);
+    if (connInfo->settled != NULL) DestroyConditionVar(connInfo->settled);
+    if (connInfo->replying != NULL) DestroyLockObject(connInfo->replying);
+    if (connInfo->streamed != NULL) DestroyConditionVar(connInfo->streamed);
+    free(connInfo);
+}
+
+// Wraps an accepted connection, on failure the client is told and let go
+
+ConnTaskArg* create_connection(ConnectionSocket* peer) {
+    ConnTaskArg* connArg = calloc(1, sizeof (ConnTaskArg));
+    if (connArg == NULL) {
+        HandleErrorStatus("Could not allocate connection info");
+        SendToPeer(peer, SITH_PROTO_FAILURE);
+        CloseConnection(peer);
+        return NULL;
+    }
+
+    // Set peer address
+    GetPeerFullAddress(peer, &(connArg->peerAddress));
+    if (connArg->peerAddress == NULL) {
+        HandleErrorStatus("Could not get peer address");
+        SendToPeer(peer, SITH_PROTO_FAILURE);
+        free(connArg);
+        CloseConnection(peer);
+        return NULL;
+    }
+
+    connArg->peerSocket = peer;
+    SetPeerTimeouts(peer, idleTimeout * 1000UL, messageTimeout * 1000UL);
+    SetPeerSendTimeout(peer, messageTimeout * 1000UL);
+    connArg->cancel = CreateCancelToken(shutdownToken);
+    if (connArg->cancel == NULL) {
+        HandleErrorStatus("Could not allocate connection info");
+        SendToPeer(peer, SITH_PROTO_FAILURE);
+        release_connection(connArg);
+        return NULL;
+    }
+
+    // The event loop thread alone handles its connections
+    if (!eventLoop) {
+        connArg->lock = CreateLockObject();
+        connArg->settled = CreateConditionVar();
+        connArg->replying = CreateLockObject();
+        connArg->streamed = CreateConditionVar();
+        if (connArg->lock == NULL || connArg->settled == NULL || connArg->replying == NULL || connArg->streamed == NULL) {
+            HandleErrorStatus("Could not allocate connection info");
+            SendToPeer(peer, SITH_PROTO_FAILURE);
+            release_connection(connArg);
+            return NULL;
+        }
+    }
+    return connArg;
+}
+
+// The request is copied if given, otherwise the caller serves it from its view
+
+PendingRequest* create_pending(ConnTaskArg* conn, unsigned int id, const char* request, size_t requestLength) {
+    PendingRequest* pending = calloc(1, sizeof (PendingRequest));
+    if (pending == NULL) return NULL;
+
+    if (request != NULL) {
+        pending->request = malloc(requestLength + 1);
+        if (pending->request == NULL) {
+            free(pending);
+            return NULL;
+        }
+        memcpy(pending->request, request, requestLength + 1);
+    }
+    pending->conn = conn;
+    pending->id = id;
+    pending->requestLength = requestLength;
+    return pending;
+}
+
+void append_loop_stats(HeapString* output);
+int hand_part(void* context, const char* lines, size_t length);
+void hold_reply(ConnTaskArg* conn, PendingRequest* pending);
+int queue_reply(ConnTaskArg* conn, Reply* reply, unsigned int id);
+void dispose_pending(PendingRequest* pending);
+
+// Threaded mode: sends the reply, or holds it back for the listing owning the
+//output to send once over; returns SITH_RET_ERR if it could not be queued. A
+//lost client is noticed by the reader
+
+int send_reply(ConnTaskArg* conn, Reply* reply, unsigned int id) {
+    int error = SITH_RET_OK;
+    DoLockObject(conn->replying);
+    if (conn->stream != NULL && !reply->sent) {
+        // The body moves over to the copy
+        PendingRequest* held = create_pending(conn, id, NULL, 0);
+        if (held != NULL) {
+            held->reply = *reply;
+            reply->body = NULL;
+            hold_reply(conn, held);
+        }
+        else {
+            error = SITH_RET_ERR;
+        }
+    }
+    else {
+        error = queue_reply(conn, reply, id);
+        FlushPeer(conn->peerSocket);
+    }
+    DoUnlockObject(conn->replying);
+    return error;
+}
+
+// Threaded mode, under the reply lock: the listing gives the output up, the
+//replies held behind it follow
+
+void end_stream(ConnTaskArg* conn) {
+    conn->stream = NULL;
+    while (conn->deferred != NULL) {
+        PendingRequest* held = conn->deferred;
+        conn->deferred = held->behind;
+        if (queue_reply(conn, &(held->reply), held->id) == SITH_RET_OK) FlushPeer(conn->peerSocket);
+        dispose_pending(held);
+    }
+    BroadcastConditionVariable(conn->streamed);
+}
+
+// Threaded mode: sends each batch as it comes, under the reply lock for that
+//batch only; the listing owns the output from its first batch on, so another
+//one waits meanwhile. A client taking nothing fails the flush past the send
+//deadline, which stops the walk
+
+int send_part(void* context, const char* lines, size_t length) {
+    PendingRequest* pending = (PendingRequest*) context;
+    ConnTaskArg* conn = pending->conn;
+    ConnectionSocket* peer = conn->peerSocket;
+    int cancelled;
+    int error = SITH_RET_OK;
+
+    DoLockObject(conn->replying);
+    while (!(cancelled = TaskCancelled()) && conn->stream != NULL && conn->stream != pending) {
+        TimedWaitConditionVariable(conn->streamed, conn->replying, SITH_SERV_CANCELPOLLMS);
+    }
+    if (!cancelled && !pending->reply.continued) {
+        conn->stream = pending;
+        pending->reply.continued = 1;
+        error = QueueTaggedToPeer(peer, pending->id, SITH_PROTO_MOREOUT, SITH_MAXCH_PROTORESP);
+    }
+    if (!cancelled && !error) error = QueueTaggedToPeer(peer, pending->id, lines, length);
+    if (!cancelled && !error) error = FlushPeer(peer);
+    DoUnlockObject(conn->replying);
+    return (cancelled || error) ? SITH_RET_ERR : SITH_RET_OK;
+}
+
+// Sends the listing while the directory is walked, so that neither memory nor
+//the wait for the first entries grows with the tree; in the event loop the
+//kernel hands it over to the loop part by part. A listing that could not start
+//is answered with a failure instead
+
+void stream_listing(PendingRequest* pending, int recursive) {
+    ConnTaskArg* conn = pending->conn;
+    Reply* reply = &(pending->reply);
+    SithWalker* walk = InitWalker(".");
+    if (walk == NULL) {
+        reply->status = SITH_PROTO_FAILURE;
+        return;
+    }
+
+    WalkSink sink = eventLoop ? hand_part : send_part;
+    if (recursive) WalkInDirParallelStreamed(walk, sink, pending, walkers);
+    else WalkInDirStreamed(walk, sink, pending);
+    DisposeWalker(walk);
+
+    if (eventLoop) {
+        if (!pending->streaming) reply->status = SITH_PROTO_FAILURE;
+        return;
+    }
+    if (reply->continued) {
+        // A lost client is noticed by the reader
+        DoLockObject(conn->replying);
+        if (QueueTaggedToPeer(conn->peerSocket, pending->id, SITH_PROTO_MOREEND, SITH_MAXCH_PROTORESP) == SITH_RET_OK) FlushPeer(conn->peerSocket);
+        reply->sent = 1;
+        end_stream(conn);
+        DoUnlockObject(conn->replying);
+    }
+    else {
+        reply->status = SITH_PROTO_FAILURE;
+    }
+}
+
+// Runs a request to completion, which may take long; the reply is left to the
+//caller to send, unless it was streamed
+
+void serve_request(PendingRequest* pending, const char* request, size_t requestLength) {
+    ConnTaskArg* conn = pending->conn;
+    Reply* reply = &(pending->reply);
+    ProcessValue ret = 0;
+    int isEncryptionRequest = 0;
+    memset(reply, 0, sizeof (Reply));
+
+    // Too short for any command, comparisons would run past the message
+    if (requestLength < SITH_MAXCH_PROTOCMD) {
+        printf("[%s] Malformed request\n", conn->peerAddress);
+        reply->status = SITH_PROTO_INVALID;
+    }
+        // Directory listing option
+    else if (CLIENT_REQUEST(request, SITH_PROTO_LIST)) {
+        stream_listing(pending, 0);
+    }
+
+        // Recursive listing option
+    else if (CLIENT_REQUEST(request, SITH_PROTO_LISTREC)) {
+        stream_listing(pending, 1);
+    }
+        // Load report option
+    else if (CLIENT_REQUEST(request, SITH_PROTO_STATUS)) {
+        HeapString* output = CreateHeapString("");
+        if (output == NULL) {
+            reply->status = SITH_PROTO_FAILURE;
+            return;
+        }
+        append_job_stats(output);
+        append_pool_stats(output, "clients", clients);
+        append_pool_stats(output, "walkers", walkers);
+        if (requests != NULL) append_pool_stats(output, "requests", requests);
+        append_acceptor_stats(output);
+        if (eventLoop) append_loop_stats(output);
+        reply->body = output;
+    }
+        // Framing negotiation, the reply is the last legacy message
+    else if (CLIENT_REQUEST(request, SITH_PROTO_FRAMING)) {
+        if (GetPeerFraming(conn->peerSocket) == framing_length) {
+            reply->status = SITH_PROTO_SUCCESS"Length framing already in use";
+        }
+        else {
+            reply->status = SITH_PROTO_SUCCESS"Switching to length framing";
+            reply->switchFraming = 1;
+        }
+    }
+        // Encrypt-Decrypt file option
+    else if ((isEncryptionRequest = CLIENT_REQUEST(request, SITH_PROTO_ENCRYPT)) || CLIENT_REQUEST(request, SITH_PROTO_DECRYPT)) {
+
+        // Call the worker function and send a response accordingly
+        switch (EndecFile(request + SITH_MAXCH_PROTOCMD, isEncryptionRequest, conn->peerSocket, &ret)) {
+            case 0:
+                // Process returned, read exit code
+                switch (ret) {
+                    case 0:
+                        // File has been correctly encrypted
+                        reply->status = SITH_PROTO_SUCCESS"OK";
+                        break;
+                    case SITH_FAILCRYPTO_404:
+                        // Encountered error while handling files
+                        reply->status = SITH_PROTO_INVALID"File not found";
+                        break;
+                    case SITH_FAILCRYPTO_SEED:
+                        // Invalid seed
+                        reply->status = SITH_PROTO_INVALID"Seed is malformed";
+                        break;
+                    case SITH_FAILCRYPTO_ARG:
+                        // Bad argument count
+                        reply->status = SITH_PROTO_INVALID"Wrong number of arguments";
+                        break;
+                    case SITH_FAILCRYPTO_NOTREG:
+                        // Invalid pathname
+                        reply->status = SITH_PROTO_INVALID"Path does not denote a regular file";
+                        break;
+                    case SITH_FAILCRYPTO_LOCKED:
+                        // Source file is locked
+                        reply->status = SITH_PROTO_FAILURE"This file is currently locked, try again later.";
+                        break;
+                    case SITH_FAILCRYPTO_FILE:
+                        // File error
+                        reply->status = SITH_PROTO_FAILURE"File error";
+                        break;
+                    case SITH_FAILCRYPTO_ENDEC:
+                        // File partially encrypted
+                        reply->status = SITH_PROTO_FAILURE"File has been partially encrypted";
+                        break;
+                    case SITH_FAILCRYPTO_RELEASE:
+                        reply->status = SITH_PROTO_FAILURE"Error while releasing resources";
+                        break;
+                    case SITH_FAILCRYPTO_NOMEM:
+                        reply->status = SITH_PROTO_FAILURE"Not enough memory for encryption";
+                        break;
+                    case SITH_FAILCRYPTO_CANCEL:
+                        // Stopped from outside the server
+                        reply->status = SITH_PROTO_FAILURE"Encryption was stopped, file left unchanged";
+                        break;
+                    default:
+                        printf("Unexpected return code from crypto: %"SITH_STRFMT_PROCVALUE"\n", ret);
+                        reply->status = SITH_PROTO_FAILURE"Unexpected error in encryption";
+                        break;
+                }
+                break;
+            case SITH_ENDECFAIL_INVAL:
+            case SITH_ENDECFAIL_STR:
+                // Command is malformed
+                reply->status = SITH_PROTO_INVALID"The received parameters are malformed";
+                break;
+            case SITH_ENDECFAIL_FULL:
+                reply->status = SITH_PROTO_SERVBUSY"Too many encryption jobs in progress, try again later";
+                break;
+            case SITH_ENDECFAIL_BUSY:
+                // Another request holds the file, do not wait for it
+                reply->status = SITH_PROTO_SERVBUSY"File is being processed by another request, try again later";
+                break;
+            case SITH_ENDECFAIL_CANCEL:
+                // The client is most likely gone, unless we are shutting down
+                printf("[%s] Request cancelled, file left unchanged\n", conn->peerAddress);
+                reply->status = SITH_PROTO_SERVBUSY"Request cancelled, server is shutting down";
+                break;
+            case SITH_ENDECFAIL_SYS:
+            case SITH_ENDECFAIL_NOMEM:
+                // Internal failure (pool saturated) (transient)
+                reply->status = SITH_PROTO_FAILURE"Not enough memory for encryption task scheduling";
+                break;
+            default:
+                reply->status = SITH_PROTO_FAILURE"Unexpected error";
+        }
+    }
+
+        // Message unrecognized
+    else {
+        printf("[%s] Malformed request\n", conn->peerAddress);
+        reply->status = SITH_PROTO_INVALID;
+    }
+}
+
+// Queues a reply on the connection, the body must outlive the flush; a body
+//that cannot be queued still leaves the markers balanced
+
+int queue_reply(ConnTaskArg* conn, Reply* reply, unsigned int id) {
+    ConnectionSocket* peer = conn->peerSocket;
+
+    if (reply->sent) return SITH_RET_OK;
+    if (reply->body != NULL || reply->continued) {
+        if (!reply->continued && QueueTaggedToPeer(peer, id, SITH_PROTO_MOREOUT, SITH_MAXCH_PROTORESP) == SITH_RET_ERR) return SITH_RET_ERR;
+        if (reply->body != NULL) QueueTaggedToPeer(peer, id, HeapStringGetRaw(reply->body), HeapStringLength(reply->body));
+        if (reply->unfinished) return SITH_RET_OK;
+        return QueueTaggedToPeer(peer, id, SITH_PROTO_MOREEND, SITH_MAXCH_PROTORESP);
+    }
+
+    if (QueueTaggedToPeer(peer, id, reply->status, strlen(reply->status)) == SITH_RET_ERR) return SITH_RET_ERR;
+    if (reply->switchFraming && SetPeerFraming(peer, framing_length) == SITH_RET_ERR) {
+        // Client pipelined past the switch, the stream cannot be resynchronized
+        fprintf(stderr, "[%s] ", conn->peerAddress);
+        HandleErrorStatus("Could not switch framing");
+        return SITH_RET_ERR;
+    }
+    return SITH_RET_OK;
+}
+
+void dispose_reply(Reply* reply) {
+    if (reply->body != NULL) DisposeHeapString(reply->body);
+    reply->body = NULL;
+}
+
+void dispose_pending(PendingRequest* pending) {
+    dispose_reply(&(pending->reply));
+    free(pending->request);
+    free(pending);
+}
+
+int request_blocks(const char* request, size_t requestLength) {
+    if (requestLength < SITH_MAXCH_PROTOCMD) return 0;
+    return CLIENT_REQUEST(request, SITH_PROTO_LIST) || CLIENT_REQUEST(request, SITH_PROTO_LISTREC) ||
+            CLIENT_REQUEST(request, SITH_PROTO_ENCRYPT) || CLIENT_REQUEST(request, SITH_PROTO_DECRYPT);
+}
+
+// Framed requests carry the ID their reply is tagged with, legacy ones have
+//none and are answered in order
+
+int receive_request(ConnTaskArg* conn, const char** request, size_t* requestLength, unsigned int* id) {
+    *id = 0;
+    if (GetPeerFraming(conn->peerSocket) == framing_length) {
+        return ReceiveFrame(conn->peerSocket, NULL, id, request, requestLength);
+    }
+    return ReceiveViewFromPeer(conn->peerSocket, request, requestLength);
+}
+
+unsigned int pipeline_limit(ConnTaskArg* conn) {
+    return (GetPeerFraming(conn->peerSocket) == framing_length) ? maxPipelined : 1;
+}
+
+SITH_TASKBODY int pipelinedTask(void* arg) {
+    PendingRequest* pending = (PendingRequest*) arg;
+    ConnTaskArg* conn = pending->conn;
+
+    serve_request(pending, pending->request, pending->requestLength);
+    send_reply(conn, &(pending->reply), pending->id);
+    dispose_pending(pending);
+
+    DoLockObject(conn->lock);
+    conn->running--;
+    BroadcastConditionVariable(conn->settled);
+    DoUnlockObject(conn->lock);
+    return 0;
+}
+
+// Waits for a free slot, then runs the request on its own kernel
+
+int pipeline_request(ConnTaskArg* conn, unsigned int id, const char* request, size_t requestLength) {
+    PendingRequest* pending = create_pending(conn, id, request, requestLength);
+    if (pending == NULL) return SITH_RET_ERR;
+
+    DoLockObject(conn->lock);
+    while (conn->running >= maxPipelined) WaitConditionVariable(conn->settled, conn->lock);
+    conn->running++;
+    DoUnlockObject(conn->lock);
+
+    if (ScheduleCancellableTask(requests, pipelinedTask, pending, 0, conn->cancel)) {
+        DoLockObject(conn->lock);
+        conn->running--;
+        DoUnlockObject(conn->lock);
+        dispose_pending(pending);
+        return SITH_RET_ERR;
+    }
+    return SITH_RET_OK;
+}
+
+// Tells the client why it is let go before the connection closes; best effort,
+//as the client may well be gone already
+
+void time_out(ConnTaskArg* conn) {
+    const char* status = PeerIsIdle(conn->peerSocket) ?
+            SITH_PROTO_TIMEDOUT"Connection idle for too long, closing" :
+            SITH_PROTO_TIMEDOUT"Request not received in time, closing";
+    printf("[%s] %s\n", conn->peerAddress, status + SITH_MAXCH_PROTORESP);
+    fflush(stdout);
+
+    // In threaded mode, an open listing sends it once over
+    if (conn->replying != NULL) {
+        Reply reply = {0};
+        reply.status = status;
+        send_reply(conn, &reply, 0);
+    }
+    else if (QueueTaggedToPeer(conn->peerSocket, 0, status, strlen(status)) == SITH_RET_OK) {
+        FlushPeer(conn->peerSocket);
+    }
+    errno = 0;
+}
+
+// An idle client waiting on pipelined requests keeps its connection, the idle
+//clock restarts once they are all answered; returns 0 if none were running
+
+int await_requests(ConnTaskArg* conn) {
+    if (!PeerIsIdle(conn->peerSocket)) return 0;
+
+    DoLockObject(conn->lock);
+    int waited = (conn->running > 0);
+    while (conn->running > 0) WaitConditionVariable(conn->settled, conn->lock);
+    DoUnlockObject(conn->lock);
+
+    if (waited) SetPeerTimeouts(conn->peerSocket, idleTimeout * 1000UL, messageTimeout * 1000UL);
+    return waited;
+}
+
+// Running requests are stopped once their client is gone, the connection
+//outlives them
+
+void settle_connection(ConnTaskArg* conn) {
+    DoLockObject(conn->lock);
+    if (conn->running > 0) RequestCancel(conn->cancel);
+    while (conn->running > 0) WaitConditionVariable(conn->settled, conn->lock);
+    DoUnlockObject(conn->lock);
+    release_connection(conn);
+}
+
 SITH_TASKBODY int clientTask(void* arg) {
     ConnTaskArg* connInfo = (ConnTaskArg*) arg;
 
@@ -247,168 +1299,666 @@ SITH_TASKBODY int clientTask(void* arg) {
     printf("Accepted connection from %s\n", connInfo->peerAddress);
     fflush(stdout);
     // Error status is set here
-    char* request;
-    ProcessValue ret = 0;
-    int isEncryptionRequest = 0;
-    while (1) switch (ReceiveFromPeer(connInfo->peerSocket, &request)) {
+    // Lent by the connection, valid until the next receive
+    const char* request;
+    size_t requestLength;
+    unsigned int id;
+    PendingRequest served;
+    Reply* reply = &(served.reply);
+    while (1) switch (receive_request(connInfo, &request, &requestLength, &id)) {
 
             case -1: // Socket failure
+                if (errno == ETIMEDOUT) {
+                    errno = 0;
+                    if (await_requests(connInfo)) continue;
+
+                    time_out(connInfo);
+                    settle_connection(connInfo);
+                    return 0;
+                }
                 fprintf(stderr, "[%s] ", connInfo->peerAddress);
                 HandleErrorStatus("Connection lost");
 
-                CloseConnection(connInfo->peerSocket);
-                free(connInfo->peerAddress);
-                free(connInfo);
-                return 0;
+                settle_connection(connInfo);
+                return 0;
+
+            case 0: // Socket closed
+                printf("[%s] Client closed the connection.\n", connInfo->peerAddress);
+                fflush(stdout);
+
+                settle_connection(connInfo);
+                return 0;
+
+            default: // We actually got a message
+                printf("[%s] Message received: %s\n", connInfo->peerAddress, request);
+
+                // Framed clients may keep several long requests running
+                memset(&served, 0, sizeof (PendingRequest));
+                served.conn = connInfo;
+                served.id = id;
+                if (pipeline_limit(connInfo) > 1 && request_blocks(request, requestLength)) {
+                    if (pipeline_request(connInfo, id, request, requestLength) == SITH_RET_OK) break;
+
+                    if (errno == EAGAIN) errno = 0;
+                    else HandleErrorStatus("Could not hand request over");
+                    reply->status = SITH_PROTO_SERVBUSY"Too many requests in progress, try again later";
+                }
+                else {
+                    serve_request(&served, request, requestLength);
+                }
+
+                int error = send_reply(connInfo, reply, id);
+                dispose_reply(reply);
+                if (error) {
+                    settle_connection(connInfo);
+                    return 0;
+                }
+        }
+
+    //We should never get here, but just in case...
+    settle_connection(connInfo);
+    return -1;
+}
+
+
+//------------------------------------------------------------------------------
+// LISTENER THREAD BODY
+
+// Opens one listener shard per acceptor where the system balances connections
+//across shards, and a single listener otherwise
+
+int open_acceptors(const char* address, unsigned short port, int backlog, unsigned int count) {
+    acceptors = calloc(count, sizeof (Acceptor));
+    if (acceptors == NULL) return SITH_RET_ERR;
+
+    if (count > 1) {
+        for (acceptorCount = 0; acceptorCount < count; acceptorCount++) {
+            acceptors[acceptorCount].listener = CreateServerShard(address, port, backlog);
+            if (acceptors[acceptorCount].listener == NULL) break;
+        }
+        if (acceptorCount == count) return SITH_RET_OK;
+
+        ErrorCode c = GetErrorCode();
+        while (acceptorCount > 0) CloseListener(acceptors[--acceptorCount].listener);
+        SetErrorCode(c);
+        if (errno != ENOSYS) return SITH_RET_ERR;
+
+        errno = 0;
+        printf("Listener shards not available on this platform, accepting on one thread\n");
+    }
+
+    acceptors->listener = CreateServerSocket(address, port, backlog);
+    if (acceptors->listener == NULL) return SITH_RET_ERR;
+    acceptorCount = 1;
+    return SITH_RET_OK;
+}
+
+ThreadValue SITH_THREAD_CALLCONV listenerBody(void* arg) {
+
+    Acceptor* acceptor = (Acceptor*) arg;
+    ownAcceptor = acceptor;
+
+#ifdef __unix__
+    // Leave only SIGUSR1 open for address updates
+    sigset_t usr1Mask;
+    sigfillset(&usr1Mask);
+    sigdelset(&usr1Mask, SIGUSR1);
+    pthread_sigmask(SIG_SETMASK, &usr1Mask, NULL);
+#endif
+
+    if (acceptor == acceptors) {
+        printf("Server is listening...\n");
+        fflush(stdout);
+    }
+
+    // Listening loop
+    int error;
+    ConnectionSocket* peer;
+    while (1) {
+#ifdef __unix__
+        // Log an eventual address change
+        if (acceptor->changed) {
+
+            if (acceptor->failed) {
+                HandleErrorStatus("Server failed updating\n");
+                exit(EXIT_FAILURE);
+            }
+            if (acceptor == acceptors) printf("Server has changed address\n");
+            acceptor->changed = 0;
+        }
+#endif
+
+        // Accept connection
+        peer = AcceptFromClient(acceptor->listener);
+        if (peer == NULL) {
+#ifdef __unix__
+            // Do check if we got interrupted by a SIGUSR1
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+#endif
+            HandleErrorStatus("Failed accepting connection");
+            continue;
+        }
+        acceptor->accepted++;
+
+        // Create connection info
+        ConnTaskArg* connArg = create_connection(peer);
+        if (connArg == NULL) continue;
+
+        // Start communication loop with client
+
+        error = ScheduleCancellableTask(clients, clientTask, connArg, 0, connArg->cancel);
+        if (error) {
+            HandleErrorStatus("Connection aborted");
+            SendToPeer(peer, SITH_PROTO_SERVBUSY);
+            release_connection(connArg);
+            continue;
+        }
+    }
+
+    // No breaks expected in listening loop
+    CloseListener(acceptor->listener);
+    return SITH_RV_ONE;
+}
+
+
+//------------------------------------------------------------------------------
+// EVENT LOOP
+//
+// - Replaces the listener threads when enabled: a single thread watches one
+//   listener and all connections, and answers cheap requests itself, so that
+//   idle clients cost no pool kernel
+// - Listings and encryptions are handed to the connection pool, and their
+//   replies come back to the loop through the completed list; a legacy client
+//   is not read from meanwhile, a framed one until it has max_pipelined
+//   requests running
+// - A reply that does not fit the socket is flushed as the socket drains, no
+//   further request is read meanwhile; a client taking none of it for the
+//   message timeout is let go, along with the listing it holds back
+// - Listings are streamed: the kernel serving the listing hands batches over
+//   as they fill, and waits while SITH_SERV_STREAMPARTS of them are not yet
+//   taken; the loop takes one only once the socket has drained the previous
+//   one, and holds other replies back until the listing is over
+// - Deadlines are checked by sweeping all connections every SITH_SERV_SWEEPMS,
+//   so that a connection may outlive its own by that much
+
+Poller* poller;
+LockObject* completedLock;
+PendingRequest* completed = NULL;
+// Signalled as the loop takes listing parts, or gives up on a listing
+CondVar* partTaken;
+
+// Loop thread only
+unsigned int loopConnections = 0;
+ConnTaskArg* loopList = NULL;
+// Events already waited for may still name these
+ConnTaskArg* droppedList = NULL;
+
+#define SITH_LOOP_LISTENERTAG ((void*) &acceptors)
+#define SITH_LOOP_LOCALTAG ((void*) &localAcceptor)
+
+void append_loop_stats(HeapString* output) {
+    char line[128];
+    snprintf(line, 128, "loop_connections %u\r\n", loopConnections);
+    HeapStringAppend(output, line);
+}
+
+// Puts the request on the completed list unless it is there already; the
+//caller holds completedLock, and wakes the loop if told to
+
+int announce_request(PendingRequest* pending) {
+    if (pending->announced) return 0;
+    pending->announced = 1;
+    pending->next = completed;
+    completed = pending;
+    return 1;
+}
+
+// Listing kernels only: the batch is copied into a part of its own, to be
+//freed once flushed
+
+int hand_part(void* context, const char* lines, size_t length) {
+    PendingRequest* pending = (PendingRequest*) context;
+    (void) length;
+
+    PendingRequest* part = create_pending(pending->conn, pending->id, NULL, 0);
+    if (part == NULL) return SITH_RET_ERR;
+    part->reply.body = CreateHeapString(lines);
+    if (part->reply.body == NULL) {
+        dispose_pending(part);
+        return SITH_RET_ERR;
+    }
+
+    DoLockObject(completedLock);
+    while (pending->partCount >= SITH_SERV_STREAMPARTS && !pending->abandoned) {
+        WaitConditionVariable(partTaken, completedLock);
+    }
+    if (pending->abandoned) {
+        DoUnlockObject(completedLock);
+        dispose_pending(part);
+        return SITH_RET_ERR;
+    }
+    if (pending->lastPart != NULL) pending->lastPart->next = part;
+    else pending->parts = part;
+    pending->lastPart = part;
+    pending->partCount++;
+    pending->streaming = 1;
+    int wake = announce_request(pending);
+    DoUnlockObject(completedLock);
+
+    if (wake && WakePoller(poller)) HandleErrorStatus("Could not wake the event loop");
+    return SITH_RET_OK;
+}
+
+SITH_TASKBODY int requestTask(void* arg) {
+    PendingRequest* pending = (PendingRequest*) arg;
+
+    serve_request(pending, pending->request, pending->requestLength);
+
+    // Hand the reply back, or tell that the listing is over
+    DoLockObject(completedLock);
+    pending->finished = 1;
+    int wake = announce_request(pending);
+    DoUnlockObject(completedLock);
+    if (wake && WakePoller(poller)) HandleErrorStatus("Could not wake the event loop");
+    return 0;
+}
+
+int watch_connection(ConnTaskArg* conn, unsigned int interest) {
+    if (conn->watching == interest) return SITH_RET_OK;
+
+    int error = interest ? WatchPeer(poller, conn->peerSocket, interest, conn) : UnwatchPeer(poller, conn->peerSocket);
+    if (error == SITH_RET_OK) conn->watching = interest;
+    return error;
+}
+
+// Reads while more requests may start, writes while replies wait for the
+//socket; legacy clients get one request at a time, answered in order
+
+int update_interest(ConnTaskArg* conn) {
+    unsigned int interest = 0;
+    if (conn->writing) interest = ready_write;
+    else if (!conn->closing && conn->stream == NULL && conn->running < pipeline_limit(conn)) interest = ready_read;
+    return watch_connection(conn, interest);
+}
+
+void dispose_sent(ConnTaskArg* conn) {
+    while (conn->sent != NULL) {
+        PendingRequest* pending = conn->sent;
+        conn->sent = pending->next;
+        dispose_pending(pending);
+    }
+}
+
+// Gives up on a listing whose client is gone, its kernel stops at the next
+//batch; returns 1 if the kernel is done with it already
+
+int abandon_stream(PendingRequest* stream) {
+    DoLockObject(completedLock);
+    PendingRequest* parts = stream->parts;
+    stream->parts = stream->lastPart = NULL;
+    stream->partCount = 0;
+    stream->abandoned = 1;
+    int done = stream->finished && !stream->announced;
+    BroadcastConditionVariable(partTaken);
+    DoUnlockObject(completedLock);
+
+    while (parts != NULL) {
+        PendingRequest* part = parts;
+        parts = part->next;
+        dispose_pending(part);
+    }
+    return done;
+}
+
+// Streams still walking come back through the completed list once their
+//kernels notice
+
+void release_streams(ConnTaskArg* conn) {
+    PendingRequest* stream = conn->stream;
+    conn->stream = NULL;
+    if (stream != NULL && abandon_stream(stream)) {
+        conn->running--;
+        dispose_pending(stream);
+    }
+    while (conn->deferred != NULL) {
+        PendingRequest* held = conn->deferred;
+        conn->deferred = held->behind;
+        if (!held->streaming) {
+            dispose_pending(held);
+        }
+        else if (abandon_stream(held)) {
+            conn->running--;
+            dispose_pending(held);
+        }
+    }
+}
+
+void drop_connection(ConnTaskArg* conn) {
+    if (conn->previous != NULL) conn->previous->next = conn->next;
+    else loopList = conn->next;
+    if (conn->next != NULL) conn->next->previous = conn->previous;
+
+    UnwatchPeer(poller, conn->peerSocket);
+    dispose_sent(conn);
+    conn->dropped = 1;
+    conn->next = droppedList;
+    droppedList = conn;
+    loopConnections--;
+}
+
+void release_dropped() {
+    while (droppedList != NULL) {
+        ConnTaskArg* conn = droppedList;
+        droppedList = conn->next;
+        release_connection(conn);
+    }
+}
+
+// Drops the connection, or stops its running requests and waits for them to
+//come back
+
+void lose_connection(ConnTaskArg* conn) {
+    release_streams(conn);
+    if (conn->running == 0) {
+        drop_connection(conn);
+        return;
+    }
+    conn->closing = 1;
+    RequestCancel(conn->cancel);
+    watch_connection(conn, 0);
+}
+
+// Sends the queued replies, or waits for the socket to drain; returns
+//SITH_RET_ERR once the connection is lost
+
+int flush_replies(ConnTaskArg* conn) {
+    if (FlushPeer(conn->peerSocket) == SITH_RET_ERR) {
+        if (errno == EAGAIN) {
+            errno = 0;
+            conn->writing = 1;
+            if (update_interest(conn) == SITH_RET_OK) return SITH_RET_OK;
+        }
+        fprintf(stderr, "[%s] ", conn->peerAddress);
+        HandleErrorStatus("Connection lost");
+        lose_connection(conn);
+        return SITH_RET_ERR;
+    }
+
+    conn->writing = 0;
+    dispose_sent(conn);
+    return SITH_RET_OK;
+}
+
+// Queues the reply behind those still being written, if any
+
+int respond(ConnTaskArg* conn, PendingRequest* pending) {
+    int error = queue_reply(conn, &(pending->reply), pending->id);
+    pending->next = conn->sent;
+    conn->sent = pending;
+    if (error) {
+        fprintf(stderr, "[%s] ", conn->peerAddress);
+        HandleErrorStatus("Connection lost");
+        lose_connection(conn);
+        return SITH_RET_ERR;
+    }
+    return conn->writing ? SITH_RET_OK : flush_replies(conn);
+}
+
+void hold_reply(ConnTaskArg* conn, PendingRequest* pending) {
+    PendingRequest** last = &(conn->deferred);
+    while (*last != NULL) last = &((*last)->behind);
+    pending->behind = NULL;
+    pending->held = 1;
+    *last = pending;
+}
+
+// Sends what the listing owning the output has handed over so far, a part at
+//a time so that a slow client holds its kernel back; once the listing is over,
+//the replies held behind it follow, up to the next listing. Returns
+//SITH_RET_ERR once the connection is lost
+
+int pump_stream(ConnTaskArg* conn) {
+    while (!conn->writing) {
+        PendingRequest* stream = conn->stream;
+        if (stream == NULL) {
+            PendingRequest* held = conn->deferred;
+            if (held == NULL) return SITH_RET_OK;
+            conn->deferred = held->behind;
+            held->held = 0;
+            if (held->streaming) conn->stream = held;
+            else if (respond(conn, held) == SITH_RET_ERR) return SITH_RET_ERR;
+            continue;
+        }
+
+        // The listing is over once its kernel said so and the loop heard it
+        DoLockObject(completedLock);
+        PendingRequest* part = stream->parts;
+        if (part != NULL) {
+            stream->parts = part->next;
+            if (stream->parts == NULL) stream->lastPart = NULL;
+            stream->partCount--;
+            BroadcastConditionVariable(partTaken);
+        }
+        int over = (part == NULL && stream->finished && !stream->announced);
+        DoUnlockObject(completedLock);
+
+        if (part != NULL) {
+            part->reply.continued = stream->reply.continued;
+            part->reply.unfinished = 1;
+            stream->reply.continued = 1;
+            if (respond(conn, part) == SITH_RET_ERR) return SITH_RET_ERR;
+        }
+        else if (over) {
+            // Only the closing marker is left
+            conn->stream = NULL;
+            conn->running--;
+            if (conn->running == 0) SetPeerTimeouts(conn->peerSocket, idleTimeout * 1000UL, messageTimeout * 1000UL);
+            if (respond(conn, stream) == SITH_RET_ERR) return SITH_RET_ERR;
+        }
+        else {
+            return SITH_RET_OK;
+        }
+    }
+    return SITH_RET_OK;
+}
+
+// Serves buffered and incoming requests until the connection may not start
+//another one, a reply has to wait for the socket, or nothing is left to read
+
+void drain_connection(ConnTaskArg* conn) {
+    const char* request;
+    size_t requestLength;
+    unsigned int id;
+
+    while (!conn->writing && conn->stream == NULL && conn->running < pipeline_limit(conn)) {
+        switch (receive_request(conn, &request, &requestLength, &id)) {
+            case -1:
+                if (errno == EAGAIN) {
+                    errno = 0;
+                    if (update_interest(conn) == SITH_RET_OK) return;
+                }
+                fprintf(stderr, "[%s] ", conn->peerAddress);
+                HandleErrorStatus("Connection lost");
+                lose_connection(conn);
+                return;
+
+            case 0:
+                printf("[%s] Client closed the connection.\n", conn->peerAddress);
+                fflush(stdout);
+                lose_connection(conn);
+                return;
+        }
+        printf("[%s] Message received: %s\n", conn->peerAddress, request);
+
+        // Kernels get a copy, the view only lasts until the next receive
+        int blocks = request_blocks(request, requestLength);
+        PendingRequest* pending = create_pending(conn, id, blocks ? request : NULL, requestLength);
+        if (pending == NULL) {
+            HandleErrorStatus("Could not allocate request");
+            lose_connection(conn);
+            return;
+        }
+
+        if (blocks) {
+            conn->running++;
+            if (ScheduleCancellableTask(clients, requestTask, pending, 0, conn->cancel) == SITH_RET_OK) continue;
+
+            conn->running--;
+            if (errno == EAGAIN) errno = 0;
+            else HandleErrorStatus("Could not hand request over");
+            pending->reply.status = SITH_PROTO_SERVBUSY"Too many requests in progress, try again later";
+        }
+        else {
+            serve_request(pending, request, requestLength);
+        }
+
+        if (respond(conn, pending) == SITH_RET_ERR) return;
+    }
 
-            case 0: // Socket closed
-                printf("[%s] Client closed the connection.\n", connInfo->peerAddress);
-                fflush(stdout);
+    if (update_interest(conn)) {
+        HandleErrorStatus("Could not watch connection");
+        lose_connection(conn);
+    }
+}
 
-                CloseConnection(connInfo->peerSocket);
-                free(connInfo->peerAddress);
-                free(connInfo);
-                return 0;
+void resume_output(ConnTaskArg* conn) {
+    if (flush_replies(conn) == SITH_RET_OK && pump_stream(conn) == SITH_RET_OK && !conn->writing) drain_connection(conn);
+}
 
-            default: // We actually got a message
-                printf("[%s] Message received: %s\n", connInfo->peerAddress, request);
+// Listings come back each time they hand parts over to an empty queue, and
+//once more when over; they are taken off the list one at a time, as kernels
+//may put them back meanwhile
 
-                // Directory listing option
-                if (CLIENT_REQUEST(request, SITH_PROTO_LIST)) {
-                    HeapString* output = CreateHeapString("");
-                    if (output == NULL) {
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE);
-                        continue;
-                    }
-                    SithWalker* walk = InitWalker(".");
-                    if (walk == NULL) {
-                        DisposeHeapString(output);
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE);
-                        continue;
-                    }
-                    WalkInDir(walk, output);
-                    if (output != NULL) {
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_MOREOUT);
-                        SendToPeer(connInfo->peerSocket, HeapStringGetRaw(output));
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_MOREEND);
-                    }
-                    DisposeHeapString(output);
-                    DisposeWalker(walk);
+void complete_requests() {
+    while (1) {
+        DoLockObject(completedLock);
+        PendingRequest* pending = completed;
+        if (pending != NULL) {
+            completed = pending->next;
+            pending->announced = 0;
+        }
+        DoUnlockObject(completedLock);
+        if (pending == NULL) return;
+        ConnTaskArg* conn = pending->conn;
+
+        if (pending->streaming) {
+            if (conn->closing) {
+                if (abandon_stream(pending)) {
+                    conn->running--;
+                    dispose_pending(pending);
+                    if (conn->running == 0) drop_connection(conn);
                 }
+                continue;
+            }
+            if (pending != conn->stream && !pending->held) hold_reply(conn, pending);
+            if (pump_stream(conn) == SITH_RET_OK && !conn->writing) drain_connection(conn);
+            continue;
+        }
 
-                    // Recursive listing option
-                else if (CLIENT_REQUEST(request, SITH_PROTO_LISTREC)) {
-                    HeapString* output = CreateHeapString("");
-                    if (output == NULL) {
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE);
-                        continue;
-                    }
-                    SithWalker* walk = InitWalker(".");
-                    if (walk == NULL) {
-                        DisposeHeapString(output);
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE);
-                        continue;
-                    }
-                    WalkInDirRecursive(walk, output);
-                    if (output != NULL) {
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_MOREOUT);
-                        SendToPeer(connInfo->peerSocket, HeapStringGetRaw(output));
-                        SendToPeer(connInfo->peerSocket, SITH_PROTO_MOREEND);
-                    }
-                    DisposeHeapString(output);
-                    DisposeWalker(walk);
-                }
-                    // Encrypt-Decrypt file option
-                else if ((isEncryptionRequest = CLIENT_REQUEST(request, SITH_PROTO_ENCRYPT)) || CLIENT_REQUEST(request, SITH_PROTO_DECRYPT)) {
-
-                    // Call the worker function and send a response accordingly
-                    switch (EndecFile(request + SITH_MAXCH_PROTOCMD, isEncryptionRequest, &ret)) {
-                        case 0:
-                            // Process returned, read exit code
-                            switch (ret) {
-                                case 0:
-                                    // File has been correctly encrypted
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_SUCCESS"OK");
-                                    break;
-                                case SITH_FAILCRYPTO_404:
-                                    // Encountered error while handling files
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_INVALID"File not found");
-                                    break;
-                                case SITH_FAILCRYPTO_SEED:
-                                    // Invalid seed
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_INVALID"Seed is malformed");
-                                    break;
-                                case SITH_FAILCRYPTO_ARG:
-                                    // Bad argument count
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_INVALID"Wrong number of arguments");
-                                    break;
-                                case SITH_FAILCRYPTO_NOTREG:
-                                    // Invalid pathname
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_INVALID"Path does not denote a regular file");
-                                    break;
-                                case SITH_FAILCRYPTO_LOCKED:
-                                    // Source file is locked
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"This file is currently locked, try again later.");
-                                    break;
-                                case SITH_FAILCRYPTO_FILE:
-                                    // File error
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"File error");
-                                    break;
-                                case SITH_FAILCRYPTO_ENDEC:
-                                    // File partially encrypted
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"File has been partially encrypted");
-                                    break;
-                                case SITH_FAILCRYPTO_RELEASE:
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"Error while releasing resources");
-                                    break;
-                                case SITH_FAILCRYPTO_NOMEM:
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"Not enough memory for encryption");
-                                    break;
-                                default:
-                                    printf("Unexpected return code from crypto: %"SITH_STRFMT_PROCVALUE"\n", ret);
-                                    SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"Unexpected error in encryption");
-                                    break;
-                            }
-                            break;
-                        case SITH_ENDECFAIL_INVAL:
-                        case SITH_ENDECFAIL_STR:
-                            // Command is malformed
-                            SendToPeer(connInfo->peerSocket, SITH_PROTO_INVALID"The received parameters are malformed");
-                            break;
-                        case SITH_ENDECFAIL_SYS:
-                        case SITH_ENDECFAIL_NOMEM:
-                            // Internal failure (pool saturated) (transient)
-                            SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"Not enough memory for encryption task scheduling");
-                            break;
-                        default:
-                            SendToPeer(connInfo->peerSocket, SITH_PROTO_FAILURE"Unexpected error");
-                    }
-                }
+        conn->running--;
+        // Waiting on a request is not idling
+        if (conn->running == 0) SetPeerTimeouts(conn->peerSocket, idleTimeout * 1000UL, messageTimeout * 1000UL);
 
-                    // Message unrecognized
-                else {
-                    printf("[%s] Malformed request\n", connInfo->peerAddress);
-                    SendToPeer(connInfo->peerSocket, SITH_PROTO_INVALID);
-                }
+        if (conn->closing) {
+            dispose_pending(pending);
+            if (conn->running == 0) drop_connection(conn);
+            continue;
+        }
+        if (conn->stream != NULL) {
+            hold_reply(conn, pending);
+            continue;
+        }
+        if (respond(conn, pending) == SITH_RET_OK) drain_connection(conn);
+    }
+}
 
-                // Do free the request
-                free(request);
+// Returns SITH_RET_ERR if accepting should pause, as when out of descriptors
+
+int accept_connections(Acceptor* acceptor) {
+    while (1) {
+        ConnectionSocket* peer = AcceptFromClient(acceptor->listener);
+        if (peer == NULL) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                return SITH_RET_OK;
+            }
+#ifdef __unix__
+            if (errno == EINTR || errno == ECONNABORTED) {
+                errno = 0;
+                continue;
+            }
+#endif
+            HandleErrorStatus("Failed accepting connection");
+            return SITH_RET_ERR;
         }
 
-    //We should never get here, but just in case...
-    CloseConnection(connInfo->peerSocket);
-    free(connInfo->peerAddress);
-    free(connInfo);
-    return -1;
+        ConnTaskArg* conn = create_connection(peer);
+        if (conn == NULL) continue;
+        if (SetPeerBlocking(peer, 0)) {
+            HandleErrorStatus("Could not set up connection");
+            SendToPeer(peer, SITH_PROTO_FAILURE);
+            release_connection(conn);
+            continue;
+        }
+        loopConnections++;
+        acceptor->accepted++;
+        conn->next = loopList;
+        if (loopList != NULL) loopList->previous = conn;
+        loopList = conn;
+
+        printf("Accepted connection from %s\n", conn->peerAddress);
+        fflush(stdout);
+
+        // Send confirmation to client to start sending messages
+        if (QueueToPeer(peer, SITH_PROTO_ACCEPTED, strlen(SITH_PROTO_ACCEPTED)) == SITH_RET_ERR) {
+            HandleErrorStatus("Failed to synchronize with client");
+            drop_connection(conn);
+            continue;
+        }
+        if (flush_replies(conn) == SITH_RET_OK && !conn->writing) drain_connection(conn);
+    }
+}
+
+// Closes connections past their deadline; while requests run, only a client
+//stalling halfway through a message is let go. One still being written to is
+//only let go once it has taken nothing for the send deadline, without a word
+//as it would not take that either
+
+void sweep_connections() {
+    ConnTaskArg* conn = loopList;
+    while (conn != NULL) {
+        ConnTaskArg* next = conn->next;
+        if (!conn->closing && conn->writing && PeerSendStalled(conn->peerSocket)) {
+            printf("[%s] Client stopped taking replies, closing\n", conn->peerAddress);
+            fflush(stdout);
+            lose_connection(conn);
+        }
+        else if (!conn->closing && !conn->writing && PeerTimedOut(conn->peerSocket) &&
+                (conn->running == 0 || !PeerIsIdle(conn->peerSocket))) {
+            time_out(conn);
+            lose_connection(conn);
+        }
+        conn = next;
+    }
 }
 
+// Both listeners pause together, running out of descriptors affects them alike
 
-//------------------------------------------------------------------------------
-// LISTENER THREAD BODY
+int watch_listeners(int watch) {
+    int error = watch ? WatchListener(poller, acceptors->listener, SITH_LOOP_LISTENERTAG) : UnwatchListener(poller, acceptors->listener);
+    if (error == SITH_RET_OK && localAcceptor.listener != NULL) {
+        error = watch ? WatchListener(poller, localAcceptor.listener, SITH_LOOP_LOCALTAG) : UnwatchListener(poller, localAcceptor.listener);
+    }
+    return error;
+}
 
-ThreadValue SITH_THREAD_CALLCONV listenerBody(void* arg) {
+ThreadValue SITH_THREAD_CALLCONV loopBody(void* arg) {
 
-    (void) arg;
+    Acceptor* acceptor = (Acceptor*) arg;
+    ownAcceptor = acceptor;
 
 #ifdef __unix__
     // Leave only SIGUSR1 open for address updates
@@ -421,72 +1971,78 @@ ThreadValue SITH_THREAD_CALLCONV listenerBody(void* arg) {
     printf("Server is listening...\n");
     fflush(stdout);
 
-    // Listening loop
-    int error;
-    ConnectionSocket* peer;
+    PollEvent events[SITH_SERV_LOOPEVENTS];
+    unsigned long long acceptResume = 0;
+    unsigned long long nextSweep = ReadTimer() + SITH_SERV_SWEEPMS * 1000000ULL;
     while (1) {
 #ifdef __unix__
-        // Log an eventual address change
-        if (servChange) {
+        // Log an eventual address change, and watch the new listener
+        if (acceptor->changed) {
 
-            if (servFailure) {
+            if (acceptor->failed) {
                 HandleErrorStatus("Server failed updating\n");
                 exit(EXIT_FAILURE);
             }
             printf("Server has changed address\n");
-            servChange = 0;
+            acceptor->changed = 0;
+            if (SetListenerBlocking(acceptor->listener, 0) || WatchListener(poller, acceptor->listener, SITH_LOOP_LISTENERTAG)) {
+                HandleErrorStatus("Could not watch the new listener");
+                exit(EXIT_FAILURE);
+            }
         }
 #endif
 
-        // Accept connection
-        peer = AcceptFromClient(listener);
-        if (peer == NULL) {
-#ifdef __unix__
-            // Do check if we got interrupted by a SIGUSR1
-            if (errno == EINTR) {
-                errno = 0;
-                continue;
+        // Accepting was paused, the listener would be reported over and over
+        if (acceptResume != 0 && ReadTimer() >= acceptResume) {
+            acceptResume = 0;
+            if (watch_listeners(1)) {
+                HandleErrorStatus("Could not watch listener");
+                exit(EXIT_FAILURE);
             }
-#endif
-            HandleErrorStatus("Failed accepting connection");
-            continue;
         }
 
-        // Create connection info
-        ConnTaskArg* connArg = calloc(1, sizeof (ConnTaskArg));
-        if (connArg == NULL) {
-            HandleErrorStatus("Could not allocate connection info");
-            SendToPeer(peer, SITH_PROTO_FAILURE);
-            CloseConnection(peer);
-            continue;
+        int timeout = acceptResume ? SITH_SERV_ACCEPTPAUSEMS : -1;
+        if (idleTimeout > 0 || messageTimeout > 0) {
+            unsigned long long now = ReadTimer();
+            if (now >= nextSweep) {
+                sweep_connections();
+                nextSweep = now + SITH_SERV_SWEEPMS * 1000000ULL;
+            }
+            if (timeout < 0) timeout = SITH_SERV_SWEEPMS;
         }
 
-        // Set peer address
-        error = GetPeerFullAddress(peer, &(connArg->peerAddress));
-        if (connArg->peerAddress == NULL) {
-            HandleErrorStatus("Could not get peer address");
-            SendToPeer(peer, SITH_PROTO_FAILURE);
-            free(connArg);
-            CloseConnection(peer);
-            continue;
+        int count = WaitPoller(poller, events, SITH_SERV_LOOPEVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            HandleErrorStatus("FATAL: Event loop failure");
+            exit(EXIT_FAILURE);
         }
 
-        connArg->peerSocket = peer;
-
-        // Start communication loop with client
-
-        error = ScheduleTask(clients, clientTask, connArg, 0);
-        if (error) {
-            HandleErrorStatus("Connection aborted");
-            SendToPeer(peer, SITH_PROTO_SERVBUSY);
-            free(connArg);
-            CloseConnection(peer);
-            continue;
+        for (int i = 0; i < count; i++) {
+            if (events[i].tag == NULL) {
+                complete_requests();
+            }
+            else if (events[i].tag == SITH_LOOP_LISTENERTAG || events[i].tag == SITH_LOOP_LOCALTAG) {
+                if (accept_connections(events[i].tag == SITH_LOOP_LOCALTAG ? &localAcceptor : acceptor)) {
+                    watch_listeners(0);
+                    acceptResume = ReadTimer() + SITH_SERV_ACCEPTPAUSEMS * 1000000ULL;
+                }
+            }
+            else {
+                ConnTaskArg* conn = (ConnTaskArg*) events[i].tag;
+                if (conn->dropped) continue;
+                if (conn->writing) resume_output(conn);
+                else drain_connection(conn);
+            }
         }
+        release_dropped();
     }
 
-    // No breaks expected in listening loop
-    CloseListener(listener);
+    // No breaks expected in the loop
+    CloseListener(acceptor->listener);
     return SITH_RV_ONE;
 }
 
@@ -505,31 +2061,49 @@ void servUpdateSigHandler(int sig, siginfo_t* info, void* ucontext) {
         return;
     }
 
-    servChange = 1;
+    // Every acceptor is signalled, and rebinds its own listener
+    Acceptor* acceptor = ownAcceptor;
+    if (acceptor == NULL) return;
+    ListenerSocket* listener = acceptor->listener;
+
+    acceptor->changed = 1;
 
     // Bypass the whole net abstraction - we need to be AsyncSignalSafe
 
     // Close the old listener
     if (close(listener->descriptor)) {
-        servFailure = 1;
+        acceptor->failed = 1;
         return;
     }
 
     // Open the socket
     if ((listener->descriptor = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        servFailure = 1;
+        acceptor->failed = 1;
+        return;
+    }
+
+    // Same options as at startup, shards bind alongside each other
+    int enable = 1;
+    if (setsockopt(listener->descriptor, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (int))) {
+        acceptor->failed = 1;
         return;
     }
+#if defined __linux__ && defined SO_REUSEPORT
+    if (listener->shared && setsockopt(listener->descriptor, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof (int))) {
+        acceptor->failed = 1;
+        return;
+    }
+#endif
 
     // Bind it to the new address
     if (bind(listener->descriptor, (struct sockaddr*) &addressBuffer, sizeof (struct sockaddr_in))) {
-        servFailure = 1;
+        acceptor->failed = 1;
         return;
     }
 
     // Relisten
     if (listen(listener->descriptor, listener->backlog)) {
-        servFailure = 1;
+        acceptor->failed = 1;
         return;
     }
 }
@@ -539,6 +2113,29 @@ void emptySigHandler(int sig) {
 }
 #endif
 
+// Running jobs are stopped, and given some time to clean up
+
+void shutdown_server() {
+    printf("Shutting down, stopping running jobs...\n");
+    fflush(stdout);
+    RequestCancel(shutdownToken);
+    if (wait_jobs_idle(SITH_SERV_SHUTDOWNMS)) {
+        fprintf(stderr, "Some jobs did not stop in time\n");
+        fflush(stderr);
+    }
+}
+
+#ifdef _WIN32
+
+BOOL WINAPI shutdownCtrlHandler(DWORD type) {
+    (void) type;
+    shutdown_server();
+
+    // Let the default handler end the process
+    return FALSE;
+}
+#endif
+
 //------------------------------------------------------------------------------
 // SERVER MAIN
 
@@ -644,11 +2241,94 @@ int main(int argc, char* argv[]) {
     GetOptionString('c', 1, root); // TDNX sizes;
 
     unsigned int maxTasks = 0;
-    GetOptionUInt('n', 1, &maxTasks);
+    if (GetOptionUInt('n', 1, &maxTasks) || maxTasks == 0) {
+        HandleErrorStatus("Bad task count specified");
+        return EXIT_FAILURE;
+    }
+
+    unsigned int maxQueued = 0;
+    if (GetOptionUInt('q', 1, &maxQueued)) {
+        HandleErrorStatus("Bad task queue length specified");
+        return EXIT_FAILURE;
+    }
 
     unsigned int maxClients = 0;
     GetOptionUInt('u', 1, &maxClients);
 
+    unsigned int maxPending = 0;
+    if (GetOptionUInt('b', 1, &maxPending)) {
+        HandleErrorStatus("Bad pending client count specified");
+        return EXIT_FAILURE;
+    }
+
+    unsigned int maxGrow = 0;
+    if (GetOptionUInt('g', 1, &maxGrow)) {
+        HandleErrorStatus("Bad client growth limit specified");
+        return EXIT_FAILURE;
+    }
+
+    unsigned int accepting = 0;
+    if (GetOptionUInt('k', 1, &accepting) || accepting == 0) {
+        HandleErrorStatus("Bad acceptor count specified");
+        return EXIT_FAILURE;
+    }
+
+    unsigned int backlog = 0;
+    if (GetOptionUInt('l', 1, &backlog) || backlog == 0 || backlog > SITH_SERV_MAXBACKLOG) {
+        HandleErrorStatus("Bad listen backlog specified");
+        return EXIT_FAILURE;
+    }
+
+    if (GetOptionUInt('r', 1, &maxPipelined) || maxPipelined == 0) {
+        HandleErrorStatus("Bad pipelined request count specified");
+        return EXIT_FAILURE;
+    }
+
+    if (GetOptionUInt('t', 1, &idleTimeout) || GetOptionUInt('m', 1, &messageTimeout)) {
+        HandleErrorStatus("Bad timeout specified");
+        return EXIT_FAILURE;
+    }
+
+    char localPath[SITH_MAX_VALUE_LEN] = {0};
+    GetOptionString('x', 1, localPath);
+    if (strcmp(localPath, "none") != 0 && (!IsLocalAddress(localPath) || strlen(localPath) > SITH_MAXCH_LOCALPATH)) {
+        HandleErrorStatus("Bad local socket path specified");
+        return EXIT_FAILURE;
+    }
+
+    GetOptionBool('w', 0, &queueLocked);
+    GetOptionBool('E', 0, &eventLoop);
+
+    // Placement is settled at startup, the engines inherit theirs through the
+    // environment
+    char clientAffinity[SITH_MAX_VALUE_LEN] = {0};
+    AffinityPolicy clientPolicy;
+    unsigned int clientCPUs[SITH_MAX_CPUS];
+    unsigned int clientCPUCount = SITH_MAX_CPUS;
+    GetOptionString('A', 1, clientAffinity);
+    if (ParseAffinity(clientAffinity, &clientPolicy, clientCPUs, &clientCPUCount)) {
+        HandleErrorStatus("Bad client affinity specified");
+        return EXIT_FAILURE;
+    }
+
+    char cryptoAffinity[SITH_MAX_VALUE_LEN] = {0};
+    AffinityPolicy cryptoPolicy;
+    unsigned int cryptoCPUs[SITH_MAX_CPUS];
+    unsigned int cryptoCPUCount = SITH_MAX_CPUS;
+    GetOptionString('C', 1, cryptoAffinity);
+    if (ParseAffinity(cryptoAffinity, &cryptoPolicy, cryptoCPUs, &cryptoCPUCount)) {
+        HandleErrorStatus("Bad crypto affinity specified");
+        return EXIT_FAILURE;
+    }
+#ifdef _WIN32
+    if (_putenv_s(SITH_CRYPTO_AFFINITYENV, cryptoAffinity)) {
+#elif defined __unix__
+    if (setenv(SITH_CRYPTO_AFFINITYENV, cryptoAffinity, 1)) {
+#endif
+        HandleErrorStatus("Could not export crypto affinity");
+        return EXIT_FAILURE;
+    }
+
 
     // ====================
     // If we got here, then options have been read correctly, server shall start
@@ -659,8 +2339,15 @@ int main(int argc, char* argv[]) {
     printf("\n--Crypto Sithis Server--\n");
     printf("Server address: %s:%hu\n", address, port);
     printf("Root folder: %s\n", root);
-    printf("Max clients: %u\n", maxClients);
-    printf("Max tasks: %u\n\n", maxTasks);
+    printf("Max clients: %u (pending %u, grow to %u)\n", maxClients, maxPending, maxGrow > maxClients ? maxGrow : maxClients);
+    printf("Max tasks: %u (queue %u)\n", maxTasks, maxQueued);
+    printf("Locked files: %s\n", queueLocked ? "queue" : "reject");
+    printf("Connections: %s\n", eventLoop ? "event loop, requests on the connection pool" : "one connection pool thread each");
+    printf("Acceptors: %u (backlog %u)\n", eventLoop ? 1 : accepting, backlog);
+    printf("Local socket: %s\n", localPath);
+    printf("Pipelined requests: %u per framed client\n", maxPipelined);
+    printf("Timeouts: idle %us, message %us\n", idleTimeout, messageTimeout);
+    printf("Affinity: clients %s, crypto %s\n\n", clientAffinity, cryptoAffinity);
 
     // Change root directory if requested
     if (strcmp(root, SITH_DEFAULT_SERVROOT) != 0) {
@@ -698,27 +2385,118 @@ int main(int argc, char* argv[]) {
 
     // INIT ####################################################################
 
+    pathLocksGuard = CreateLockObject();
+    pathLocksReleased = CreateConditionVar();
+    if (pathLocksGuard == NULL || pathLocksReleased == NULL) {
+        HandleErrorStatus("Could not create path lock table");
+        exit(EXIT_FAILURE);
+    }
+    shutdownToken = CreateCancelToken(NULL);
+    if (shutdownToken == NULL) {
+        HandleErrorStatus("Could not create shutdown token");
+        exit(EXIT_FAILURE);
+    }
+    if (init_job_limiter(maxTasks, maxQueued)) {
+        HandleErrorStatus("Could not create job limiter");
+        exit(EXIT_FAILURE);
+    }
+
     // [UNIX] All signals are blocked, start the actual server logic
     //   so that all threads spawned here inherit the "block-all" sigmask 
-    clients = CreateThreadPool("CS_clients", maxClients);
+    walkers = CreateThreadPool("CS_walkers", SITH_SERV_WALKERS);
+    if (walkers == NULL || SetThreadPoolStealing(walkers, 1)) {
+        HandleErrorStatus("Could not create listing pool");
+        exit(EXIT_FAILURE);
+    }
+
+    clients = CreatePinnedThreadPool("CS_clients", maxClients, clientPolicy, clientCPUs, clientCPUCount);
     if (clients == NULL) {
         HandleErrorStatus("Could not create connection pool");
         exit(EXIT_FAILURE);
     }
+    if (SetThreadPoolQueueLength(clients, maxPending)) {
+        HandleErrorStatus("Could not create pending client queue");
+        exit(EXIT_FAILURE);
+    }
+    if (set_client_autoscale(maxClients, maxGrow)) {
+        HandleErrorStatus("Could not start connection pool autoscaling");
+        exit(EXIT_FAILURE);
+    }
 
     // ACTIVATION POINT
-    // Open server socket
-    listener = CreateServerSocket(address, port, SITH_SERV_BACKLOG);
-    if (listener == NULL) {
+    // Idle clients only cost a watched socket in the event loop
+    if (eventLoop) {
+        poller = CreatePoller();
+        if (poller == NULL && errno == ENOSYS) {
+            errno = 0;
+            printf("Event loop not available on this platform, serving one client per thread\n");
+            eventLoop = 0;
+        }
+        else {
+            completedLock = CreateLockObject();
+            partTaken = CreateConditionVar();
+            if (poller == NULL || completedLock == NULL || partTaken == NULL) {
+                HandleErrorStatus("FATAL: Could not start the event loop");
+                exit(EXIT_FAILURE);
+            }
+            // The loop does its own accepting
+            accepting = 1;
+        }
+    }
+
+    // Framed clients' long requests need threads of their own, connection
+    //threads are taken by their readers; sized so that the job limiter still
+    //does the queueing
+    if (!eventLoop) {
+        requests = CreateThreadPool("CS_requests", maxTasks + maxQueued);
+        if (requests == NULL) {
+            HandleErrorStatus("FATAL: Could not create request pool");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Open server sockets
+    if (open_acceptors(address, port, (int) backlog, accepting)) {
         HandleErrorStatus("FATAL: Failed to create server socket");
         exit(EXIT_FAILURE);
     }
+    if (strcmp(localPath, "none") != 0) {
+        localAcceptor.listener = CreateServerSocket(localPath, 0, (int) backlog);
+        if (localAcceptor.listener == NULL) {
+            HandleErrorStatus("FATAL: Failed to create local socket");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (eventLoop && (SetListenerBlocking(acceptors->listener, 0) ||
+            (localAcceptor.listener != NULL && SetListenerBlocking(localAcceptor.listener, 0)) ||
+            watch_listeners(1))) {
+        HandleErrorStatus("FATAL: Could not start the event loop");
+        exit(EXIT_FAILURE);
+    }
 
-    // Start listener thread
-    listenerThread = SpawnThread(listenerBody, NULL);
+    // Start acceptor threads, signals for address changes are sent to them
+    for (unsigned int i = 0; i < acceptorCount; i++) {
+        acceptors[i].thread = SpawnThread(eventLoop ? loopBody : listenerBody, &(acceptors[i]));
+        if (acceptors[i].thread == NULL) {
+            HandleErrorStatus("FATAL: Could not start acceptor thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!eventLoop && localAcceptor.listener != NULL) {
+        localAcceptor.thread = SpawnThread(listenerBody, &localAcceptor);
+        if (localAcceptor.thread == NULL) {
+            HandleErrorStatus("FATAL: Could not start acceptor thread");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // POST-INIT ###############################################################
 #ifdef _WIN32
+    // Console interrupts stop running jobs before the process ends
+    if (!SetConsoleCtrlHandler(shutdownCtrlHandler, TRUE)) {
+        HandleErrorStatus("Could not install shutdown handler");
+    }
+
     // Stun this thread, we need it alive to avoid process termination
     while (1) Sleep(INFINITE);
 
@@ -727,8 +2505,11 @@ int main(int argc, char* argv[]) {
     // From now on, main tread will act as the process' signal handler and
     // change the process' config accordingly
     sigset_t actualMask = originalMask;
-    // Block SIGUSR1, let the listener react to it
+    // Block SIGUSR1, let the acceptors react to it; termination requests are
+    // waited for below
     sigaddset(&actualMask, SIGUSR1);
+    sigaddset(&actualMask, SIGTERM);
+    sigaddset(&actualMask, SIGINT);
     pthread_sigmask(SIG_SETMASK, &actualMask, NULL);
 
 
@@ -741,7 +2522,7 @@ int main(int argc, char* argv[]) {
     hupaction.sa_flags = 0;
     sigaction(SIGHUP, &hupaction, (struct sigaction*) NULL);
 
-    // SIGUSR1 will be raised here and caught by the listener
+    // SIGUSR1 will be raised here and caught by the acceptors
     // Use the enhanced function prototype to check the signal PID
     struct sigaction usr1action;
     usr1action.sa_sigaction = servUpdateSigHandler;
@@ -761,6 +2542,8 @@ int main(int argc, char* argv[]) {
     sigemptyset(&hupset);
     sigaddset(&hupset, SIGHUP);
     sigaddset(&hupset, SIGCHLD);
+    sigaddset(&hupset, SIGTERM);
+    sigaddset(&hupset, SIGINT);
     siginfo_t signalInfo;
     char newAddr[SITH_MAXCH_IPV4 + 1];
     unsigned short newPort;
@@ -777,9 +2560,14 @@ int main(int argc, char* argv[]) {
         if (signalInfo.si_signo == SIGCHLD)
             continue;
 
+        if (signalInfo.si_signo == SIGTERM || signalInfo.si_signo == SIGINT) {
+            shutdown_server();
+            exit(EXIT_SUCCESS);
+        }
+
         // React to the signal
         printf("Hang-up signal received, updating configuration...\n");
-        BitFieldMask mask = {0, 0, 0, 0};
+        BitFieldMask mask = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
         int change = ReadConfigFile(&mask);
         if (change == SITH_RET_ERR) {
             HandleErrorStatus("Failed to update configuration file");
@@ -804,14 +2592,14 @@ int main(int argc, char* argv[]) {
                     SetOptionUShort('p', 0, port);
                     goto after_address;
             }
-            addressBuffer.sin_port = htons(port);
+            addressBuffer.sin_port = htons(newPort);
 
             memcpy(address, newAddr, SITH_MAXCH_IPV4 + 1);
             port = newPort;
 
-            // Trigger handler by raising SIGUSR1
+            // Trigger handlers by raising SIGUSR1 on every acceptor
             printf("Changing server address to %s:%hu\n", address, port);
-            SignalThread(listenerThread, SIGUSR1);
+            for (unsigned int i = 0; i < acceptorCount; i++) SignalThread(acceptors[i].thread, SIGUSR1);
         }
 after_address:
 
@@ -828,7 +2616,7 @@ after_address:
 
                 if (ResizeThreadPool(clients, opt)) {
                     if (errno == EAGAIN) {
-                        // Means too many kernels are busy
+                        // Means connection threads are still retiring
                         fprintf(stderr, "Can't resize connection pool, try again\n");
                         errno = 0;
                     }
@@ -836,7 +2624,7 @@ after_address:
                         HandleErrorStatus("Critical error on client pool resizing");
                     }
 
-                    if (SetOptionUInt(SITH_SERVOPT_CLIENTS, 1, GetThreadPoolSize(clients))) {
+                    if (SetOptionUInt('u', 1, GetThreadPoolSize(clients))) {
                         HandleErrorStatus("FATAL: Can't restore configuration");
                         return EXIT_FAILURE;
                     }
@@ -848,6 +2636,82 @@ after_address:
             printf("Signals restored\n");
         }
 
+        if (mask.changed_max_clients || mask.changed_max_grow) {
+            // The autoscaler thread may be starting now
+            pthread_sigmask(SIG_SETMASK, &muteMask, &originalMask);
+
+            unsigned int newGrow = 0;
+            if (GetOptionUInt('g', 1, &newGrow)) {
+                HandleErrorStatus("Failed to read client growth option");
+            }
+            else {
+                unsigned int base = GetThreadPoolSize(clients);
+                GetOptionUInt('u', 1, &base);
+                if (set_client_autoscale(base, newGrow)) {
+                    HandleErrorStatus("Could not change connection pool autoscaling");
+                }
+                else if (newGrow > base) {
+                    printf("Connection pool grows from %u up to %u clients\n", base, newGrow);
+                }
+                else {
+                    printf("Connection pool autoscaling disabled\n");
+                }
+            }
+
+            pthread_sigmask(SIG_SETMASK, &originalMask, NULL);
+        }
+
+        if (mask.changed_queue_locked) {
+            GetOptionBool('w', 0, &queueLocked);
+            printf("Requests on locked files will be %s\n", queueLocked ? "queued" : "rejected");
+        }
+
+        if (mask.changed_max_tasks) {
+            unsigned int newTasks = 0, newQueued = 0;
+            if (GetOptionUInt('n', 1, &newTasks) || newTasks == 0 || GetOptionUInt('q', 1, &newQueued)) {
+                HandleErrorStatus("Bad task limits, keeping the current ones");
+                SetOptionUInt('n', 1, maxTasks);
+                SetOptionUInt('q', 1, maxQueued);
+            }
+            else {
+                printf("Changing task limits from %u (queue %u) to %u (queue %u)\n", maxTasks, maxQueued, newTasks, newQueued);
+                maxTasks = newTasks;
+                maxQueued = newQueued;
+                set_job_limits(maxTasks, maxQueued);
+
+                // Threads are spawned, block signals meanwhile
+                if (requests != NULL) {
+                    pthread_sigmask(SIG_SETMASK, &muteMask, &originalMask);
+                    if (ResizeThreadPool(requests, maxTasks + maxQueued)) {
+                        HandleErrorStatus("Could not resize request pool");
+                    }
+                    pthread_sigmask(SIG_SETMASK, &originalMask, NULL);
+                }
+            }
+        }
+
+        if (mask.changed_max_pending) {
+            unsigned int newPending = 0;
+            if (GetOptionUInt('b', 1, &newPending)) {
+                HandleErrorStatus("Failed to read pending client option");
+            }
+            else {
+                printf("Changing pending client count from %u to %u\n", GetThreadPoolQueueLength(clients), newPending);
+
+                if (SetThreadPoolQueueLength(clients, newPending)) {
+                    if (errno == EAGAIN) {
+                        // Means too many clients are waiting
+                        fprintf(stderr, "Can't shrink pending client queue, try again\n");
+                        errno = 0;
+                    }
+                    else {
+                        HandleErrorStatus("Could not resize pending client queue");
+                    }
+                    SetOptionUInt('b', 1, GetThreadPoolQueueLength(clients));
+                }
+            }
+        }
+
         if (mask.changed_root_dir) {
 
             // Change root directory
@@ -866,6 +2730,47 @@ after_address:
                 printf("Root directory changed: %s\n", root);
         }
 
+        if (mask.changed_event_loop) {
+            printf("Event loop mode takes effect on restart\n");
+        }
+
+        if (mask.changed_listening) {
+            printf("Acceptor, backlog and local socket changes take effect on restart\n");
+        }
+
+        if (mask.changed_max_pipelined) {
+            unsigned int newPipelined = 0;
+            if (GetOptionUInt('r', 1, &newPipelined) || newPipelined == 0) {
+                HandleErrorStatus("Bad pipelined request count, keeping the current one");
+                SetOptionUInt('r', 1, maxPipelined);
+            }
+            else {
+                printf("Changing pipelined requests from %u to %u per client\n", maxPipelined, newPipelined);
+                maxPipelined = newPipelined;
+            }
+        }
+
+        if (mask.changed_timeouts) {
+            unsigned int newIdle = 0;
+            unsigned int newMessage = 0;
+            if (GetOptionUInt('t', 1, &newIdle) || GetOptionUInt('m', 1, &newMessage)) {
+                HandleErrorStatus("Bad timeout, keeping the current ones");
+                SetOptionUInt('t', 1, idleTimeout);
+                SetOptionUInt('m', 1, messageTimeout);
+            }
+            else {
+                printf("Changing timeouts from %u/%u to %u/%u seconds (idle/message)\n", idleTimeout, messageTimeout, newIdle, newMessage);
+                idleTimeout = newIdle;
+                messageTimeout = newMessage;
+            }
+        }
+
+        if (mask.changed_affinity) {
+            // Live threads are not moved, nor is the environment touched while
+            // clients may be spawning engines
+            printf("Affinity changes take effect on restart\n");
+        }
+
         fflush(stdout);
     }
 #endif
@@ -4,10 +4,15 @@
 #include "plat.h"
 #ifdef __unix__
 #include <pthread.h>
+#include <time.h>
 #ifdef __STDC_NO_ATOMICS__
 #error "<stdatomic.h> required for compilation"
 #endif
 #include <stdatomic.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #endif
 
 #include "sync.h"
@@ -16,6 +21,11 @@
 #define SITH_LOCK_POISON 0xDEAD
 #define SITH_LOCK_NORMAL 0
 
+#define SITH_PARK_EMPTY 0
+#define SITH_PARK_NOTIFIED 1
+#define SITH_PARK_PARKED -1
+#define SITH_PARK_SPINS 128
+
 //------------------------------------------------------------------------------
 // SEMAPHORES
 
@@ -286,6 +296,33 @@ int WaitConditionVariable(CondVar* this, LockObject* lock) {
     return SITH_RET_OK;
 }
 
+int TimedWaitConditionVariable(CondVar* this, LockObject* lock, unsigned long milliseconds) {
+#ifdef _WIN32
+    BOOL success = SleepConditionVariableCS(&(this->impl), &(lock->impl), milliseconds);
+    if (!success) {
+        if (GetLastError() == ERROR_TIMEOUT) errno = ETIMEDOUT;
+        return SITH_RET_ERR;
+    }
+#elif defined __unix__
+    // Default condvars measure against the realtime clock
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += milliseconds / 1000;
+    deadline.tv_nsec += (milliseconds % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int error = pthread_cond_timedwait(&(this->impl), &(lock->impl), &deadline);
+    if (error) {
+        errno = error;
+        return SITH_RET_ERR;
+    }
+#endif
+    return SITH_RET_OK;
+}
+
 int NotifyConditionVariable(CondVar* this) {
 #ifdef _WIN32
     WakeConditionVariable(&(this->impl));
@@ -298,6 +335,18 @@ int NotifyConditionVariable(CondVar* this) {
     return SITH_RET_OK;
 }
 
+int BroadcastConditionVariable(CondVar* this) {
+#ifdef _WIN32
+    WakeAllConditionVariable(&(this->impl));
+#elif defined __unix__
+    int error = pthread_cond_broadcast(&(this->impl));
+    if (error) {
+        return SITH_RET_ERR;
+    }
+#endif
+    return SITH_RET_OK;
+}
+
 int DestroyConditionVar(CondVar* this) {
 
 #ifdef _WIN32
@@ -311,3 +360,135 @@ int DestroyConditionVar(CondVar* this) {
     free(this);
     return SITH_RET_OK;
 }
+
+
+//------------------------------------------------------------------------------
+// PARKING
+//
+// - State goes EMPTY -> PARKED on park, anything -> NOTIFIED on unpark; only an
+//   unpark that finds the owner PARKED issues a wake-up
+// - Sleeps may end spuriously, the state is always rechecked
+// - Spinning is pointless on a single processor, the unparker can't run
+// - [UNIX] Futexes are Linux only, other systems sleep on a condition variable,
+//   whose mutex is taken by an unpark only when it finds the owner PARKED
+
+struct sith_parker {
+#ifdef _WIN32
+    volatile LONG state;
+#elif defined __unix__
+    _Atomic int state;
+#ifndef __linux__
+    pthread_mutex_t lock;
+    pthread_cond_t woken;
+#endif
+#endif
+};
+
+#ifdef _WIN32
+#define park_exchange(p, v) InterlockedExchange(&((p)->state), (v))
+#define park_decrement(p) (InterlockedDecrement(&((p)->state)) + 1)
+#define park_load(p) InterlockedCompareExchange(&((p)->state), 0, 0)
+#define park_claim(p) (InterlockedCompareExchange(&((p)->state), SITH_PARK_EMPTY, SITH_PARK_NOTIFIED) == SITH_PARK_NOTIFIED)
+#elif defined __unix__
+#define park_exchange(p, v) atomic_exchange(&((p)->state), (v))
+#define park_decrement(p) atomic_fetch_sub(&((p)->state), 1)
+#define park_load(p) atomic_load_explicit(&((p)->state), memory_order_relaxed)
+
+int park_claim(ParkObject* this) {
+    int notified = SITH_PARK_NOTIFIED;
+    return atomic_compare_exchange_strong(&(this->state), &notified, SITH_PARK_EMPTY);
+}
+#endif
+
+// Set by the first CreateParkObject() call, racing callers agree on the value
+int parkSpins = -1;
+
+void park_relax() {
+#if defined __x86_64__ || defined __i386__
+    __builtin_ia32_pause();
+#elif defined _WIN32
+    YieldProcessor();
+#endif
+}
+
+ParkObject* CreateParkObject() {
+    ParkObject* this = malloc(sizeof (ParkObject));
+    if (this == NULL) return NULL;
+    park_exchange(this, SITH_PARK_EMPTY);
+#if defined __unix__ && !defined __linux__
+    if (pthread_mutex_init(&(this->lock), NULL)) {
+        free(this);
+        return NULL;
+    }
+    if (pthread_cond_init(&(this->woken), NULL)) {
+        pthread_mutex_destroy(&(this->lock));
+        free(this);
+        return NULL;
+    }
+#endif
+
+    if (parkSpins == -1) {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        parkSpins = info.dwNumberOfProcessors > 1 ? SITH_PARK_SPINS : 0;
+#elif defined __unix__
+        parkSpins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SITH_PARK_SPINS : 0;
+#endif
+    }
+    return this;
+}
+
+int ParkThread(ParkObject* this) {
+
+    // A permit often arrives within a few hundred cycles under load
+    for (int spin = 0; spin < parkSpins; spin++) {
+        if (park_load(this) == SITH_PARK_NOTIFIED && park_claim(this)) return SITH_RET_OK;
+        park_relax();
+    }
+
+    // NOTIFIED -> EMPTY means we consumed a permit, else we are now PARKED
+    if (park_decrement(this) == SITH_PARK_NOTIFIED) return SITH_RET_OK;
+
+    while (1) {
+#ifdef _WIN32
+        LONG parked = SITH_PARK_PARKED;
+        if (!WaitOnAddress(&(this->state), &parked, sizeof (LONG), INFINITE)) return SITH_RET_ERR;
+#elif defined __linux__
+        if (syscall(SYS_futex, &(this->state), FUTEX_WAIT_PRIVATE, SITH_PARK_PARKED, NULL, NULL, 0) == -1) {
+            // EAGAIN: state already changed, EINTR: go around
+            if (errno != EAGAIN && errno != EINTR) return SITH_RET_ERR;
+            errno = 0;
+        }
+#elif defined __unix__
+        pthread_mutex_lock(&(this->lock));
+        while (park_load(this) == SITH_PARK_PARKED) pthread_cond_wait(&(this->woken), &(this->lock));
+        pthread_mutex_unlock(&(this->lock));
+#endif
+        if (park_claim(this)) return SITH_RET_OK;
+    }
+}
+
+int UnparkThread(ParkObject* this) {
+    if (park_exchange(this, SITH_PARK_NOTIFIED) == SITH_PARK_PARKED) {
+#ifdef _WIN32
+        WakeByAddressSingle((PVOID) &(this->state));
+#elif defined __linux__
+        if (syscall(SYS_futex, &(this->state), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) == -1) return SITH_RET_ERR;
+#elif defined __unix__
+        pthread_mutex_lock(&(this->lock));
+        pthread_cond_signal(&(this->woken));
+        pthread_mutex_unlock(&(this->lock));
+#endif
+    }
+    return SITH_RET_OK;
+}
+
+void DestroyParkObject(ParkObject* this) {
+    if (this == NULL) return;
+#if defined __unix__ && !defined __linux__
+    pthread_cond_destroy(&(this->woken));
+    pthread_mutex_destroy(&(this->lock));
+#endif
+    free(this);
+}
@@ -12,6 +12,11 @@
  * - [UNIX]: On mutexes, default attributes are kept for performance:
  * http://pubs.opengroup.org/onlinepubs/9699919799/functions/pthread_mutexattr_destroy.html#
  * 
+ * - ParkObjects hold a single wake-up permit for one owning thread, they are
+ *   built on futexes [Linux] / WaitOnAddress [WIN32] / a condition variable
+ *   [other UNIX], so an unpark that finds its owner running costs a single
+ *   atomic operation
+ * 
  *
  * Created on 11 August 2017, 15:18
  */
@@ -31,6 +36,7 @@ extern "C" {
 typedef struct sith_sem SemObject;
 typedef struct sith_mutex LockObject;
 typedef struct sith_cv CondVar;
+typedef struct sith_parker ParkObject;
 
 
 //------------------------------------------------------------------------------
@@ -82,9 +88,48 @@ void DestroyLockObject(LockObject* cs);
 
 CondVar* CreateConditionVar();
 int WaitConditionVariable(CondVar* this, LockObject* lock);
+
+/**
+ * Same as WaitConditionVariable, fails with ETIMEDOUT if not woken within the
+ * given time. Wake-ups may be spurious, as usual
+ * 
+ * @param this
+ * @param lock
+ * @param milliseconds
+ * @return 0 if successful, -1 otherwise
+ */
+int TimedWaitConditionVariable(CondVar* this, LockObject* lock, unsigned long milliseconds);
 int NotifyConditionVariable(CondVar* this);
+int BroadcastConditionVariable(CondVar* this);
 int DestroyConditionVar(CondVar* this);
 
+/**
+ * Creates a parking spot with no permit, to be waited on by a single thread
+ * 
+ * @return a new ParkObject, or NULL if creation failed
+ */
+ParkObject* CreateParkObject();
+
+/**
+ * Blocks the calling thread until a permit is available, then consumes it.
+ * Spins briefly before sleeping
+ * 
+ * @param this
+ * @return 0 if successful, -1 otherwise
+ */
+int ParkThread(ParkObject* this);
+
+/**
+ * Makes a permit available, waking the parked thread if there is one.
+ * Permits do not accumulate
+ * 
+ * @param this
+ * @return 0 if successful, -1 otherwise
+ */
+int UnparkThread(ParkObject* this);
+
+void DestroyParkObject(ParkObject* this);
+
 #ifdef __cplusplus
 }
 #endif
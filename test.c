@@ -16,18 +16,29 @@
 #include "sync.h"
 #include "list.h"
 #include "arguments.h"
+#include "net.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #ifdef _WIN32
 
+#include <direct.h>
 #define SITH_TEST_PROCESS ".\\testaux.exe"
+#define SITH_TEST_MKDIR(path) _mkdir(path)
+#define SITH_TEST_RMDIR(path) _rmdir(path)
 #define SYSPAUSE system("pause");
 
 #elif defined __unix__
 
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #define SITH_TEST_PROCESS "./testaux"
+#define SITH_TEST_MKDIR(path) mkdir(path, 0755)
+#define SITH_TEST_RMDIR(path) rmdir(path)
 #define SYSPAUSE system("read -n1 -r -p 'Press any key to continue...'");
 
 #endif
@@ -38,6 +49,10 @@
 #define COLOR_CYAN    "\x1b[36m"
 #define COLOR_RESET   "\x1b[0m"
 
+#define SITH_TEST_ADDRESS "127.0.0.1"
+#define SITH_TEST_PORT 28917
+#define SITH_TEST_WALKDIR "sith_walktest"
+
 int testTask(void* arg) {
     WaitSemObject((SemObject*) arg, 1);
     return 0;
@@ -285,6 +300,602 @@ int test_list() {
     return 0;
 }
 
+// Holds a kernel until the gate opens, telling the test once it has started
+
+typedef struct {
+    SemObject* started;
+    SemObject* gate;
+} GatedTask;
+
+int gatedTask(void* arg) {
+    GatedTask* gated = (GatedTask*) arg;
+    SignalSemObject(gated->started);
+    WaitSemObject(gated->gate, 1);
+    return 0;
+}
+
+int test_bounded_queue() {
+    ThreadPool* pool = CreateThreadPool("bounded", 2);
+    GatedTask gated = {CreateSemObject(0, 8), CreateSemObject(0, 8)};
+    if (pool == NULL || gated.started == NULL || gated.gate == NULL || SetThreadPoolQueueLength(pool, 3)) {
+        HandleErrorStatus("Could not set up bounded queue");
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure creating a pool with a bounded queue\n");
+        return -1;
+    }
+
+    // Both kernels held, three tasks queued behind them
+    int ok = 1;
+    for (int i = 0; i < 2; i++) ok = ok && ScheduleTask(pool, gatedTask, &gated, 1) == SITH_RET_OK;
+    for (int i = 0; ok && i < 2; i++) ok = WaitSemObject(gated.started, 1) == SITH_RET_OK;
+    for (int i = 0; i < 3; i++) ok = ok && ScheduleTask(pool, gatedTask, &gated, 0) == SITH_RET_OK;
+
+    // A full queue turns further tasks down, and cannot shrink below what it
+    //holds
+    ok = ok && ScheduleTask(pool, gatedTask, &gated, 0) == SITH_RET_ERR && errno == EAGAIN;
+    errno = 0;
+    ok = ok && SetThreadPoolQueueLength(pool, 1) == SITH_RET_ERR && errno == EAGAIN;
+    errno = 0;
+
+    // Queued tasks still run once the kernels are let go
+    for (int i = 0; i < 6; i++) SignalSemObject(gated.gate);
+    for (int i = 0; ok && i < 3; i++) ok = WaitSemObject(gated.started, 1) == SITH_RET_OK;
+
+    DestroyThreadPool(pool, 1);
+    DestroySemObject(gated.started);
+    DestroySemObject(gated.gate);
+    if (!ok) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in bounded queue\n");
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Bounded queue test passed\n");
+    return 0;
+}
+
+void pause_millis(unsigned long millis) {
+#ifdef _WIN32
+    Sleep((DWORD) millis);
+#elif defined __unix__
+    struct timespec wait = {(time_t) (millis / 1000), (long) (millis % 1000) * 1000000L};
+    nanosleep(&wait, NULL);
+#endif
+}
+
+// A binary tree of tasks, each node submitting its children from its kernel,
+//one at a time as walker tasks do or as a batch; leaves track how many of them
+//run at once
+
+#define SITH_TEST_TREEDEPTH 6
+#define SITH_TEST_TREETASKS 127
+
+ThreadPool* treePool;
+LockObject* treeLock;
+SemObject* treeDone;
+int treeBatched;
+unsigned int treeTasks;
+unsigned int treeRunning;
+unsigned int treeOverlap;
+
+int treeTask(void* arg) {
+    uintptr_t depth = (uintptr_t) arg;
+    if (depth > 0 && treeBatched) {
+        TaskEntry children[2] = {{treeTask, (void*) (depth - 1)}, {treeTask, (void*) (depth - 1)}};
+        if (ScheduleTasks(treePool, children, 2, 1, NULL, NULL)) return 1;
+    }
+    else if (depth > 0) {
+        for (int i = 0; i < 2; i++) {
+            if (ScheduleTask(treePool, treeTask, (void*) (depth - 1), 1)) return 1;
+        }
+    }
+    else {
+        DoLockObject(treeLock);
+        if (++treeRunning > treeOverlap) treeOverlap = treeRunning;
+        DoUnlockObject(treeLock);
+        pause_millis(2);
+        DoLockObject(treeLock);
+        treeRunning--;
+        DoUnlockObject(treeLock);
+    }
+
+    DoLockObject(treeLock);
+    int last = ++treeTasks == SITH_TEST_TREETASKS;
+    DoUnlockObject(treeLock);
+    if (last) SignalSemObject(treeDone);
+    return 0;
+}
+
+// Subtasks land on the deque of the kernel running their parent, leaves only
+//overlap if the other kernel steals some
+
+int run_tree(int batched) {
+    treePool = CreateThreadPool("stealing", 2);
+    treeBatched = batched;
+    treeTasks = 0;
+    treeRunning = 0;
+    treeOverlap = 0;
+    if (treePool == NULL || SetThreadPoolStealing(treePool, 1)) {
+        HandleErrorStatus("Could not set up stealing pool");
+        if (treePool != NULL) DestroyThreadPool(treePool, 1);
+        return 0;
+    }
+
+    int ok = ScheduleTask(treePool, treeTask, (void*) SITH_TEST_TREEDEPTH, 1) == SITH_RET_OK &&
+            WaitSemObject(treeDone, 1) == SITH_RET_OK && treeTasks == SITH_TEST_TREETASKS && treeOverlap > 1;
+
+    // Kernels account for a task after it returns, the last one may lag
+    PoolStats stats;
+    KernelStats kernels[2];
+    for (int tries = 0; ok && tries < 1000; tries++) {
+        ok = GetThreadPoolStats(treePool, &stats, kernels, 2) == SITH_RET_OK;
+        if (stats.total.tasks >= SITH_TEST_TREETASKS) break;
+        pause_millis(1);
+    }
+    ok = ok && kernels[0].tasks > 0 && kernels[1].tasks > 0;
+    DestroyThreadPool(treePool, 1);
+    return ok;
+}
+
+int test_stealing() {
+    treeLock = CreateLockObject();
+    treeDone = CreateSemObject(0, 1);
+    if (treeLock == NULL || treeDone == NULL) {
+        HandleErrorStatus("Could not set up stealing test");
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure creating a stealing pool\n");
+        return -1;
+    }
+
+    int single = run_tree(0);
+    int batched = run_tree(1);
+    DestroyLockObject(treeLock);
+    DestroySemObject(treeDone);
+    if (!single) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in work stealing with single submissions\n");
+        return -1;
+    }
+    if (!batched) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in work stealing with batches\n");
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Work stealing test passed\n");
+    return 0;
+}
+
+int resultTask(void* arg) {
+    return (int) (uintptr_t) arg;
+}
+
+int test_task_groups() {
+    ThreadPool* pool = CreateThreadPool("groups", 2);
+    TaskGroup* group = CreateTaskGroup();
+    SemObject* gate = CreateSemObject(0, 1);
+    if (pool == NULL || group == NULL || gate == NULL || SetThreadPoolQueueLength(pool, 8)) {
+        HandleErrorStatus("Could not set up task groups");
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure creating a pool for task groups\n");
+        return -1;
+    }
+
+    // Failures are counted since the last wait, so that the group is reused
+    unsigned int failures = 0;
+    int ok = 1;
+    for (uintptr_t i = 0; i < 6; i++) ok = ok && ScheduleTrackedTask(pool, resultTask, (void*) (i % 2), 1, group, NULL) == SITH_RET_OK;
+    ok = ok && WaitTaskGroup(group, &failures) == SITH_RET_OK && failures == 3;
+    for (int i = 0; i < 2; i++) ok = ok && ScheduleTrackedTask(pool, resultTask, NULL, 1, group, NULL) == SITH_RET_OK;
+    ok = ok && WaitTaskGroup(group, &failures) == SITH_RET_OK && failures == 0;
+
+    // A task held at the gate is still running for its handle and its group
+    TaskHandle* handle = NULL;
+    int result = -1;
+    ok = ok && ScheduleTrackedTask(pool, testTask, gate, 1, group, &handle) == SITH_RET_OK &&
+            PollTask(handle, &result) == SITH_RET_ERR && errno == EAGAIN &&
+            TimedWaitTaskGroup(group, 20, NULL) == SITH_RET_ERR && errno == ETIMEDOUT &&
+            DestroyTaskGroup(group) == SITH_RET_ERR && errno == EBUSY;
+    errno = 0;
+    SignalSemObject(gate);
+    ok = ok && WaitTask(handle, &result) == SITH_RET_OK && result == 0 && WaitTaskGroup(group, NULL) == SITH_RET_OK;
+    if (handle != NULL) ReleaseTaskHandle(handle);
+
+    DestroyThreadPool(pool, 1);
+    ok = DestroyTaskGroup(group) == SITH_RET_OK && ok;
+    DestroySemObject(gate);
+    if (!ok) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in task groups\n");
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Task group test passed\n");
+    return 0;
+}
+
+int test_batches() {
+    ThreadPool* pool = CreateThreadPool("batches", 2);
+    TaskGroup* group = CreateTaskGroup();
+    GatedTask gated = {CreateSemObject(0, 8), CreateSemObject(0, 8)};
+    if (pool == NULL || group == NULL || gated.started == NULL || gated.gate == NULL || SetThreadPoolQueueLength(pool, 3)) {
+        HandleErrorStatus("Could not set up batches");
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure creating a pool for batches\n");
+        return -1;
+    }
+    TaskEntry entries[8];
+    for (int i = 0; i < 8; i++) {
+        entries[i].task = gatedTask;
+        entries[i].argument = &gated;
+    }
+
+    // Both kernels held, so that only the three queue slots are left
+    int ok = 1;
+    for (int i = 0; i < 2; i++) ok = ok && ScheduleTask(pool, gatedTask, &gated, 1) == SITH_RET_OK;
+    for (int i = 0; ok && i < 2; i++) ok = WaitSemObject(gated.started, 1) == SITH_RET_OK;
+
+    // A non-blocking batch takes what fits, always a prefix
+    unsigned int scheduled = 0;
+    ok = ok && ScheduleTasks(pool, entries, 8, 0, group, &scheduled) == SITH_RET_ERR && errno == EAGAIN && scheduled == 3;
+    errno = 0;
+    for (unsigned int i = 0; i < scheduled + 2; i++) SignalSemObject(gated.gate);
+    unsigned int failures = 1;
+    ok = WaitTaskGroup(group, &failures) == SITH_RET_OK && failures == 0 && ok;
+
+    // A blocking one waits for room until all entries are taken
+    unsigned int rest = 0;
+    for (unsigned int i = scheduled; i < 8; i++) SignalSemObject(gated.gate);
+    ok = ok && ScheduleTasks(pool, entries + scheduled, 8 - scheduled, 1, group, &rest) == SITH_RET_OK && rest == 8 - scheduled;
+    ok = WaitTaskGroup(group, &failures) == SITH_RET_OK && failures == 0 && ok;
+
+    DestroyThreadPool(pool, 1);
+    DestroyTaskGroup(group);
+    DestroySemObject(gated.started);
+    DestroySemObject(gated.gate);
+    if (!ok) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in batch scheduling, %u of 8 taken at first\n", scheduled);
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Batch scheduling test passed\n");
+    return 0;
+}
+
+// Connects to a listener of our own, which is not needed past the accept
+
+int open_pair(ConnectionSocket** client, ConnectionSocket** server) {
+    char address[] = SITH_TEST_ADDRESS;
+    ListenerSocket* listener = CreateServerSocket(address, SITH_TEST_PORT, 1);
+    if (listener == NULL) return SITH_RET_ERR;
+    *client = ConnectToServer(address, SITH_TEST_PORT);
+    *server = (*client != NULL) ? AcceptFromClient(listener) : NULL;
+    CloseListener(listener);
+    if (*server == NULL) {
+        if (*client != NULL) CloseConnection(*client);
+        return SITH_RET_ERR;
+    }
+    return SITH_RET_OK;
+}
+
+int test_queued_flush() {
+    ConnectionSocket* client;
+    ConnectionSocket* server;
+    if (open_pair(&client, &server)) {
+        HandleErrorStatus("Could not connect to ourselves");
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure opening a test connection\n");
+        return -1;
+    }
+
+    // Several messages leave in one flush and still arrive one by one
+    const char* view;
+    size_t length;
+    int ok = QueueToPeer(client, "first", 5) == SITH_RET_OK && QueueToPeer(client, "second", 6) == SITH_RET_OK &&
+            FlushPeer(client) == SITH_RET_OK &&
+            ReceiveViewFromPeer(server, &view, &length) == 1 && length == 5 && strcmp(view, "first") == 0 &&
+            ReceiveViewFromPeer(server, &view, &length) == 1 && length == 6 && strcmp(view, "second") == 0;
+
+    // Queued frames go out ahead of a sent one
+    ok = ok && SetPeerFraming(client, framing_length) == SITH_RET_OK && SetPeerFraming(server, framing_length) == SITH_RET_OK &&
+            QueueToPeer(client, "third", 5) == SITH_RET_OK && SendToPeer(client, "fourth") == SITH_RET_OK &&
+            ReceiveFrame(server, NULL, NULL, &view, &length) == 1 && length == 5 && memcmp(view, "third", 5) == 0 &&
+            ReceiveFrame(server, NULL, NULL, &view, &length) == 1 && length == 6 && memcmp(view, "fourth", 6) == 0;
+    CloseConnection(client);
+    CloseConnection(server);
+    if (!ok) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure sending queued messages\n");
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Queued flush test passed\n");
+    return 0;
+}
+
+// Larger than loopback buffers, so that the flush has to stop and resume
+#define SITH_TEST_FLUSHLENGTH (6U << 20)
+
+int test_flush_resume() {
+    ConnectionSocket* client;
+    ConnectionSocket* server;
+    if (open_pair(&client, &server)) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure opening a test connection\n");
+        return -1;
+    }
+    char* payload = malloc(SITH_TEST_FLUSHLENGTH);
+    if (payload == NULL) {
+        CloseConnection(client);
+        CloseConnection(server);
+        return -1;
+    }
+    for (size_t i = 0; i < SITH_TEST_FLUSHLENGTH; i++) payload[i] = (char) (i * 31 + i / 4099);
+
+    SetPeerFraming(client, framing_length);
+    SetPeerFraming(server, framing_length);
+    SetPeerBlocking(client, 0);
+    SetPeerBlocking(server, 0);
+
+    // Messages start at different offsets, so that a resumed one cannot pass
+    //for another
+    int ok = 1;
+    for (unsigned int k = 0; k < 3; k++) {
+        ok = ok && QueueToPeer(server, payload + k, SITH_TEST_FLUSHLENGTH - k) == SITH_RET_OK;
+    }
+    unsigned int stalls = 0;
+    unsigned int received = 0;
+    for (unsigned int rounds = 0; ok && received < 3 && rounds < 1000000; rounds++) {
+        if (FlushPeer(server) == SITH_RET_ERR) {
+            if (errno != EAGAIN) ok = 0;
+            errno = 0;
+            stalls++;
+        }
+
+        const char* view;
+        size_t length;
+        int status = ReceiveFrame(client, NULL, NULL, &view, &length);
+        if (status == 1) {
+            ok = length == SITH_TEST_FLUSHLENGTH - received && memcmp(view, payload + received, length) == 0;
+            received++;
+        }
+        else if (status == SITH_RET_ERR && errno == EAGAIN) {
+            errno = 0;
+        }
+        else {
+            ok = 0;
+        }
+    }
+    free(payload);
+    CloseConnection(client);
+    CloseConnection(server);
+    if (!ok || received != 3 || stalls == 0) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure resuming a partial flush, %u messages after %u stalls\n", received, stalls);
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Partial flush test passed\n");
+    return 0;
+}
+
+// Listing sink counting what it is handed; it may refuse lines after a few
+//batches, or take its time with each
+
+typedef struct {
+    unsigned int calls;
+    unsigned int lines;
+    unsigned int shortBatches;
+    int terminated;
+    int misplaced;
+    unsigned int stopAfter;
+    unsigned long pause;
+} WalkCount;
+
+int count_lines(void* context, const char* lines, size_t length) {
+    WalkCount* count = (WalkCount*) context;
+    // Nothing may follow the terminator
+    if (count->terminated || strlen(lines) != length) count->misplaced = 1;
+    count->calls++;
+    if (length < SITH_WALK_BATCH) count->shortBatches++;
+    for (size_t i = 0; i < length; i++) {
+        if (lines[i] == '\n') count->lines++;
+    }
+    count->terminated = length >= 3 && strcmp(lines + length - 3, ".\r\n") == 0 && (length == 3 || lines[length - 4] == '\n');
+    if (count->pause != 0) pause_millis(count->pause);
+    return (count->stopAfter != 0 && count->calls >= count->stopAfter) ? SITH_RET_ERR : SITH_RET_OK;
+}
+
+// Files with long names, so that a directory takes more than one batch
+
+int make_walk_tree(unsigned int dirs, unsigned int files) {
+    char path[96];
+    if (SITH_TEST_MKDIR(SITH_TEST_WALKDIR)) return SITH_RET_ERR;
+    for (unsigned int d = 0; d < dirs; d++) {
+        snprintf(path, 96, SITH_TEST_WALKDIR"/d%u", d);
+        if (SITH_TEST_MKDIR(path)) return SITH_RET_ERR;
+        for (unsigned int f = 0; f < files; f++) {
+            snprintf(path, 96, SITH_TEST_WALKDIR"/d%u/file_with_a_fairly_long_name_%04u", d, f);
+            FILE* file = fopen(path, "w");
+            if (file == NULL) return SITH_RET_ERR;
+            fclose(file);
+        }
+    }
+    return SITH_RET_OK;
+}
+
+void remove_walk_tree(unsigned int dirs, unsigned int files) {
+    char path[96];
+    for (unsigned int d = 0; d < dirs; d++) {
+        for (unsigned int f = 0; f < files; f++) {
+            snprintf(path, 96, SITH_TEST_WALKDIR"/d%u/file_with_a_fairly_long_name_%04u", d, f);
+            remove(path);
+        }
+        snprintf(path, 96, SITH_TEST_WALKDIR"/d%u", d);
+        SITH_TEST_RMDIR(path);
+    }
+    SITH_TEST_RMDIR(SITH_TEST_WALKDIR);
+}
+
+#define SITH_TEST_WALKDIRS 12
+#define SITH_TEST_WALKFILES 300
+
+int test_walker_streamed() {
+    if (make_walk_tree(SITH_TEST_WALKDIRS, SITH_TEST_WALKFILES)) {
+        perror("Could not create the test tree");
+        remove_walk_tree(SITH_TEST_WALKDIRS, SITH_TEST_WALKFILES);
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure creating the test tree\n");
+        return -1;
+    }
+
+    // Full batches, then the rest and the terminator
+    WalkCount count = {0};
+    SithWalker* walker = InitWalker(SITH_TEST_WALKDIR"/d0");
+    int ok = walker != NULL && WalkInDirStreamed(walker, count_lines, &count) == SITH_RET_OK &&
+            count.calls > 1 && count.shortBatches <= 1 && count.terminated && !count.misplaced &&
+            count.lines == SITH_TEST_WALKFILES + 1;
+    DisposeWalker(walker);
+
+    // A refusing sink stops the walk at once
+    WalkCount refused = {0};
+    refused.stopAfter = 1;
+    walker = InitWalker(SITH_TEST_WALKDIR"/d0");
+    ok = ok && walker != NULL && WalkInDirStreamed(walker, count_lines, &refused) == SITH_RET_ERR && refused.calls == 1;
+    DisposeWalker(walker);
+    if (!ok) {
+        remove_walk_tree(SITH_TEST_WALKDIRS, SITH_TEST_WALKFILES);
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in streamed walk, %u lines in %u batches\n", count.lines, count.calls);
+        return -1;
+    }
+
+    // A slow sink makes the parallel walk set tasks aside, no line is lost
+    ThreadPool* pool = CreateThreadPool("walkers", 2);
+    if (pool == NULL || SetThreadPoolStealing(pool, 1)) {
+        remove_walk_tree(SITH_TEST_WALKDIRS, SITH_TEST_WALKFILES);
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure creating a walker pool\n");
+        return -1;
+    }
+    WalkCount parallel = {0};
+    parallel.pause = 2;
+    walker = InitWalker(SITH_TEST_WALKDIR);
+    ok = walker != NULL && WalkInDirParallelStreamed(walker, count_lines, &parallel, pool) == SITH_RET_OK &&
+            parallel.terminated && !parallel.misplaced &&
+            parallel.lines == SITH_TEST_WALKDIRS * (SITH_TEST_WALKFILES + 1) + 1;
+    DisposeWalker(walker);
+
+    WalkCount stopped = {0};
+    stopped.stopAfter = 2;
+    walker = InitWalker(SITH_TEST_WALKDIR);
+    ok = ok && walker != NULL && WalkInDirParallelStreamed(walker, count_lines, &stopped, pool) == SITH_RET_ERR && stopped.calls == 2;
+    DisposeWalker(walker);
+
+    DestroyThreadPool(pool, 1);
+    remove_walk_tree(SITH_TEST_WALKDIRS, SITH_TEST_WALKFILES);
+    if (!ok) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in parallel streamed walk, %u lines in %u batches\n", parallel.lines, parallel.calls);
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Streamed FileWalker test passed\n");
+    return 0;
+}
+
+// Sends a raw header from a legacy end to a framed one, which must refuse it
+//with the given error before reading any payload
+
+int refuse_header(const unsigned char* header, int expected) {
+    ConnectionSocket* client;
+    ConnectionSocket* server;
+    if (open_pair(&client, &server)) return 0;
+
+    // In legacy framing the bytes go out as they are, followed by an EOT
+    const char* view;
+    size_t length;
+    SetPeerFraming(server, framing_length);
+    int refused = QueueToPeer(client, (const char*) header, SITH_FRAME_HEADERLENGTH) == SITH_RET_OK &&
+            FlushPeer(client) == SITH_RET_OK &&
+            ReceiveFrame(server, NULL, NULL, &view, &length) == SITH_RET_ERR && errno == expected;
+    errno = 0;
+    CloseConnection(client);
+    CloseConnection(server);
+    return refused;
+}
+
+int test_framing() {
+    ConnectionSocket* client;
+    ConnectionSocket* server;
+    if (open_pair(&client, &server)) {
+        HandleErrorStatus("Could not connect to ourselves");
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure opening a test connection\n");
+        return -1;
+    }
+    SetPeerFraming(client, framing_length);
+    SetPeerFraming(server, framing_length);
+
+    // Payloads may hold any byte, EOT and NUL included
+    char payload[256];
+    for (int i = 0; i < 256; i++) payload[i] = (char) i;
+    FrameType type;
+    unsigned int id;
+    const char* view;
+    size_t length;
+    int ok = SendFrame(client, frame_binary, 42, payload, 256) == SITH_RET_OK &&
+            ReceiveFrame(server, &type, &id, &view, &length) == 1 &&
+            type == frame_binary && id == 42 && length == 256 && memcmp(view, payload, 256) == 0;
+
+    // Empty frames, and replies tagged with the ID of the last request
+    ok = ok && SendFrame(client, frame_text, 7, NULL, 0) == SITH_RET_OK &&
+            ReceiveFrame(server, &type, &id, &view, &length) == 1 && id == 7 && length == 0;
+    ok = ok && SendToPeer(server, "reply") == SITH_RET_OK &&
+            ReceiveFrame(client, &type, &id, &view, &length) == 1 &&
+            type == frame_text && id == 7 && length == 5 && memcmp(view, "reply", 5) == 0;
+    CloseConnection(client);
+    CloseConnection(server);
+    if (!ok) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure in frame round trip\n");
+        return -1;
+    }
+
+    const unsigned char badVersion[SITH_FRAME_HEADERLENGTH] = {1, frame_text, 0, 0, 0, 0, 0, 1, 0, 0, 0, 5};
+    if (!refuse_header(badVersion, EBADMSG)) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Frame with a bad version not refused\n");
+        return -1;
+    }
+    const unsigned char oversize[SITH_FRAME_HEADERLENGTH] = {SITH_FRAME_VERSION, frame_text, 0, 0, 0, 0, 0, 1, 0xFF, 0xFF, 0xFF, 0xFF};
+    if (!refuse_header(oversize, EMSGSIZE)) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Oversize frame not refused\n");
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] Framing test passed\n");
+    return 0;
+}
+
+int test_eot_split() {
+    ConnectionSocket* client;
+    ConnectionSocket* server;
+    if (open_pair(&client, &server)) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure opening a test connection\n");
+        return -1;
+    }
+
+    const char* view;
+    size_t length;
+
+    // A frame is the only way to put bytes without an EOT on the wire: the
+    //receiver has to keep them and find the EOT in a later read
+    int ok = SetPeerBlocking(server, 0) == SITH_RET_OK && SetPeerFraming(client, framing_length) == SITH_RET_OK &&
+            SendFrame(client, frame_text, 1, "hel", 3) == SITH_RET_OK && SetPeerFraming(client, framing_eot) == SITH_RET_OK;
+    ok = ok && ReceiveViewFromPeer(server, &view, &length) == SITH_RET_ERR && errno == EAGAIN;
+    errno = 0;
+    ok = ok && SendToPeer(client, "lo") == SITH_RET_OK;
+    int status = SITH_RET_ERR;
+    for (int tries = 0; ok && tries < 1000; tries++) {
+        status = ReceiveViewFromPeer(server, &view, &length);
+        if (status != SITH_RET_ERR || errno != EAGAIN) break;
+        errno = 0;
+        pause_millis(1);
+    }
+    ok = ok && status == 1 && length == SITH_FRAME_HEADERLENGTH + 5 && memcmp(view + SITH_FRAME_HEADERLENGTH, "hello", 5) == 0;
+    CloseConnection(client);
+    CloseConnection(server);
+    if (!ok) {
+        printf("["COLOR_RED"FAILED"COLOR_RESET"] Failure receiving an EOT split from its message\n");
+        return -1;
+    }
+
+    printf("["COLOR_GREEN"OK"COLOR_RESET"] EOT framing test passed\n");
+    return 0;
+}
+
 int main(void) {
 
     test_list();
@@ -295,6 +906,20 @@ int main(void) {
     test_getter();
     test_setter();
     test_split();
+
+    test_bounded_queue();
+    test_stealing(); // Requires sync
+    test_task_groups();
+    test_batches();
+
+    SocketAPIInit();
+    test_queued_flush();
+    test_flush_resume();
+    test_framing();
+    test_eot_split();
+    SocketAPIDestroy();
+
+    test_walker_streamed(); // Requires pool
 // Relies on user input timing
     //test_pool();
 
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "error.h"
+#include "sync.h"
+
+#ifdef __unix__
+#include <time.h>
+#endif
+
+#include "timing.h"
+
+#define SITH_TIMING_ENV "SITH_TIMING_FILE"
+
+
+//------------------------------------------------------------------------------
+// REGISTRY
+
+typedef struct sith_timing_slot {
+    unsigned int worker;
+    unsigned long long elapsed[phase_count];
+    unsigned long long hits[phase_count];
+
+    struct sith_timing_slot* next;
+} TimingSlot;
+
+LockObject* timingLock = NULL;
+TimingSlot* timingSlots = NULL;
+unsigned int timingWorkers = 0;
+unsigned long long timingOrigin = 0;
+
+SITH_THREADLOCAL TimingSlot* ownSlot = NULL;
+
+const char* phaseNames[phase_count] = {
+    "open", "lock", "wait", "mask", "map", "xor", "read", "write", "sync", "unmap", "unlink", "close"
+};
+
+// Registers the calling thread, slots are only freed at process exit
+
+TimingSlot* register_slot() {
+    TimingSlot* slot = calloc(1, sizeof (TimingSlot));
+    if (slot == NULL) return NULL;
+
+    DoLockObject(timingLock);
+    slot->worker = timingWorkers++;
+    slot->next = timingSlots;
+    timingSlots = slot;
+    DoUnlockObject(timingLock);
+
+    return slot;
+}
+
+void print_phases(FILE* stream, unsigned long long* elapsed, unsigned long long* hits) {
+    fprintf(stream, "{");
+    for (int phase = 0; phase < phase_count; phase++) {
+        fprintf(stream, "%s\"%s\":{\"ns\":%llu,\"count\":%llu}", phase ? "," : "", phaseNames[phase], elapsed[phase], hits[phase]);
+    }
+    fprintf(stream, "}");
+}
+
+void print_escaped(FILE* stream, const char* string) {
+    fputc('"', stream);
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') fprintf(stream, "\\%c", *c);
+        else if ((unsigned char) *c < 0x20) fprintf(stream, "\\u%04x", (unsigned char) *c);
+        else fputc(*c, stream);
+    }
+    fputc('"', stream);
+}
+
+
+//------------------------------------------------------------------------------
+// API FUNCTIONS
+
+int InitTiming() {
+    if (timingLock != NULL) return SITH_RET_OK;
+
+    timingLock = CreateLockObject();
+    if (timingLock == NULL) return SITH_RET_ERR;
+
+    timingOrigin = ReadTimer();
+    return SITH_RET_OK;
+}
+
+unsigned long long ReadTimer() {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = {.QuadPart = 0};
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    // Split to avoid overflowing on long uptimes
+    unsigned long long seconds = counter.QuadPart / frequency.QuadPart;
+    unsigned long long rest = counter.QuadPart % frequency.QuadPart;
+    return seconds * 1000000000ULL + rest * 1000000000ULL / frequency.QuadPart;
+#elif defined __unix__
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+void AccountPhase(Phase phase, unsigned long long elapsed) {
+    if (timingLock == NULL || phase >= phase_count) return;
+
+    if (ownSlot == NULL) {
+        ownSlot = register_slot();
+        if (ownSlot == NULL) return;
+    }
+
+    ownSlot->elapsed[phase] += elapsed;
+    (ownSlot->hits[phase])++;
+}
+
+int EmitTimingReport(const char* job, FILE* fallback) {
+    if (timingLock == NULL || job == NULL) {
+        errno = EINVAL;
+        return SITH_RET_ERR;
+    }
+
+    FILE* stream = fallback;
+    const char* path = getenv(SITH_TIMING_ENV);
+    if (path != NULL) {
+        stream = fopen(path, "a");
+        if (stream == NULL) return SITH_RET_ERR;
+    }
+
+    // Job totals are the sum over all threads
+    unsigned long long elapsed[phase_count] = {0};
+    unsigned long long hits[phase_count] = {0};
+    for (TimingSlot* slot = timingSlots; slot != NULL; slot = slot->next) {
+        for (int phase = 0; phase < phase_count; phase++) {
+            elapsed[phase] += slot->elapsed[phase];
+            hits[phase] += slot->hits[phase];
+        }
+    }
+
+    fprintf(stream, "{\"job\":");
+    print_escaped(stream, job);
+    fprintf(stream, ",\"wall_ns\":%llu,\"phases\":", ReadTimer() - timingOrigin);
+    print_phases(stream, elapsed, hits);
+    fprintf(stream, ",\"workers\":[");
+    for (TimingSlot* slot = timingSlots; slot != NULL; slot = slot->next) {
+        fprintf(stream, "{\"worker\":%u,\"phases\":", slot->worker);
+        print_phases(stream, slot->elapsed, slot->hits);
+        fprintf(stream, "}%s", slot->next != NULL ? "," : "");
+    }
+    fprintf(stream, "]}\n");
+    fflush(stream);
+
+    if (path != NULL) fclose(stream);
+    return SITH_RET_OK;
+}
+
+const char* GetPhaseName(Phase phase) {
+    return (phase < phase_count) ? phaseNames[phase] : "unknown";
+}
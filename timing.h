@@ -0,0 +1,113 @@
+/*
+ * File:   timing.h
+ * Brief:  Phase-level timers for the crypto engine
+ *
+ *
+ * Implementation notes:
+ *
+ * - Everything here is compiled out unless SITH_TIMING is defined, use the
+ *   macros rather than the functions so that call sites vanish as well
+ *
+ * - Time is read from the monotonic clock (CLOCK_MONOTONIC / QPC) in
+ *   nanoseconds, and accumulated in a per-thread slot without locking; the
+ *   lock is only taken the first time a thread records something
+ *
+ * - Slots are read by EmitTimingReport() without synchronization, so it must
+ *   be called after all recording threads have been joined
+ *
+ * - The report is a single JSON object per job; if the SITH_TIMING_FILE
+ *   environment variable is set it is appended there, otherwise it goes to the
+ *   given stream
+ */
+
+#ifndef SITH_TIMING_H
+#define SITH_TIMING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+
+//------------------------------------------------------------------------------
+// DEFINITIONS
+
+typedef enum sith_phase {
+    phase_open,
+    phase_lock,
+    phase_wait,
+    phase_mask,
+    phase_map,
+    phase_xor,
+    phase_read,
+    phase_write,
+    phase_sync,
+    phase_unmap,
+    phase_unlink,
+    phase_close,
+    phase_count
+} Phase;
+
+#ifdef SITH_TIMING
+#define SITH_TIMING_INIT() InitTiming()
+#define SITH_TIMER_START(timer) unsigned long long timer = ReadTimer()
+#define SITH_TIMER_STOP(timer, phase) AccountPhase((phase), ReadTimer() - (timer))
+#define SITH_TIMING_REPORT(job, stream) EmitTimingReport((job), (stream))
+#else
+#define SITH_TIMING_INIT()
+#define SITH_TIMER_START(timer)
+#define SITH_TIMER_STOP(timer, phase)
+#define SITH_TIMING_REPORT(job, stream)
+#endif
+
+
+//------------------------------------------------------------------------------
+// FUNCTIONS
+
+/**
+ * Prepares the timing registry, must be called before any thread records
+ *
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int InitTiming();
+
+/**
+ * Reads the monotonic clock
+ *
+ * @return The current time in nanoseconds, from an arbitrary origin
+ */
+unsigned long long ReadTimer();
+
+/**
+ * Adds the given duration to the calling thread's account for the given phase.
+ * Has no effect if InitTiming() was not called
+ *
+ * @param phase
+ * @param elapsed Nanoseconds spent in the phase
+ */
+void AccountPhase(Phase phase, unsigned long long elapsed);
+
+/**
+ * Writes the JSON summary of all phases, per job and per thread
+ *
+ * @param job A label for the job, usually the source path
+ * @param fallback The stream used when SITH_TIMING_FILE is not set
+ * @return SITH_RET_OK if successful, SITH_RET_ERR otherwise
+ */
+int EmitTimingReport(const char* job, FILE* fallback);
+
+/**
+ * Returns the name used for the given phase in reports
+ *
+ * @param phase
+ * @return A static string
+ */
+const char* GetPhaseName(Phase phase);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SITH_TIMING_H */